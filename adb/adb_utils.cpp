@@ -321,6 +321,50 @@ std::string adb_get_android_dir_path() {
     return android_dir;
 }
 
+WorkerPool::WorkerPool(std::string name, size_t thread_count) : name_(std::move(name)) {
+    CHECK_GT(thread_count, 0U);
+    for (size_t i = 0; i < thread_count; ++i) {
+        threads_.emplace_back([this]() { Run(); });
+    }
+}
+
+WorkerPool::~WorkerPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    cv_.notify_all();
+    for (auto& thread : threads_) {
+        thread.join();
+    }
+}
+
+void WorkerPool::Enqueue(std::function<void()> task) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        CHECK(!stopping_);
+        tasks_.push_back(std::move(task));
+    }
+    cv_.notify_one();
+}
+
+void WorkerPool::Run() {
+    adb_thread_setname(name_);
+    while (true) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cv_.wait(lock, [this]() { return stopping_ || !tasks_.empty(); });
+            if (tasks_.empty()) {
+                return;
+            }
+            task = std::move(tasks_.front());
+            tasks_.pop_front();
+        }
+        task();
+    }
+}
+
 std::string GetLogFilePath() {
     // https://issuetracker.google.com/112588493
     const char* path = getenv("ANDROID_ADB_LOG_PATH");
@@ -18,9 +18,12 @@
 
 #include <charconv>
 #include <condition_variable>
+#include <deque>
+#include <functional>
 #include <mutex>
 #include <string>
 #include <string_view>
+#include <thread>
 #include <type_traits>
 #include <vector>
 
@@ -95,6 +98,28 @@ class BlockingQueue {
     }
 };
 
+// A fixed number of threads that run tasks in the order they were enqueued.
+// The destructor runs every task that was already enqueued before joining the threads.
+class WorkerPool {
+  public:
+    WorkerPool(std::string name, size_t thread_count);
+    ~WorkerPool();
+
+    void Enqueue(std::function<void()> task);
+
+  private:
+    void Run();
+
+    std::string name_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<std::function<void()>> tasks_;
+    bool stopping_ = false;
+    std::vector<std::thread> threads_;
+
+    DISALLOW_COPY_AND_ASSIGN(WorkerPool);
+};
+
 std::string GetLogFilePath();
 
 inline std::string_view StripTrailingNulls(std::string_view str) {
@@ -21,6 +21,10 @@
 #include <userenv.h>
 #endif
 
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
 #include <string>
 
 #include <gtest/gtest.h>
@@ -234,3 +238,46 @@ TEST(adb_utils, ParseUint) {
     std::string_view substr = std::string_view(x).substr(0, std::to_string(UINT32_MAX).size());
     TestParseUint(substr, true, UINT32_MAX);
 }
+
+TEST(adb_utils, WorkerPool_bounded_concurrency) {
+    // A rack of devices arriving at once, as the libusb arrival path hands them to its pool. Each
+    // open blocks until the test lets it finish, so concurrency is observed rather than timed.
+    static constexpr size_t kThreads = 8;
+    static constexpr size_t kDevices = 48;
+    std::mutex mutex;
+    std::condition_variable cv;
+    size_t running = 0;
+    size_t max_running = 0;
+    size_t opened = 0;
+    bool release = false;
+    bool all_threads_busy;
+
+    {
+        WorkerPool pool("test pool", kThreads);
+        for (size_t i = 0; i < kDevices; ++i) {
+            pool.Enqueue([&]() {
+                std::unique_lock<std::mutex> lock(mutex);
+                max_running = std::max(max_running, ++running);
+                cv.notify_all();
+                cv.wait(lock, [&]() { return release; });
+                --running;
+                ++opened;
+            });
+        }
+
+        // Every thread has to be blocked in an open at once, which can't happen if the pool opens
+        // devices one at a time. The deadline only matters if the test fails: release the opens
+        // either way so the pool can be joined.
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            all_threads_busy = cv.wait_for(lock, std::chrono::seconds(10),
+                                           [&]() { return running >= kThreads; });
+            release = true;
+        }
+        cv.notify_all();
+    }
+
+    ASSERT_TRUE(all_threads_busy);
+    EXPECT_EQ(kDevices, opened);
+    EXPECT_EQ(kThreads, max_running);
+}
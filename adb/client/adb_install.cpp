@@ -22,20 +22,27 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
 #include <string>
 #include <string_view>
 #include <vector>
 
 #include <android-base/file.h>
 #include <android-base/parsebool.h>
+#include <android-base/parseint.h>
 #include <android-base/stringprintf.h>
 #include <android-base/strings.h>
 
 #include "adb.h"
 #include "adb_client.h"
+#include "adb_io.h"
 #include "adb_unique_fd.h"
 #include "adb_utils.h"
 #include "client/file_sync_client.h"
+#include "client/line_printer.h"
 #include "commandline.h"
 #include "fastdeploy.h"
 #include "incremental.h"
@@ -45,6 +52,9 @@ using namespace std::literals;
 
 static constexpr int kFastDeployMinApi = 24;
 
+// Enough streams to hide the setup latency of each connection without flooding the device.
+static constexpr size_t kDefaultInstallWriteJobs = 4;
+
 namespace {
 
 enum InstallMode {
@@ -301,7 +311,8 @@ static int ms_between(TimePoint start, TimePoint end) {
     return std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
 }
 
-static int install_app_incremental(int argc, const char** argv, bool wait, bool silent) {
+static int install_app_incremental(int argc, const char** argv, bool wait, bool silent,
+                                   const std::string& trace_path) {
     using clock = std::chrono::high_resolution_clock;
     const auto start = clock::now();
     int first_apk = -1;
@@ -339,7 +350,7 @@ static int install_app_incremental(int argc, const char** argv, bool wait, bool
     }
 
     printf("Performing Incremental Install\n");
-    auto server_process = incremental::install(files, passthrough_args, silent);
+    auto server_process = incremental::install(files, passthrough_args, silent, trace_path);
     if (!server_process) {
         return -1;
     }
@@ -425,10 +436,12 @@ static std::pair<InstallMode, std::optional<InstallMode>> calculate_install_mode
 static std::vector<const char*> parse_install_mode(std::vector<const char*> argv,
                                                    InstallMode* install_mode,
                                                    CmdlineOption* incremental_request,
-                                                   bool* incremental_wait) {
+                                                   bool* incremental_wait,
+                                                   std::string* incremental_trace) {
     *install_mode = INSTALL_DEFAULT;
     *incremental_request = CmdlineOption::None;
     *incremental_wait = false;
+    incremental_trace->clear();
 
     std::vector<const char*> passthrough;
     for (auto&& arg : argv) {
@@ -442,6 +455,8 @@ static std::vector<const char*> parse_install_mode(std::vector<const char*> argv
             *incremental_request = CmdlineOption::Disable;
         } else if (arg == "--wait"sv) {
             *incremental_wait = true;
+        } else if (std::string_view(arg).starts_with("--incremental-trace="sv)) {
+            *incremental_trace = arg + strlen("--incremental-trace=");
         } else {
             passthrough.push_back(arg);
         }
@@ -478,12 +493,13 @@ int install_app(int argc, const char** argv) {
     InstallMode install_mode = INSTALL_DEFAULT;
     auto incremental_request = CmdlineOption::None;
     bool incremental_wait = false;
+    std::string incremental_trace;
 
     bool use_fastdeploy = false;
     FastDeploy_AgentUpdateStrategy agent_update_strategy = FastDeploy_AgentUpdateDifferentVersion;
 
     auto unused_argv = parse_install_mode({argv, argv + argc}, &install_mode, &incremental_request,
-                                          &incremental_wait);
+                                          &incremental_wait, &incremental_trace);
     auto passthrough_argv =
             parse_fast_deploy_mode(std::move(unused_argv), &use_fastdeploy, &agent_update_strategy);
 
@@ -518,7 +534,7 @@ int install_app(int argc, const char** argv) {
                                             use_fastdeploy);
             case INSTALL_INCREMENTAL:
                 return install_app_incremental(passthrough_argv.size(), passthrough_argv.data(),
-                                               incremental_wait, silent);
+                                               incremental_wait, silent, incremental_trace);
             case INSTALL_DEFAULT:
             default:
                 error_exit("invalid install mode");
@@ -531,6 +547,149 @@ int install_app(int argc, const char** argv) {
     return res;
 }
 
+// How many splits install-multiple streams into the session at once, from $ADB_INSTALL_JOBS.
+static size_t install_write_jobs() {
+    size_t jobs = kDefaultInstallWriteJobs;
+    if (const char* env = getenv("ADB_INSTALL_JOBS"); env && *env) {
+        if (!android::base::ParseUint(env, &jobs) || jobs == 0) {
+            error_exit("invalid ADB_INSTALL_JOBS '%s'", env);
+        }
+    }
+    return jobs;
+}
+
+// Streams one split into the install session. Returns an error message on failure, or an empty
+// string if it stopped early because another split set |failed|.
+static std::string install_write_split(const std::string& install_cmd,
+                                       const std::string& session_id, const char* file,
+                                       std::atomic<uint64_t>* bytes_written,
+                                       const std::atomic<bool>* failed) {
+    struct stat sb;
+    if (stat(file, &sb) == -1) {
+        return android::base::StringPrintf("failed to stat \"%s\": %s", file, strerror(errno));
+    }
+
+    std::vector<std::string> cmd_args = {
+            install_cmd,
+            "install-write",
+            "-S",
+            std::to_string(sb.st_size),
+            session_id,
+            android::base::Basename(file),
+            "-",
+    };
+
+    unique_fd local_fd(adb_open(file, O_RDONLY | O_CLOEXEC));
+    if (local_fd < 0) {
+        return android::base::StringPrintf("failed to open \"%s\": %s", file, strerror(errno));
+    }
+#ifdef __linux__
+    posix_fadvise(local_fd.get(), 0, 0, POSIX_FADV_SEQUENTIAL | POSIX_FADV_NOREUSE);
+#endif
+
+    std::string error;
+    unique_fd remote_fd = send_command(cmd_args, &error);
+    if (remote_fd < 0) {
+        return "connect error for write: " + error;
+    }
+
+    std::vector<char> buf(64 * 1024);
+    while (true) {
+        if (*failed) {
+            return "";
+        }
+        int len = adb_read(local_fd, buf.data(), buf.size());
+        if (len == 0) {
+            break;
+        }
+        if (len < 0 || !WriteFdExactly(remote_fd, buf.data(), len)) {
+            return android::base::StringPrintf("failed to write \"%s\": %s", file,
+                                               strerror(errno));
+        }
+        *bytes_written += len;
+    }
+
+    char status[BUFSIZ];
+    read_status_line(remote_fd.get(), status, sizeof(status));
+    if (strncmp("Success", status, 7)) {
+        return android::base::StringPrintf("failed to write \"%s\"\n%s", file, status);
+    }
+    return "";
+}
+
+// Streams every split into the install session, several at a time: each goes over its own
+// connection, and with many small splits a one-at-a-time install is dominated by setting those up.
+static bool install_write_splits(const std::string& install_cmd, const std::string& session_id,
+                                 const std::vector<const char*>& files, uint64_t total_size) {
+    const size_t jobs = std::min(install_write_jobs(), files.size());
+
+    std::atomic<uint64_t> bytes_written = 0;
+    // The session is abandoned as soon as one split fails, so the rest stop early.
+    std::atomic<bool> failed = false;
+    std::mutex mutex;
+    std::condition_variable cv;
+    size_t done = 0;
+    std::vector<std::string> errors(files.size());
+
+    const auto start = std::chrono::steady_clock::now();
+    {
+        WorkerPool pool("install-write", jobs);
+        for (size_t i = 0; i < files.size(); ++i) {
+            pool.Enqueue([&, i]() {
+                if (!failed) {
+                    errors[i] = install_write_split(install_cmd, session_id, files[i],
+                                                    &bytes_written, &failed);
+                    if (!errors[i].empty()) {
+                        failed = true;
+                    }
+                }
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    ++done;
+                }
+                cv.notify_one();
+            });
+        }
+
+        LinePrinter lp;
+        std::unique_lock<std::mutex> lock(mutex);
+        while (done < files.size()) {
+            cv.wait_for(lock, 100ms);
+            const uint64_t written = bytes_written;
+            lp.Print(android::base::StringPrintf(
+                             "[%3d%%] streaming %zu splits: %zu done, %" PRIu64 "/%" PRIu64
+                             " bytes",
+                             total_size ? int(std::min(written, total_size) * 100 / total_size)
+                                        : 100,
+                             files.size(), done, written, total_size),
+                     LinePrinter::INFO);
+        }
+        lock.unlock();
+
+        bool success = true;
+        for (const auto& error : errors) {
+            if (!error.empty()) {
+                lp.Print("adb: " + error, LinePrinter::ERROR);
+                success = false;
+            }
+        }
+        if (!success) {
+            return false;
+        }
+
+        const double seconds =
+                std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        lp.Print(android::base::StringPrintf(
+                         "%zu splits streamed, %" PRIu64 " bytes in %.3fs (%.1f MB/s, %zu at a "
+                         "time)",
+                         files.size(), total_size, seconds,
+                         seconds > 0 ? total_size / seconds / 1000000 : 0.0, jobs),
+                 LinePrinter::INFO);
+        lp.KeepInfoLine();
+    }
+    return true;
+}
+
 static int install_multiple_app_streamed(int argc, const char** argv) {
     // Find all APK arguments starting at end.
     // All other arguments passed through verbatim.
@@ -601,58 +760,9 @@ static int install_multiple_app_streamed(int argc, const char** argv) {
     const auto session_id_str = std::to_string(session_id);
 
     // Valid session, now stream the APKs
-    bool success = true;
-    for (int i = first_apk; i < argc; i++) {
-        const char* file = argv[i];
-        struct stat sb;
-        if (stat(file, &sb) == -1) {
-            fprintf(stderr, "adb: failed to stat \"%s\": %s\n", file, strerror(errno));
-            success = false;
-            goto finalize_session;
-        }
+    bool success = install_write_splits(install_cmd, session_id_str,
+                                        {argv + first_apk, argv + argc}, total_size);
 
-        std::vector<std::string> cmd_args = {
-                install_cmd,
-                "install-write",
-                "-S",
-                std::to_string(sb.st_size),
-                session_id_str,
-                android::base::Basename(file),
-                "-",
-        };
-
-        unique_fd local_fd(adb_open(file, O_RDONLY | O_CLOEXEC));
-        if (local_fd < 0) {
-            fprintf(stderr, "adb: failed to open \"%s\": %s\n", file, strerror(errno));
-            success = false;
-            goto finalize_session;
-        }
-
-        std::string error;
-        unique_fd remote_fd = send_command(cmd_args, &error);
-        if (remote_fd < 0) {
-            fprintf(stderr, "adb: connect error for write: %s\n", error.c_str());
-            success = false;
-            goto finalize_session;
-        }
-
-        if (!copy_to_file(local_fd.get(), remote_fd.get())) {
-            fprintf(stderr, "adb: failed to write \"%s\": %s\n", file, strerror(errno));
-            success = false;
-            goto finalize_session;
-        }
-
-        read_status_line(remote_fd.get(), buf, sizeof(buf));
-
-        if (strncmp("Success", buf, 7)) {
-            fprintf(stderr, "adb: failed to write \"%s\"\n", file);
-            fputs(buf, stderr);
-            success = false;
-            goto finalize_session;
-        }
-    }
-
-finalize_session:
     // Commit session if we streamed everything okay; otherwise abandon.
     std::vector<std::string> service_args = {
             install_cmd,
@@ -683,10 +793,12 @@ int install_multiple_app(int argc, const char** argv) {
     InstallMode install_mode = INSTALL_DEFAULT;
     auto incremental_request = CmdlineOption::None;
     bool incremental_wait = false;
+    std::string incremental_trace;
     bool use_fastdeploy = false;
 
-    auto passthrough_argv = parse_install_mode({argv + 1, argv + argc}, &install_mode,
-                                               &incremental_request, &incremental_wait);
+    auto passthrough_argv =
+            parse_install_mode({argv + 1, argv + argc}, &install_mode, &incremental_request,
+                               &incremental_wait, &incremental_trace);
 
     auto [primary_mode, fallback_mode] =
             calculate_install_mode(install_mode, use_fastdeploy, incremental_request);
@@ -704,7 +816,7 @@ int install_multiple_app(int argc, const char** argv) {
                                                      passthrough_argv.data());
             case INSTALL_INCREMENTAL:
                 return install_app_incremental(passthrough_argv.size(), passthrough_argv.data(),
-                                               incremental_wait, silent);
+                                               incremental_wait, silent, incremental_trace);
             case INSTALL_DEFAULT:
             default:
                 error_exit("invalid install mode");
@@ -66,6 +66,7 @@
 #include "client/file_sync_client.h"
 #include "commandline.h"
 #include "fastdeploy.h"
+#include "incremental_cache.h"
 #include "incremental_server.h"
 #include "services.h"
 #include "shell_protocol.h"
@@ -196,8 +197,11 @@ static void help() {
 #ifndef _WIN32
         "     --local-agent: locate agent files from local source build (instead of SDK location)\n"
 #endif
+        "     --incremental-trace=PATH: write a timeline of incremental install serving to PATH\n"
         "     (See also `adb shell pm help` for more options.)\n"
         //TODO--installlog <filename>
+        " inc-cache [clear]        show or clear the host's cache of blocks served by\n"
+        "                          incremental installs\n"
         " uninstall [-k] PACKAGE\n"
         "     remove this app package from the device\n"
         "     '-k': keep the data and cache directories\n"
@@ -258,6 +262,8 @@ static void help() {
         " $ANDROID_LOG_TAGS        tags to be used by logcat (see logcat --help)\n"
         " $ADB_LOCAL_TRANSPORT_MAX_PORT max emulator scan port (default 5585, 16 emus)\n"
         " $ADB_MDNS_AUTO_CONNECT   comma-separated list of mdns services to allow auto-connect (default adb-tls-connect)\n"
+        " $ADB_INCREMENTAL_CACHE_SIZE size limit of the incremental install cache (default 1g, 0 to disable)\n"
+        " $ADB_INSTALL_JOBS        number of APKs install-multiple streams at once (default 4)\n"
         "\n"
         "Online documentation: https://android.googlesource.com/platform/packages/modules/adb/+/refs/heads/main/docs/user/adb.1.md\n"
         "\n"
@@ -1496,6 +1502,37 @@ static int process_remount_or_verity_service(const int argc, const char** argv)
     }
 }
 
+static int adb_inc_cache(int argc, const char** argv) {
+    const std::string dir = incremental::BlockCacheDir();
+    if (argc == 2 && !strcmp(argv[1], "clear")) {
+        incremental::TrimBlockCache(dir, 0);
+        return 0;
+    }
+    if (argc != 1) {
+        error_exit("usage: adb inc-cache [clear]");
+    }
+
+    const int64_t limit = incremental::BlockCacheSizeLimit();
+    auto entries = incremental::ListBlockCache(dir);
+    int64_t total = 0;
+    for (auto it = entries.rbegin(); it != entries.rend(); ++it) {
+        char last_used[32] = {};
+        strftime(last_used, sizeof(last_used), "%Y-%m-%d %H:%M:%S", localtime(&it->last_used));
+        total += it->file_size;
+        if (it->suffix != ".blocks") {
+            printf("%.16s  %-8s  %10" PRId64 " bytes  last used %s\n", it->digest.c_str(),
+                   it->suffix.c_str() + 1, it->file_size, last_used);
+            continue;
+        }
+        printf("%.16s  %8d blocks  %10" PRId64 " -> %10" PRId64 " bytes (%.2fx)  last used %s\n",
+               it->digest.c_str(), it->block_count, it->raw_size, it->encoded_size,
+               it->encoded_size > 0 ? double(it->raw_size) / it->encoded_size : 1.0, last_used);
+    }
+    printf("%s: %zu entries, %" PRId64 " of %" PRId64 " bytes used%s\n", dir.c_str(),
+           entries.size(), total, limit, limit == 0 ? " (disabled)" : "");
+    return 0;
+}
+
 static int adb_query_command(const std::string& command) {
     std::string result;
     std::string error;
@@ -2209,6 +2246,18 @@ int adb_commandline(int argc, const char** argv) {
             }
         }
     } else if (!strcmp(argv[0], "inc-server")) {
+        incremental::ServeOptions options;
+        while (argc > 1 && !strncmp(argv[1], "--", 2)) {
+            if (!strcmp(argv[1], "--zstd")) {
+                options.zstd = true;
+            } else if (!strncmp(argv[1], "--trace=", strlen("--trace="))) {
+                options.trace_path = argv[1] + strlen("--trace=");
+            } else {
+                error_exit("inc-server: unknown option %s", argv[1]);
+            }
+            --argc;
+            ++argv;
+        }
         if (argc < 4) {
 #ifdef _WIN32
             error_exit("usage: adb inc-server CONNECTION_HANDLE OUTPUT_HANDLE FILE1 FILE2 ...");
@@ -2230,7 +2279,9 @@ int adb_commandline(int argc, const char** argv) {
         }
         output_fd = adb_register_socket(output_fd);
         close_on_exec(output_fd);
-        return incremental::serve(connection_fd, output_fd, argc - 3, argv + 3);
+        return incremental::serve(connection_fd, output_fd, argc - 3, argv + 3, options);
+    } else if (!strcmp(argv[0], "inc-cache")) {
+        return adb_inc_cache(argc, argv);
     } else if (!strcmp(argv[0], "attach") || !strcmp(argv[0], "detach")) {
         const char* service = strcmp(argv[0], "attach") == 0 ? "host:attach" : "host:detach";
         std::string result;
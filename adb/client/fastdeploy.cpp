@@ -18,12 +18,18 @@
 
 #include "fastdeploy.h"
 
+#include <inttypes.h>
 #include <string.h>
 #include <algorithm>
 #include <array>
+#include <future>
 #include <memory>
 
+#include <openssl/md5.h>
+
+#include "android-base/endian.h"
 #include "android-base/file.h"
+#include "android-base/hex.h"
 #include "android-base/strings.h"
 #include "androidfw/ResourceTypes.h"
 #include "androidfw/ZipFileRO.h"
@@ -38,7 +44,9 @@
 #include "sysdeps.h"
 
 #include "adb_client.h"
+#include "adb_io.h"
 #include "adb_utils.h"
+#include "transport.h"
 
 static constexpr long kRequiredAgentVersion = 0x00000003;
 
@@ -52,6 +60,10 @@ static constexpr bool g_verbose_timings = false;
 static FastDeploy_AgentUpdateStrategy g_agent_update_strategy =
         FastDeploy_AgentUpdateDifferentVersion;
 
+// No APK comes anywhere near this, it only guards against a corrupt response.
+static constexpr uint64_t kMaxCentralDirectorySize = 256 * 1024 * 1024;
+
+using APKDump = com::android::fastdeploy::APKDump;
 using APKMetaData = com::android::fastdeploy::APKMetaData;
 
 namespace {
@@ -239,14 +251,90 @@ static void update_agent_if_necessary() {
     }
 }
 
-std::optional<APKMetaData> extract_metadata(const char* apk_path) {
-    // Update agent if there is a command line argument forcing to do so.
-    update_agent_if_necessary();
+static bool is_fastdeploy_dump_supported() {
+    auto&& features = adb_get_feature_set_or_die();
+    return CanUseFeature(*features, kFeatureFastDeployDump);
+}
 
+static std::string md5_hex(const void* data, size_t size) {
+    uint8_t digest[MD5_DIGEST_LENGTH];
+    MD5(static_cast<const uint8_t*>(data), size, digest);
+    return android::base::HexString(digest, sizeof(digest));
+}
+
+// Returns true if the agent on the device is exactly the one deploy_agent() would push.
+static bool is_device_agent_current() {
     REPORT_FUNC_TIME();
+    std::string command = android::base::StringPrintf("md5sum -b %s %s", kDeviceAgentFile,
+                                                      kDeviceAgentScript);
+    std::vector<char> out_buffer;
+    std::vector<char> error_buffer;
+    if (capture_shell_command(command.c_str(), &out_buffer, &error_buffer) != 0) {
+        return false;
+    }
+    auto hashes = android::base::Tokenize(std::string(out_buffer.begin(), out_buffer.end()), "\n");
+    return hashes.size() == 2 && hashes[0] == md5_hex(kDeployAgent, sizeof(kDeployAgent)) &&
+           hashes[1] == md5_hex(kDeployAgentScript, sizeof(kDeployAgentScript));
+}
 
-    std::string package_name = get_package_name_from_apk(apk_path);
+// Returns the path of the base APK of |package_name| on the device, or an empty string if the
+// package isn't installed.
+static std::string get_device_apk_path(const std::string& package_name) {
+    REPORT_FUNC_TIME();
+    std::string command = "cmd package path " + package_name;
+    std::vector<char> out_buffer;
+    std::vector<char> error_buffer;
+    if (capture_shell_command(command.c_str(), &out_buffer, &error_buffer) != 0) {
+        return {};
+    }
+    // The base APK comes first, followed by the splits.
+    for (const auto& line :
+         android::base::Split(std::string(out_buffer.begin(), out_buffer.end()), "\n")) {
+        std::string path = android::base::Trim(line);
+        if (android::base::StartsWith(path, "package:")) {
+            return path.substr(strlen("package:"));
+        }
+    }
+    return {};
+}
 
+// Reads the central directory of the APK at |device_path| with adbd's fastdeploy-dump service.
+static std::optional<APKDump> dump_device_apk(const std::string& package_name,
+                                              const std::string& device_path) {
+    REPORT_FUNC_TIME();
+    std::string error;
+    unique_fd fd(adb_connect("fastdeploy-dump:" + device_path, &error));
+    if (fd < 0 || !adb_status(fd.get(), &error)) {
+        fprintf(stderr, "adb: failed to dump %s: %s\n", device_path.c_str(), error.c_str());
+        return {};
+    }
+
+    uint64_t size;
+    if (!ReadFdExactly(fd, &size, sizeof(size))) {
+        fprintf(stderr, "adb: failed to dump %s: %s\n", device_path.c_str(), strerror(errno));
+        return {};
+    }
+    size = le64toh(size);
+    if (size > kMaxCentralDirectorySize) {
+        fprintf(stderr, "adb: failed to dump %s: bad size %" PRIu64 "\n", device_path.c_str(),
+                size);
+        return {};
+    }
+    std::string cd(size, '\0');
+    if (!ReadFdExactly(fd, cd.data(), cd.size())) {
+        fprintf(stderr, "adb: failed to dump %s: %s\n", device_path.c_str(), strerror(errno));
+        return {};
+    }
+
+    APKDump dump;
+    dump.set_name(package_name);
+    dump.set_cd(std::move(cd));
+    dump.set_absolute_path(device_path);
+    return dump;
+}
+
+// Gets the metadata from the agent's dump command.
+static std::optional<APKMetaData> extract_metadata_with_agent(const std::string& package_name) {
     // Dump apk command checks the required vs current agent version and if they match then returns
     // the APK dump for package. Doing this in a single call saves round-trip and agent launch time.
     constexpr const char* kAgentDumpCommandPattern = "/data/local/tmp/deployagent dump %ld %s";
@@ -291,7 +379,7 @@ std::optional<APKMetaData> extract_metadata(const char* apk_path) {
         error_exit("Aborting");
     }
 
-    com::android::fastdeploy::APKDump dump;
+    APKDump dump;
     if (!dump.ParseFromArray(dump_out_buffer.data(), dump_out_buffer.size())) {
         fprintf(stderr, "Can't parse output of %s\n", dump_command.c_str());
         error_exit("Aborting");
@@ -300,6 +388,46 @@ std::optional<APKMetaData> extract_metadata(const char* apk_path) {
     return PatchUtils::GetDeviceAPKMetaData(dump);
 }
 
+// Gets the metadata from adbd rather than from the agent, which costs starting a VM on the device.
+static std::optional<APKMetaData> extract_metadata_natively(const std::string& package_name) {
+    // The agent is still what applies the patch. Check that it's up to date while the metadata is
+    // read, unless it's just been deployed anyway.
+    std::future<bool> agent_current;
+    if (g_agent_update_strategy == FastDeploy_AgentUpdateDifferentVersion) {
+        agent_current = std::async(std::launch::async, is_device_agent_current);
+    }
+
+    std::string device_path = get_device_apk_path(package_name);
+    if (device_path.empty()) {
+        fprintf(stderr, "Package %s not found, falling back to install\n", package_name.c_str());
+        return {};
+    }
+    auto dump = dump_device_apk(package_name, device_path);
+
+    if (agent_current.valid() && !agent_current.get()) {
+        printf("Device agent is missing or out of date, deploying\n");
+        deploy_agent(/*check_time_stamps=*/false);
+    }
+    if (!dump) {
+        fprintf(stderr, "Falling back to the device agent\n");
+        return extract_metadata_with_agent(package_name);
+    }
+    return PatchUtils::GetDeviceAPKMetaData(*dump);
+}
+
+std::optional<APKMetaData> extract_metadata(const char* apk_path) {
+    // Update agent if there is a command line argument forcing to do so.
+    update_agent_if_necessary();
+
+    REPORT_FUNC_TIME();
+
+    std::string package_name = get_package_name_from_apk(apk_path);
+    if (is_fastdeploy_dump_supported()) {
+        return extract_metadata_natively(package_name);
+    }
+    return extract_metadata_with_agent(package_name);
+}
+
 unique_fd install_patch(int argc, const char** argv) {
     REPORT_FUNC_TIME();
     constexpr char kAgentApplyServicePattern[] = "shell:/data/local/tmp/deployagent apply - -pm %s";
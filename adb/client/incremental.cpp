@@ -17,6 +17,7 @@
 #include "incremental.h"
 
 #include "incremental_utils.h"
+#include "incremental_verity.h"
 
 #include <android-base/file.h>
 #include <android-base/stringprintf.h>
@@ -26,6 +27,7 @@
 #include "adb_utils.h"
 #include "commandline.h"
 #include "sysdeps.h"
+#include "transport.h"
 
 using namespace std::literals;
 
@@ -72,7 +74,11 @@ static std::pair<unique_fd, std::vector<char>> read_signature(Size file_size,
         return {std::move(fd), std::move(invalid_signature)};
     }
 
-    if (auto expected = verity_tree_size_for_file(file_size); tree_size != expected) {
+    // inc-server builds the tree itself for signatures that leave it out.
+    auto info = ParseHashingInfo(signature);
+    const bool can_build_tree = tree_size == 0 && info && CanBuildVerityTree(*info);
+    if (auto expected = verity_tree_size_for_file(file_size);
+        tree_size != expected && !can_build_tree) {
         if (!silent) {
             fprintf(stderr,
                     "Verity tree size mismatch in signature file: %s [was %lld, expected %lld].\n",
@@ -168,7 +174,8 @@ bool can_install(const Files& files) {
     return true;
 }
 
-std::optional<Process> install(const Files& files, const Args& passthrough_args, bool silent) {
+std::optional<Process> install(const Files& files, const Args& passthrough_args, bool silent,
+                               const std::string& trace_path) {
     auto connection_fd = start_install(files, passthrough_args, silent);
     if (connection_fd < 0) {
         if (!silent) {
@@ -197,10 +204,18 @@ std::optional<Process> install(const Files& files, const Args& passthrough_args,
     close_on_exec(pipe_read_fd);
 
     std::vector<std::string> args(std::move(files));
+    args.insert(args.begin(), {fd_param, pipe_write_fd_param});
+    auto&& features = adb_get_feature_set_or_die();
+    if (CanUseFeature(*features, kFeatureIncrementalZstd)) {
+        args.insert(args.begin(), "--zstd");
+    }
+    if (!trace_path.empty()) {
+        args.insert(args.begin(), "--trace=" + trace_path);
+    }
     if (basename == "linker" || basename == "linker64") {
-        args.insert(args.begin(), {"inc-server", adb_path, fd_param, pipe_write_fd_param});
+        args.insert(args.begin(), {"inc-server", adb_path});
     } else {
-        args.insert(args.begin(), {"inc-server", fd_param, pipe_write_fd_param});    
+        args.insert(args.begin(), "inc-server");
     }
     auto child =
             adb_launch_process(executable_path, std::move(args), {connection_fd.get(), pipe_write_fd});
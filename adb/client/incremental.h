@@ -29,7 +29,9 @@ using Files = std::vector<std::string>;
 using Args = std::vector<std::string_view>;
 
 bool can_install(const Files& files);
-std::optional<Process> install(const Files& files, const Args& passthrough_args, bool silent);
+// |trace_path|, if not empty, is where inc-server writes its serving trace.
+std::optional<Process> install(const Files& files, const Args& passthrough_args, bool silent,
+                               const std::string& trace_path);
 
 enum class Result { Success, Failure, None };
 Result wait_for_installation(int read_fd);
@@ -0,0 +1,342 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define TRACE_TAG INCREMENTAL
+
+#include "incremental_cache.h"
+
+#include <dirent.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <utime.h>
+
+#include <algorithm>
+
+#include <android-base/hex.h>
+#include <android-base/parseint.h>
+#include <android-base/stringprintf.h>
+#include <android-base/strings.h>
+
+#include "adb_io.h"
+#include "adb_trace.h"
+#include "adb_utils.h"
+#include "sysdeps.h"
+
+namespace incremental {
+
+namespace {
+
+constexpr char kMagic[8] = {'A', 'D', 'B', 'I', 'N', 'C', 'C', '1'};
+constexpr char kEntrySuffix[] = ".blocks";
+// Files kept alongside the entries and trimmed along with them.
+constexpr const char* kSideFileSuffixes[] = {".profile", ".tree"};
+constexpr char kTempInfix[] = ".tmp.";
+// Entries are recorded for as long as a file is served, which rarely takes more than minutes, so
+// a temporary file this old was left behind by an inc-server that died.
+constexpr time_t kStaleTempAge = 24 * 60 * 60;
+constexpr int64_t kDefaultSizeLimit = 1024LL * 1024 * 1024;
+constexpr size_t kIndexEntrySize = 16;
+
+struct Header {
+    char magic[8];
+    int32_t block_count;
+    int32_t reserved;
+    int64_t raw_size;
+    int64_t encoded_size;
+};
+
+// The index follows the header, one entry per block, and the block data follows the index.
+constexpr uint64_t DataOffset(int32_t block_count) {
+    return sizeof(Header) + uint64_t(block_count) * kIndexEntrySize;
+}
+
+std::string EntryPath(const std::string& dir, std::string_view digest) {
+    return dir + OS_PATH_SEPARATOR + std::string(digest) + kEntrySuffix;
+}
+
+bool ReadHeader(borrowed_fd fd, Header* header) {
+    return adb_pread(fd, header, sizeof(*header), 0) == sizeof(*header) &&
+           memcmp(header->magic, kMagic, sizeof(kMagic)) == 0;
+}
+
+bool WriteAt(borrowed_fd fd, uint64_t offset, const void* data, size_t size) {
+    return adb_lseek(fd, offset, SEEK_SET) == int64_t(offset) && WriteFdExactly(fd, data, size);
+}
+
+}  // namespace
+
+struct BlockCache::IndexEntry {
+    uint64_t offset;
+    int16_t size;
+    int16_t raw_size;
+    int8_t compression_type;
+    int8_t present;
+    int16_t reserved;
+};
+
+BlockCache::BlockCache(std::string path, int32_t block_count)
+    : path_(std::move(path)), block_count_(block_count) {
+    static_assert(sizeof(IndexEntry) == kIndexEntrySize);
+    static_assert(sizeof(Header) == 32);
+}
+
+BlockCache::~BlockCache() {
+    if (temp_fd_.ok()) {
+        temp_fd_.reset();
+        adb_unlink(temp_path_.c_str());
+    }
+}
+
+std::unique_ptr<BlockCache> BlockCache::Open(const std::string& dir, const std::string& digest,
+                                             int32_t block_count) {
+    if (digest.empty() || block_count <= 0) {
+        return nullptr;
+    }
+    if (adb_mkdir(dir, 0750) == -1 && errno != EEXIST) {
+        D("Failed to create incremental cache directory %s: %s", dir.c_str(), strerror(errno));
+        return nullptr;
+    }
+
+    std::unique_ptr<BlockCache> cache(new BlockCache(EntryPath(dir, digest), block_count));
+
+    unique_fd fd(adb_open(cache->path_.c_str(), O_RDONLY));
+    if (fd.ok()) {
+        const int64_t file_size = adb_lseek(fd, 0, SEEK_END);
+        Header header;
+        if (file_size >= int64_t(DataOffset(block_count)) && ReadHeader(fd, &header) &&
+            header.block_count == block_count) {
+            cache->map_ = android::base::MappedFile::FromOsHandle(adb_get_os_handle(fd), 0,
+                                                                  file_size, PROT_READ);
+        }
+        if (cache->map_) {
+            cache->index_ =
+                    reinterpret_cast<const IndexEntry*>(cache->map_->data() + sizeof(Header));
+            for (int32_t i = 0; i < block_count; ++i) {
+                const IndexEntry& entry = cache->index_[i];
+                if (!entry.present || entry.size < 0 ||
+                    entry.offset + entry.size > uint64_t(file_size)) {
+                    D("Ignoring corrupt incremental cache entry %s", cache->path_.c_str());
+                    cache->map_.reset();
+                    cache->index_ = nullptr;
+                    break;
+                }
+            }
+        }
+        if (cache->map_) {
+            cache->fd_ = std::move(fd);
+            // Mark the entry as recently used.
+            utime(cache->path_.c_str(), nullptr);
+            D("Serving %s from the incremental cache", cache->path_.c_str());
+            return cache;
+        }
+    }
+
+    cache->temp_path_ = cache->path_ + kTempInfix + std::to_string(getpid());
+    cache->temp_fd_.reset(adb_creat(cache->temp_path_.c_str(), 0640));
+    if (!cache->temp_fd_.ok()) {
+        D("Failed to create %s: %s", cache->temp_path_.c_str(), strerror(errno));
+        return nullptr;
+    }
+    cache->recorded_.resize(block_count);
+    cache->write_offset_ = DataOffset(block_count);
+    return cache;
+}
+
+std::optional<BlockCache::Block> BlockCache::Lookup(int32_t block_idx) const {
+    if (!index_ || block_idx < 0 || block_idx >= block_count_) {
+        return std::nullopt;
+    }
+    const IndexEntry& entry = index_[block_idx];
+    return Block{entry.compression_type, entry.raw_size,
+                 std::string_view(map_->data() + entry.offset, entry.size)};
+}
+
+void BlockCache::Record(int32_t block_idx, int8_t compression_type, const void* data,
+                        int16_t size, int16_t raw_size) {
+    if (!temp_fd_.ok() || write_failed_ || block_idx < 0 || block_idx >= block_count_ ||
+        recorded_[block_idx].present) {
+        return;
+    }
+    if (!WriteAt(temp_fd_, write_offset_, data, size)) {
+        D("Failed to write to %s: %s", temp_path_.c_str(), strerror(errno));
+        write_failed_ = true;
+        return;
+    }
+    recorded_[block_idx] = IndexEntry{
+            .offset = write_offset_,
+            .size = size,
+            .raw_size = raw_size,
+            .compression_type = compression_type,
+            .present = 1,
+    };
+    write_offset_ += size;
+    ++recorded_count_;
+}
+
+bool BlockCache::Commit() {
+    if (!temp_fd_.ok() || write_failed_ || recorded_count_ != block_count_) {
+        return false;
+    }
+
+    Header header = {};
+    header.block_count = block_count_;
+    for (const IndexEntry& entry : recorded_) {
+        header.raw_size += entry.raw_size;
+        header.encoded_size += entry.size;
+    }
+    // The magic goes in last, so that an interrupted write never looks like a valid entry.
+    if (!WriteAt(temp_fd_, sizeof(Header), recorded_.data(),
+                 recorded_.size() * sizeof(IndexEntry)) ||
+        !WriteAt(temp_fd_, 0, &header, sizeof(header)) ||
+        !WriteAt(temp_fd_, 0, kMagic, sizeof(kMagic))) {
+        D("Failed to write to %s: %s", temp_path_.c_str(), strerror(errno));
+        return false;
+    }
+    temp_fd_.reset();
+
+    // Another server may have published the same entry in the meantime. Its contents are the
+    // same, so it doesn't matter which one wins.
+    if (adb_rename(temp_path_.c_str(), path_.c_str()) != 0) {
+        D("Failed to publish %s: %s", path_.c_str(), strerror(errno));
+        adb_unlink(temp_path_.c_str());
+        return false;
+    }
+    D("Published %s (%" PRId64 " bytes for %" PRId64 " bytes of data)", path_.c_str(),
+      header.encoded_size, header.raw_size);
+    return true;
+}
+
+std::string BlockCacheDir() {
+    if (const char* dir = getenv("ADB_INCREMENTAL_CACHE_DIR"); dir && *dir) {
+        return dir;
+    }
+    return adb_get_android_dir_path() + OS_PATH_SEPARATOR + "incremental_cache";
+}
+
+int64_t BlockCacheSizeLimit() {
+    if (const char* size = getenv("ADB_INCREMENTAL_CACHE_SIZE"); size && *size) {
+        uint64_t limit;
+        if (android::base::ParseByteCount(size, &limit, uint64_t(INT64_MAX))) {
+            return limit;
+        }
+        fprintf(stderr, "adb: ignoring invalid $ADB_INCREMENTAL_CACHE_SIZE '%s'\n", size);
+    }
+    return kDefaultSizeLimit;
+}
+
+std::string FileCacheKey(const std::string& root_hash, int64_t size, time_t mtime) {
+    if (root_hash.empty()) {
+        return {};
+    }
+    return android::base::StringPrintf(
+            "%s-%" PRIx64 "-%" PRIx64,
+            android::base::HexString(root_hash.data(), root_hash.size()).c_str(), uint64_t(size),
+            uint64_t(mtime));
+}
+
+std::vector<BlockCacheEntryInfo> ListBlockCache(const std::string& dir) {
+    std::vector<BlockCacheEntryInfo> entries;
+    std::unique_ptr<DIR, decltype(&closedir)> d(opendir(dir.c_str()), closedir);
+    if (!d) {
+        return entries;
+    }
+    while (struct dirent* de = readdir(d.get())) {
+        std::string_view name = de->d_name;
+        if (!android::base::ConsumeSuffix(&name, kEntrySuffix)) {
+            for (const char* suffix : kSideFileSuffixes) {
+                struct stat st;
+                if (android::base::ConsumeSuffix(&name, suffix) &&
+                    stat((dir + OS_PATH_SEPARATOR + de->d_name).c_str(), &st) == 0) {
+                    entries.push_back(BlockCacheEntryInfo{
+                            .digest = std::string(name),
+                            .suffix = suffix,
+                            .file_size = st.st_size,
+                            .last_used = st.st_mtime,
+                    });
+                    break;
+                }
+            }
+            continue;
+        }
+        const std::string path = EntryPath(dir, name);
+        struct stat st;
+        unique_fd fd(adb_open(path.c_str(), O_RDONLY));
+        Header header;
+        if (!fd.ok() || stat(path.c_str(), &st) != 0 || !ReadHeader(fd, &header)) {
+            continue;
+        }
+        entries.push_back(BlockCacheEntryInfo{
+                .digest = std::string(name),
+                .suffix = kEntrySuffix,
+                .block_count = header.block_count,
+                .raw_size = header.raw_size,
+                .encoded_size = header.encoded_size,
+                .file_size = st.st_size,
+                .last_used = st.st_mtime,
+        });
+    }
+    std::sort(entries.begin(), entries.end(), [](const auto& lhs, const auto& rhs) {
+        return lhs.last_used < rhs.last_used;
+    });
+    return entries;
+}
+
+// Removes the temporary files of entries that were never committed. Trimming to nothing removes
+// them all, otherwise only the stale ones.
+static void RemoveTempFiles(const std::string& dir, int64_t limit) {
+    std::unique_ptr<DIR, decltype(&closedir)> d(opendir(dir.c_str()), closedir);
+    if (!d) {
+        return;
+    }
+    const time_t now = time(nullptr);
+    while (struct dirent* de = readdir(d.get())) {
+        if (!strstr(de->d_name, kTempInfix)) {
+            continue;
+        }
+        const std::string path = dir + OS_PATH_SEPARATOR + de->d_name;
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0 || (limit > 0 && now - st.st_mtime < kStaleTempAge)) {
+            continue;
+        }
+        if (adb_unlink(path.c_str()) == 0) {
+            D("Removed %s from the incremental cache", path.c_str());
+        }
+    }
+}
+
+void TrimBlockCache(const std::string& dir, int64_t limit) {
+    RemoveTempFiles(dir, limit);
+
+    auto entries = ListBlockCache(dir);
+    int64_t total = 0;
+    for (const auto& entry : entries) {
+        total += entry.file_size;
+    }
+    for (const auto& entry : entries) {
+        if (total <= limit) {
+            break;
+        }
+        const std::string path = dir + OS_PATH_SEPARATOR + entry.digest + entry.suffix;
+        if (adb_unlink(path.c_str()) == 0) {
+            D("Evicted %s from the incremental cache", path.c_str());
+            total -= entry.file_size;
+        }
+    }
+}
+
+}  // namespace incremental
@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <android-base/mapped_file.h>
+
+#include "adb_unique_fd.h"
+
+namespace incremental {
+
+// An on-disk cache of encoded data blocks, keyed by the SHA-256 of the file they came from and
+// shared by every inc-server on the host. Installing the same APK on another device maps the
+// blocks from the cache instead of reading and compressing them again.
+//
+// An entry is recorded while a file is being served and is only published, by renaming it into
+// place, once every block has been recorded. Readers never see a partial entry.
+class BlockCache {
+  public:
+    struct Block {
+        int8_t compression_type;
+        int16_t raw_size;
+        std::string_view data;
+    };
+
+    // Opens the entry for |digest| if there's a complete one, or starts recording a new one.
+    // Returns nullptr if |dir| can't be used.
+    static std::unique_ptr<BlockCache> Open(const std::string& dir, const std::string& digest,
+                                            int32_t block_count);
+
+    ~BlockCache();
+
+    // True if the entry was found in the cache, in which case Lookup() succeeds for every block.
+    bool complete() const { return map_ != nullptr; }
+
+    // Safe to call from any thread.
+    std::optional<Block> Lookup(int32_t block_idx) const;
+
+    // Records an encoded block for an entry that isn't complete yet.
+    void Record(int32_t block_idx, int8_t compression_type, const void* data, int16_t size,
+                int16_t raw_size);
+
+    // Publishes the entry if every block has been recorded, returning true if it did.
+    bool Commit();
+
+  private:
+    struct IndexEntry;
+
+    BlockCache(std::string path, int32_t block_count);
+
+    std::string path_;
+    int32_t block_count_;
+
+    // Set when reading a complete entry.
+    unique_fd fd_;
+    std::unique_ptr<android::base::MappedFile> map_;
+    const IndexEntry* index_ = nullptr;
+
+    // Set when recording a new entry.
+    std::string temp_path_;
+    unique_fd temp_fd_;
+    std::vector<IndexEntry> recorded_;
+    int32_t recorded_count_ = 0;
+    uint64_t write_offset_ = 0;
+    bool write_failed_ = false;
+};
+
+struct BlockCacheEntryInfo {
+    std::string digest;
+    // ".blocks" for an entry, whose sizes follow, or the suffix of a file kept alongside entries.
+    std::string suffix;
+    int32_t block_count = 0;
+    int64_t raw_size = 0;
+    int64_t encoded_size = 0;
+    int64_t file_size;
+    time_t last_used;
+};
+
+// The cache lives in ~/.android/incremental_cache unless $ADB_INCREMENTAL_CACHE_DIR says otherwise.
+std::string BlockCacheDir();
+
+// From $ADB_INCREMENTAL_CACHE_SIZE (e.g. "512m"), 1 GiB by default. 0 disables the cache.
+int64_t BlockCacheSizeLimit();
+
+// Returns the name a file of |size| bytes last modified at |mtime| is cached under, from the
+// |root_hash| of its v4 signature, or an empty string if there's no root hash. The root hash stands
+// for the whole file without it being read, and the size and mtime keep a file that was changed
+// after it was signed from being served the blocks of the one that was.
+std::string FileCacheKey(const std::string& root_hash, int64_t size, time_t mtime);
+
+// Lists the complete entries in |dir|, and the files kept alongside them such as profiles and
+// verity trees, least recently used first.
+std::vector<BlockCacheEntryInfo> ListBlockCache(const std::string& dir);
+
+// Removes the least recently used entries until the cache fits in |limit| bytes, along with what
+// inc-servers that died left behind.
+void TrimBlockCache(const std::string& dir, int64_t limit);
+
+}  // namespace incremental
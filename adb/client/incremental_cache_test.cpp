@@ -0,0 +1,165 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "incremental_cache.h"
+
+#include <utime.h>
+
+#include <algorithm>
+#include <string>
+
+#include <android-base/file.h>
+#include <gtest/gtest.h>
+
+#include "sysdeps.h"
+
+namespace incremental {
+
+static std::string BlockData(int32_t block_idx) {
+    return std::string(100 + block_idx, 'a' + block_idx % 26);
+}
+
+static void Populate(const std::string& dir, const std::string& digest, int32_t block_count) {
+    auto cache = BlockCache::Open(dir, digest, block_count);
+    ASSERT_NE(nullptr, cache);
+    ASSERT_FALSE(cache->complete());
+    // Blocks are recorded in whatever order they were served in.
+    for (int32_t i = block_count - 1; i >= 0; --i) {
+        std::string data = BlockData(i);
+        cache->Record(i, i % 2, data.data(), data.size(), 4096);
+    }
+    ASSERT_TRUE(cache->Commit());
+}
+
+TEST(BlockCache, round_trip) {
+    TemporaryDir dir;
+    ASSERT_NO_FATAL_FAILURE(Populate(dir.path, "0123abcd", 10));
+
+    auto cache = BlockCache::Open(dir.path, "0123abcd", 10);
+    ASSERT_NE(nullptr, cache);
+    ASSERT_TRUE(cache->complete());
+    for (int32_t i = 0; i < 10; ++i) {
+        auto block = cache->Lookup(i);
+        ASSERT_TRUE(block);
+        ASSERT_EQ(i % 2, block->compression_type);
+        ASSERT_EQ(4096, block->raw_size);
+        ASSERT_EQ(BlockData(i), block->data);
+    }
+    ASSERT_FALSE(cache->Lookup(10));
+    ASSERT_FALSE(cache->Commit());
+
+    auto entries = ListBlockCache(dir.path);
+    ASSERT_EQ(1U, entries.size());
+    ASSERT_EQ("0123abcd", entries[0].digest);
+    ASSERT_EQ(10, entries[0].block_count);
+    ASSERT_EQ(40960, entries[0].raw_size);
+}
+
+TEST(BlockCache, incomplete_entry_not_published) {
+    TemporaryDir dir;
+    {
+        auto cache = BlockCache::Open(dir.path, "digest", 3);
+        ASSERT_NE(nullptr, cache);
+        std::string data = BlockData(0);
+        cache->Record(0, 0, data.data(), data.size(), 4096);
+        cache->Record(2, 0, data.data(), data.size(), 4096);
+        ASSERT_FALSE(cache->Commit());
+    }
+
+    auto cache = BlockCache::Open(dir.path, "digest", 3);
+    ASSERT_NE(nullptr, cache);
+    ASSERT_FALSE(cache->complete());
+    ASSERT_FALSE(cache->Lookup(0));
+    ASSERT_TRUE(ListBlockCache(dir.path).empty());
+}
+
+TEST(BlockCache, block_count_mismatch) {
+    TemporaryDir dir;
+    ASSERT_NO_FATAL_FAILURE(Populate(dir.path, "digest", 4));
+
+    auto cache = BlockCache::Open(dir.path, "digest", 5);
+    ASSERT_NE(nullptr, cache);
+    ASSERT_FALSE(cache->complete());
+}
+
+TEST(BlockCache, trim_evicts_least_recently_used) {
+    TemporaryDir dir;
+    ASSERT_NO_FATAL_FAILURE(Populate(dir.path, "old", 8));
+    ASSERT_NO_FATAL_FAILURE(Populate(dir.path, "new", 8));
+
+    std::string old_path = std::string(dir.path) + OS_PATH_SEPARATOR + "old.blocks";
+    struct utimbuf times = {.actime = 1000, .modtime = 1000};
+    ASSERT_EQ(0, utime(old_path.c_str(), &times));
+
+    auto entries = ListBlockCache(dir.path);
+    ASSERT_EQ(2U, entries.size());
+    ASSERT_EQ("old", entries[0].digest);
+
+    TrimBlockCache(dir.path, entries[1].file_size);
+    entries = ListBlockCache(dir.path);
+    ASSERT_EQ(1U, entries.size());
+    ASSERT_EQ("new", entries[0].digest);
+
+    TrimBlockCache(dir.path, 0);
+    ASSERT_TRUE(ListBlockCache(dir.path).empty());
+}
+
+TEST(BlockCache, side_files_listed_and_trimmed) {
+    TemporaryDir dir;
+    ASSERT_NO_FATAL_FAILURE(Populate(dir.path, "digest", 4));
+    const std::string profile = std::string(dir.path) + OS_PATH_SEPARATOR + "digest.profile";
+    const std::string tree = std::string(dir.path) + OS_PATH_SEPARATOR + "digest.tree";
+    ASSERT_TRUE(android::base::WriteStringToFile("profile", profile));
+    ASSERT_TRUE(android::base::WriteStringToFile("tree", tree));
+
+    auto entries = ListBlockCache(dir.path);
+    ASSERT_EQ(3U, entries.size());
+    auto it = std::find_if(entries.begin(), entries.end(),
+                           [](const auto& entry) { return entry.suffix == ".profile"; });
+    ASSERT_NE(entries.end(), it);
+    ASSERT_EQ("digest", it->digest);
+    ASSERT_EQ(7, it->file_size);
+
+    TrimBlockCache(dir.path, 0);
+    ASSERT_TRUE(ListBlockCache(dir.path).empty());
+    ASSERT_NE(0, access(profile.c_str(), F_OK));
+    ASSERT_NE(0, access(tree.c_str(), F_OK));
+}
+
+TEST(BlockCache, trim_removes_stale_temp_files) {
+    TemporaryDir dir;
+    const std::string prefix = std::string(dir.path) + OS_PATH_SEPARATOR;
+    ASSERT_TRUE(android::base::WriteStringToFile("x", prefix + "stale.blocks.tmp.1"));
+    ASSERT_TRUE(android::base::WriteStringToFile("x", prefix + "live.blocks.tmp.2"));
+    struct utimbuf times = {.actime = 1000, .modtime = 1000};
+    ASSERT_EQ(0, utime((prefix + "stale.blocks.tmp.1").c_str(), &times));
+
+    TrimBlockCache(dir.path, 1 << 20);
+    ASSERT_NE(0, access((prefix + "stale.blocks.tmp.1").c_str(), F_OK));
+    ASSERT_EQ(0, access((prefix + "live.blocks.tmp.2").c_str(), F_OK));
+
+    TrimBlockCache(dir.path, 0);
+    ASSERT_NE(0, access((prefix + "live.blocks.tmp.2").c_str(), F_OK));
+}
+
+TEST(BlockCache, FileCacheKey) {
+    const std::string root_hash("\x01\xab", 2);
+    ASSERT_EQ("01ab-3-5f5e1000", FileCacheKey(root_hash, 3, 1600000000));
+    // A file without a root hash isn't cached.
+    ASSERT_EQ("", FileCacheKey("", 3, 1600000000));
+}
+
+}  // namespace incremental
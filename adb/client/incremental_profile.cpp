@@ -0,0 +1,136 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define TRACE_TAG INCREMENTAL
+
+#include "incremental_profile.h"
+
+#include <inttypes.h>
+#include <string.h>
+
+#include <algorithm>
+#include <unordered_map>
+
+#include <android-base/file.h>
+#include <android-base/parseint.h>
+#include <android-base/stringprintf.h>
+#include <android-base/strings.h>
+
+#include "adb_trace.h"
+#include "sysdeps.h"
+
+namespace incremental {
+
+// Enough runs to smooth over one-off launches, few enough to follow the app as it changes.
+static constexpr size_t kMaxRuns = 16;
+
+std::string ProfilePath(const std::string& dir, const std::string& digest) {
+    return dir + OS_PATH_SEPARATOR + digest + ".profile";
+}
+
+std::vector<ProfileRun> ReadProfile(const std::string& path) {
+    std::vector<ProfileRun> runs;
+    std::string content;
+    if (!android::base::ReadFileToString(path, &content)) {
+        return runs;
+    }
+    for (const auto& line : android::base::Split(content, "\n")) {
+        auto fields = android::base::Tokenize(line, " ");
+        if (fields.size() < 3 || fields[0] != "run") {
+            continue;
+        }
+        ProfileRun run;
+        int64_t time;
+        if (!android::base::ParseInt(fields[1], &time) ||
+            !android::base::ParseInt(fields[2], &run.misses, 0)) {
+            D("Ignoring malformed line in %s", path.c_str());
+            continue;
+        }
+        run.time = time;
+        run.blocks.reserve(fields.size() - 3);
+        for (size_t i = 3; i < fields.size(); ++i) {
+            int32_t block;
+            if (!android::base::ParseInt(fields[i], &block, 0)) {
+                break;
+            }
+            run.blocks.push_back(block);
+        }
+        runs.push_back(std::move(run));
+    }
+    return runs;
+}
+
+bool AppendProfileRun(const std::string& path, const ProfileRun& run) {
+    // Two servers finishing at the same moment can each drop the other's run. That only costs a
+    // little accuracy, so there's no locking.
+    auto runs = ReadProfile(path);
+    runs.push_back(run);
+    if (runs.size() > kMaxRuns) {
+        runs.erase(runs.begin(), runs.end() - kMaxRuns);
+    }
+
+    std::string content = "# adb incremental install profile\n";
+    for (const auto& r : runs) {
+        content += android::base::StringPrintf("run %" PRId64 " %d", int64_t(r.time), r.misses);
+        for (int32_t block : r.blocks) {
+            content += ' ';
+            content += std::to_string(block);
+        }
+        content += '\n';
+    }
+
+    const std::string temp_path = path + ".tmp." + std::to_string(getpid());
+    if (!android::base::WriteStringToFile(content, temp_path)) {
+        D("Failed to write %s: %s", temp_path.c_str(), strerror(errno));
+        return false;
+    }
+    // Windows won't rename over an existing file.
+    if (adb_rename(temp_path.c_str(), path.c_str()) != 0 &&
+        (adb_unlink(path.c_str()) != 0 || adb_rename(temp_path.c_str(), path.c_str()) != 0)) {
+        D("Failed to write %s: %s", path.c_str(), strerror(errno));
+        adb_unlink(temp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+std::vector<int32_t> ProfileBlocks(const std::vector<ProfileRun>& runs) {
+    // Each block scores its relative position in every run it was missed in, and 1 (as late as
+    // possible) in every run it wasn't missed in. Lower scores go first.
+    std::unordered_map<int32_t, double> scores;
+    for (const auto& run : runs) {
+        for (size_t i = 0; i < run.blocks.size(); ++i) {
+            scores.try_emplace(run.blocks[i], double(runs.size()));
+            scores[run.blocks[i]] -= 1.0 - double(i) / run.blocks.size();
+        }
+    }
+
+    std::vector<std::pair<double, int32_t>> ordered;
+    ordered.reserve(scores.size());
+    for (const auto& [block, score] : scores) {
+        ordered.emplace_back(score, block);
+    }
+    std::sort(ordered.begin(), ordered.end());
+
+    std::vector<int32_t> blocks;
+    blocks.reserve(ordered.size());
+    for (const auto& [score, block] : ordered) {
+        blocks.push_back(block);
+    }
+    return blocks;
+}
+
+}  // namespace incremental
@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+
+#include <string>
+#include <vector>
+
+namespace incremental {
+
+// The blocks a device asked for with BLOCK_MISSING during one incremental install, in the order
+// it first asked for them.
+struct ProfileRun {
+    time_t time = 0;
+    int32_t misses = 0;  // Including repeated requests for the same block.
+    std::vector<int32_t> blocks;
+};
+
+// A profile records the miss logs of the last few installs of a file, keyed by FileCacheKey(),
+// so that the next install can prefetch what the app is going to read before it reads it.
+//
+// Profiles are plain text with one run per line, so the profiles collected by different hosts for
+// the same APK can be aggregated by concatenating them.
+std::string ProfilePath(const std::string& dir, const std::string& digest);
+
+std::vector<ProfileRun> ReadProfile(const std::string& path);
+
+// Adds |run| to the profile at |path|, dropping the oldest runs beyond the most recent few.
+bool AppendProfileRun(const std::string& path, const ProfileRun& run);
+
+// Orders the blocks missed across |runs|: blocks missed early and in most runs come first.
+std::vector<int32_t> ProfileBlocks(const std::vector<ProfileRun>& runs);
+
+}  // namespace incremental
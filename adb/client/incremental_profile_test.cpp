@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "incremental_profile.h"
+
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <gtest/gtest.h>
+
+namespace incremental {
+
+TEST(IncrementalProfile, round_trip) {
+    TemporaryDir dir;
+    const std::string path = ProfilePath(dir.path, "digest");
+    ASSERT_TRUE(ReadProfile(path).empty());
+
+    ASSERT_TRUE(AppendProfileRun(path, {.time = 100, .misses = 5, .blocks = {7, 3, 9}}));
+    ASSERT_TRUE(AppendProfileRun(path, {.time = 200, .misses = 1, .blocks = {3}}));
+
+    auto runs = ReadProfile(path);
+    ASSERT_EQ(2U, runs.size());
+    ASSERT_EQ(100, runs[0].time);
+    ASSERT_EQ(5, runs[0].misses);
+    ASSERT_EQ((std::vector<int32_t>{7, 3, 9}), runs[0].blocks);
+    ASSERT_EQ(200, runs[1].time);
+    ASSERT_EQ((std::vector<int32_t>{3}), runs[1].blocks);
+}
+
+TEST(IncrementalProfile, keeps_recent_runs) {
+    TemporaryDir dir;
+    const std::string path = ProfilePath(dir.path, "digest");
+    for (int i = 0; i < 40; ++i) {
+        ASSERT_TRUE(AppendProfileRun(path, {.time = i, .misses = 1, .blocks = {i}}));
+    }
+    auto runs = ReadProfile(path);
+    ASSERT_LT(runs.size(), 40U);
+    ASSERT_EQ(39, runs.back().time);
+}
+
+// Profiles from different hosts are aggregated by concatenating them.
+TEST(IncrementalProfile, concatenated_profiles) {
+    TemporaryDir dir;
+    const std::string first = ProfilePath(dir.path, "first");
+    const std::string second = ProfilePath(dir.path, "second");
+    ASSERT_TRUE(AppendProfileRun(first, {.time = 1, .misses = 2, .blocks = {1, 2}}));
+    ASSERT_TRUE(AppendProfileRun(second, {.time = 2, .misses = 2, .blocks = {2, 1}}));
+
+    std::string a, b;
+    ASSERT_TRUE(android::base::ReadFileToString(first, &a));
+    ASSERT_TRUE(android::base::ReadFileToString(second, &b));
+    const std::string merged = ProfilePath(dir.path, "merged");
+    ASSERT_TRUE(android::base::WriteStringToFile(a + b, merged));
+    ASSERT_EQ(2U, ReadProfile(merged).size());
+}
+
+TEST(IncrementalProfile, ProfileBlocks) {
+    ASSERT_TRUE(ProfileBlocks({}).empty());
+
+    // Block 5 is always missed first. Block 8 is missed before block 4, but only once, so it goes
+    // last.
+    std::vector<ProfileRun> runs = {
+            {.blocks = {5, 2, 8, 4}},
+            {.blocks = {5, 2, 4}},
+            {.blocks = {5, 2, 4}},
+    };
+    ASSERT_EQ((std::vector<int32_t>{5, 2, 4, 8}), ProfileBlocks(runs));
+}
+
+}  // namespace incremental
@@ -19,6 +19,7 @@
 #include "incremental_server.h"
 
 #include <android-base/endian.h>
+#include <android-base/mapped_file.h>
 #include <android-base/strings.h>
 #include <inttypes.h>
 #include <lz4.h>
@@ -26,10 +27,17 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <zstd.h>
 
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <condition_variable>
 #include <deque>
 #include <fstream>
+#include <memory>
+#include <mutex>
+#include <string_view>
 #include <thread>
 #include <type_traits>
 #include <unordered_set>
@@ -40,21 +48,46 @@
 #include "adb_trace.h"
 #include "adb_unique_fd.h"
 #include "adb_utils.h"
+#include "incremental_cache.h"
+#include "incremental_profile.h"
+#include "incremental_trace.h"
 #include "incremental_utils.h"
+#include "incremental_verity.h"
 #include "sysdeps.h"
+#include "sysdeps/uio.h"
 
 namespace incremental {
 
+using android::base::MappedFile;
+
 static constexpr int kHashesPerBlock = kBlockSize / kDigestSize;
 static constexpr int kCompressedSizeMax = kBlockSize * 0.95;
 static constexpr int8_t kTypeData = 0;
 static constexpr int8_t kTypeHash = 1;
 static constexpr int8_t kCompressionNone = 0;
 static constexpr int8_t kCompressionLZ4 = 1;
-static constexpr int kCompressBound = std::max(kBlockSize, LZ4_COMPRESSBOUND(kBlockSize));
+static constexpr int8_t kCompressionZstd = 2;
+static constexpr int kCompressBound =
+        std::max({kBlockSize, LZ4_COMPRESSBOUND(kBlockSize), int(ZSTD_COMPRESSBOUND(kBlockSize))});
+
+// Misses are compressed on the serving thread while the device waits, prefetch blocks on the
+// encoder threads ahead of time.
+static constexpr int kZstdMissLevel = 1;
+static constexpr int kZstdPrefetchLevel = 9;
 static constexpr auto kReadBufferSize = 128 * 1024;
+static constexpr int kMaxIovecs = 256;
+
+// Prefetch asks for the file to be read in this far ahead, in aligned windows of this size.
+static constexpr int kAdviseWindowBlocks = 2 * 1024 * 1024 / kBlockSize;
 static constexpr int kPollTimeoutMillis = 300000;  // 5 minutes
 
+// How many prefetch blocks may be read and compressed ahead of the serving thread.
+static constexpr int kEncodeAheadBlocks = 128;
+static constexpr auto kEncodeWaitTimeout = std::chrono::milliseconds(1);
+
+// How often the serving trace records each file's progress: every 1 MiB sent.
+static constexpr int kTraceProgressBlocks = 256;
+
 using BlockSize = int16_t;
 using FileId = int16_t;
 using BlockIdx = int32_t;
@@ -146,22 +179,109 @@ struct BlockBuffer {
     char data[Size];
 } __attribute__((packed));
 
+// A data block that's been read and compressed, ready to be spliced into a chunk.
+struct EncodedBlock {
+    FileId fileId;
+    BlockIdx blockIdx;
+    bool ok = false;
+    int16_t rawSize = 0;
+    int16_t blockSize = 0;
+
+    // The block is read into |raw| and compressed into |compressed|, and whichever is sent has
+    // its header filled in, so that the response goes out without being copied.
+    BlockBuffer<> raw;
+    BlockBuffer<kCompressBound> compressed;
+    ResponseHeader* header = nullptr;
+    // Follows |header| unless it points into the block cache or the mapped file.
+    const char* data = nullptr;
+
+    // Set by the encoder thread once the fields above are filled in.
+    std::atomic<bool> ready = false;
+
+    EncodedBlock(FileId fileId, BlockIdx blockIdx) : fileId(fileId), blockIdx(blockIdx) {}
+};
+
+// Maps |length| bytes of |fd| at |offset|. Returns nullptr if that's not possible, in which case
+// the file is read with pread() instead.
+static std::unique_ptr<MappedFile> MapForServing(borrowed_fd fd, int64_t offset, int64_t length) {
+    if (length <= 0) {
+        return nullptr;
+    }
+#ifndef __LP64__
+    if (length >= INT_MAX) {
+        return nullptr;
+    }
+#endif
+    auto map = MappedFile::FromOsHandle(adb_get_os_handle(fd), offset, length, PROT_READ);
+    if (!map) {
+        D("Failed to map %" PRId64 " bytes at %" PRId64 ": %s", length, offset, strerror(errno));
+    }
+    return map;
+}
+
+#if defined(_WIN32)
+// There's no madvise() on Windows, so mappings go without hints there.
+#define MADV_SEQUENTIAL 0
+#define MADV_WILLNEED 0
+#endif
+
+// Passes |advice| on for the pages of |map| covering [offset, offset + length).
+static void AdviseMapping(const MappedFile& map, int64_t offset, int64_t length, int advice) {
+#if defined(_WIN32)
+    (void)map, (void)offset, (void)length, (void)advice;
+#else
+    static const uintptr_t kPageSize = sysconf(_SC_PAGESIZE);
+    offset = std::clamp<int64_t>(offset, 0, map.size());
+    length = std::min<int64_t>(length, map.size() - offset);
+    if (length <= 0) {
+        return;
+    }
+    // The mapping itself starts on a page boundary, even if data() doesn't.
+    const auto begin = reinterpret_cast<uintptr_t>(map.data() + offset) & ~(kPageSize - 1);
+    const auto end = reinterpret_cast<uintptr_t>(map.data() + offset + length);
+    if (madvise(reinterpret_cast<void*>(begin), end - begin, advice) != 0) {
+        D("madvise(%d) failed: %s", advice, strerror(errno));
+    }
+#endif
+}
+
 // Holds streaming state for a file
 class File {
   public:
     // Plain file
     File(const char* filepath, FileId id, int64_t size, unique_fd fd, int64_t tree_offset,
-         unique_fd tree_fd)
+         unique_fd tree_fd, std::string tree = {})
         : File(filepath, id, size, tree_offset) {
         this->fd_ = std::move(fd);
         this->tree_fd_ = std::move(tree_fd);
+        this->tree_ = std::move(tree);
         priority_blocks_ = PriorityBlocksForFile(filepath, fd_.get(), size);
+
+        // Blocks are served straight out of the page cache rather than pread() one at a time.
+        // Most of them are read in order by prefetch, and the small tree is read all over.
+        map_ = MapForServing(fd_, 0, size);
+        if (map_) {
+            AdviseMapping(*map_, 0, size, MADV_SEQUENTIAL);
+        }
+        if (tree_fd_.ok()) {
+            tree_map_ = MapForServing(tree_fd_, tree_offset_, verity_tree_size_for_file(size));
+            if (tree_map_) {
+                AdviseMapping(*tree_map_, 0, tree_map_->size(), MADV_WILLNEED);
+            }
+        }
     }
-    int64_t ReadDataBlock(BlockIdx block_idx, void* buf, bool* is_zip_compressed) const {
-        int64_t bytes_read = -1;
+
+    // Returns the size of the block, with |*data| pointing at its contents: into the mapping, or
+    // into |buf| if the file couldn't be mapped.
+    int64_t ReadDataBlock(BlockIdx block_idx, char* buf, const char** data,
+                          bool* is_zip_compressed) const {
         const off64_t offsetStart = blockIndexToOffset(block_idx);
-        bytes_read = adb_pread(fd_, buf, kBlockSize, offsetStart);
-        return bytes_read;
+        if (map_) {
+            *data = map_->data() + offsetStart;
+            return std::clamp<int64_t>(size - offsetStart, 0, kBlockSize);
+        }
+        *data = buf;
+        return adb_pread(fd_, buf, kBlockSize, offsetStart);
     }
     int64_t ReadTreeBlock(BlockIdx block_idx, void* buf) const {
         int64_t bytes_read = -1;
@@ -169,14 +289,58 @@ class File {
         bytes_read = adb_pread(tree_fd_, buf, kBlockSize, offsetStart);
         return bytes_read;
     }
+    // Returns the block if the tree is mapped, or an empty view if it has to be read.
+    std::string_view MappedTreeBlock(BlockIdx block_idx) const {
+        std::string_view tree = tree_;
+        if (tree_map_) {
+            tree = {tree_map_->data(), tree_map_->size()};
+        }
+        const int64_t offset = blockIndexToOffset(block_idx);
+        const int64_t length = std::clamp<int64_t>(int64_t(tree.size()) - offset, 0, kBlockSize);
+        return tree.substr(std::min<int64_t>(offset, tree.size()), length);
+    }
+
+    // Called with each block prefetch is about to read, to have the kernel read the next window
+    // of the file in ahead of it.
+    void PrefetchHint(BlockIdx block_idx) {
+        if (!map_ || block_idx + kAdviseWindowBlocks < advisedUntil_) {
+            return;
+        }
+        const BlockIdx start = std::max(advisedUntil_, block_idx / kAdviseWindowBlocks *
+                                                               kAdviseWindowBlocks);
+        advisedUntil_ = start + kAdviseWindowBlocks;
+        AdviseMapping(*map_, blockIndexToOffset(start), blockIndexToOffset(kAdviseWindowBlocks),
+                      MADV_WILLNEED);
+    }
 
     const std::vector<BlockIdx>& PriorityBlocks() const { return priority_blocks_; }
 
-    bool hasTree() const { return tree_fd_.ok(); }
+    // Appends |blocks| that aren't priority blocks already.
+    void AddPriorityBlocks(const std::vector<BlockIdx>& blocks) {
+        std::unordered_set<BlockIdx> present(priority_blocks_.begin(), priority_blocks_.end());
+        for (BlockIdx block : blocks) {
+            if (block >= 0 && block < (BlockIdx)sentBlocks.size() && present.insert(block).second) {
+                priority_blocks_.push_back(block);
+            }
+        }
+    }
+
+    bool hasTree() const { return tree_fd_.ok() || !tree_.empty(); }
 
     std::vector<bool> sentBlocks;
     NumBlocks sentBlocksCount = 0;
 
+    // Blocks that have been handed to the encoders and not spliced yet.
+    std::vector<bool> queuedBlocks;
+
+    // Encoded blocks shared with other servers, if the cache is enabled.
+    std::unique_ptr<BlockCache> cache;
+
+    // Where this install's misses are saved to order the next install's prefetch.
+    std::string profilePath;
+    ProfileRun profileRun;
+    std::vector<bool> missLogged;
+
     std::vector<bool> sentTreeBlocks;
 
     const char* const filepath;
@@ -187,22 +351,42 @@ class File {
     File(const char* filepath, FileId id, int64_t size, int64_t tree_offset)
         : filepath(filepath), id(id), size(size), tree_offset_(tree_offset) {
         sentBlocks.resize(numBytesToNumBlocks(size));
+        queuedBlocks.resize(sentBlocks.size());
+        missLogged.resize(sentBlocks.size());
         sentTreeBlocks.resize(verity_tree_blocks_for_file(size));
     }
     unique_fd fd_;
+    // Reading a page of the mapping that's past the end of the file raises SIGBUS, so truncating
+    // an APK while it's being served kills the server rather than failing the install. The same
+    // goes for the tree in a truncated .idsig. Files aren't expected to change while they're
+    // installed, and Windows won't truncate a mapped file at all.
+    std::unique_ptr<MappedFile> map_;
     std::vector<BlockIdx> priority_blocks_;
+    BlockIdx advisedUntil_ = 0;
 
     unique_fd tree_fd_;
+    std::unique_ptr<MappedFile> tree_map_;
     const int64_t tree_offset_;
+    // Built by the server when the signature file doesn't carry the tree.
+    std::string tree_;
 };
 
 class IncrementalServer {
   public:
-    IncrementalServer(unique_fd adb_fd, unique_fd output_fd, std::vector<File> files)
-        : adb_fd_(std::move(adb_fd)), output_fd_(std::move(output_fd)), files_(std::move(files)) {
+    IncrementalServer(unique_fd adb_fd, unique_fd output_fd, std::vector<File> files,
+                      const ServeOptions& options)
+        : adb_fd_(std::move(adb_fd)),
+          output_fd_(std::move(output_fd)),
+          files_(std::move(files)),
+          compression_(options.zstd ? kCompressionZstd : kCompressionLZ4) {
         buffer_.reserve(kReadBufferSize);
-        pendingBlocksBuffer_.resize(kChunkFlushSize + 2 * kBlockSize);
-        pendingBlocks_ = pendingBlocksBuffer_.data() + sizeof(ChunkHeader);
+        pendingIovecs_.reserve(kMaxIovecs);
+        pendingIovecs_.push_back({});  // For the chunk header.
+        encoders_ = std::make_unique<WorkerPool>(
+                "inc-encoder", std::clamp(std::thread::hardware_concurrency(), 2U, 8U));
+        if (!options.trace_path.empty()) {
+            trace_ = ServingTrace::Open(options.trace_path);
+        }
     }
 
     bool Serve();
@@ -237,22 +421,36 @@ class IncrementalServer {
     void erase_buffer_head(int count) { buffer_.erase(buffer_.begin(), buffer_.begin() + count); }
 
     enum class SendResult { Sent, Skipped, Error };
-    SendResult SendDataBlock(FileId fileId, BlockIdx blockIdx, bool flush = false);
+    // Sets |*encodedTime|, if given, once the block has been read and compressed.
+    SendResult SendDataBlock(FileId fileId, BlockIdx blockIdx, bool flush = false,
+                             ServingTrace::Clock::time_point* encodedTime = nullptr);
+    SendResult SendEncodedBlock(std::shared_ptr<const EncodedBlock> block, bool flush);
 
     bool SendTreeBlock(FileId fileId, int32_t fileBlockIdx, BlockIdx blockIdx);
     bool SendTreeBlocksForDataBlock(FileId fileId, BlockIdx blockIdx);
 
     bool SendDone();
     void RunPrefetching();
+    bool QueueNextPrefetchBlock();
+    int SpliceEncodedBlocks();
 
-    void Send(const void* data, size_t size, bool flush);
+    // |data| must stay valid until the next Flush(), which |hold| can ensure.
+    void Send(const void* data, size_t size, bool flush, std::shared_ptr<const void> hold);
+    // Queues |data| without flushing, for the first part of a response that Send() finishes.
+    void Append(const void* data, size_t size);
     void Flush();
     using TimePoint = decltype(std::chrono::high_resolution_clock::now());
     bool ServingComplete(std::optional<TimePoint> startTime, int missesCount, int missesSent);
+    void ReportStats(std::optional<TimePoint> startTime);
+    // Both return true if they wrote to the cache, which then needs trimming.
+    bool CommitCache();
+    bool SaveProfiles();
+    ServingTotals Totals(int missesCount, int missesSent) const;
 
     unique_fd const adb_fd_;
     unique_fd const output_fd_;
     std::vector<File> files_;
+    const CompressionType compression_;
 
     // Incoming data buffer.
     std::vector<char> buffer_;
@@ -260,16 +458,96 @@ class IncrementalServer {
     std::deque<PrefetchState> prefetches_;
     int compressed_ = 0, uncompressed_ = 0;
     long long sentSize_ = 0;
+    long long rawDataSize_ = 0, encodedDataSize_ = 0;
 
     static constexpr auto kChunkFlushSize = 31 * kBlockSize;
 
-    std::vector<char> pendingBlocksBuffer_;
-    char* pendingBlocks_ = nullptr;
+    // The next chunk, as the pieces of the responses that go in it and whatever keeps them alive.
+    ChunkHeader pendingChunkHeader_ = 0;
+    std::vector<adb_iovec> pendingIovecs_;
+    std::vector<std::shared_ptr<const void>> pendingHolds_;
+    size_t pendingBytes_ = 0;
 
     // True when client notifies that all the data has been received
     bool servingComplete_ = false;
+
+    std::unique_ptr<ServingTrace> trace_;
+
+    // Prefetch blocks handed to encoders_, in the order they were queued. Only the serving
+    // thread touches the deque; the encoders signal encodedCv_ as each block becomes ready.
+    std::deque<std::shared_ptr<EncodedBlock>> encoding_;
+    std::mutex encodedMutex_;
+    std::condition_variable encodedCv_;
+
+    // Declared last so that it's joined before anything its tasks use goes away.
+    std::unique_ptr<WorkerPool> encoders_;
 };
 
+// Returns the compressed size, or 0 if |src| couldn't be compressed into |dst|.
+static int CompressBlock(CompressionType compression, int level, const char* src, int size,
+                         char* dst) {
+    if (compression == kCompressionZstd) {
+        thread_local std::unique_ptr<ZSTD_CCtx, decltype(&ZSTD_freeCCtx)> cctx(ZSTD_createCCtx(),
+                                                                              ZSTD_freeCCtx);
+        const size_t compressed =
+                ZSTD_compressCCtx(cctx.get(), dst, kCompressBound, src, size, level);
+        return ZSTD_isError(compressed) ? 0 : compressed;
+    }
+    return LZ4_compress_default(src, dst, size, kCompressBound);
+}
+
+// Reads and compresses a data block, or copies it from the cache. Safe to call from any thread.
+static void EncodeDataBlock(const File& file, EncodedBlock* block, CompressionType compression,
+                            int level) {
+    if (file.cache && file.cache->complete()) {
+        auto cached = file.cache->Lookup(block->blockIdx);
+        if (!cached || cached->data.size() > sizeof(block->compressed.data)) {
+            fprintf(stderr, "Invalid cached data for %s at blockIdx=%d.\n", file.filepath,
+                    block->blockIdx);
+            return;
+        }
+        block->header = &block->compressed.header;
+        block->header->compression_type = cached->compression_type;
+        block->data = cached->data.data();
+        block->blockSize = cached->data.size();
+        block->rawSize = cached->raw_size;
+    } else {
+        bool isZipCompressed = false;
+        const char* raw = nullptr;
+        const int64_t bytesRead =
+                file.ReadDataBlock(block->blockIdx, block->raw.data, &raw, &isZipCompressed);
+        if (bytesRead < 0) {
+            fprintf(stderr, "Failed to get data for %s at blockIdx=%d (%d).\n", file.filepath,
+                    block->blockIdx, errno);
+            return;
+        }
+
+        int16_t compressedSize = 0;
+        if (!isZipCompressed) {
+            compressedSize =
+                    CompressBlock(compression, level, raw, bytesRead, block->compressed.data);
+        }
+        if (compressedSize > 0 && compressedSize < kCompressedSizeMax) {
+            block->header = &block->compressed.header;
+            block->header->compression_type = compression;
+            block->data = block->compressed.data;
+            block->blockSize = compressedSize;
+        } else {
+            block->header = &block->raw.header;
+            block->header->compression_type = kCompressionNone;
+            block->data = raw;
+            block->blockSize = bytesRead;
+        }
+        block->rawSize = bytesRead;
+    }
+
+    block->header->block_type = kTypeData;
+    block->header->file_id = toBigEndian(block->fileId);
+    block->header->block_size = toBigEndian(block->blockSize);
+    block->header->block_idx = toBigEndian(block->blockIdx);
+    block->ok = true;
+}
+
 bool IncrementalServer::SkipToRequest(void* buffer, size_t* size, bool blocking) {
     while (true) {
         // Looking for INCR magic.
@@ -389,26 +667,38 @@ bool IncrementalServer::SendTreeBlocksForDataBlock(const FileId fileId, const Bl
 bool IncrementalServer::SendTreeBlock(FileId fileId, int32_t fileBlockIdx, BlockIdx blockIdx) {
     const auto& file = files_[fileId];
 
-    BlockBuffer buffer;
-    const int64_t bytesRead = file.ReadTreeBlock(blockIdx, buffer.data);
+    auto fillHeader = [&](ResponseHeader* header, int64_t size) {
+        header->compression_type = kCompressionNone;
+        header->block_type = kTypeHash;
+        header->file_id = toBigEndian(fileId);
+        header->block_size = toBigEndian(int16_t(size));
+        header->block_idx = toBigEndian(blockIdx);
+    };
+
+    if (auto mapped = file.MappedTreeBlock(blockIdx); !mapped.empty()) {
+        auto header = std::make_shared<ResponseHeader>();
+        fillHeader(header.get(), mapped.size());
+        Append(header.get(), sizeof(*header));
+        Send(mapped.data(), mapped.size(), /*flush=*/false, header);
+        return true;
+    }
+
+    auto buffer = std::make_shared<BlockBuffer<>>();
+    const int64_t bytesRead = file.ReadTreeBlock(blockIdx, buffer->data);
     if (bytesRead <= 0) {
         fprintf(stderr, "Failed to get data for %s.idsig at blockIdx=%d.\n", file.filepath,
                 blockIdx);
         return false;
     }
 
-    buffer.header.compression_type = kCompressionNone;
-    buffer.header.block_type = kTypeHash;
-    buffer.header.file_id = toBigEndian(fileId);
-    buffer.header.block_size = toBigEndian(int16_t(bytesRead));
-    buffer.header.block_idx = toBigEndian(blockIdx);
-
-    Send(&buffer, ResponseHeader::responseSizeFor(bytesRead), /*flush=*/false);
+    fillHeader(&buffer->header, bytesRead);
+    Send(buffer.get(), ResponseHeader::responseSizeFor(bytesRead), /*flush=*/false, buffer);
 
     return true;
 }
 
-auto IncrementalServer::SendDataBlock(FileId fileId, BlockIdx blockIdx, bool flush) -> SendResult {
+auto IncrementalServer::SendDataBlock(FileId fileId, BlockIdx blockIdx, bool flush,
+                                      ServingTrace::Clock::time_point* encodedTime) -> SendResult {
     auto& file = files_[fileId];
     if (blockIdx >= static_cast<long>(file.sentBlocks.size())) {
         // may happen as we schedule some extra blocks for reported page misses
@@ -419,113 +709,210 @@ auto IncrementalServer::SendDataBlock(FileId fileId, BlockIdx blockIdx, bool flu
         return SendResult::Skipped;
     }
 
-    if (!SendTreeBlocksForDataBlock(fileId, blockIdx)) {
-        return SendResult::Error;
+    auto block = std::make_shared<EncodedBlock>(fileId, blockIdx);
+    EncodeDataBlock(file, block.get(), compression_,
+                    compression_ == kCompressionZstd ? kZstdMissLevel : 0);
+    if (encodedTime) {
+        *encodedTime = ServingTrace::Clock::now();
     }
+    return SendEncodedBlock(block, flush);
+}
 
-    BlockBuffer raw;
-    bool isZipCompressed = false;
-    const int64_t bytesRead = file.ReadDataBlock(blockIdx, raw.data, &isZipCompressed);
-    if (bytesRead < 0) {
-        fprintf(stderr, "Failed to get data for %s at blockIdx=%d (%d).\n", file.filepath, blockIdx,
-                errno);
+auto IncrementalServer::SendEncodedBlock(std::shared_ptr<const EncodedBlock> block, bool flush)
+        -> SendResult {
+    auto& file = files_[block->fileId];
+    if (file.sentBlocks[block->blockIdx]) {
+        return SendResult::Skipped;
+    }
+    if (!block->ok) {
         return SendResult::Error;
     }
 
-    BlockBuffer<kCompressBound> compressed;
-    int16_t compressedSize = 0;
-    if (!isZipCompressed) {
-        compressedSize = LZ4_compress_default(raw.data, compressed.data, bytesRead, kCompressBound);
+    if (!SendTreeBlocksForDataBlock(block->fileId, block->blockIdx)) {
+        return SendResult::Error;
     }
-    int16_t blockSize;
-    ResponseHeader* header;
-    if (compressedSize > 0 && compressedSize < kCompressedSizeMax) {
+
+    const CompressionType compressionType = block->header->compression_type;
+    if (compressionType != kCompressionNone) {
         ++compressed_;
-        blockSize = compressedSize;
-        header = &compressed.header;
-        header->compression_type = kCompressionLZ4;
     } else {
         ++uncompressed_;
-        blockSize = bytesRead;
-        header = &raw.header;
-        header->compression_type = kCompressionNone;
+    }
+    rawDataSize_ += block->rawSize;
+    encodedDataSize_ += block->blockSize;
+    if (file.cache && !file.cache->complete()) {
+        file.cache->Record(block->blockIdx, compressionType, block->data, block->blockSize,
+                           block->rawSize);
     }
 
-    header->block_type = kTypeData;
-    header->file_id = toBigEndian(fileId);
-    header->block_size = toBigEndian(blockSize);
-    header->block_idx = toBigEndian(blockIdx);
-
-    file.sentBlocks[blockIdx] = true;
+    file.sentBlocks[block->blockIdx] = true;
     file.sentBlocksCount += 1;
-    Send(header, ResponseHeader::responseSizeFor(blockSize), flush);
+    if (trace_ && (file.sentBlocksCount % kTraceProgressBlocks == 0 ||
+                   file.sentBlocksCount == NumBlocks(file.sentBlocks.size()))) {
+        trace_->Progress(file.id, file.sentBlocksCount, file.sentBlocks.size());
+    }
+    if (block->data == reinterpret_cast<const char*>(block->header + 1)) {
+        Send(block->header, ResponseHeader::responseSizeFor(block->blockSize), flush, block);
+    } else {
+        // The header and the data must go out in the same chunk.
+        Append(block->header, sizeof(ResponseHeader));
+        Send(block->data, block->blockSize, flush, block);
+    }
 
     return SendResult::Sent;
 }
 
 bool IncrementalServer::SendDone() {
-    ResponseHeader header;
-    header.file_id = -1;
-    header.block_type = 0;
-    header.compression_type = 0;
-    header.block_idx = 0;
-    header.block_size = 0;
-    Send(&header, sizeof(header), true);
+    auto header = std::make_shared<ResponseHeader>();
+    header->file_id = -1;
+    header->block_type = 0;
+    header->compression_type = 0;
+    header->block_idx = 0;
+    header->block_size = 0;
+    Send(header.get(), sizeof(*header), true, header);
+    if (trace_) {
+        trace_->Event("done");
+    }
     return true;
 }
 
-void IncrementalServer::RunPrefetching() {
-    constexpr auto kPrefetchBlocksPerIteration = 128;
-
-    int blocksToSend = kPrefetchBlocksPerIteration;
-    while (!prefetches_.empty() && blocksToSend > 0) {
+// Picks the next block to prefetch and hands it to the encoders. Returns false if there's
+// nothing left to prefetch.
+bool IncrementalServer::QueueNextPrefetchBlock() {
+    while (!prefetches_.empty()) {
         auto& prefetch = prefetches_.front();
-        const auto& file = *prefetch.file;
+        auto& file = files_[prefetch.file->id];
         const auto& priority_blocks = file.PriorityBlocks();
-        if (!priority_blocks.empty()) {
-            for (auto& i = prefetch.priorityIndex;
-                 blocksToSend > 0 && i < (BlockIdx)priority_blocks.size(); ++i) {
-                if (auto res = SendDataBlock(file.id, priority_blocks[i]);
-                    res == SendResult::Sent) {
-                    --blocksToSend;
-                } else if (res == SendResult::Error) {
-                    fprintf(stderr, "Failed to send priority block %" PRId32 "\n", i);
-                }
-            }
-        }
-        for (auto& i = prefetch.overallIndex; blocksToSend > 0 && i < prefetch.overallEnd; ++i) {
-            if (auto res = SendDataBlock(file.id, i); res == SendResult::Sent) {
-                --blocksToSend;
-            } else if (res == SendResult::Error) {
-                fprintf(stderr, "Failed to send block %" PRId32 "\n", i);
-            }
+
+        std::optional<BlockIdx> blockIdx;
+        if (prefetch.priorityIndex < (BlockIdx)priority_blocks.size()) {
+            blockIdx = priority_blocks[prefetch.priorityIndex++];
+        } else if (prefetch.overallIndex < prefetch.overallEnd) {
+            blockIdx = prefetch.overallIndex++;
+            file.PrefetchHint(*blockIdx);
         }
         if (prefetch.done()) {
             prefetches_.pop_front();
         }
+        if (!blockIdx || *blockIdx < 0 || *blockIdx >= (BlockIdx)file.sentBlocks.size() ||
+            file.sentBlocks[*blockIdx] || file.queuedBlocks[*blockIdx]) {
+            continue;
+        }
+
+        file.queuedBlocks[*blockIdx] = true;
+        auto block = std::make_shared<EncodedBlock>(file.id, *blockIdx);
+        encoding_.push_back(block);
+        if (file.cache && file.cache->complete()) {
+            // Nothing to compress, just a pointer into the cache.
+            EncodeDataBlock(file, block.get(), compression_, 0);
+            block->ready = true;
+            return true;
+        }
+        encoders_->Enqueue([this, &file, block]() {
+            EncodeDataBlock(file, block.get(), compression_,
+                            compression_ == kCompressionZstd ? kZstdPrefetchLevel : 0);
+            {
+                std::lock_guard<std::mutex> lock(encodedMutex_);
+                block->ready = true;
+            }
+            encodedCv_.notify_one();
+        });
+        return true;
     }
+    return false;
 }
 
-void IncrementalServer::Send(const void* data, size_t size, bool flush) {
-    pendingBlocks_ = std::copy_n(static_cast<const char*>(data), size, pendingBlocks_);
-    if (flush || pendingBlocks_ - pendingBlocksBuffer_.data() > kChunkFlushSize) {
+// Sends the encoded blocks at the head of the queue that are ready, without waiting for the rest.
+int IncrementalServer::SpliceEncodedBlocks() {
+    int sent = 0;
+    while (!encoding_.empty() && encoding_.front()->ready) {
+        auto block = std::move(encoding_.front());
+        encoding_.pop_front();
+        files_[block->fileId].queuedBlocks[block->blockIdx] = false;
+        if (auto res = SendEncodedBlock(block, /*flush=*/false); res == SendResult::Sent) {
+            ++sent;
+        } else if (res == SendResult::Error) {
+            fprintf(stderr, "Failed to send block %" PRId32 "\n", block->blockIdx);
+        }
+    }
+    return sent;
+}
+
+void IncrementalServer::RunPrefetching() {
+    while ((int)encoding_.size() < kEncodeAheadBlocks && QueueNextPrefetchBlock()) {
+    }
+
+    if (SpliceEncodedBlocks() > 0 || encoding_.empty()) {
+        return;
+    }
+
+    // Nothing was ready yet. Rather than spinning on the request poll, give the oldest block a
+    // moment to finish: that's at most one block's worth of work, so misses don't wait on it long.
+    const auto waitStart = ServingTrace::Clock::now();
+    {
+        std::unique_lock<std::mutex> lock(encodedMutex_);
+        encodedCv_.wait_for(lock, kEncodeWaitTimeout,
+                            [this]() { return encoding_.front()->ready.load(); });
+    }
+    if (trace_) {
+        trace_->EncodeWait(ServingTrace::Clock::now() - waitStart);
+    }
+    SpliceEncodedBlocks();
+}
+
+void IncrementalServer::Append(const void* data, size_t size) {
+    adb_iovec iov;
+    iov.iov_base = const_cast<void*>(data);
+    iov.iov_len = size;
+    pendingIovecs_.push_back(iov);
+    pendingBytes_ += size;
+}
+
+void IncrementalServer::Send(const void* data, size_t size, bool flush,
+                             std::shared_ptr<const void> hold) {
+    Append(data, size);
+    pendingHolds_.push_back(std::move(hold));
+    // A data block takes at most two iovecs.
+    if (flush || pendingBytes_ > kChunkFlushSize ||
+        pendingIovecs_.size() + 2 > static_cast<size_t>(kMaxIovecs)) {
         Flush();
     }
 }
 
 void IncrementalServer::Flush() {
-    auto dataBytes = pendingBlocks_ - (pendingBlocksBuffer_.data() + sizeof(ChunkHeader));
-    if (dataBytes == 0) {
+    if (pendingBytes_ == 0) {
         return;
     }
 
-    *(ChunkHeader*)pendingBlocksBuffer_.data() = toBigEndian<int32_t>(dataBytes);
-    auto totalBytes = sizeof(ChunkHeader) + dataBytes;
-    if (!WriteFdExactly(adb_fd_, pendingBlocksBuffer_.data(), totalBytes)) {
-        fprintf(stderr, "Failed to write %d bytes\n", int(totalBytes));
+    pendingChunkHeader_ = toBigEndian<int32_t>(pendingBytes_);
+    pendingIovecs_[0].iov_base = &pendingChunkHeader_;
+    pendingIovecs_[0].iov_len = sizeof(pendingChunkHeader_);
+    const size_t totalBytes = sizeof(ChunkHeader) + pendingBytes_;
+
+    adb_iovec* iov = pendingIovecs_.data();
+    int iovcnt = pendingIovecs_.size();
+    while (iovcnt > 0) {
+        ssize_t written = adb_writev(adb_fd_, iov, iovcnt);
+        if (written <= 0) {
+            fprintf(stderr, "Failed to write %d bytes\n", int(totalBytes));
+            break;
+        }
+        // Skip whatever went out, resuming a short write in the middle of an iovec.
+        while (iovcnt > 0 && static_cast<size_t>(written) >= iov->iov_len) {
+            written -= iov->iov_len;
+            ++iov;
+            --iovcnt;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = static_cast<char*>(iov->iov_base) + written;
+            iov->iov_len -= written;
+        }
     }
     sentSize_ += totalBytes;
-    pendingBlocks_ = pendingBlocksBuffer_.data() + sizeof(ChunkHeader);
+
+    pendingIovecs_.resize(1);
+    pendingHolds_.clear();
+    pendingBytes_ = 0;
 }
 
 bool IncrementalServer::ServingComplete(std::optional<TimePoint> startTime, int missesCount,
@@ -539,9 +926,71 @@ bool IncrementalServer::ServingComplete(std::optional<TimePoint> startTime, int
       "Total time taken: %.3fms",
       missesCount, missesSent, compressed_, uncompressed_, sentSize_ / 1024.0 / 1024.0,
       duration_cast<microseconds>(endTime - (startTime ? *startTime : endTime)).count() / 1000.0);
+    if (trace_) {
+        trace_->Event("serving_complete");
+    }
     return true;
 }
 
+void IncrementalServer::ReportStats(std::optional<TimePoint> startTime) {
+    using namespace std::chrono;
+    auto endTime = high_resolution_clock::now();
+    const double seconds =
+            duration_cast<microseconds>(endTime - (startTime ? *startTime : endTime)).count() /
+            1000000.0;
+    const int blocks = compressed_ + uncompressed_;
+    D("Served %d data blocks in %.3fs (%.1f blocks/s), compression ratio %.3f "
+      "(%lld bytes read, %lld bytes sent)",
+      blocks, seconds, seconds > 0 ? blocks / seconds : 0.0,
+      encodedDataSize_ > 0 ? double(rawDataSize_) / encodedDataSize_ : 1.0, rawDataSize_,
+      encodedDataSize_);
+}
+
+bool IncrementalServer::CommitCache() {
+    // Queued prefetch blocks may still be reading from and recording into the caches, so let the
+    // encoders finish them first.
+    encoders_.reset();
+
+    bool committed = false;
+    for (auto& file : files_) {
+        if (file.cache) {
+            committed |= file.cache->Commit();
+            file.cache.reset();
+        }
+    }
+    return committed;
+}
+
+ServingTotals IncrementalServer::Totals(int missesCount, int missesSent) const {
+    return ServingTotals{
+            .misses = missesCount,
+            .unique_misses = missesSent,
+            .compressed = compressed_,
+            .uncompressed = uncompressed_,
+            .bytes_sent = sentSize_,
+            .raw_bytes = rawDataSize_,
+            .encoded_bytes = encodedDataSize_,
+    };
+}
+
+bool IncrementalServer::SaveProfiles() {
+    bool saved = false;
+    for (auto& file : files_) {
+        if (file.profilePath.empty() || file.profileRun.misses == 0) {
+            continue;
+        }
+        file.profileRun.time = time(nullptr);
+        if (adb_mkdir(BlockCacheDir(), 0750) == -1 && errno != EEXIST) {
+            return saved;
+        }
+        D("Saving %d unique misses of %d to %s", int(file.profileRun.blocks.size()),
+          file.profileRun.misses, file.profilePath.c_str());
+        AppendProfileRun(file.profilePath, file.profileRun);
+        saved = true;
+    }
+    return saved;
+}
+
 bool IncrementalServer::Serve() {
     // Initial handshake to verify connection is still alive
     if (!SendOkay(adb_fd_)) {
@@ -558,7 +1007,7 @@ bool IncrementalServer::Serve() {
     std::optional<TimePoint> startTime;
 
     while (true) {
-        if (!doneSent && prefetches_.empty() &&
+        if (!doneSent && prefetches_.empty() && encoding_.empty() &&
             std::all_of(files_.begin(), files_.end(), [](const File& f) {
                 return f.sentBlocksCount == NumBlocks(f.sentBlocks.size());
             })) {
@@ -567,12 +1016,17 @@ bool IncrementalServer::Serve() {
             doneSent = true;
         }
 
-        const bool blocking = prefetches_.empty();
+        const bool blocking = prefetches_.empty() && encoding_.empty();
         if (blocking) {
             // We've no idea how long the blocking call is, so let's flush whatever is still unsent.
             Flush();
         }
+        const auto requestStart = ServingTrace::Clock::now();
         auto request = ReadRequest(blocking);
+        const auto requestTime = ServingTrace::Clock::now();
+        if (trace_ && blocking) {
+            trace_->Stall(requestStart, requestTime);
+        }
 
         if (!startTime) {
             startTime = high_resolution_clock::now();
@@ -585,6 +1039,14 @@ bool IncrementalServer::Serve() {
             switch (request->request_type) {
                 case DESTROY: {
                     // Stop everything.
+                    ReportStats(startTime);
+                    const bool saved = SaveProfiles();
+                    if (CommitCache() || saved) {
+                        TrimBlockCache(BlockCacheDir(), BlockCacheSizeLimit());
+                    }
+                    if (trace_) {
+                        trace_->Finish(Totals(missesCount, missesSent));
+                    }
                     return true;
                 }
                 case SERVING_COMPLETE: {
@@ -604,6 +1066,12 @@ bool IncrementalServer::Serve() {
                         break;
                     }
 
+                    if (auto& file = files_[fileId]; !file.missLogged[blockIdx]) {
+                        file.missLogged[blockIdx] = true;
+                        file.profileRun.blocks.push_back(blockIdx);
+                    }
+                    ++files_[fileId].profileRun.misses;
+
                     if (VLOG_IS_ON(INCREMENTAL)) {
                         auto& file = files_[fileId];
                         auto posP = std::find(file.PriorityBlocks().begin(),
@@ -616,8 +1084,15 @@ bool IncrementalServer::Serve() {
                           int(file.PriorityBlocks().size()));
                     }
 
-                    if (auto res = SendDataBlock(fileId, blockIdx, true);
-                        res == SendResult::Error) {
+                    const bool queued = files_[fileId].queuedBlocks[blockIdx];
+                    auto encodedTime = requestTime;
+                    const auto res = SendDataBlock(fileId, blockIdx, true, &encodedTime);
+                    if (trace_) {
+                        trace_->Miss(fileId, blockIdx, requestTime, encodedTime,
+                                     ServingTrace::Clock::now(), queued,
+                                     res == SendResult::Sent);
+                    }
+                    if (res == SendResult::Error) {
                         fprintf(stderr, "Failed to send block %" PRId32 ".\n", blockIdx);
                     } else if (res == SendResult::Sent) {
                         ++missesSent;
@@ -643,6 +1118,10 @@ bool IncrementalServer::Serve() {
                     }
                     D("Received prefetch request for file_id %" PRId16 ".", fileId);
                     prefetches_.emplace_back(files_[fileId]);
+                    if (trace_) {
+                        trace_->Progress(fileId, files_[fileId].sentBlocksCount,
+                                         files_[fileId].sentBlocks.size());
+                    }
                     break;
                 }
                 default:
@@ -656,7 +1135,7 @@ bool IncrementalServer::Serve() {
     }
 }
 
-static std::pair<unique_fd, int64_t> open_fd(const char* filepath) {
+static std::pair<unique_fd, struct stat> open_fd(const char* filepath) {
     struct stat st;
     if (stat(filepath, &st)) {
         error_exit("inc-server: failed to stat input file '%s'.", filepath);
@@ -667,10 +1146,15 @@ static std::pair<unique_fd, int64_t> open_fd(const char* filepath) {
         error_exit("inc-server: failed to open file '%s'.", filepath);
     }
 
-    return {std::move(fd), st.st_size};
+    return {std::move(fd), st};
 }
 
-static std::pair<unique_fd, int64_t> open_signature(int64_t file_size, const char* filepath) {
+// Returns the signature file positioned at the start of its verity tree, and the tree's offset,
+// and sets |*root_hash| if the signature has one. Signature files don't have to carry the tree: if
+// it's missing, it's built into |*tree| instead, or loaded if it was built before.
+static std::pair<unique_fd, int64_t> open_signature(int64_t file_size, const char* filepath,
+                                                    borrowed_fd file_fd, std::string* tree,
+                                                    std::string* root_hash) {
     std::string signature_file(filepath);
     signature_file += IDSIG;
 
@@ -680,11 +1164,35 @@ static std::pair<unique_fd, int64_t> open_signature(int64_t file_size, const cha
         return {};
     }
 
-    auto [tree_offset, tree_size] = skip_id_sig_headers(fd);
-    if (auto expected = verity_tree_size_for_file(file_size); tree_size != expected) {
+    auto [signature, tree_size] = read_id_sig_headers(fd);
+    auto info = ParseHashingInfo(signature);
+    if (info) {
+        *root_hash = info->root_hash;
+    }
+    const auto expected = verity_tree_size_for_file(file_size);
+    if (tree_size == 0 && expected != 0) {
+        if (!info || !CanBuildVerityTree(*info)) {
+            error_exit("inc-server: signature file %s has no verity tree, and it can't be built.",
+                       signature_file.c_str());
+        }
+        auto built = LoadOrBuildVerityTree(BlockCacheDir(), info->root_hash, file_fd, file_size);
+        if (!built) {
+            error_exit("inc-server: failed to build the verity tree for '%s'.", filepath);
+        }
+        if (built->root_hash != info->root_hash) {
+            error_exit("inc-server: signature file %s doesn't match '%s'. Was the APK changed "
+                       "after it was signed?",
+                       signature_file.c_str(), filepath);
+        }
+        D("Verity tree built for %s, tree size: %d", filepath, int(built->tree.size()));
+        *tree = std::move(built->tree);
+        return {};
+    }
+    if (tree_size != expected) {
         error_exit("Verity tree size mismatch in signature file: %s [was %lld, expected %lld].\n",
                    signature_file.c_str(), (long long)tree_size, (long long)expected);
     }
+    const int64_t tree_offset = adb_lseek(fd, 0, SEEK_CUR);
 
     int32_t data_block_count = numBytesToNumBlocks(file_size);
     int32_t leaf_nodes_count = (data_block_count + kHashesPerBlock - 1) / kHashesPerBlock;
@@ -694,26 +1202,52 @@ static std::pair<unique_fd, int64_t> open_signature(int64_t file_size, const cha
     return {std::move(fd), tree_offset};
 }
 
-bool serve(int connection_fd, int output_fd, int argc, const char** argv) {
+bool serve(int connection_fd, int output_fd, int argc, const char** argv,
+           const ServeOptions& options) {
     auto connection_ufd = unique_fd(connection_fd);
     auto output_ufd = unique_fd(output_fd);
     if (argc <= 0) {
         error_exit("inc-server: must specify at least one file.");
     }
 
+    const bool use_cache = BlockCacheSizeLimit() > 0;
     std::vector<File> files;
     files.reserve(argc);
     for (int i = 0; i < argc; ++i) {
         auto filepath = argv[i];
 
-        auto [file_fd, file_size] = open_fd(filepath);
-        auto [sign_fd, sign_offset] = open_signature(file_size, filepath);
+        auto [file_fd, st] = open_fd(filepath);
+        const int64_t file_size = st.st_size;
+
+        std::string tree;
+        std::string root_hash;
+        auto [sign_fd, sign_offset] =
+                open_signature(file_size, filepath, file_fd, &tree, &root_hash);
+        // The file is cached under its signature's root hash, so serving doesn't wait for the
+        // whole file to be read.
+        const std::string cache_key =
+                use_cache ? FileCacheKey(root_hash, file_size, st.st_mtime) : "";
+        std::unique_ptr<BlockCache> cache;
+        if (!cache_key.empty()) {
+            // Blocks compressed differently are cached separately.
+            cache = BlockCache::Open(BlockCacheDir(),
+                                     options.zstd ? cache_key + "-zstd" : cache_key,
+                                     numBytesToNumBlocks(file_size));
+        }
 
-        files.emplace_back(filepath, i, file_size, std::move(file_fd), sign_offset,
-                           std::move(sign_fd));
+        auto& file = files.emplace_back(filepath, i, file_size, std::move(file_fd), sign_offset,
+                                        std::move(sign_fd), std::move(tree));
+        file.cache = std::move(cache);
+        if (!cache_key.empty()) {
+            // What the app read first last time goes right after what installation needs. Profiles
+            // live in the cache, so they're off along with it.
+            file.profilePath = ProfilePath(BlockCacheDir(), cache_key);
+            file.AddPriorityBlocks(ProfileBlocks(ReadProfile(file.profilePath)));
+        }
     }
 
-    IncrementalServer server(std::move(connection_ufd), std::move(output_ufd), std::move(files));
+    IncrementalServer server(std::move(connection_ufd), std::move(output_ufd), std::move(files),
+                             options);
     printf("Serving...\n");
     fclose(stdin);
     fclose(stdout);
@@ -16,11 +16,21 @@
 
 #pragma once
 
+#include <string>
+
 namespace incremental {
 
+struct ServeOptions {
+    // Compress data blocks with zstd instead of LZ4. The device has to support it.
+    bool zstd = false;
+    // Where to write a timeline of serving, if anywhere. See incremental_trace.h.
+    std::string trace_path;
+};
+
 // Expecting arguments like:
 // {FILE1 FILE2 ...}
 // Where FILE* are files to serve.
-bool serve(int connection_fd, int output_fd, int argc, const char** argv);
+bool serve(int connection_fd, int output_fd, int argc, const char** argv,
+           const ServeOptions& options = {});
 
 }  // namespace incremental
@@ -0,0 +1,160 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define TRACE_TAG INCREMENTAL
+
+#include "incremental_trace.h"
+
+#include <inttypes.h>
+#include <math.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "adb_trace.h"
+
+namespace incremental {
+
+void LatencyHistogram::Add(int64_t us) {
+    size_t bucket = 0;
+    for (int64_t v = std::max<int64_t>(us, 0); v > 0 && bucket < kBuckets - 1; v >>= 1) {
+        ++bucket;
+    }
+    ++buckets_[bucket];
+    ++count_;
+    max_ = std::max(max_, us);
+}
+
+int64_t LatencyHistogram::Percentile(double p) const {
+    if (count_ == 0) {
+        return 0;
+    }
+    const int64_t rank = std::max<int64_t>(1, ceil(p / 100 * count_));
+    int64_t seen = 0;
+    for (size_t i = 0; i < kBuckets; ++i) {
+        seen += buckets_[i];
+        if (seen >= rank) {
+            return std::min(BucketLimit(i), max_);
+        }
+    }
+    return max_;
+}
+
+std::unique_ptr<ServingTrace> ServingTrace::Open(const std::string& path) {
+    FILE* file = fopen(path.c_str(), "w");
+    if (!file) {
+        fprintf(stderr, "inc-server: failed to open trace file '%s': %s\n", path.c_str(),
+                strerror(errno));
+        return nullptr;
+    }
+    D("Writing serving trace to %s", path.c_str());
+    return std::unique_ptr<ServingTrace>(new ServingTrace(file));
+}
+
+ServingTrace::ServingTrace(FILE* file) : file_(file), start_(Clock::now()) {}
+
+ServingTrace::~ServingTrace() {
+    if (file_) {
+        Finish({});
+    }
+}
+
+int64_t ServingTrace::Micros(Clock::time_point time) const {
+    return std::chrono::duration_cast<std::chrono::microseconds>(time - start_).count();
+}
+
+void ServingTrace::Miss(int16_t file_id, int32_t block_idx, Clock::time_point arrived,
+                        Clock::time_point encoded, Clock::time_point flushed, bool queued,
+                        bool sent) {
+    if (!file_) {
+        return;
+    }
+    const int64_t latency = Micros(flushed) - Micros(arrived);
+    miss_latency_.Add(latency);
+    queued_misses_ += queued;
+    fprintf(file_,
+            "{\"t\":%" PRId64 ",\"type\":\"miss\",\"file\":%d,\"block\":%" PRId32
+            ",\"queued\":%s,\"sent\":%s,\"encode_us\":%" PRId64 ",\"write_us\":%" PRId64
+            ",\"latency_us\":%" PRId64 "}\n",
+            Micros(arrived), file_id, block_idx, queued ? "true" : "false",
+            sent ? "true" : "false", Micros(encoded) - Micros(arrived),
+            Micros(flushed) - Micros(encoded), latency);
+}
+
+void ServingTrace::Stall(Clock::time_point start, Clock::time_point end) {
+    if (!file_) {
+        return;
+    }
+    const int64_t us = Micros(end) - Micros(start);
+    stall_us_ += us;
+    fprintf(file_, "{\"t\":%" PRId64 ",\"type\":\"stall\",\"us\":%" PRId64 "}\n", Micros(start),
+            us);
+}
+
+void ServingTrace::EncodeWait(Clock::duration duration) {
+    encode_wait_us_ += std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+}
+
+void ServingTrace::Progress(int16_t file_id, int64_t sent_blocks, int64_t total_blocks) {
+    if (!file_) {
+        return;
+    }
+    fprintf(file_,
+            "{\"t\":%" PRId64 ",\"type\":\"progress\",\"file\":%d,\"sent\":%" PRId64
+            ",\"total\":%" PRId64 "}\n",
+            Micros(Clock::now()), file_id, sent_blocks, total_blocks);
+}
+
+void ServingTrace::Event(const char* type) {
+    if (!file_) {
+        return;
+    }
+    fprintf(file_, "{\"t\":%" PRId64 ",\"type\":\"%s\"}\n", Micros(Clock::now()), type);
+}
+
+void ServingTrace::Finish(const ServingTotals& totals) {
+    if (!file_) {
+        return;
+    }
+    std::string histogram;
+    const auto& buckets = miss_latency_.buckets();
+    for (size_t i = 0; i < buckets.size(); ++i) {
+        if (buckets[i] == 0) {
+            continue;
+        }
+        if (!histogram.empty()) {
+            histogram += ',';
+        }
+        histogram += "{\"lt_us\":" + std::to_string(LatencyHistogram::BucketLimit(i)) +
+                     ",\"count\":" + std::to_string(buckets[i]) + "}";
+    }
+    fprintf(file_,
+            "{\"t\":%" PRId64 ",\"type\":\"summary\",\"misses\":%d,\"unique_misses\":%d"
+            ",\"queued_misses\":%d,\"compressed\":%d,\"uncompressed\":%d"
+            ",\"bytes_sent\":%" PRId64 ",\"raw_bytes\":%" PRId64 ",\"encoded_bytes\":%" PRId64
+            ",\"stall_us\":%" PRId64 ",\"encode_wait_us\":%" PRId64
+            ",\"miss_latency_us\":{\"p50\":%" PRId64 ",\"p90\":%" PRId64 ",\"p99\":%" PRId64
+            ",\"max\":%" PRId64 ",\"histogram\":[%s]}}\n",
+            Micros(Clock::now()), totals.misses, totals.unique_misses, queued_misses_,
+            totals.compressed, totals.uncompressed, totals.bytes_sent, totals.raw_bytes,
+            totals.encoded_bytes, stall_us_, encode_wait_us_, miss_latency_.Percentile(50),
+            miss_latency_.Percentile(90), miss_latency_.Percentile(99), miss_latency_.max(),
+            histogram.c_str());
+    fclose(file_);
+    file_ = nullptr;
+}
+
+}  // namespace incremental
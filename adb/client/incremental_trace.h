@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <array>
+#include <chrono>
+#include <memory>
+#include <string>
+
+namespace incremental {
+
+// Counts latencies in power-of-two buckets of microseconds: bucket i holds [2^(i-1), 2^i).
+class LatencyHistogram {
+  public:
+    static constexpr size_t kBuckets = 32;
+
+    void Add(int64_t us);
+
+    int64_t count() const { return count_; }
+    int64_t max() const { return max_; }
+    const std::array<int64_t, kBuckets>& buckets() const { return buckets_; }
+
+    // The upper bound of the bucket holding the |p|th percentile, in microseconds.
+    int64_t Percentile(double p) const;
+
+    static int64_t BucketLimit(size_t bucket) { return int64_t(1) << bucket; }
+
+  private:
+    std::array<int64_t, kBuckets> buckets_ = {};
+    int64_t count_ = 0;
+    int64_t max_ = 0;
+};
+
+struct ServingTotals {
+    int misses = 0;
+    int unique_misses = 0;
+    int compressed = 0;
+    int uncompressed = 0;
+    int64_t bytes_sent = 0;
+    int64_t raw_bytes = 0;
+    int64_t encoded_bytes = 0;
+};
+
+// A timeline of what inc-server did, written with --incremental-trace to tell whether a slow
+// first launch was waiting on the link, on compression or on blocks being prefetched in the
+// wrong order.
+//
+// The trace is JSON lines: one event per line, with "t" in microseconds since the trace started,
+// and a summary line with a histogram of miss latencies at the end.
+class ServingTrace {
+  public:
+    using Clock = std::chrono::steady_clock;
+
+    // Returns nullptr if |path| can't be written.
+    static std::unique_ptr<ServingTrace> Open(const std::string& path);
+
+    ~ServingTrace();
+
+    // A BLOCK_MISSING request that arrived at |arrived|, was read and compressed by |encoded|
+    // and written out by |flushed|. |queued| means prefetch was already encoding the block, and
+    // |sent| is false if the block had already been sent.
+    void Miss(int16_t file_id, int32_t block_idx, Clock::time_point arrived,
+              Clock::time_point encoded, Clock::time_point flushed, bool queued, bool sent);
+
+    // Time spent blocked waiting for the device's next request.
+    void Stall(Clock::time_point start, Clock::time_point end);
+
+    // Time the serving thread spent waiting for the encoders to finish a prefetched block.
+    void EncodeWait(Clock::duration duration);
+
+    void Progress(int16_t file_id, int64_t sent_blocks, int64_t total_blocks);
+
+    // A point event with no data, e.g. "done".
+    void Event(const char* type);
+
+    // Writes the summary and closes the trace. Nothing is recorded after this.
+    void Finish(const ServingTotals& totals);
+
+    const LatencyHistogram& miss_latency() const { return miss_latency_; }
+
+  private:
+    explicit ServingTrace(FILE* file);
+
+    int64_t Micros(Clock::time_point time) const;
+
+    FILE* file_;
+    const Clock::time_point start_;
+    LatencyHistogram miss_latency_;
+    int64_t stall_us_ = 0;
+    int64_t encode_wait_us_ = 0;
+    int queued_misses_ = 0;
+};
+
+}  // namespace incremental
@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "incremental_trace.h"
+
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/strings.h>
+#include <gtest/gtest.h>
+
+namespace incremental {
+
+using namespace std::chrono_literals;
+
+TEST(LatencyHistogram, buckets) {
+    LatencyHistogram histogram;
+    ASSERT_EQ(0, histogram.Percentile(50));
+
+    histogram.Add(0);
+    histogram.Add(1);
+    histogram.Add(3);
+    histogram.Add(1000);
+    ASSERT_EQ(4, histogram.count());
+    ASSERT_EQ(1000, histogram.max());
+    ASSERT_EQ(1, histogram.buckets()[0]);   // [0, 1)
+    ASSERT_EQ(1, histogram.buckets()[1]);   // [1, 2)
+    ASSERT_EQ(1, histogram.buckets()[2]);   // [2, 4)
+    ASSERT_EQ(1, histogram.buckets()[10]);  // [512, 1024)
+
+    ASSERT_EQ(2, histogram.Percentile(50));
+    ASSERT_EQ(4, histogram.Percentile(75));
+    // Capped at the largest latency seen rather than the bucket's limit.
+    ASSERT_EQ(1000, histogram.Percentile(100));
+}
+
+TEST(ServingTrace, timeline) {
+    TemporaryDir dir;
+    const std::string path = std::string(dir.path) + "/trace.json";
+    auto trace = ServingTrace::Open(path);
+    ASSERT_NE(nullptr, trace);
+
+    const auto now = ServingTrace::Clock::now();
+    trace->Stall(now, now + 5ms);
+    trace->Miss(1, 42, now, now + 100us, now + 300us, /*queued=*/true, /*sent=*/true);
+    trace->Progress(1, 256, 1000);
+    trace->Event("done");
+    trace->Finish({.misses = 1, .unique_misses = 1, .compressed = 1});
+    ASSERT_EQ(1, trace->miss_latency().count());
+
+    std::string content;
+    ASSERT_TRUE(android::base::ReadFileToString(path, &content));
+    auto lines = android::base::Split(android::base::Trim(content), "\n");
+    ASSERT_EQ(5U, lines.size());
+    ASSERT_NE(std::string::npos, lines[0].find("\"type\":\"stall\",\"us\":5000")) << lines[0];
+    ASSERT_NE(std::string::npos,
+              lines[1].find("\"file\":1,\"block\":42,\"queued\":true,\"sent\":true,"
+                            "\"encode_us\":100,\"write_us\":200,\"latency_us\":300"))
+            << lines[1];
+    ASSERT_NE(std::string::npos, lines[2].find("\"sent\":256,\"total\":1000")) << lines[2];
+    ASSERT_NE(std::string::npos, lines[3].find("\"type\":\"done\"")) << lines[3];
+    ASSERT_NE(std::string::npos, lines[4].find("\"type\":\"summary\",\"misses\":1")) << lines[4];
+    ASSERT_NE(std::string::npos, lines[4].find("\"stall_us\":5000")) << lines[4];
+    ASSERT_NE(std::string::npos, lines[4].find("\"histogram\":[{\"lt_us\":512,\"count\":1}]"))
+            << lines[4];
+
+    // Nothing is recorded once the trace is finished.
+    trace->Event("after_finish");
+    ASSERT_TRUE(android::base::ReadFileToString(path, &content));
+    ASSERT_EQ(std::string::npos, content.find("after_finish"));
+}
+
+TEST(ServingTrace, bad_path) {
+    TemporaryDir dir;
+    ASSERT_EQ(nullptr, ServingTrace::Open(std::string(dir.path) + "/missing/trace.json"));
+}
+
+}  // namespace incremental
@@ -0,0 +1,251 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define TRACE_TAG INCREMENTAL
+
+#include "incremental_verity.h"
+
+#include <string.h>
+#include <utime.h>
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+#include <android-base/endian.h>
+#include <android-base/file.h>
+#include <android-base/hex.h>
+#include <openssl/sha.h>
+
+#include "adb_trace.h"
+#include "adb_utils.h"
+#include "sysdeps.h"
+
+namespace incremental {
+
+namespace {
+
+// From V4Signature.java.
+constexpr int32_t kHashAlgorithmSha256 = 1;
+constexpr int8_t kLog2BlockSize = 12;
+
+constexpr int kHashesPerBlock = kBlockSize / kDigestSize;
+
+// Data blocks hashed by each task: enough to amortize the read, small enough to spread a
+// medium-sized APK over every thread.
+constexpr Size kBlocksPerTask = 256;
+
+class Reader {
+  public:
+    Reader(const char* data, size_t size) : data_(data), left_(size) {}
+
+    template <typename T>
+    bool Read(T* value) {
+        if (left_ < sizeof(T)) {
+            return false;
+        }
+        memcpy(value, data_, sizeof(T));
+        data_ += sizeof(T);
+        left_ -= sizeof(T);
+        return true;
+    }
+
+    bool ReadBytesWithSize(std::string* bytes) {
+        int32_t size;
+        if (!Read(&size) || (size = int32_t(le32toh(size))) < 0 || size_t(size) > left_) {
+            return false;
+        }
+        bytes->assign(data_, size);
+        data_ += size;
+        left_ -= size;
+        return true;
+    }
+
+  private:
+    const char* data_;
+    size_t left_;
+};
+
+// Hashes |count| blocks of |data| into consecutive digests at |out|.
+void HashBlocks(const char* data, Size count, char* out) {
+    for (Size i = 0; i < count; ++i) {
+        SHA256(reinterpret_cast<const uint8_t*>(data + i * kBlockSize), kBlockSize,
+               reinterpret_cast<uint8_t*>(out + i * kDigestSize));
+    }
+}
+
+// Reads and hashes data blocks [first, first + count), zero-padding the last block of the file.
+bool HashDataBlocks(borrowed_fd fd, Size size, Size first, Size count, char* out) {
+    std::vector<char> buf(count * kBlockSize);
+    const Size offset = first * kBlockSize;
+    const Size length = std::min<Size>(buf.size(), size - offset);
+    for (Size done = 0; done < length;) {
+        const int n = adb_pread(fd, buf.data() + done, length - done, offset + done);
+        if (n <= 0) {
+            return false;
+        }
+        done += n;
+    }
+    HashBlocks(buf.data(), count, out);
+    return true;
+}
+
+// Block counts of each level of the tree over |data_block_count| blocks, from the leaves up.
+std::vector<Size> LevelBlocks(Size data_block_count) {
+    std::vector<Size> level_blocks;
+    for (Size count = data_block_count; count > 1;) {
+        count = (count + kHashesPerBlock - 1) / kHashesPerBlock;
+        level_blocks.push_back(count);
+    }
+    return level_blocks;
+}
+
+Size DataBlockCount(Size size) {
+    return (size + kBlockSize - 1) / kBlockSize;
+}
+
+}  // namespace
+
+std::optional<HashingInfo> ParseHashingInfo(const std::vector<char>& signature) {
+    Reader signature_reader(signature.data(), signature.size());
+    int32_t version;
+    std::string hashing_info;
+    if (!signature_reader.Read(&version) || !signature_reader.ReadBytesWithSize(&hashing_info)) {
+        return std::nullopt;
+    }
+
+    Reader reader(hashing_info.data(), hashing_info.size());
+    HashingInfo info;
+    if (!reader.Read(&info.hash_algorithm) || !reader.Read(&info.log2_block_size) ||
+        !reader.ReadBytesWithSize(&info.salt) || !reader.ReadBytesWithSize(&info.root_hash)) {
+        return std::nullopt;
+    }
+    info.hash_algorithm = int32_t(le32toh(info.hash_algorithm));
+    return info;
+}
+
+bool CanBuildVerityTree(const HashingInfo& info) {
+    return info.hash_algorithm == kHashAlgorithmSha256 && info.log2_block_size == kLog2BlockSize &&
+           info.salt.empty();
+}
+
+std::optional<VerityTree> BuildVerityTree(borrowed_fd fd, Size size, size_t threads) {
+    VerityTree result;
+    if (size <= 0) {
+        return result;
+    }
+    const Size data_block_count = DataBlockCount(size);
+
+    // A single block has no tree, just a root hash.
+    if (data_block_count == 1) {
+        result.root_hash.resize(kDigestSize);
+        if (!HashDataBlocks(fd, size, 0, 1, result.root_hash.data())) {
+            return std::nullopt;
+        }
+        return result;
+    }
+
+    const std::vector<Size> level_blocks = LevelBlocks(data_block_count);
+    std::vector<Size> level_offsets(level_blocks.size());
+    Size offset = 0;
+    for (size_t i = level_blocks.size(); i-- > 0;) {
+        level_offsets[i] = offset;
+        offset += level_blocks[i] * kBlockSize;
+    }
+    result.tree.resize(offset);
+    char* const tree = result.tree.data();
+
+    // Hashing the data is nearly all of the work. SHA256() picks the fastest implementation the
+    // CPU supports (SHA extensions, AVX2 or NEON), and the blocks are spread across threads.
+    std::atomic<bool> failed = false;
+    {
+        WorkerPool pool("inc-verity", std::max<size_t>(threads, 1));
+        for (Size first = 0; first < data_block_count; first += kBlocksPerTask) {
+            const Size count = std::min(kBlocksPerTask, data_block_count - first);
+            char* out = tree + level_offsets[0] + first * kDigestSize;
+            pool.Enqueue([&failed, fd, size, first, count, out]() {
+                if (!failed && !HashDataBlocks(fd, size, first, count, out)) {
+                    failed = true;
+                }
+            });
+        }
+    }
+    if (failed) {
+        return std::nullopt;
+    }
+
+    // The rest of the tree is less than 1% of the size of the data.
+    for (size_t i = 1; i < level_blocks.size(); ++i) {
+        HashBlocks(tree + level_offsets[i - 1], level_blocks[i - 1], tree + level_offsets[i]);
+    }
+    result.root_hash.resize(kDigestSize);
+    HashBlocks(tree, 1, result.root_hash.data());
+    return result;
+}
+
+std::string VerityTreePath(const std::string& dir, const std::string& root_hash) {
+    return dir + OS_PATH_SEPARATOR + android::base::HexString(root_hash.data(), root_hash.size()) +
+           ".tree";
+}
+
+std::optional<VerityTree> LoadOrBuildVerityTree(const std::string& dir,
+                                                const std::string& root_hash, borrowed_fd fd,
+                                                Size size) {
+    Size tree_size = 0;
+    for (Size blocks : LevelBlocks(DataBlockCount(size))) {
+        tree_size += blocks * kBlockSize;
+    }
+    const std::string path = VerityTreePath(dir, root_hash);
+    if (tree_size > 0 && !root_hash.empty()) {
+        VerityTree cached;
+        if (android::base::ReadFileToString(path, &cached.tree) &&
+            Size(cached.tree.size()) == tree_size) {
+            cached.root_hash.resize(kDigestSize);
+            HashBlocks(cached.tree.data(), 1, cached.root_hash.data());
+            // The root hash checks the whole tree, so a damaged one is rebuilt.
+            if (cached.root_hash == root_hash) {
+                // Mark the entry as recently used.
+                utime(path.c_str(), nullptr);
+                D("Loaded verity tree from %s", path.c_str());
+                return cached;
+            }
+        }
+    }
+
+    auto built = BuildVerityTree(fd, size, std::thread::hardware_concurrency());
+    if (!built || tree_size == 0 || built->root_hash != root_hash) {
+        return built;
+    }
+
+    if (adb_mkdir(dir, 0750) == -1 && errno != EEXIST) {
+        D("Failed to create incremental cache directory %s: %s", dir.c_str(), strerror(errno));
+        return built;
+    }
+    const std::string temp_path = path + ".tmp." + std::to_string(getpid());
+    if (!android::base::WriteStringToFile(built->tree, temp_path)) {
+        D("Failed to write %s: %s", temp_path.c_str(), strerror(errno));
+        adb_unlink(temp_path.c_str());
+        return built;
+    }
+    // Another server may have saved the same tree in the meantime. It doesn't matter which wins.
+    if (adb_rename(temp_path.c_str(), path.c_str()) != 0) {
+        D("Failed to save %s: %s", path.c_str(), strerror(errno));
+        adb_unlink(temp_path.c_str());
+    }
+    return built;
+}
+
+}  // namespace incremental
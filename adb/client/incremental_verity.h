@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "adb_unique_fd.h"
+#include "incremental_utils.h"
+
+namespace incremental {
+
+// The hashing parameters from the v4 signature's hashingInfo.
+struct HashingInfo {
+    int32_t hash_algorithm;
+    int8_t log2_block_size;
+    std::string salt;
+    std::string root_hash;
+};
+
+// Parses the hashingInfo out of signature bytes returned by read_id_sig_headers().
+std::optional<HashingInfo> ParseHashingInfo(const std::vector<char>& signature);
+
+// True if the tree for |info| is one BuildVerityTree() can build: SHA-256 over unsalted 4K blocks,
+// which is what apksigner produces.
+bool CanBuildVerityTree(const HashingInfo& info);
+
+struct VerityTree {
+    // Laid out the way incfs expects it, and the way it's stored in .idsig files: the level below
+    // the root first and the leaf level last, every level padded to a whole block.
+    std::string tree;
+    std::string root_hash;
+};
+
+// Builds the verity tree of the first |size| bytes of |fd|, hashing the data blocks on |threads|
+// threads. Returns nullopt if the file can't be read.
+std::optional<VerityTree> BuildVerityTree(borrowed_fd fd, Size size, size_t threads);
+
+// Trees built for .idsig files that don't carry one (apksigner --v4-no-merkle-tree) are kept in
+// the incremental cache directory, keyed by their root hash, which the .idsig has. They're kept
+// even with the block cache off, since they're small and take reading the whole file to build.
+std::string VerityTreePath(const std::string& dir, const std::string& root_hash);
+
+// Returns the tree for a file of |size| bytes whose tree should have |root_hash| from |dir|, or if
+// it isn't there or doesn't have that root hash, builds it and saves it if it does. Returns
+// nullopt if the tree can't be built.
+std::optional<VerityTree> LoadOrBuildVerityTree(const std::string& dir,
+                                                const std::string& root_hash, borrowed_fd fd,
+                                                Size size);
+
+}  // namespace incremental
@@ -0,0 +1,168 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "incremental_verity.h"
+
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <gtest/gtest.h>
+#include <openssl/sha.h>
+
+#include "sysdeps.h"
+
+namespace incremental {
+
+static std::string Sha256(std::string_view data) {
+    std::string digest(SHA256_DIGEST_LENGTH, '\0');
+    SHA256(reinterpret_cast<const uint8_t*>(data.data()), data.size(),
+           reinterpret_cast<uint8_t*>(digest.data()));
+    return digest;
+}
+
+static std::string PaddedBlock(std::string_view data) {
+    std::string block(data.substr(0, kBlockSize));
+    block.resize(kBlockSize);
+    return block;
+}
+
+// A file that needs two leaf blocks, with a partial last block.
+static std::string TestData() {
+    std::string data;
+    for (int i = 0; i < 130 * kBlockSize - 100; ++i) {
+        data += char(i * 7 % 251);
+    }
+    return data;
+}
+
+static unique_fd WriteTestFile(const TemporaryFile& tf, const std::string& data) {
+    EXPECT_TRUE(android::base::WriteStringToFd(data, tf.fd));
+    return unique_fd(adb_open(tf.path, O_RDONLY));
+}
+
+TEST(VerityTree, layout) {
+    const std::string data = TestData();
+    TemporaryFile tf;
+    unique_fd fd = WriteTestFile(tf, data);
+    ASSERT_TRUE(fd.ok());
+
+    auto tree = BuildVerityTree(fd, data.size(), 4);
+    ASSERT_TRUE(tree);
+    ASSERT_EQ(3 * kBlockSize, Size(tree->tree.size()));
+
+    // The leaves come last and hash the data blocks, zero-padded.
+    std::string leaves;
+    for (size_t offset = 0; offset < data.size(); offset += kBlockSize) {
+        leaves += Sha256(PaddedBlock(std::string_view(data).substr(offset)));
+    }
+    ASSERT_EQ(PaddedBlock(leaves), tree->tree.substr(kBlockSize, kBlockSize));
+    ASSERT_EQ(PaddedBlock(leaves.substr(kBlockSize)), tree->tree.substr(2 * kBlockSize));
+
+    const std::string top = Sha256(tree->tree.substr(kBlockSize, kBlockSize)) +
+                            Sha256(tree->tree.substr(2 * kBlockSize, kBlockSize));
+    ASSERT_EQ(PaddedBlock(top), tree->tree.substr(0, kBlockSize));
+    ASSERT_EQ(Sha256(tree->tree.substr(0, kBlockSize)), tree->root_hash);
+
+    auto single_threaded = BuildVerityTree(fd, data.size(), 1);
+    ASSERT_TRUE(single_threaded);
+    ASSERT_EQ(tree->tree, single_threaded->tree);
+}
+
+TEST(VerityTree, single_block) {
+    TemporaryFile tf;
+    unique_fd fd = WriteTestFile(tf, "abc");
+    ASSERT_TRUE(fd.ok());
+
+    auto tree = BuildVerityTree(fd, 3, 4);
+    ASSERT_TRUE(tree);
+    ASSERT_TRUE(tree->tree.empty());
+    ASSERT_EQ(Sha256(PaddedBlock("abc")), tree->root_hash);
+}
+
+TEST(VerityTree, ParseHashingInfo) {
+    auto append_int = [](std::vector<char>* bytes, int32_t value) {
+        bytes->insert(bytes->end(), reinterpret_cast<char*>(&value),
+                      reinterpret_cast<char*>(&value) + sizeof(value));
+    };
+    const std::string root_hash(kDigestSize, 'r');
+    std::vector<char> hashing_info;
+    append_int(&hashing_info, 1);  // SHA-256
+    hashing_info.push_back(12);    // 4K blocks
+    append_int(&hashing_info, 0);  // No salt.
+    append_int(&hashing_info, root_hash.size());
+    hashing_info.insert(hashing_info.end(), root_hash.begin(), root_hash.end());
+
+    std::vector<char> signature;
+    append_int(&signature, 2);  // version
+    append_int(&signature, hashing_info.size());
+    signature.insert(signature.end(), hashing_info.begin(), hashing_info.end());
+
+    auto info = ParseHashingInfo(signature);
+    ASSERT_TRUE(info);
+    ASSERT_EQ(root_hash, info->root_hash);
+    ASSERT_TRUE(CanBuildVerityTree(*info));
+
+    info->salt = "salt";
+    ASSERT_FALSE(CanBuildVerityTree(*info));
+
+    signature.pop_back();
+    ASSERT_FALSE(ParseHashingInfo(signature));
+}
+
+TEST(VerityTree, cached) {
+    const std::string data = TestData();
+    TemporaryFile tf;
+    unique_fd fd = WriteTestFile(tf, data);
+    ASSERT_TRUE(fd.ok());
+    TemporaryDir dir;
+    const std::string root_hash = BuildVerityTree(fd, data.size(), 1)->root_hash;
+    const std::string path = VerityTreePath(dir.path, root_hash);
+
+    auto built = LoadOrBuildVerityTree(dir.path, root_hash, fd, data.size());
+    ASSERT_TRUE(built);
+    ASSERT_EQ(root_hash, built->root_hash);
+    std::string saved;
+    ASSERT_TRUE(android::base::ReadFileToString(path, &saved));
+    ASSERT_EQ(built->tree, saved);
+
+    // The next install loads the tree instead of hashing the file again.
+    TemporaryFile other_tf;
+    unique_fd other_fd = WriteTestFile(other_tf, std::string(data.size(), 'x'));
+    auto cached = LoadOrBuildVerityTree(dir.path, root_hash, other_fd, data.size());
+    ASSERT_TRUE(cached);
+    ASSERT_EQ(built->tree, cached->tree);
+    ASSERT_EQ(root_hash, cached->root_hash);
+
+    // A tree that doesn't have the root hash, or has the wrong size, is rebuilt.
+    for (const std::string& damaged : {std::string(saved.size(), 'x'), std::string("short")}) {
+        ASSERT_TRUE(android::base::WriteStringToFile(damaged, path));
+        auto rebuilt = LoadOrBuildVerityTree(dir.path, root_hash, fd, data.size());
+        ASSERT_TRUE(rebuilt);
+        ASSERT_EQ(built->tree, rebuilt->tree);
+        ASSERT_TRUE(android::base::ReadFileToString(path, &saved));
+        ASSERT_EQ(built->tree, saved);
+    }
+
+    // A tree that isn't the one the signature expects isn't saved.
+    TemporaryDir other_dir;
+    auto mismatched = LoadOrBuildVerityTree(other_dir.path, root_hash, other_fd, data.size());
+    ASSERT_TRUE(mismatched);
+    ASSERT_NE(root_hash, mismatched->root_hash);
+    ASSERT_NE(0, access(VerityTreePath(other_dir.path, root_hash).c_str(), F_OK));
+}
+
+}  // namespace incremental
@@ -16,6 +16,8 @@
 
 #pragma once
 
+#include <stddef.h>
+#include <stdint.h>
 #include <sys/types.h>
 
 #include "adb.h"
@@ -39,6 +41,13 @@ bool is_adb_interface(int usb_class, int usb_subclass, int usb_protocol);
 
 bool is_libusb_enabled();
 
+// Whether a bulk OUT transfer of |write_length| bytes has to be followed by a zero-length packet
+// for the device to see the end of the transfer. |zero_mask| is the endpoint's max packet size
+// minus one, or 0 if the device can detect the end of a transfer on its own.
+inline bool should_perform_zero_transfer(size_t write_length, uint16_t zero_mask) {
+    return write_length != 0 && zero_mask != 0 && (write_length & zero_mask) == 0;
+}
+
 namespace libusb {
 void usb_init();
 void usb_init(int fd);
@@ -81,7 +81,10 @@ struct DeviceHandleDeleter {
 
 using unique_device_handle = std::unique_ptr<libusb_device_handle, DeviceHandleDeleter>;
 
-static void process_device(libusb_device* device_raw);
+using DeviceClock = std::chrono::steady_clock;
+
+static void process_device(libusb_device* device_raw,
+                           DeviceClock::time_point arrival_time = DeviceClock::time_point());
 
 static std::string get_device_address(libusb_device* device) {
     uint8_t ports[7];
@@ -108,9 +111,17 @@ static bool endpoint_is_output(uint8_t endpoint) {
     return (endpoint & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_OUT;
 }
 
-static bool should_perform_zero_transfer(size_t write_length, uint16_t zero_mask) {
-    return write_length != 0 && zero_mask != 0 && (write_length & zero_mask) == 0;
+#if defined(__linux__)
+// Devices are opened on a bounded pool of threads instead of a thread each, so that a rack of
+// devices rebooting at once is waited on and claimed concurrently without an unbounded number
+// of threads. Each open mostly waits on udev and the device itself, not on the CPU.
+static constexpr size_t kDeviceOpenThreads = 8;
+
+static WorkerPool& device_open_pool() {
+    static auto& pool = *new WorkerPool("libusb open", kDeviceOpenThreads);
+    return pool;
 }
+#endif
 
 struct LibusbConnection : public Connection {
     struct ReadBlock {
@@ -133,6 +144,10 @@ struct LibusbConnection : public Connection {
     ~LibusbConnection() { Stop(); }
 
     void HandlePacket(amessage& msg, std::optional<Block> payload) {
+        if (msg.command == A_CNXN && arrival_time_ != DeviceClock::time_point()) {
+            ReportTimeToOnline();
+        }
+
         auto packet = std::make_unique<apacket>();
         packet->msg = msg;
         if (payload) {
@@ -272,6 +287,24 @@ struct LibusbConnection : public Connection {
         }
     }
 
+    // Log how long it took from the hotplug event until the device answered with its CNXN, split
+    // into time spent waiting for an open thread and for permissions, opening and claiming the
+    // interface, and the handshake itself.
+    void ReportTimeToOnline() {
+        auto now = DeviceClock::now();
+        auto to_ms = [](DeviceClock::duration d) {
+            return std::chrono::duration_cast<std::chrono::milliseconds>(d).count();
+        };
+        LOG(INFO) << "usb device " << serial_ << " (" << GetUsbDeviceAddress() << ") online after "
+                  << to_ms(now - arrival_time_) << "ms (waiting "
+                  << to_ms(open_start_time_ - arrival_time_) << "ms, open "
+                  << to_ms(attach_time_ - open_start_time_) << "ms, handshake "
+                  << to_ms(now - attach_time_) << "ms)";
+
+        // Only the first attach follows the arrival; later ones would be timed from it.
+        arrival_time_ = DeviceClock::time_point();
+    }
+
     bool DoTlsHandshake(RSA*, std::string*) final {
         LOG(FATAL) << "tls not supported";
         return false;
@@ -643,6 +676,7 @@ struct LibusbConnection : public Connection {
         }
 
         RetrieveSpeeds();
+        attach_time_ = DeviceClock::now();
         return true;
     }
 
@@ -891,6 +925,13 @@ struct LibusbConnection : public Connection {
 
     uint64_t negotiated_speed_ = 0;
     uint64_t max_speed_ = 0;
+
+    // When the hotplug event arrived, when a worker picked it up, and when we claimed the
+    // interface. arrival_time_ is set by each arrival, and cleared once the time to online is
+    // reported; it's left unset for devices reattached after a reset.
+    DeviceClock::time_point arrival_time_;
+    DeviceClock::time_point open_start_time_;
+    DeviceClock::time_point attach_time_;
 };
 
 static std::mutex usb_handles_mutex [[clang::no_destroy]];
@@ -898,10 +939,11 @@ static std::unordered_map<libusb_device*, std::weak_ptr<LibusbConnection>> usb_h
         [[clang::no_destroy]] GUARDED_BY(usb_handles_mutex);
 static std::atomic<int> connecting_devices(0);
 
-static void process_device(libusb_device* device_raw) {
+static void process_device(libusb_device* device_raw, DeviceClock::time_point arrival_time) {
     std::string device_address = "usb:" + get_device_address(device_raw);
     VLOG(USB) << "device connected: " << device_address;
 
+    auto open_start_time = DeviceClock::now();
     unique_device device(libusb_ref_device(device_raw));
     auto connection_opt = LibusbConnection::Create(std::move(device));
     if (!connection_opt) {
@@ -909,6 +951,8 @@ static void process_device(libusb_device* device_raw) {
     }
 
     auto connection = *connection_opt;
+    connection->arrival_time_ = arrival_time;
+    connection->open_start_time_ = open_start_time;
 
     {
         std::lock_guard<std::mutex> lock(usb_handles_mutex);
@@ -921,14 +965,16 @@ static void process_device(libusb_device* device_raw) {
     register_usb_transport(connection, connection->serial_.c_str(), device_address.c_str(), true);
 }
 
-static void device_connected(libusb_device* device) {
+static DeviceClock::time_point usb_init_time;
+
+static void device_connected(libusb_device* device, DeviceClock::time_point arrival_time) {
 #if defined(__linux__)
     // Android's host linux libusb uses netlink instead of udev for device hotplug notification,
     // which means we can get hotplug notifications before udev has updated ownership/perms on the
     // device. Since we're not going to be able to link against the system's libudev any time soon,
     // poll for accessibility changes with inotify until a timeout expires.
     libusb_ref_device(device);
-    auto thread = std::thread([device]() {
+    device_open_pool().Enqueue([device, arrival_time]() {
         std::string bus_path = StringPrintf("/dev/bus/usb/%03d/", libusb_get_bus_number(device));
         std::string device_path =
                 StringPrintf("%s/%03d", bus_path.c_str(), libusb_get_device_address(device));
@@ -980,15 +1026,21 @@ static void device_connected(libusb_device* device) {
             }
         }
 
-        process_device(device);
+        process_device(device, arrival_time);
         if (--connecting_devices == 0) {
+            static std::once_flag once;
+            std::call_once(once, []() {
+                auto elapsed = DeviceClock::now() - usb_init_time;
+                LOG(INFO) << "initial usb device scan complete after "
+                          << std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count()
+                          << "ms";
+            });
             adb_notify_device_scan_complete();
         }
         libusb_unref_device(device);
     });
-    thread.detach();
 #else
-    process_device(device);
+    process_device(device, arrival_time);
 #endif
 }
 
@@ -1015,17 +1067,23 @@ static void device_disconnected(libusb_device* device) {
     usb_handles_mutex.unlock();
 }
 
-static auto& hotplug_queue = *new BlockingQueue<std::pair<libusb_hotplug_event, libusb_device*>>();
+struct HotplugEvent {
+    libusb_hotplug_event event;
+    libusb_device* device;
+    DeviceClock::time_point time;
+};
+
+static auto& hotplug_queue = *new BlockingQueue<HotplugEvent>();
 static void hotplug_thread() {
     VLOG(USB) << "libusb hotplug thread started";
     adb_thread_setname("libusb hotplug");
     while (true) {
-        hotplug_queue.PopAll([](std::pair<libusb_hotplug_event, libusb_device*> pair) {
-            libusb_hotplug_event event = pair.first;
-            libusb_device* device = pair.second;
+        hotplug_queue.PopAll([](HotplugEvent hotplug_event) {
+            libusb_hotplug_event event = hotplug_event.event;
+            libusb_device* device = hotplug_event.device;
             if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) {
                 VLOG(USB) << "libusb hotplug: device arrived";
-                device_connected(device);
+                device_connected(device, hotplug_event.time);
             } else if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT) {
                 VLOG(USB) << "libusb hotplug: device left";
                 device_disconnected(device);
@@ -1046,7 +1104,7 @@ static LIBUSB_CALL int hotplug_callback(libusb_context*, libusb_device* device,
     if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) {
         ++connecting_devices;
     }
-    hotplug_queue.Push({event, device});
+    hotplug_queue.Push({event, device, DeviceClock::now()});
     return 0;
 }
 
@@ -1054,6 +1112,7 @@ namespace libusb {
 
 void usb_init() {
     VLOG(USB) << "initializing libusb...";
+    usb_init_time = DeviceClock::now();
     int rc = libusb_init(nullptr);
     if (rc != 0) {
         LOG(WARNING) << "failed to initialize libusb: " << libusb_error_name(rc);
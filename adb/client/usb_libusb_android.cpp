@@ -108,10 +108,6 @@ static bool endpoint_is_output(uint8_t endpoint) {
     return (endpoint & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_OUT;
 }
 
-static bool should_perform_zero_transfer(size_t write_length, uint16_t zero_mask) {
-    return write_length != 0 && zero_mask != 0 && (write_length & zero_mask) == 0;
-}
-
 struct LibusbConnection : public Connection {
     struct ReadBlock {
         LibusbConnection* self = nullptr;
@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define TRACE_TAG SERVICES
+
+#include "daemon/fastdeploy_service.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <android-base/endian.h>
+#include <android-base/stringprintf.h>
+#include <ziparchive/zip_archive.h>
+
+#include "adb_io.h"
+#include "adb_trace.h"
+#include "services.h"
+#include "sysdeps.h"
+
+using android::base::StringPrintf;
+
+static void dump_central_directory(unique_fd fd, const std::string& path) {
+    unique_fd apk_fd(adb_open(path.c_str(), O_RDONLY | O_CLOEXEC));
+    if (apk_fd < 0) {
+        SendFail(fd, StringPrintf("failed to open %s: %s", path.c_str(), strerror(errno)));
+        return;
+    }
+
+    // libziparchive finds and validates the central directory, the rest is a plain copy.
+    ZipArchiveHandle zip;
+    if (int32_t result = OpenArchiveFd(apk_fd.get(), path.c_str(), &zip, false); result != 0) {
+        SendFail(fd, StringPrintf("failed to open %s: %s", path.c_str(), ErrorCodeString(result)));
+        CloseArchive(zip);
+        return;
+    }
+    const ZipArchiveInfo info = GetArchiveInfo(zip);
+    CloseArchive(zip);
+
+    const uint64_t size = htole64(info.central_directory_size);
+    if (!SendOkay(fd) || !WriteFdExactly(fd, &size, sizeof(size))) {
+        return;
+    }
+
+    std::vector<char> buf(64 * 1024);
+    off64_t offset = info.central_directory_offset;
+    uint64_t remaining = info.central_directory_size;
+    while (remaining > 0) {
+        ssize_t n = adb_pread(apk_fd, buf.data(), std::min<uint64_t>(remaining, buf.size()),
+                              offset);
+        if (n <= 0) {
+            // The host notices the short read.
+            D("fastdeploy-dump: failed to read %s: %s", path.c_str(), strerror(errno));
+            return;
+        }
+        if (!WriteFdExactly(fd, buf.data(), n)) {
+            return;
+        }
+        offset += n;
+        remaining -= n;
+    }
+}
+
+unique_fd fastdeploy_dump_service(std::string_view path) {
+    return create_service_thread("fastdeploy",
+                                 [path = std::string(path)](unique_fd fd) {
+                                     dump_central_directory(std::move(fd), path);
+                                 });
+}
@@ -0,0 +1,29 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <string_view>
+
+#include "adb_unique_fd.h"
+
+// Serves "fastdeploy-dump:<path>": streams the central directory of the APK at |path| back to
+// the host, which compares it against its own APK to build a fastdeploy patch. This is what the
+// Java deployagent's "dump" command does, without starting a VM.
+//
+// The response is "OKAY", the size of the central directory as a little-endian 64-bit integer,
+// and the central directory itself; or "FAIL" and a length-prefixed error message.
+unique_fd fastdeploy_dump_service(std::string_view path);
@@ -53,6 +53,7 @@
 #include "sysdeps.h"
 #include "transport.h"
 
+#include "daemon/fastdeploy_service.h"
 #include "daemon/file_sync_service.h"
 #include "daemon/framebuffer_service.h"
 #include "daemon/jdwp_service.h"
@@ -353,6 +354,8 @@ unique_fd daemon_service_to_fd(std::string_view name, atransport* transport) {
                                SubprocessProtocol::kNone);
     } else if (name.starts_with("sync:")) {
         return create_service_thread("sync", file_sync_service);
+    } else if (android::base::ConsumePrefix(&name, "fastdeploy-dump:")) {
+        return fastdeploy_dump_service(name);
     } else if (android::base::ConsumePrefix(&name, "reverse:")) {
         return reverse_service(name, transport);
     } else if (name == "reconnect") {
@@ -34,29 +34,34 @@
 // a single pipe which is registered with a local socket in adbd. The local
 // socket uses the fdevent loop to pass raw data between this pipe and the
 // transport, which then passes data back to the adb client. Cleanup is done by
-// waiting in a separate thread for the subprocesses to exit and then signaling
-// a separate fdevent to close out the local socket from the main loop.
+// the shell reactor, a single thread that waits with epoll for every subprocess
+// to exit (via a pidfd) and then signals a separate fdevent to close out the
+// local socket from the main loop.
 //
 // ------------------+-------------------------+------------------------------
-//   Subprocess      |  adbd subprocess thread |   adbd main fdevent loop
+//   Subprocess      |  adbd shell reactor     |   adbd main fdevent loop
 // ------------------+-------------------------+------------------------------
 //                   |                         |
 //   stdin/out/err <----------------------------->       LocalSocket
 //      |            |                         |
-//      |            |      Block on exit      |
+//      |            |      Wait for exit      |
 //      |            |           *             |
 //      v            |           *             |
-//     Exit         --->      Unblock          |
+//     Exit         --->     pidfd ready       |
 //                   |           |             |
 //                   |           v             |
 //                   |   Notify shell exit FD --->    Close LocalSocket
 // ------------------+-------------------------+------------------------------
 //
-// The protocol requires the thread to intercept stdin/out/err in order to
-// wrap/unwrap data with shell protocol packets.
+// The protocol requires the reactor to intercept stdin/out/err in order to
+// wrap/unwrap data with shell protocol packets. It does so for every
+// subprocess at once with non-blocking I/O, so that a subprocess costs its FDs
+// rather than a thread and a pair of MAX_PAYLOAD protocol buffers. Data that
+// can't be passed on yet waits in a buffer sized to it from a shared pool, and
+// reading from its source stops until it has been.
 //
 // ------------------+-------------------------+------------------------------
-//   Subprocess      |  adbd subprocess thread |   adbd main fdevent loop
+//   Subprocess      |  adbd shell reactor     |   adbd main fdevent loop
 // ------------------+-------------------------+------------------------------
 //                   |                         |
 //     stdin/out   <--->      Protocol       <--->       LocalSocket
@@ -71,9 +76,9 @@
 //
 // An alternate approach is to put the protocol wrapping/unwrapping in the main
 // fdevent loop, which has the advantage of being able to re-use the existing
-// select() code for handling data streams. However, implementation turned out
-// to be more complex due to partial reads and non-blocking I/O so this model
-// was chosen instead.
+// fdevent code for handling data streams. However, that loop handles a single
+// event per wakeup and is shared with the transports, so the shell protocol
+// gets its own epoll loop instead.
 
 #define TRACE_TAG SHELL
 
@@ -87,7 +92,16 @@
 #include <pwd.h>
 #include <termios.h>
 
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include <algorithm>
+#include <bit>
 #include <memory>
+#include <mutex>
+#include <optional>
 #include <string>
 #include <thread>
 #include <unordered_map>
@@ -96,6 +110,7 @@
 #include <android-base/logging.h>
 #include <android-base/properties.h>
 #include <android-base/stringprintf.h>
+#include <android-base/thread_annotations.h>
 #include <private/android_logger.h>
 
 #if defined(__ANDROID__)
@@ -141,20 +156,56 @@ bool CreateSocketpair(unique_fd* fd1, unique_fd* fd2) {
     return true;
 }
 
-struct SubprocessPollfds {
-    adb_pollfd pfds[3];
+// The shell protocol's packet header: a 1-byte ID and a 4-byte length.
+constexpr size_t kPacketHeaderSize = sizeof(ShellProtocol::Id) + sizeof(uint32_t);
+
+// The most read from an FD at once, header included for packets, so that what's left waiting
+// for a full destination fits in a small buffer.
+constexpr size_t kMaxReadSize = 64 * 1024;
+
+// Buffers for data that a subprocess couldn't pass on yet because its destination was full. Most
+// subprocesses never need one, and those that do get one sized to the data, rounded up to a power
+// of two. Freed buffers are kept for reuse, up to kMaxPooledBytes in all.
+class BufferPool {
+  public:
+    struct Buffer {
+        std::unique_ptr<char[]> data;
+        size_t capacity = 0;
+    };
 
-    adb_pollfd* data() { return pfds; }
-    size_t size() { return 3; }
+    Buffer Get(size_t size);
+    void Put(Buffer buffer);
 
-    adb_pollfd* begin() { return pfds; }
-    adb_pollfd* end() { return pfds + size(); }
+  private:
+    static constexpr size_t kMinSize = 4096;
+    static constexpr size_t kSizeCount = 16;
+    static constexpr size_t kMaxPooledBytes = 8 * kMaxReadSize;
 
-    adb_pollfd& stdinout_pfd() { return pfds[0]; }
-    adb_pollfd& stderr_pfd() { return pfds[1]; }
-    adb_pollfd& protocol_pfd() { return pfds[2]; }
+    std::vector<std::unique_ptr<char[]>> free_[kSizeCount];
+    size_t pooled_bytes_ = 0;
 };
 
+// Bytes waiting for an FD to have room, in a buffer from a BufferPool.
+class Backlog {
+  public:
+    bool empty() const { return begin_ == end_; }
+    const char* data() const { return buffer_.data.get() + begin_; }
+    size_t size() const { return end_ - begin_; }
+
+    void Append(BufferPool* pool, const char* data, size_t size);
+
+    // Drops |size| bytes from the front, returning the buffer to |pool| once it's empty.
+    void Consume(BufferPool* pool, size_t size);
+    void Clear(BufferPool* pool) { Consume(pool, this->size()); }
+
+  private:
+    BufferPool::Buffer buffer_;
+    size_t begin_ = 0;
+    size_t end_ = 0;
+};
+
+class ShellReactor;
+
 class Subprocess {
   public:
     Subprocess(std::string command, const char* terminal_type, SubprocessType type,
@@ -167,35 +218,63 @@ class Subprocess {
 
     pid_t pid() const { return pid_; }
 
-    // Sets up FDs, forks a subprocess, starts the subprocess manager thread,
-    // and exec's the child. Returns false and sets error on failure.
+    // Sets up FDs, forks a subprocess, and exec's the child. Returns false and
+    // sets error on failure.
     bool ForkAndExec(std::string* _Nonnull error);
 
-    // Sets up FDs, starts a thread executing command and the manager thread,
-    // Returns false and sets error on failure.
+    // Sets up FDs and starts a thread executing command. Returns false and sets
+    // error on failure.
     bool ExecInProcess(Command command, std::string* _Nonnull error);
 
-    // Start the subprocess manager thread. Consumes the subprocess, regardless of success.
+    // Hands the subprocess over to the shell reactor, which passes its data and
+    // reaps it. Consumes the subprocess, regardless of success.
     // Returns false and sets error on failure.
-    static bool StartThread(std::unique_ptr<Subprocess> subprocess,
-                            std::string* _Nonnull error);
+    static bool Start(std::unique_ptr<Subprocess> subprocess, std::string* _Nonnull error);
 
   private:
+    friend class ShellReactor;
+
+    // An FD of the subprocess that the reactor watches, and the epoll events
+    // it's registered for.
+    struct Watch {
+        Subprocess* subprocess;
+        unique_fd* fd;
+        uint32_t events = 0;
+    };
+
     // Opens the file at |pts_name|.
     int OpenPtyChildFd(const char* pts_name, unique_fd* error_sfd);
 
     bool ConnectProtocolEndpoints(std::string* _Nonnull error);
 
-    static void ThreadHandler(void* userdata);
-    void PassDataStreams();
-    void WaitForExit();
+    // Opens |exit_sfd_|, which becomes readable when the child exits.
+    bool OpenExitFd(std::string* _Nonnull error);
 
-    unique_fd* PollLoop(SubprocessPollfds* pfds);
+    // The rest runs on the reactor thread. HandleEvent() and Update() return
+    // true once the subprocess is finished with, and can be deleted.
+    bool HandleEvent(Watch* watch, uint32_t events);
+    bool Update();
 
-    // Input/output stream handlers. Success returns nullptr, failure returns
-    // a pointer to the failed FD.
-    unique_fd* PassInput();
-    unique_fd* PassOutput(unique_fd* sfd, ShellProtocol::Id id);
+    // Whether data is still passed between the protocol FD and the subprocess:
+    // until the protocol FD or both the subprocess pipes die.
+    bool streaming() const {
+        return protocol_sfd_ != -1 && (stdinout_sfd_ != -1 || stderr_sfd_ != -1);
+    }
+
+    void PassOutput(Watch* watch, ShellProtocol::Id id);
+    void PassInput();
+    // Handles received protocol bytes, and returns how many were handled
+    // before writing to stdin would block.
+    size_t HandleInput(const char* data, size_t size);
+    void FinishInputPacket();
+    void FlushInput();
+    // Sends the |length| bytes of data after the header space at the start of
+    // |packet|.
+    void SendPacket(ShellProtocol::Id id, char* packet, size_t length);
+    void FlushOutput();
+    void CloseWatch(Watch* watch);
+    void CloseProtocol();
+    void Reap();
 
     const std::string command_;
     const std::string terminal_type_;
@@ -207,12 +286,68 @@ class Subprocess {
 
     // Shell protocol variables.
     unique_fd stdinout_sfd_, stderr_sfd_, protocol_sfd_;
-    std::unique_ptr<ShellProtocol> input_, output_;
-    size_t input_bytes_left_ = 0;
+
+    // A pidfd of the child, or a pipe a thread writes its wait status to.
+    unique_fd exit_sfd_;
+    bool exit_sfd_is_pidfd_ = false;
+    std::optional<int> exit_code_;
+    bool exit_code_sent_ = false;
+
+    ShellReactor* reactor_ = nullptr;
+    Watch stdinout_watch_{this, &stdinout_sfd_};
+    Watch stderr_watch_{this, &stderr_sfd_};
+    Watch protocol_watch_{this, &protocol_sfd_};
+    Watch exit_watch_{this, &exit_sfd_};
+
+    // Protocol bytes received but not handled yet because stdin is full.
+    Backlog input_backlog_;
+    // Packets not sent yet because the protocol FD is full.
+    Backlog output_backlog_;
+
+    // The packet being received: its header, how much of its data is still to
+    // come, and the data of a window size change.
+    char input_header_[kPacketHeaderSize];
+    size_t input_header_size_ = 0;
+    uint32_t input_left_ = 0;
+    std::string window_size_;
 
     DISALLOW_COPY_AND_ASSIGN(Subprocess);
 };
 
+// Passes the data of every shell protocol subprocess, and reaps every
+// subprocess, with epoll on a single thread. Data read from an FD is passed on
+// from a scratch buffer shared by all of them, and only what its destination
+// can't take yet is copied to a buffer from the pool.
+class ShellReactor {
+  public:
+    static ShellReactor& Instance();
+
+    // Takes over |subprocess| on the reactor thread.
+    void Add(std::unique_ptr<Subprocess> subprocess);
+
+    // Registers |watch| for |events|, or unregisters it if there are none.
+    void SetEvents(Subprocess::Watch* watch, uint32_t events);
+
+    static constexpr size_t kScratchSize = kMaxReadSize;
+    char* scratch() { return scratch_.get(); }
+    BufferPool* pool() { return &pool_; }
+
+  private:
+    ShellReactor();
+    void Run();
+    void TakeAdded();
+
+    unique_fd epoll_fd_;
+    unique_fd wake_fd_;
+
+    std::mutex added_lock_;
+    std::vector<std::unique_ptr<Subprocess>> added_ GUARDED_BY(added_lock_);
+
+    std::unordered_map<Subprocess*, std::unique_ptr<Subprocess>> subprocesses_;
+    std::unique_ptr<char[]> scratch_;
+    BufferPool pool_;
+};
+
 Subprocess::Subprocess(std::string command, const char* terminal_type, SubprocessType type,
                        SubprocessProtocol protocol, bool make_pty_raw)
     : command_(std::move(command)),
@@ -222,7 +357,12 @@ Subprocess::Subprocess(std::string command, const char* terminal_type, Subproces
       make_pty_raw_(make_pty_raw) {}
 
 Subprocess::~Subprocess() {
-    WaitForExit();
+    // The reactor reaps the subprocesses it takes over; this is for the ones
+    // that failed to start.
+    if (pid_ != -1 && !exit_sfd_.ok() && !exit_code_) {
+        D("waiting for pid %d", pid_);
+        TEMP_FAILURE_RETRY(waitpid(pid_, nullptr, 0));
+    }
 }
 
 static std::string GetHostName() {
@@ -474,18 +614,11 @@ bool Subprocess::ConnectProtocolEndpoints(std::string* _Nonnull error) {
         }
         D("protocol FD = %d", protocol_sfd_.get());
 
-        input_ = std::make_unique<ShellProtocol>(protocol_sfd_);
-        output_ = std::make_unique<ShellProtocol>(protocol_sfd_);
-        if (!input_ || !output_) {
-            *error = "failed to allocate shell protocol objects";
-            return false;
-        }
-
-        // Don't let reads/writes to the subprocess block our thread. This isn't
-        // likely but could happen under unusual circumstances, such as if we
-        // write a ton of data to stdin but the subprocess never reads it and
-        // the pipe fills up.
-        for (int fd : {stdinout_sfd_.get(), stderr_sfd_.get()}) {
+        // Don't let reads/writes to the subprocess or the local socket block
+        // the reactor, which passes the data of every subprocess: e.g. if we
+        // write a ton of data to stdin but the subprocess never reads it, or
+        // the client stops reading the subprocess's output.
+        for (int fd : {stdinout_sfd_.get(), stderr_sfd_.get(), protocol_sfd_.get()}) {
             if (fd >= 0) {
                 if (!set_file_block_mode(fd, false)) {
                     *error = android::base::StringPrintf(
@@ -499,10 +632,41 @@ bool Subprocess::ConnectProtocolEndpoints(std::string* _Nonnull error) {
     return true;
 }
 
-bool Subprocess::StartThread(std::unique_ptr<Subprocess> subprocess, std::string* error) {
-    Subprocess* raw = subprocess.release();
-    std::thread(ThreadHandler, raw).detach();
+bool Subprocess::Start(std::unique_ptr<Subprocess> subprocess, std::string* error) {
+    if (subprocess->pid_ != -1 && !subprocess->OpenExitFd(error)) {
+        kill(subprocess->pid_, SIGKILL);
+        return false;
+    }
+    ShellReactor::Instance().Add(std::move(subprocess));
+    return true;
+}
 
+bool Subprocess::OpenExitFd(std::string* error) {
+#if defined(__NR_pidfd_open)
+    exit_sfd_.reset(syscall(__NR_pidfd_open, pid_, 0));
+    if (exit_sfd_ != -1) {
+        exit_sfd_is_pidfd_ = true;
+        return true;
+    }
+    if (errno != ENOSYS) {
+        *error = android::base::StringPrintf("failed to open pidfd: %s", strerror(errno));
+        return false;
+    }
+#endif
+
+    // Kernels before 5.3 don't have pidfds, so a thread waits for the child instead.
+    unique_fd write_sfd;
+    if (!Pipe(&exit_sfd_, &write_sfd)) {
+        *error = android::base::StringPrintf("failed to create exit pipe: %s", strerror(errno));
+        return false;
+    }
+    std::thread([pid = pid_, write_sfd = std::move(write_sfd)]() {
+        adb_thread_setname(android::base::StringPrintf("shell wait %d", pid));
+        int status;
+        if (TEMP_FAILURE_RETRY(waitpid(pid, &status, 0)) == pid) {
+            WriteFdExactly(write_sfd, &status, sizeof(status));
+        }
+    }).detach();
     return true;
 }
 
@@ -540,255 +704,448 @@ int Subprocess::OpenPtyChildFd(const char* pts_name, unique_fd* error_sfd) {
     return child_fd;
 }
 
-void Subprocess::ThreadHandler(void* userdata) {
-    Subprocess* subprocess = reinterpret_cast<Subprocess*>(userdata);
+bool Subprocess::HandleEvent(Watch* watch, uint32_t events) {
+    // Errors and hangups are reported whatever the watch is registered for;
+    // reading or writing finds out what they mean.
+    events &= watch->events | EPOLLERR | EPOLLHUP;
+    const bool readable = (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) != 0;
+    const bool writable = (events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) != 0;
+
+    if (watch == &exit_watch_) {
+        Reap();
+    } else if (watch == &protocol_watch_) {
+        if (writable && !output_backlog_.empty()) {
+            FlushOutput();
+        }
+        if (readable && (watch->events & EPOLLIN) && protocol_sfd_ != -1) {
+            PassInput();
+        }
+    } else if (watch == &stdinout_watch_) {
+        // Read the output first, since a failed write closes the FD.
+        if (readable && (watch->events & EPOLLIN)) {
+            PassOutput(watch, ShellProtocol::kIdStdout);
+        }
+        if (writable && (watch->events & EPOLLOUT) && stdinout_sfd_ != -1) {
+            FlushInput();
+        }
+    } else if (watch == &stderr_watch_) {
+        if (readable) {
+            PassOutput(watch, ShellProtocol::kIdStderr);
+        }
+    }
+    return Update();
+}
+
+bool Subprocess::Update() {
+    // Any stdin data still waiting for stdin after it's closed is dropped.
+    if (!input_backlog_.empty() && stdinout_sfd_ == -1) {
+        FlushInput();
+    }
 
-    adb_thread_setname(android::base::StringPrintf("shell svc %d", subprocess->pid()));
+    // Once the subprocess's output has all been passed on and it's exited,
+    // send its exit code and close the protocol FD.
+    if (protocol_sfd_ != -1 && !streaming() && exit_code_ && !exit_code_sent_) {
+        char packet[kPacketHeaderSize + 1];
+        packet[kPacketHeaderSize] = *exit_code_;
+        exit_code_sent_ = true;
+        SendPacket(ShellProtocol::kIdExit, packet, 1);
+        D("queued the exit code packet: %d", *exit_code_);
+    }
+    if (protocol_sfd_ != -1 && exit_code_sent_ && output_backlog_.empty()) {
+        CloseWatch(&protocol_watch_);
+    }
 
-    D("passing data streams for PID %d", subprocess->pid());
-    subprocess->PassDataStreams();
+    // Pass data in one direction until its destination has taken what's
+    // waiting for it.
+    uint32_t stdinout_events = 0;
+    uint32_t stderr_events = 0;
+    uint32_t protocol_events = 0;
+    if (streaming()) {
+        if (output_backlog_.empty()) {
+            stdinout_events |= EPOLLIN;
+            stderr_events |= EPOLLIN;
+        }
+        if (input_backlog_.empty()) {
+            protocol_events |= EPOLLIN;
+        } else {
+            stdinout_events |= EPOLLOUT;
+        }
+    }
+    if (!output_backlog_.empty()) {
+        protocol_events |= EPOLLOUT;
+    }
+    for (auto [watch, events] : {std::pair{&stdinout_watch_, stdinout_events},
+                                 std::pair{&stderr_watch_, stderr_events},
+                                 std::pair{&protocol_watch_, protocol_events},
+                                 std::pair{&exit_watch_, uint32_t(EPOLLIN)}}) {
+        // An FD with nothing to wait for is unregistered, so that its hangup
+        // isn't reported over and over.
+        reactor_->SetEvents(watch, *watch->fd != -1 ? events : 0);
+    }
 
-    D("deleting Subprocess for PID %d", subprocess->pid());
-    delete subprocess;
+    return exit_code_ && protocol_sfd_ == -1;
 }
 
-void Subprocess::PassDataStreams() {
-    if (protocol_sfd_ == -1) {
+void Subprocess::PassOutput(Watch* watch, ShellProtocol::Id id) {
+    char* packet = reactor_->scratch();
+    int bytes = adb_read(*watch->fd, packet + kPacketHeaderSize,
+                         ShellReactor::kScratchSize - kPacketHeaderSize);
+    if (bytes == 0 || (bytes < 0 && errno != EAGAIN)) {
+        // read() returns EIO if a PTY closes; don't report this as an error,
+        // it just means the subprocess completed.
+        if (bytes < 0 && !(type_ == SubprocessType::kPty && errno == EIO)) {
+            PLOG(ERROR) << "error reading output FD " << watch->fd->get();
+        }
+        CloseWatch(watch);
         return;
     }
 
-    // Start by trying to read from the protocol FD, stdout, and stderr.
-    SubprocessPollfds pfds;
-    pfds.stdinout_pfd() = {.fd = stdinout_sfd_.get(), .events = POLLIN};
-    pfds.stderr_pfd() = {.fd = stderr_sfd_.get(), .events = POLLIN};
-    pfds.protocol_pfd() = {.fd = protocol_sfd_.get(), .events = POLLIN};
-
-    // Pass data until the protocol FD or both the subprocess pipes die, at
-    // which point we can't pass any more data.
-    while (protocol_sfd_ != -1 && (stdinout_sfd_ != -1 || stderr_sfd_ != -1)) {
-        unique_fd* dead_sfd = PollLoop(&pfds);
-        if (dead_sfd) {
-            D("closing FD %d", dead_sfd->get());
-            auto it = std::find_if(pfds.begin(), pfds.end(), [=](const adb_pollfd& pfd) {
-                return pfd.fd == dead_sfd->get();
-            });
-            CHECK(it != pfds.end());
-            it->fd = -1;
-            it->events = 0;
-            if (dead_sfd == &protocol_sfd_) {
-                // Using SIGHUP is a decent general way to indicate that the
-                // controlling process is going away. If specific signals are
-                // needed (e.g. SIGINT), pass those through the shell protocol
-                // and only fall back on this for unexpected closures.
-                D("protocol FD died, sending SIGHUP to pid %d", pid_);
-                if (pid_ != -1) {
-                    kill(pid_, SIGHUP);
-                }
+    if (bytes > 0) {
+        SendPacket(id, packet, bytes);
+    }
+}
 
-                // We also need to close the pipes connected to the child process
-                // so that if it ignores SIGHUP and continues to write data it
-                // won't fill up the pipe and block.
-                stdinout_sfd_.reset();
-                stderr_sfd_.reset();
-            }
-            dead_sfd->reset();
+void Subprocess::PassInput() {
+    char* buffer = reactor_->scratch();
+    int bytes = adb_read(protocol_sfd_, buffer, ShellReactor::kScratchSize);
+    if (bytes == 0 || (bytes < 0 && errno != EAGAIN)) {
+        if (bytes < 0) {
+            PLOG(ERROR) << "error reading protocol FD " << protocol_sfd_.get();
+        }
+        // Using SIGHUP is a decent general way to indicate that the
+        // controlling process is going away. If specific signals are
+        // needed (e.g. SIGINT), pass those through the shell protocol
+        // and only fall back on this for unexpected closures.
+        D("protocol FD died, sending SIGHUP to pid %d", pid_);
+        if (pid_ != -1 && !exit_code_) {
+            kill(pid_, SIGHUP);
         }
+        CloseProtocol();
+        return;
+    }
+
+    if (bytes > 0) {
+        size_t handled = HandleInput(buffer, bytes);
+        input_backlog_.Append(reactor_->pool(), buffer + handled, bytes - handled);
     }
 }
 
-unique_fd* Subprocess::PollLoop(SubprocessPollfds* pfds) {
-    unique_fd* dead_sfd = nullptr;
-    adb_pollfd& stdinout_pfd = pfds->stdinout_pfd();
-    adb_pollfd& stderr_pfd = pfds->stderr_pfd();
-    adb_pollfd& protocol_pfd = pfds->protocol_pfd();
+size_t Subprocess::HandleInput(const char* data, size_t size) {
+    size_t offset = 0;
+    while (offset < size) {
+        if (input_header_size_ < kPacketHeaderSize) {
+            size_t length = std::min(kPacketHeaderSize - input_header_size_, size - offset);
+            memcpy(&input_header_[input_header_size_], &data[offset], length);
+            input_header_size_ += length;
+            offset += length;
+            if (input_header_size_ == kPacketHeaderSize) {
+                memcpy(&input_left_, &input_header_[1], sizeof(input_left_));
+                window_size_.clear();
+                if (input_left_ == 0) {
+                    FinishInputPacket();
+                }
+            }
+            continue;
+        }
 
-    // Keep calling poll() and passing data until an FD closes/errors.
-    while (!dead_sfd) {
-        if (adb_poll(pfds->data(), pfds->size(), -1) < 0) {
-            if (errno == EINTR) {
-                continue;
+        size_t length = std::min<size_t>(input_left_, size - offset);
+        if (input_header_[0] == ShellProtocol::kIdStdin && stdinout_sfd_ != -1) {
+            int bytes = adb_write(stdinout_sfd_, &data[offset], length);
+            if (bytes < 0 && errno == EAGAIN) {
+                return offset;
+            }
+            if (bytes <= 0) {
+                if (bytes < 0) {
+                    PLOG(ERROR) << "error writing stdin FD " << stdinout_sfd_.get();
+                }
+                // stdin is done, so drop the rest of its data.
+                CloseWatch(&stdinout_watch_);
             } else {
-                PLOG(ERROR) << "poll failed, closing subprocess pipes";
-                stdinout_sfd_.reset(-1);
-                stderr_sfd_.reset(-1);
-                return nullptr;
+                length = bytes;
             }
+        } else if (input_header_[0] == ShellProtocol::kIdWindowSizeChange) {
+            // An ASCII version of struct winsize is all that's expected.
+            window_size_.append(&data[offset], std::min<size_t>(length, 64));
         }
-
-        // Read stdout, write to protocol FD.
-        if (stdinout_pfd.fd != -1 && (stdinout_pfd.revents & POLLIN)) {
-            dead_sfd = PassOutput(&stdinout_sfd_, ShellProtocol::kIdStdout);
+        offset += length;
+        input_left_ -= length;
+        if (input_left_ == 0) {
+            FinishInputPacket();
         }
+    }
+    return offset;
+}
 
-        // Read stderr, write to protocol FD.
-        if (!dead_sfd && stderr_pfd.fd != 1 && (stderr_pfd.revents & POLLIN)) {
-            dead_sfd = PassOutput(&stderr_sfd_, ShellProtocol::kIdStderr);
-        }
+void Subprocess::FinishInputPacket() {
+    input_header_size_ = 0;
+    if (stdinout_sfd_ == -1) {
+        return;
+    }
 
-        // Read protocol FD, write to stdin.
-        if (!dead_sfd && protocol_pfd.fd != -1 && (protocol_pfd.revents & POLLIN)) {
-            dead_sfd = PassInput();
-            // If we didn't finish writing, block on stdin write.
-            if (input_bytes_left_) {
-                protocol_pfd.events &= ~POLLIN;
-                stdinout_pfd.events |= POLLOUT;
+    switch (input_header_[0]) {
+        case ShellProtocol::kIdWindowSizeChange:
+            int rows, cols, x_pixels, y_pixels;
+            if (sscanf(window_size_.c_str(), "%dx%d,%dx%d", &rows, &cols, &x_pixels,
+                       &y_pixels) == 4) {
+                winsize ws;
+                ws.ws_row = rows;
+                ws.ws_col = cols;
+                ws.ws_xpixel = x_pixels;
+                ws.ws_ypixel = y_pixels;
+                ioctl(stdinout_sfd_.get(), TIOCSWINSZ, &ws);
             }
-        }
-
-        // Continue writing to stdin; only happens if a previous write blocked.
-        if (!dead_sfd && stdinout_pfd.fd != -1 && (stdinout_pfd.revents & POLLOUT)) {
-            dead_sfd = PassInput();
-            // If we finished writing, go back to blocking on protocol read.
-            if (!input_bytes_left_) {
-                protocol_pfd.events |= POLLIN;
-                stdinout_pfd.events &= ~POLLOUT;
+            break;
+        case ShellProtocol::kIdCloseStdin:
+            if (type_ == SubprocessType::kRaw) {
+                if (adb_shutdown(stdinout_sfd_, SHUT_WR) != 0) {
+                    PLOG(ERROR) << "failed to shutdown writes to FD " << stdinout_sfd_.get();
+                    CloseWatch(&stdinout_watch_);
+                }
+            } else {
+                // PTYs can't close just input, so rather than close the
+                // FD and risk losing subprocess output, leave it open.
+                // This only happens if the client starts a PTY shell
+                // non-interactively which is rare and unsupported.
+                // If necessary, the client can manually close the shell
+                // with `exit` or by killing the adb client process.
+                D("can't close input for PTY FD %d", stdinout_sfd_.get());
             }
-        }
+            break;
+    }
+}
 
-        // After handling all of the events we've received, check to see if any fds have died.
-        auto poll_finished = [](int events) {
-            // Don't return failure until we've read out all of the fd's incoming data.
-            return (events & POLLIN) == 0 &&
-                   (events & (POLLHUP | POLLRDHUP | POLLERR | POLLNVAL)) != 0;
-        };
+void Subprocess::FlushInput() {
+    input_backlog_.Consume(reactor_->pool(),
+                           HandleInput(input_backlog_.data(), input_backlog_.size()));
+}
 
-        if (poll_finished(stdinout_pfd.revents)) {
-            return &stdinout_sfd_;
+void Subprocess::SendPacket(ShellProtocol::Id id, char* packet, size_t length) {
+    packet[0] = id;
+    uint32_t typed_length = length;
+    memcpy(&packet[1], &typed_length, sizeof(typed_length));
+    length += kPacketHeaderSize;
+
+    size_t written = 0;
+    if (output_backlog_.empty()) {
+        int bytes = adb_write(protocol_sfd_, packet, length);
+        if (bytes < 0 && errno != EAGAIN) {
+            PLOG(ERROR) << "error writing protocol FD " << protocol_sfd_.get();
+            CloseProtocol();
+            return;
         }
+        written = std::max(bytes, 0);
+    }
+    output_backlog_.Append(reactor_->pool(), packet + written, length - written);
+}
+
+void Subprocess::FlushOutput() {
+    int bytes = adb_write(protocol_sfd_, output_backlog_.data(), output_backlog_.size());
+    if (bytes < 0 && errno != EAGAIN) {
+        PLOG(ERROR) << "error writing protocol FD " << protocol_sfd_.get();
+        CloseProtocol();
+        return;
+    }
+    output_backlog_.Consume(reactor_->pool(), std::max(bytes, 0));
+}
 
-        if (poll_finished(stderr_pfd.revents)) {
-            return &stderr_sfd_;
+void Subprocess::CloseWatch(Watch* watch) {
+    D("closing FD %d", watch->fd->get());
+    reactor_->SetEvents(watch, 0);
+    watch->fd->reset();
+}
+
+void Subprocess::CloseProtocol() {
+    CloseWatch(&protocol_watch_);
+    input_backlog_.Clear(reactor_->pool());
+    output_backlog_.Clear(reactor_->pool());
+
+    // We also need to close the pipes connected to the child process
+    // so that if it ignores SIGHUP and continues to write data it
+    // won't fill up the pipe and block.
+    for (Watch* watch : {&stdinout_watch_, &stderr_watch_}) {
+        if (*watch->fd != -1) {
+            CloseWatch(watch);
         }
+    }
+}
 
-        if (poll_finished(protocol_pfd.revents)) {
-            return &protocol_sfd_;
+void Subprocess::Reap() {
+    int status;
+    if (exit_sfd_is_pidfd_) {
+        pid_t result = TEMP_FAILURE_RETRY(waitpid(pid_, &status, WNOHANG));
+        if (result == 0) {
+            return;
+        }
+        if (result != pid_) {
+            PLOG(ERROR) << "waitpid failed for pid " << pid_;
+            status = -1;
         }
-    }  // while (!dead_sfd)
+    } else if (!ReadFdExactly(exit_sfd_, &status, sizeof(status))) {
+        PLOG(ERROR) << "failed to read the wait status of pid " << pid_;
+        status = -1;
+    }
+    CloseWatch(&exit_watch_);
+
+    D("post waitpid (pid=%d) status=%04x", pid_, status);
+    if (status == -1) {
+        exit_code_ = 1;
+    } else if (WIFSIGNALED(status)) {
+        exit_code_ = 0x80 | WTERMSIG(status);
+        ADB_LOG(Shell) << "subprocess " << pid_ << " killed by signal " << WTERMSIG(status);
+    } else if (!WIFEXITED(status)) {
+        D("subprocess didn't exit");
+        exit_code_ = 1;
+    } else {
+        exit_code_ = WEXITSTATUS(status);
+        ADB_LOG(Shell) << "subprocess " << pid_ << " exited with status " << *exit_code_;
+    }
+}
 
-    return dead_sfd;
+BufferPool::Buffer BufferPool::Get(size_t size) {
+    const size_t capacity = std::bit_ceil(std::max(size, kMinSize));
+    const size_t index = std::countr_zero(capacity / kMinSize);
+    if (index < kSizeCount && !free_[index].empty()) {
+        Buffer buffer{std::move(free_[index].back()), capacity};
+        free_[index].pop_back();
+        pooled_bytes_ -= capacity;
+        return buffer;
+    }
+    return {std::unique_ptr<char[]>(new char[capacity]), capacity};
 }
 
-unique_fd* Subprocess::PassInput() {
-    // Only read a new packet if we've finished writing the last one.
-    if (!input_bytes_left_) {
-        if (!input_->Read()) {
-            // Read() uses ReadFdExactly() which sets errno to 0 on EOF.
-            if (errno != 0) {
-                PLOG(ERROR) << "error reading protocol FD " << protocol_sfd_.get();
-            }
-            return &protocol_sfd_;
-        }
-
-        if (stdinout_sfd_ != -1) {
-            switch (input_->id()) {
-                case ShellProtocol::kIdWindowSizeChange:
-                    int rows, cols, x_pixels, y_pixels;
-                    if (sscanf(input_->data(), "%dx%d,%dx%d",
-                               &rows, &cols, &x_pixels, &y_pixels) == 4) {
-                        winsize ws;
-                        ws.ws_row = rows;
-                        ws.ws_col = cols;
-                        ws.ws_xpixel = x_pixels;
-                        ws.ws_ypixel = y_pixels;
-                        ioctl(stdinout_sfd_.get(), TIOCSWINSZ, &ws);
-                    }
-                    break;
-                case ShellProtocol::kIdStdin:
-                    input_bytes_left_ = input_->data_length();
-                    break;
-                case ShellProtocol::kIdCloseStdin:
-                    if (type_ == SubprocessType::kRaw) {
-                        if (adb_shutdown(stdinout_sfd_, SHUT_WR) == 0) {
-                            return nullptr;
-                        }
-                        PLOG(ERROR) << "failed to shutdown writes to FD " << stdinout_sfd_.get();
-                        return &stdinout_sfd_;
-                    } else {
-                        // PTYs can't close just input, so rather than close the
-                        // FD and risk losing subprocess output, leave it open.
-                        // This only happens if the client starts a PTY shell
-                        // non-interactively which is rare and unsupported.
-                        // If necessary, the client can manually close the shell
-                        // with `exit` or by killing the adb client process.
-                        D("can't close input for PTY FD %d", stdinout_sfd_.get());
-                    }
-                    break;
-            }
-        }
+void BufferPool::Put(Buffer buffer) {
+    const size_t index = std::countr_zero(buffer.capacity / kMinSize);
+    if (buffer.data && index < kSizeCount &&
+        pooled_bytes_ + buffer.capacity <= kMaxPooledBytes) {
+        pooled_bytes_ += buffer.capacity;
+        free_[index].push_back(std::move(buffer.data));
     }
+}
 
-    if (input_bytes_left_ > 0) {
-        int index = input_->data_length() - input_bytes_left_;
-        int bytes = adb_write(stdinout_sfd_, input_->data() + index, input_bytes_left_);
-        if (bytes == 0 || (bytes < 0 && errno != EAGAIN)) {
-            if (bytes < 0) {
-                PLOG(ERROR) << "error reading stdin FD " << stdinout_sfd_.get();
-            }
-            // stdin is done, mark this packet as finished and we'll just start
-            // dumping any further data received from the protocol FD.
-            input_bytes_left_ = 0;
-            return &stdinout_sfd_;
-        } else if (bytes > 0) {
-            input_bytes_left_ -= bytes;
-        }
+void Backlog::Append(BufferPool* pool, const char* data, size_t size) {
+    if (size == 0) {
+        return;
+    }
+    if (end_ + size > buffer_.capacity) {
+        BufferPool::Buffer buffer = pool->Get(this->size() + size);
+        memcpy(buffer.data.get(), this->data(), this->size());
+        end_ = this->size();
+        begin_ = 0;
+        pool->Put(std::exchange(buffer_, std::move(buffer)));
     }
+    memcpy(buffer_.data.get() + end_, data, size);
+    end_ += size;
+}
 
-    return nullptr;
+void Backlog::Consume(BufferPool* pool, size_t size) {
+    begin_ += size;
+    if (begin_ == end_) {
+        pool->Put(std::exchange(buffer_, {}));
+        begin_ = end_ = 0;
+    }
 }
 
-unique_fd* Subprocess::PassOutput(unique_fd* sfd, ShellProtocol::Id id) {
-    int bytes = adb_read(*sfd, output_->data(), output_->data_capacity());
-    if (bytes == 0 || (bytes < 0 && errno != EAGAIN)) {
-        // read() returns EIO if a PTY closes; don't report this as an error,
-        // it just means the subprocess completed.
-        if (bytes < 0 && !(type_ == SubprocessType::kPty && errno == EIO)) {
-            PLOG(ERROR) << "error reading output FD " << sfd->get();
-        }
-        return sfd;
+ShellReactor& ShellReactor::Instance() {
+    static ShellReactor* reactor = new ShellReactor();
+    return *reactor;
+}
+
+ShellReactor::ShellReactor() : scratch_(new char[kScratchSize]) {
+    epoll_fd_.reset(epoll_create1(EPOLL_CLOEXEC));
+    if (epoll_fd_ == -1) {
+        PLOG(FATAL) << "failed to create shell epoll FD";
+    }
+    wake_fd_.reset(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK));
+    if (wake_fd_ == -1) {
+        PLOG(FATAL) << "failed to create shell eventfd";
     }
+    epoll_event event = {.events = EPOLLIN, .data = {.ptr = nullptr}};
+    if (epoll_ctl(epoll_fd_.get(), EPOLL_CTL_ADD, wake_fd_.get(), &event) != 0) {
+        PLOG(FATAL) << "failed to register shell eventfd";
+    }
+    std::thread([this]() { Run(); }).detach();
+}
 
-    if (bytes > 0 && !output_->Write(id, bytes)) {
-        if (errno != 0) {
-            PLOG(ERROR) << "error reading protocol FD " << protocol_sfd_.get();
-        }
-        return &protocol_sfd_;
+void ShellReactor::Add(std::unique_ptr<Subprocess> subprocess) {
+    {
+        std::lock_guard<std::mutex> lock(added_lock_);
+        added_.push_back(std::move(subprocess));
+    }
+    uint64_t value = 1;
+    if (adb_write(wake_fd_, &value, sizeof(value)) != sizeof(value)) {
+        PLOG(FATAL) << "failed to write to shell eventfd";
     }
+}
 
-    return nullptr;
+void ShellReactor::SetEvents(Subprocess::Watch* watch, uint32_t events) {
+    if (events == watch->events) {
+        return;
+    }
+    epoll_event event = {.events = events, .data = {.ptr = watch}};
+    int op = watch->events == 0 ? EPOLL_CTL_ADD : events == 0 ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
+    if (epoll_ctl(epoll_fd_.get(), op, watch->fd->get(), &event) != 0) {
+        PLOG(FATAL) << "failed to update shell FD " << watch->fd->get() << " with epoll";
+    }
+    watch->events = events;
 }
 
-void Subprocess::WaitForExit() {
-    int exit_code = 1;
+void ShellReactor::TakeAdded() {
+    uint64_t value;
+    adb_read(wake_fd_, &value, sizeof(value));
 
-    D("waiting for pid %d", pid_);
-    while (pid_ != -1) {
-        int status;
-        if (pid_ == waitpid(pid_, &status, 0)) {
-            D("post waitpid (pid=%d) status=%04x", pid_, status);
-            if (WIFSIGNALED(status)) {
-                exit_code = 0x80 | WTERMSIG(status);
-                ADB_LOG(Shell) << "subprocess " << pid_ << " killed by signal " << WTERMSIG(status);
-                break;
-            } else if (!WIFEXITED(status)) {
-                D("subprocess didn't exit");
-                break;
-            } else if (WEXITSTATUS(status) >= 0) {
-                exit_code = WEXITSTATUS(status);
-                ADB_LOG(Shell) << "subprocess " << pid_ << " exited with status " << exit_code;
-                break;
-            }
+    std::vector<std::unique_ptr<Subprocess>> added;
+    {
+        std::lock_guard<std::mutex> lock(added_lock_);
+        added.swap(added_);
+    }
+    for (auto& subprocess : added) {
+        D("passing data streams for PID %d", subprocess->pid());
+        Subprocess* raw = subprocess.get();
+        raw->reactor_ = this;
+        if (raw->pid_ == -1) {
+            // Commands run in-process have no exit code to report.
+            raw->exit_code_ = 1;
+        }
+        subprocesses_.emplace(raw, std::move(subprocess));
+        if (raw->Update()) {
+            D("deleting Subprocess for PID %d", raw->pid());
+            subprocesses_.erase(raw);
         }
     }
+}
 
-    // If we have an open protocol FD send an exit packet.
-    if (protocol_sfd_ != -1) {
-        output_->data()[0] = exit_code;
-        if (output_->Write(ShellProtocol::kIdExit, 1)) {
-            D("wrote the exit code packet: %d", exit_code);
-        } else {
-            PLOG(ERROR) << "failed to write the exit code packet";
+void ShellReactor::Run() {
+    adb_thread_setname("shell svc");
+
+    std::vector<epoll_event> events(64);
+    std::vector<Subprocess*> finished;
+    while (true) {
+        int count = epoll_wait(epoll_fd_.get(), events.data(), events.size(), -1);
+        if (count == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            PLOG(FATAL) << "shell epoll_wait failed";
+        }
+
+        for (int i = 0; i < count; i++) {
+            if (events[i].data.ptr == nullptr) {
+                TakeAdded();
+                continue;
+            }
+            // A watch unregistered by an earlier event, maybe along with its
+            // finished subprocess, is skipped. Subprocesses are only deleted
+            // once all the events are handled.
+            auto watch = static_cast<Subprocess::Watch*>(events[i].data.ptr);
+            if (watch->events != 0 && watch->subprocess->HandleEvent(watch, events[i].events)) {
+                finished.push_back(watch->subprocess);
+            }
+        }
+        for (Subprocess* subprocess : finished) {
+            D("deleting Subprocess for PID %d", subprocess->pid());
+            subprocesses_.erase(subprocess);
         }
-        protocol_sfd_.reset(-1);
+        finished.clear();
     }
 }
 
@@ -831,7 +1188,7 @@ unique_fd StartSubprocess(std::string name, const char* terminal_type, Subproces
     // of the PTY closes, which we rely on. If we use a raw pipe, processes that don't read/write,
     // e.g. screenrecord, will never notice the broken pipe and terminate.
     // The shell protocol doesn't require a PTY because it's always monitoring the local socket FD
-    // with select() and will send SIGHUP manually to the child process.
+    // with epoll and will send SIGHUP manually to the child process.
     bool make_pty_raw = false;
     if (protocol == SubprocessProtocol::kNone && type == SubprocessType::kRaw) {
         // Disable PTY input/output processing since the client is expecting raw data.
@@ -875,8 +1232,8 @@ unique_fd StartSubprocess(std::string name, const char* terminal_type, Subproces
     D("subprocess creation successful: local_socket_fd=%d, pid=%d", local_socket.get(),
       subprocess->pid());
 
-    if (!Subprocess::StartThread(std::move(subprocess), &error)) {
-        LOG(ERROR) << "failed to start subprocess management thread: " << error;
+    if (!Subprocess::Start(std::move(subprocess), &error)) {
+        LOG(ERROR) << "failed to start watching subprocess: " << error;
         *error_fd = ReportError(error_protocol, error);
         return {};
     }
@@ -908,8 +1265,8 @@ unique_fd StartCommandInProcess(std::string name, Command command, SubprocessPro
     D("inprocess creation successful: local_socket_fd=%d, pid=%d", local_socket.get(),
       subprocess->pid());
 
-    if (!Subprocess::StartThread(std::move(subprocess), &error)) {
-        LOG(ERROR) << "failed to start inprocess management thread: " << error;
+    if (!Subprocess::Start(std::move(subprocess), &error)) {
+        LOG(ERROR) << "failed to start watching inprocess command: " << error;
         return ReportError(protocol, error);
     }
 
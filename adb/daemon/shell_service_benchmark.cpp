@@ -0,0 +1,191 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Throughput and memory use of many concurrent shell subprocesses, as when a
+// test harness runs hundreds of `adb shell` commands against one device.
+
+#include <signal.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/parseint.h>
+#include <android-base/strings.h>
+#include <android-base/unique_fd.h>
+#include <benchmark/benchmark.h>
+
+#include "adb_io.h"
+#include "daemon/shell_service.h"
+#include "shell_protocol.h"
+#include "sysdeps.h"
+
+using android::base::unique_fd;
+
+namespace {
+
+// Reads shell protocol packets from |fd| until the exit packet, and returns the
+// exit code, or -1 if the stream ends first.
+int ReadExitCode(borrowed_fd fd) {
+    char header[5];
+    std::string data;
+    while (ReadFdExactly(fd, header, sizeof(header))) {
+        uint32_t length;
+        memcpy(&length, &header[1], sizeof(length));
+        data.resize(length);
+        if (!ReadFdExactly(fd, data.data(), length)) {
+            break;
+        }
+        if (header[0] == ShellProtocol::kIdExit && length == 1) {
+            return static_cast<uint8_t>(data[0]);
+        }
+    }
+    return -1;
+}
+
+// Returns the value of |field| in /proc/self/status, e.g. the kB of VmRSS.
+int64_t ProcStatus(const std::string& field) {
+    std::string status;
+    CHECK(android::base::ReadFileToString("/proc/self/status", &status));
+    for (const auto& line : android::base::Split(status, "\n")) {
+        if (android::base::StartsWith(line, field + ":")) {
+            int64_t value;
+            std::string number = android::base::Trim(line.substr(field.size() + 1));
+            number = number.substr(0, number.find(' '));
+            if (android::base::ParseInt(number, &value)) {
+                return value;
+            }
+        }
+    }
+    return -1;
+}
+
+void IgnoreSigpipe() {
+    // This is normally done in main.cpp.
+    static auto unused = signal(SIGPIPE, SIG_IGN);
+    UNUSED(unused);
+}
+
+// Runs a subprocess to completion, so that anything started along with the
+// first one is already running when the benchmark measures.
+void WarmUp() {
+    unique_fd fd =
+            StartSubprocess("true", nullptr, SubprocessType::kRaw, SubprocessProtocol::kShell);
+    CHECK_EQ(0, ReadExitCode(fd));
+}
+
+// Sends |size| bytes to a `cat` subprocess's stdin and reads them back from its
+// stdout.
+bool Echo(borrowed_fd fd, size_t size) {
+    std::string packet(5 + size, 'x');
+    packet[0] = ShellProtocol::kIdStdin;
+    const uint32_t length = size;
+    memcpy(&packet[1], &length, sizeof(length));
+    if (!WriteFdExactly(fd, packet.data(), packet.size())) {
+        return false;
+    }
+
+    char header[5];
+    std::string data;
+    for (size_t received = 0; received < size; received += data.size()) {
+        uint32_t length;
+        if (!ReadFdExactly(fd, header, sizeof(header))) {
+            return false;
+        }
+        memcpy(&length, &header[1], sizeof(length));
+        data.resize(length);
+        if (header[0] != ShellProtocol::kIdStdout || !ReadFdExactly(fd, data.data(), length)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Waits up to a second for the threads of finished subprocesses to go away.
+void WaitForThreads(int64_t count) {
+    for (int i = 0; i < 1000 && ProcStatus("Threads") > count; i++) {
+        usleep(1000);
+    }
+}
+
+}  // namespace
+
+// Starts arg 0 `true` subprocesses at once with the shell protocol, and waits
+// for each of their exit codes.
+static void BM_ShellTrue(benchmark::State& state) {
+    IgnoreSigpipe();
+    WarmUp();
+    const size_t count = state.range(0);
+    std::vector<unique_fd> fds(count);
+    int64_t threads = 0;
+    for (auto _ : state) {
+        for (auto& fd : fds) {
+            fd = StartSubprocess("true", nullptr, SubprocessType::kRaw, SubprocessProtocol::kShell);
+        }
+        threads = std::max(threads, ProcStatus("Threads"));
+        for (auto& fd : fds) {
+            if (ReadExitCode(fd) != 0) {
+                state.SkipWithError("subprocess failed");
+                return;
+            }
+            fd.reset();
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * count);
+    state.counters["threads"] = threads;
+}
+BENCHMARK(BM_ShellTrue)->Arg(1)->Arg(16)->Arg(64)->Arg(256)->UseRealTime();
+
+// Keeps arg 0 `cat` subprocesses waiting for input after echoing 64KiB through
+// each, and reports how much memory and how many threads each one costs.
+static void BM_ShellIdle(benchmark::State& state) {
+    constexpr size_t kEchoSize = 64 * 1024;
+    IgnoreSigpipe();
+    WarmUp();
+    const size_t count = state.range(0);
+    std::vector<unique_fd> fds(count);
+    const int64_t threads_before = ProcStatus("Threads");
+    double rss_kib = 0;
+    double threads = 0;
+    for (auto _ : state) {
+        const int64_t rss_before = ProcStatus("VmRSS");
+        for (auto& fd : fds) {
+            fd = StartSubprocess("cat", nullptr, SubprocessType::kRaw, SubprocessProtocol::kShell);
+        }
+        // Echo some data through each one, so that their buffers are in use.
+        for (auto& fd : fds) {
+            if (!Echo(fd, kEchoSize)) {
+                state.SkipWithError("subprocess failed");
+                return;
+            }
+        }
+        rss_kib += double(ProcStatus("VmRSS") - rss_before) / count;
+        threads += double(ProcStatus("Threads") - threads_before) / count;
+        for (auto& fd : fds) {
+            // Closing the socket hangs the subprocess up.
+            fd.reset();
+        }
+        WaitForThreads(threads_before);
+    }
+    state.SetItemsProcessed(state.iterations() * count);
+    state.counters["rss_kib"] = benchmark::Counter(rss_kib, benchmark::Counter::kAvgIterations);
+    state.counters["threads"] = benchmark::Counter(threads, benchmark::Counter::kAvgIterations);
+}
+BENCHMARK(BM_ShellIdle)->Arg(16)->Arg(64)->Arg(256)->UseRealTime();
+
+BENCHMARK_MAIN();
@@ -21,6 +21,7 @@
 #include <signal.h>
 
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <android-base/strings.h>
@@ -198,6 +199,41 @@ TEST_F(ShellServiceTest, CloseStderrSubprocess) {
     ExpectLinesEqual(stderr, {});
 }
 
+// Tests that subprocesses sharing the shell reactor each get all their data
+// through while the others' clients fall behind.
+TEST_F(ShellServiceTest, ConcurrentEchoSubprocesses) {
+    constexpr size_t kCount = 8;
+    constexpr size_t kPacketSize = 64 * 1024;
+    constexpr size_t kPackets = 16;
+
+    std::vector<unique_fd> fds;
+    std::vector<std::thread> writers;
+    for (size_t i = 0; i < kCount; ++i) {
+        fds.push_back(StartSubprocess("cat", nullptr, SubprocessType::kRaw,
+                                      SubprocessProtocol::kShell));
+        ASSERT_GE(fds.back(), 0);
+        writers.emplace_back([fd = fds.back().get(), i]() {
+            ShellProtocol protocol(fd);
+            memset(protocol.data(), 'a' + i, kPacketSize);
+            for (size_t packet = 0; packet < kPackets; ++packet) {
+                ASSERT_TRUE(protocol.Write(ShellProtocol::kIdStdin, kPacketSize));
+            }
+            ASSERT_TRUE(protocol.Write(ShellProtocol::kIdCloseStdin, 0));
+        });
+    }
+
+    // Read them one at a time, so that the rest have to wait.
+    for (size_t i = 0; i < kCount; ++i) {
+        std::string stdout, stderr;
+        EXPECT_EQ(0, ReadShellProtocol(fds[i], &stdout, &stderr));
+        EXPECT_EQ(std::string(kPacketSize * kPackets, 'a' + i), stdout);
+        EXPECT_EQ("", stderr);
+    }
+    for (auto& writer : writers) {
+        writer.join();
+    }
+}
+
 // Tests an inprocess command with no protocol.
 TEST_F(ShellServiceTest, RawNoProtocolInprocess) {
     ASSERT_NO_FATAL_FAILURE(
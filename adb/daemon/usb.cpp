@@ -24,6 +24,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <unistd.h>
 
@@ -36,6 +37,7 @@
 #include <memory>
 #include <mutex>
 #include <optional>
+#include <utility>
 #include <vector>
 
 #include <asyncio/AsyncIO.h>
@@ -66,6 +68,12 @@ static constexpr size_t kUsbReadSize = 16384;
 static constexpr size_t kUsbWriteQueueDepth = 8;
 static constexpr size_t kUsbWriteSize = 16384;
 
+// Outgoing transfers are staged in a ring of slots that lives as long as the connection, so the
+// write path doesn't allocate per packet. Headers are copied into a pinned per-slot staging
+// buffer; payloads of any size are submitted straight out of the packet's Block.
+static constexpr size_t kUsbWriteRingSize = 64;
+static constexpr size_t kUsbWriteStagingSize = sizeof(amessage);
+
 static const char* to_string(enum usb_functionfs_event_type type) {
     switch (type) {
         case FUNCTIONFS_BIND:
@@ -95,7 +103,70 @@ struct IoBlock {
 };
 
 using IoReadBlock = IoBlock<Block>;
-using IoWriteBlock = IoBlock<std::shared_ptr<Block>>;
+
+struct IoWriteSlot {
+    bool pending = false;
+    bool completed = false;
+    struct iocb control = {};
+
+    // kUsbWriteStagingSize bytes of pinned memory owned by the ring.
+    char* staging = nullptr;
+
+    // Set on the slot that carries the final chunk of a packet's payload. Slots are retired in
+    // order, so this outlives every other transfer that points into it.
+    Block payload;
+
+    TransferId id() const { return TransferId::from_value(control.aio_data); }
+};
+
+// Anonymous mapping that is faulted in up front and locked, so that the kernel doesn't have to
+// page in our staging buffers when it pins them for each transfer.
+struct ScopedStagingArea {
+    ScopedStagingArea() = default;
+    ~ScopedStagingArea() { reset(); }
+
+    ScopedStagingArea(const ScopedStagingArea& copy) = delete;
+    ScopedStagingArea& operator=(const ScopedStagingArea& copy) = delete;
+
+    static ScopedStagingArea Create(size_t size) {
+        void* addr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+        if (addr == MAP_FAILED) {
+            PLOG(FATAL) << "failed to map USB write staging area";
+        }
+        if (mlock(addr, size) != 0) {
+            PLOG(WARNING) << "failed to lock USB write staging area";
+        }
+        ScopedStagingArea result;
+        result.data_ = static_cast<char*>(addr);
+        result.size_ = size;
+        return result;
+    }
+
+    ScopedStagingArea(ScopedStagingArea&& move)
+        : data_(std::exchange(move.data_, nullptr)), size_(std::exchange(move.size_, 0)) {}
+
+    ScopedStagingArea& operator=(ScopedStagingArea&& move) {
+        reset();
+        data_ = std::exchange(move.data_, nullptr);
+        size_ = std::exchange(move.size_, 0);
+        return *this;
+    }
+
+    void reset() {
+        if (data_ != nullptr) {
+            munmap(data_, size_);
+        }
+        data_ = nullptr;
+        size_ = 0;
+    }
+
+    char* get() { return data_; }
+
+  private:
+    char* data_ = nullptr;
+    size_t size_ = 0;
+};
 
 struct ScopedAioContext {
     ScopedAioContext() = default;
@@ -142,10 +213,11 @@ struct ScopedAioContext {
 
 struct UsbFfsConnection : public Connection {
     UsbFfsConnection(unique_fd control, unique_fd read, unique_fd write,
-                     std::promise<void> destruction_notifier)
+                     std::promise<void> destruction_notifier, UsbFfsReadCallback read_callback)
         : worker_started_(false),
           stopped_(false),
           destruction_notifier_(std::move(destruction_notifier)),
+          read_callback_(std::move(read_callback)),
           control_fd_(std::move(control)),
           read_fd_(std::move(read)),
           write_fd_(std::move(write)) {
@@ -161,6 +233,11 @@ struct UsbFfsConnection : public Connection {
         }
 
         aio_context_ = ScopedAioContext::Create(kUsbReadQueueDepth + kUsbWriteQueueDepth);
+
+        write_staging_ = ScopedStagingArea::Create(kUsbWriteRingSize * kUsbWriteStagingSize);
+        for (size_t i = 0; i < kUsbWriteRingSize; ++i) {
+            write_slots_[i].staging = write_staging_.get() + i * kUsbWriteStagingSize;
+        }
     }
 
     ~UsbFfsConnection() {
@@ -180,28 +257,10 @@ struct UsbFfsConnection : public Connection {
 
     virtual bool Write(std::unique_ptr<apacket> packet) override final {
         LOG(DEBUG) << "USB write: " << dump_header(&packet->msg);
-        auto header = std::make_shared<Block>(sizeof(packet->msg));
-        memcpy(header->data(), &packet->msg, sizeof(packet->msg));
 
         std::lock_guard<std::mutex> lock(write_mutex_);
-        write_requests_.push_back(
-                CreateWriteBlock(std::move(header), 0, sizeof(packet->msg), next_write_id_++));
-        if (!packet->payload.empty()) {
-            // The kernel attempts to allocate a contiguous block of memory for each write,
-            // which can fail if the write is large and the kernel heap is fragmented.
-            // Split large writes into smaller chunks to avoid this.
-            auto payload = std::make_shared<Block>(std::move(packet->payload));
-            size_t offset = 0;
-            size_t len = payload->size();
-
-            while (len > 0) {
-                size_t write_size = std::min(kUsbWriteSize, len);
-                write_requests_.push_back(
-                        CreateWriteBlock(payload, offset, write_size, next_write_id_++));
-                len -= write_size;
-                offset += write_size;
-            }
-        }
+        write_backlog_.push_back(std::move(packet));
+        StageWrites();
 
         // Wake up the worker thread to submit writes.
         uint64_t notify = 1;
@@ -586,7 +645,11 @@ struct UsbFfsConnection : public Connection {
 
                 // TODO: Make apacket contain an IOVector so we don't have to coalesce.
                 packet->payload = std::move(incoming_payload_).coalesce();
-                transport_->HandleRead(std::move(packet));
+                if (read_callback_) {
+                    read_callback_(std::move(packet));
+                } else {
+                    transport_->HandleRead(std::move(packet));
+                }
 
                 incoming_header_.reset();
                 // reuse the capacity of the incoming payload while we can.
@@ -615,66 +678,113 @@ struct UsbFfsConnection : public Connection {
 
     void HandleWrite(TransferId id) {
         std::lock_guard<std::mutex> lock(write_mutex_);
-        auto it =
-                std::find_if(write_requests_.begin(), write_requests_.end(), [id](const auto& req) {
-                    return static_cast<uint64_t>(req.id()) == static_cast<uint64_t>(id);
-                });
-        CHECK(it != write_requests_.end());
+        IoWriteSlot* slot = &write_slots_[id.id % kUsbWriteRingSize];
+        CHECK(slot->id() == id);
+        CHECK(slot->pending);
+        slot->pending = false;
+        slot->completed = true;
+
+        // Completions can arrive out of order, but slots are only handed back in order.
+        while (next_retire_id_ != next_submit_id_) {
+            IoWriteSlot* retired = &write_slots_[next_retire_id_ % kUsbWriteRingSize];
+            if (!retired->completed) {
+                break;
+            }
+            retired->completed = false;
+            retired->payload.clear();
+            ++next_retire_id_;
+        }
 
-        write_requests_.erase(it);
         size_t outstanding_writes = --writes_submitted_;
         LOG(DEBUG) << "USB write: reaped, down to " << outstanding_writes;
     }
 
-    IoWriteBlock CreateWriteBlock(std::shared_ptr<Block> payload, size_t offset, size_t len,
-                                  uint64_t id) {
-        auto block = IoWriteBlock();
-        block.payload = std::move(payload);
-        block.control.aio_data = static_cast<uint64_t>(TransferId::write(id));
-        block.control.aio_rw_flags = 0;
-        block.control.aio_lio_opcode = IOCB_CMD_PWRITE;
-        block.control.aio_reqprio = 0;
-        block.control.aio_fildes = write_fd_.get();
-        block.control.aio_buf = reinterpret_cast<uintptr_t>(block.payload->data() + offset);
-        block.control.aio_nbytes = len;
-        block.control.aio_offset = 0;
-        block.control.aio_flags = IOCB_FLAG_RESFD;
-        block.control.aio_resfd = worker_event_fd_.get();
-        return block;
+    // Claim the next free slot for a transfer of |len| bytes out of |data|, or out of the slot's
+    // staging buffer if |data| is null.
+    IoWriteSlot* AcquireWriteSlot(const char* data, size_t len) REQUIRES(write_mutex_) {
+        CHECK_LT(next_write_id_ - next_retire_id_, kUsbWriteRingSize);
+        uint64_t id = next_write_id_++;
+        IoWriteSlot* slot = &write_slots_[id % kUsbWriteRingSize];
+        CHECK(!slot->pending);
+        CHECK(!slot->completed);
+        CHECK(slot->payload.empty());
+
+        slot->control.aio_data = static_cast<uint64_t>(TransferId::write(id));
+        slot->control.aio_rw_flags = 0;
+        slot->control.aio_lio_opcode = IOCB_CMD_PWRITE;
+        slot->control.aio_reqprio = 0;
+        slot->control.aio_fildes = write_fd_.get();
+        slot->control.aio_buf = reinterpret_cast<uintptr_t>(data ? data : slot->staging);
+        slot->control.aio_nbytes = len;
+        slot->control.aio_offset = 0;
+        slot->control.aio_flags = IOCB_FLAG_RESFD;
+        slot->control.aio_resfd = worker_event_fd_.get();
+        return slot;
     }
 
-    IoWriteBlock CreateWriteBlock(Block&& payload, uint64_t id) {
-        size_t len = payload.size();
-        return CreateWriteBlock(std::make_shared<Block>(std::move(payload)), 0, len, id);
+    // Move as much of the backlog as fits into free ring slots.
+    void StageWrites() REQUIRES(write_mutex_) {
+        while (!write_backlog_.empty() && next_write_id_ - next_retire_id_ < kUsbWriteRingSize) {
+            apacket* packet = write_backlog_.front().get();
+            Block& payload = packet->payload;
+            size_t payload_size = payload.size();
+
+            if (!write_backlog_header_staged_) {
+                // The header always goes out as its own transfer, because both ends frame on it.
+                // It's submitted in the same io_submit batch as the start of the payload.
+                IoWriteSlot* slot = AcquireWriteSlot(nullptr, sizeof(packet->msg));
+                memcpy(slot->staging, &packet->msg, sizeof(packet->msg));
+                write_backlog_header_staged_ = true;
+            } else {
+                // The kernel attempts to allocate a contiguous block of memory for each write,
+                // which can fail if the write is large and the kernel heap is fragmented.
+                // Split large writes into smaller chunks to avoid this.
+                size_t offset = write_backlog_offset_;
+                size_t write_size = std::min(kUsbWriteSize, payload_size - offset);
+                IoWriteSlot* slot = AcquireWriteSlot(payload.data() + offset, write_size);
+                write_backlog_offset_ += write_size;
+                if (write_backlog_offset_ == payload_size) {
+                    slot->payload = std::move(payload);
+                }
+            }
+
+            if (write_backlog_offset_ == payload_size) {
+                write_backlog_.pop_front();
+                write_backlog_header_staged_ = false;
+                write_backlog_offset_ = 0;
+            }
+        }
     }
 
     void SubmitWrites() REQUIRES(write_mutex_) {
+        StageWrites();
         if (writes_submitted_ == kUsbWriteQueueDepth) {
             return;
         }
 
-        ssize_t writes_to_submit = std::min(kUsbWriteQueueDepth - writes_submitted_,
-                                            write_requests_.size() - writes_submitted_);
-        CHECK_GE(writes_to_submit, 0);
+        size_t writes_to_submit = std::min(kUsbWriteQueueDepth - writes_submitted_,
+                                           static_cast<size_t>(next_write_id_ - next_submit_id_));
         if (writes_to_submit == 0) {
             return;
         }
 
         struct iocb* iocbs[kUsbWriteQueueDepth];
-        for (int i = 0; i < writes_to_submit; ++i) {
-            CHECK(!write_requests_[writes_submitted_ + i].pending);
-            write_requests_[writes_submitted_ + i].pending = true;
-            iocbs[i] = &write_requests_[writes_submitted_ + i].control;
+        for (size_t i = 0; i < writes_to_submit; ++i) {
+            IoWriteSlot* slot = &write_slots_[(next_submit_id_ + i) % kUsbWriteRingSize];
+            CHECK(!slot->pending);
+            slot->pending = true;
+            iocbs[i] = &slot->control;
             LOG(VERBOSE) << "submitting write_request " << static_cast<void*>(iocbs[i]);
         }
 
+        next_submit_id_ += writes_to_submit;
         writes_submitted_ += writes_to_submit;
 
         int rc = io_submit(aio_context_.get(), writes_to_submit, iocbs);
         if (rc == -1) {
             HandleError(StringPrintf("failed to submit write requests: %s", strerror(errno)));
             return;
-        } else if (rc != writes_to_submit) {
+        } else if (static_cast<size_t>(rc) != writes_to_submit) {
             LOG(FATAL) << "failed to submit all writes: wanted to submit " << writes_to_submit
                        << ", actually submitted " << rc;
         }
@@ -682,11 +792,11 @@ struct UsbFfsConnection : public Connection {
 
     void CancelWrites() {
         std::lock_guard<std::mutex> lock(write_mutex_);
-        for (size_t i = 0; i < writes_submitted_; ++i) {
+        for (size_t i = 0; i < kUsbWriteRingSize; ++i) {
             struct io_event res;
-            if (write_requests_[i].pending == true) {
-                LOG(INFO) << "cancelling pending write# " << i;
-                io_cancel(aio_context_.get(), &write_requests_[i].control, &res);
+            if (write_slots_[i].pending == true) {
+                LOG(INFO) << "cancelling pending write# " << write_slots_[i].id().id;
+                io_cancel(aio_context_.get(), &write_slots_[i].control, &res);
             }
         }
     }
@@ -710,6 +820,7 @@ struct UsbFfsConnection : public Connection {
 
     std::atomic<bool> stopped_;
     std::promise<void> destruction_notifier_;
+    UsbFfsReadCallback read_callback_;
     std::once_flag error_flag_;
 
     unique_fd worker_event_fd_;
@@ -734,13 +845,34 @@ struct UsbFfsConnection : public Connection {
     size_t needed_read_id_ = 0;
 
     std::mutex write_mutex_;
-    std::deque<IoWriteBlock> write_requests_ GUARDED_BY(write_mutex_);
-    size_t next_write_id_ GUARDED_BY(write_mutex_) = 0;
+    ScopedStagingArea write_staging_;
+    std::array<IoWriteSlot, kUsbWriteRingSize> write_slots_ GUARDED_BY(write_mutex_);
+
+    // Packets that haven't been completely staged into the ring yet, and how far into the packet
+    // at the front of the queue we've gotten.
+    std::deque<std::unique_ptr<apacket>> write_backlog_ GUARDED_BY(write_mutex_);
+    bool write_backlog_header_staged_ GUARDED_BY(write_mutex_) = false;
+    size_t write_backlog_offset_ GUARDED_BY(write_mutex_) = 0;
+
+    // IDs of the next slot to stage, submit, and retire; next_retire_id_ <= next_submit_id_ <=
+    // next_write_id_, and next_write_id_ - next_retire_id_ never exceeds kUsbWriteRingSize.
+    uint64_t next_write_id_ GUARDED_BY(write_mutex_) = 0;
+    uint64_t next_submit_id_ GUARDED_BY(write_mutex_) = 0;
+    uint64_t next_retire_id_ GUARDED_BY(write_mutex_) = 0;
     size_t writes_submitted_ GUARDED_BY(write_mutex_) = 0;
 
     static constexpr int kInterruptionSignal = SIGUSR1;
 };
 
+std::unique_ptr<Connection> CreateUsbFfsConnection(unique_fd control, unique_fd bulk_out,
+                                                   unique_fd bulk_in,
+                                                   std::promise<void> destruction_notifier,
+                                                   UsbFfsReadCallback read_callback) {
+    return std::make_unique<UsbFfsConnection>(std::move(control), std::move(bulk_out),
+                                              std::move(bulk_in), std::move(destruction_notifier),
+                                              std::move(read_callback));
+}
+
 static void usb_ffs_open_thread() {
     adb_thread_setname("usb ffs open");
 
@@ -777,9 +909,9 @@ static void usb_ffs_open_thread() {
         transport->serial = "UsbFfs";
         std::promise<void> destruction_notifier;
         std::future<void> future = destruction_notifier.get_future();
-        transport->SetConnection(std::make_unique<UsbFfsConnection>(
-                std::move(control), std::move(bulk_out), std::move(bulk_in),
-                std::move(destruction_notifier)));
+        transport->SetConnection(CreateUsbFfsConnection(std::move(control), std::move(bulk_out),
+                                                        std::move(bulk_in),
+                                                        std::move(destruction_notifier)));
         register_transport(transport);
         future.wait();
     }
@@ -0,0 +1,202 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Throughput of UsbFfsConnection over a virtual USB link, without a USB gadget.
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <linux/usb/functionfs.h>
+
+#include <condition_variable>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <android-base/logging.h>
+#include <android-base/unique_fd.h>
+#include <benchmark/benchmark.h>
+
+#include "adb.h"
+#include "client/usb.h"
+#include "daemon/usb_ffs.h"
+#include "test_utils/virtual_usb.h"
+#include "transport.h"
+
+using android::base::unique_fd;
+using test_utils::VirtualUsbConfig;
+using test_utils::VirtualUsbLink;
+using test_utils::VirtualUsbPipe;
+using test_utils::VirtualUsbStatus;
+
+namespace {
+
+class UsbFfsHarness {
+  public:
+    explicit UsbFfsHarness(VirtualUsbConfig config) : link_(config) {
+        int sockets[2];
+        CHECK_EQ(0, socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sockets));
+        unique_fd control(sockets[0]);
+        control_.reset(sockets[1]);
+
+        unique_fd bulk_out(open("/dev/null", O_RDWR | O_CLOEXEC));
+        unique_fd bulk_in(open("/dev/null", O_RDWR | O_CLOEXEC));
+        CHECK_NE(-1, bulk_out.get());
+        CHECK_NE(-1, bulk_in.get());
+        bound_fds_ = {bulk_out.get(), bulk_in.get()};
+        test_utils::VirtualAioBind(bulk_out.get(), &link_.host_to_device);
+        test_utils::VirtualAioBind(bulk_in.get(), &link_.device_to_host);
+
+        std::promise<void> destruction_notifier;
+        destroyed_ = destruction_notifier.get_future();
+        connection_ = CreateUsbFfsConnection(
+                std::move(control), std::move(bulk_out), std::move(bulk_in),
+                std::move(destruction_notifier), [this](std::unique_ptr<apacket>) {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    ++packets_received_;
+                    cv_.notify_all();
+                });
+        connection_->Start();
+        SendEvent(FUNCTIONFS_BIND);
+        SendEvent(FUNCTIONFS_ENABLE);
+    }
+
+    ~UsbFfsHarness() {
+        connection_.reset();
+        destroyed_.wait();
+        for (int fd : bound_fds_) {
+            test_utils::VirtualAioUnbind(fd);
+        }
+    }
+
+    Connection* connection() { return connection_.get(); }
+    VirtualUsbLink* link() { return &link_; }
+
+    void WaitForPackets(size_t count) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this, count]() { return packets_received_ >= count; });
+    }
+
+  private:
+    void SendEvent(usb_functionfs_event_type type) {
+        usb_functionfs_event event = {};
+        event.type = type;
+        CHECK_EQ(static_cast<ssize_t>(sizeof(event)), write(control_.get(), &event, sizeof(event)));
+    }
+
+    VirtualUsbLink link_;
+    unique_fd control_;
+    std::vector<int> bound_fds_;
+    std::unique_ptr<Connection> connection_;
+    std::future<void> destroyed_;
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    size_t packets_received_ = 0;
+};
+
+amessage MakeHeader(size_t length) {
+    amessage msg = {};
+    msg.command = A_WRTE;
+    msg.data_length = length;
+    msg.magic = msg.command ^ 0xffffffff;
+    return msg;
+}
+
+// Wait for a transfer on |pipe| to finish.
+void Transfer(VirtualUsbPipe* pipe, bool read, void* data, size_t length) {
+    auto done = std::make_shared<std::promise<void>>();
+    auto future = done->get_future();
+    auto callback = [done](VirtualUsbStatus status, size_t) {
+        CHECK(status == VirtualUsbStatus::kCompleted);
+        done->set_value();
+    };
+    if (read) {
+        pipe->SubmitRead(data, length, callback);
+    } else {
+        pipe->SubmitWrite(data, length, callback);
+    }
+    future.wait();
+}
+
+VirtualUsbConfig ConfigFromState(const benchmark::State& state) {
+    VirtualUsbConfig config;
+    config.bandwidth = state.range(1) * 1024 * 1024;
+    return config;
+}
+
+// Device to host: range(0) is the payload size, range(1) the link bandwidth in MiB/s (0 for none).
+void BM_UsbFfsConnection_Write(benchmark::State& state) {
+    UsbFfsHarness harness(ConfigFromState(state));
+    size_t payload_size = state.range(0);
+    std::string payload(payload_size, 'x');
+    std::vector<char> buf(payload_size);
+    VirtualUsbPipe* pipe = &harness.link()->device_to_host;
+
+    for (auto _ : state) {
+        auto packet = std::make_unique<apacket>();
+        packet->msg = MakeHeader(payload_size);
+        packet->payload = apacket::payload_type(payload.begin(), payload.end());
+        harness.connection()->Write(std::move(packet));
+
+        amessage msg;
+        Transfer(pipe, true, &msg, sizeof(msg));
+        if (payload_size != 0) {
+            Transfer(pipe, true, buf.data(), payload_size);
+        }
+    }
+    state.SetBytesProcessed(state.iterations() * payload_size);
+}
+BENCHMARK(BM_UsbFfsConnection_Write)
+        ->ArgsProduct({{0, 512, 4096, 16384, 65536, MAX_PAYLOAD}, {0, 40}})
+        ->UseRealTime();
+
+// Host to device, with the host keeping up to range(2) packets in flight.
+void BM_UsbFfsConnection_Read(benchmark::State& state) {
+    UsbFfsHarness harness(ConfigFromState(state));
+    size_t payload_size = state.range(0);
+    size_t queue_depth = state.range(2);
+    std::string payload(payload_size, 'x');
+    amessage msg = MakeHeader(payload_size);
+    VirtualUsbPipe* pipe = &harness.link()->host_to_device;
+    uint16_t zero_mask = pipe->config().max_packet_size - 1;
+
+    size_t sent = 0;
+    for (auto _ : state) {
+        for (size_t i = 0; i < queue_depth; ++i) {
+            pipe->SubmitWrite(&msg, sizeof(msg), [](VirtualUsbStatus, size_t) {});
+            if (payload_size != 0) {
+                pipe->SubmitWrite(payload.data(), payload_size, [](VirtualUsbStatus, size_t) {});
+            }
+            if (should_perform_zero_transfer(payload_size, zero_mask)) {
+                pipe->SubmitWrite(nullptr, 0, [](VirtualUsbStatus, size_t) {});
+            }
+        }
+        sent += queue_depth;
+        harness.WaitForPackets(sent);
+    }
+    state.SetBytesProcessed(state.iterations() * queue_depth * payload_size);
+}
+BENCHMARK(BM_UsbFfsConnection_Read)
+        ->ArgsProduct({{0, 4096, 16384, 65536, MAX_PAYLOAD}, {0, 40}, {1, 8}})
+        ->UseRealTime();
+
+}  // namespace
+
+BENCHMARK_MAIN();
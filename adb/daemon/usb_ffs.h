@@ -16,7 +16,28 @@
 
 #pragma once
 
+#include <functional>
+#include <future>
+#include <memory>
+
 #include <android-base/unique_fd.h>
 
+#include "types.h"
+
+struct Connection;
+
 bool open_functionfs(android::base::unique_fd* control, android::base::unique_fd* bulk_out,
                      android::base::unique_fd* bulk_in);
+
+// Called with each packet read from the host, in place of the transport's HandleRead.
+using UsbFfsReadCallback = std::function<void(std::unique_ptr<apacket> packet)>;
+
+// Create a connection over the functionfs endpoints returned by open_functionfs.
+// |destruction_notifier| is fulfilled once the connection has been destroyed and the endpoints
+// have been closed. If |read_callback| is set, packets are handed to it instead of the transport,
+// which allows the connection to be driven without one.
+std::unique_ptr<Connection> CreateUsbFfsConnection(android::base::unique_fd control,
+                                                   android::base::unique_fd bulk_out,
+                                                   android::base::unique_fd bulk_in,
+                                                   std::promise<void> destruction_notifier,
+                                                   UsbFfsReadCallback read_callback = nullptr);
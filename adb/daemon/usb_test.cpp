@@ -0,0 +1,306 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "daemon/usb_ffs.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <linux/usb/functionfs.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <android-base/logging.h>
+#include <android-base/unique_fd.h>
+#include <gtest/gtest.h>
+
+#include "adb.h"
+#include "client/usb.h"
+#include "test_utils/virtual_usb.h"
+#include "transport.h"
+
+using namespace std::chrono_literals;
+
+using android::base::unique_fd;
+using test_utils::VirtualUsbConfig;
+using test_utils::VirtualUsbLink;
+using test_utils::VirtualUsbPipe;
+using test_utils::VirtualUsbStatus;
+
+namespace {
+
+struct TransferResult {
+    VirtualUsbStatus status;
+    size_t length;
+};
+
+std::future<TransferResult> SubmitWrite(VirtualUsbPipe* pipe, const void* data, size_t length) {
+    auto promise = std::make_shared<std::promise<TransferResult>>();
+    auto future = promise->get_future();
+    pipe->SubmitWrite(data, length, [promise](VirtualUsbStatus status, size_t length) {
+        promise->set_value({status, length});
+    });
+    return future;
+}
+
+TransferResult Read(VirtualUsbPipe* pipe, void* data, size_t length) {
+    auto promise = std::make_shared<std::promise<TransferResult>>();
+    auto future = promise->get_future();
+    pipe->SubmitRead(data, length, [promise](VirtualUsbStatus status, size_t length) {
+        promise->set_value({status, length});
+    });
+    return future.get();
+}
+
+std::string MakePayload(size_t length, char seed) {
+    std::string payload(length, '\0');
+    for (size_t i = 0; i < length; ++i) {
+        payload[i] = static_cast<char>(seed + i * 7);
+    }
+    return payload;
+}
+
+}  // namespace
+
+// Runs a UsbFfsConnection on top of a VirtualUsbLink, with the test playing the part of the host
+// and of the functionfs control endpoint.
+class UsbFfsConnectionTest : public ::testing::Test {
+  protected:
+    void Start(VirtualUsbConfig config = {}) {
+        link_ = std::make_unique<VirtualUsbLink>(config);
+
+        int sockets[2];
+        ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sockets));
+        unique_fd control(sockets[0]);
+        control_.reset(sockets[1]);
+
+        // The endpoints are never actually read or written, only used to route iocbs.
+        unique_fd bulk_out(open("/dev/null", O_RDWR | O_CLOEXEC));
+        unique_fd bulk_in(open("/dev/null", O_RDWR | O_CLOEXEC));
+        ASSERT_NE(-1, bulk_out.get());
+        ASSERT_NE(-1, bulk_in.get());
+        test_utils::VirtualAioBind(bulk_out.get(), &link_->host_to_device);
+        test_utils::VirtualAioBind(bulk_in.get(), &link_->device_to_host);
+        bound_fds_ = {bulk_out.get(), bulk_in.get()};
+
+        std::promise<void> destruction_notifier;
+        destroyed_ = destruction_notifier.get_future();
+        connection_ = CreateUsbFfsConnection(
+                std::move(control), std::move(bulk_out), std::move(bulk_in),
+                std::move(destruction_notifier), [this](std::unique_ptr<apacket> packet) {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    received_.push_back(std::move(packet));
+                    cv_.notify_all();
+                });
+        connection_->Start();
+
+        SendEvent(FUNCTIONFS_BIND);
+        SendEvent(FUNCTIONFS_ENABLE);
+    }
+
+    void TearDown() override {
+        if (connection_) {
+            connection_.reset();
+            destroyed_.wait();
+        }
+        for (int fd : bound_fds_) {
+            test_utils::VirtualAioUnbind(fd);
+        }
+        bound_fds_.clear();
+        link_.reset();
+    }
+
+    void SendEvent(usb_functionfs_event_type type) {
+        usb_functionfs_event event = {};
+        event.type = type;
+        ASSERT_EQ(static_cast<ssize_t>(sizeof(event)), write(control_.get(), &event, sizeof(event)));
+    }
+
+    static amessage MakeHeader(const std::string& payload) {
+        amessage msg = {};
+        msg.command = A_WRTE;
+        msg.arg0 = 1;
+        msg.arg1 = 2;
+        msg.data_length = payload.size();
+        msg.magic = msg.command ^ 0xffffffff;
+        return msg;
+    }
+
+    // Queue a packet from the host the way the host does it: the header and the payload as
+    // separate transfers, followed by a zero-length packet if the payload would otherwise run into
+    // the next transfer.
+    void SubmitHostPacket(const amessage& msg, const std::string& payload,
+                          std::vector<std::future<TransferResult>>* writes) {
+        VirtualUsbPipe* pipe = &link_->host_to_device;
+        writes->push_back(SubmitWrite(pipe, &msg, sizeof(msg)));
+        if (!payload.empty()) {
+            writes->push_back(SubmitWrite(pipe, payload.data(), payload.size()));
+        }
+        if (should_perform_zero_transfer(payload.size(), pipe->config().max_packet_size - 1)) {
+            writes->push_back(SubmitWrite(pipe, nullptr, 0));
+        }
+    }
+
+    // Read a packet written by the device, the way the host does it.
+    void ReadDevicePacket(amessage* msg, std::string* payload) {
+        VirtualUsbPipe* pipe = &link_->device_to_host;
+        TransferResult result = Read(pipe, msg, sizeof(*msg));
+        ASSERT_EQ(VirtualUsbStatus::kCompleted, result.status);
+        ASSERT_EQ(sizeof(*msg), result.length);
+
+        payload->resize(msg->data_length);
+        size_t offset = 0;
+        while (offset < payload->size()) {
+            result = Read(pipe, payload->data() + offset, payload->size() - offset);
+            ASSERT_EQ(VirtualUsbStatus::kCompleted, result.status);
+            offset += result.length;
+        }
+    }
+
+    bool WaitForPackets(size_t count, std::chrono::milliseconds timeout = 10s) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        return cv_.wait_for(lock, timeout, [this, count]() { return received_.size() >= count; });
+    }
+
+    std::unique_ptr<VirtualUsbLink> link_;
+    unique_fd control_;
+    std::vector<int> bound_fds_;
+    std::unique_ptr<Connection> connection_;
+    std::future<void> destroyed_;
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::vector<std::unique_ptr<apacket>> received_;
+};
+
+TEST_F(UsbFfsConnectionTest, write) {
+    Start();
+    const std::vector<size_t> sizes = {0, 1, 511, 512, 4096, 4097, 16384, 3 * 16384 + 7,
+                                       MAX_PAYLOAD};
+    for (size_t i = 0; i < sizes.size(); ++i) {
+        std::string payload = MakePayload(sizes[i], i);
+        auto packet = std::make_unique<apacket>();
+        packet->msg = MakeHeader(payload);
+        packet->payload = apacket::payload_type(payload.begin(), payload.end());
+        ASSERT_TRUE(connection_->Write(std::move(packet)));
+    }
+
+    for (size_t i = 0; i < sizes.size(); ++i) {
+        amessage msg;
+        std::string payload;
+        ASSERT_NO_FATAL_FAILURE(ReadDevicePacket(&msg, &payload));
+        ASSERT_EQ(static_cast<uint32_t>(A_WRTE), msg.command);
+        ASSERT_EQ(MakePayload(sizes[i], i), payload) << "packet " << i;
+    }
+}
+
+TEST_F(UsbFfsConnectionTest, read) {
+    Start();
+    const std::vector<size_t> sizes = {0, 1, 511, 512, 4096, 16383, 16384, 16385, MAX_PAYLOAD};
+    std::vector<std::string> payloads;
+    std::vector<amessage> headers;
+    for (size_t i = 0; i < sizes.size(); ++i) {
+        payloads.push_back(MakePayload(sizes[i], i));
+        headers.push_back(MakeHeader(payloads.back()));
+    }
+
+    std::vector<std::future<TransferResult>> writes;
+    for (size_t i = 0; i < sizes.size(); ++i) {
+        SubmitHostPacket(headers[i], payloads[i], &writes);
+    }
+    for (auto& write : writes) {
+        ASSERT_EQ(VirtualUsbStatus::kCompleted, write.get().status);
+    }
+
+    ASSERT_TRUE(WaitForPackets(sizes.size()));
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (size_t i = 0; i < sizes.size(); ++i) {
+        const apacket& packet = *received_[i];
+        ASSERT_EQ(headers[i].data_length, packet.msg.data_length);
+        ASSERT_EQ(payloads[i], std::string(packet.payload.begin(), packet.payload.end()))
+                << "packet " << i;
+    }
+}
+
+// Completions of reads that finish together are delivered in a random order, which must not
+// change the order that packets are handed up in.
+TEST_F(UsbFfsConnectionTest, reordered_read_completions) {
+    for (uint32_t seed = 0; seed < 8; ++seed) {
+        SCOPED_TRACE(seed);
+        Start({.reorder_completions = true, .seed = seed});
+
+        static constexpr size_t kPacketCount = 256;
+        std::vector<std::string> payloads;
+        std::vector<amessage> headers;
+        for (size_t i = 0; i < kPacketCount; ++i) {
+            payloads.push_back(MakePayload(i % 3 == 0 ? 0 : 1 + (i * 37) % 1000, i));
+            headers.push_back(MakeHeader(payloads.back()));
+        }
+
+        std::vector<std::future<TransferResult>> writes;
+        for (size_t i = 0; i < kPacketCount; ++i) {
+            SubmitHostPacket(headers[i], payloads[i], &writes);
+        }
+        for (auto& write : writes) {
+            ASSERT_EQ(VirtualUsbStatus::kCompleted, write.get().status);
+        }
+
+        ASSERT_TRUE(WaitForPackets(kPacketCount));
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (size_t i = 0; i < kPacketCount; ++i) {
+                const apacket& packet = *received_[i];
+                ASSERT_EQ(payloads[i], std::string(packet.payload.begin(), packet.payload.end()))
+                        << "packet " << i;
+            }
+            received_.clear();
+        }
+
+        TearDown();
+    }
+}
+
+// A payload that's a multiple of the max packet size only reaches the device as a packet of its
+// own if the host terminates it with a zero-length packet.
+TEST_F(UsbFfsConnectionTest, missing_zero_length_packet) {
+    Start();
+    std::string first = MakePayload(4096, 0);
+    std::string second = MakePayload(100, 1);
+    amessage first_header = MakeHeader(first);
+    amessage second_header = MakeHeader(second);
+
+    VirtualUsbPipe* pipe = &link_->host_to_device;
+    std::vector<std::future<TransferResult>> writes;
+    writes.push_back(SubmitWrite(pipe, &first_header, sizeof(first_header)));
+    writes.push_back(SubmitWrite(pipe, first.data(), first.size()));
+    writes.push_back(SubmitWrite(pipe, &second_header, sizeof(second_header)));
+    writes.push_back(SubmitWrite(pipe, second.data(), second.size()));
+    for (auto& write : writes) {
+        ASSERT_EQ(VirtualUsbStatus::kCompleted, write.get().status);
+    }
+
+    // The device reads the first payload and the second header as one transfer, which is more
+    // than the first packet said it had.
+    ASSERT_FALSE(WaitForPackets(1, 500ms));
+}
@@ -25,6 +25,7 @@
 #include <iostream>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <unordered_map>
 
 #include <openssl/md5.h>
@@ -37,6 +38,9 @@
 
 using namespace com::android::fastdeploy;
 
+// Below this, starting a thread costs more than the lookups it would take over.
+static constexpr int kMinEntriesPerThread = 1024;
+
 void DeployPatchGenerator::Log(const char* fmt, ...) {
     va_list ap;
     va_start(ap, fmt);
@@ -224,27 +228,50 @@ uint64_t DeployPatchGenerator::BuildIdenticalEntries(std::vector<SimpleEntry>& o
         deviceEntries[md5].push_back(&deviceEntry);
     }
 
-    uint64_t totalSize = 0;
-    for (const auto& localEntry : localApkMetadata.entries()) {
-        totalSize += localEntry.datasize();
-
-        md5Digest md5;
-        memcpy(&md5, localEntry.md5().data(), localEntry.md5().size());
+    // Each local entry is matched independently, so big APKs are split across threads.
+    const int localCount = localApkMetadata.entries_size();
+    const int threadCount = std::clamp<int>(localCount / kMinEntriesPerThread, 1,
+                                            std::max(1U, std::thread::hardware_concurrency()));
+    std::vector<std::vector<SimpleEntry>> matches(threadCount);
+    std::vector<uint64_t> sizes(threadCount);
+    auto match = [&](int thread) {
+        const int begin = int64_t(localCount) * thread / threadCount;
+        const int end = int64_t(localCount) * (thread + 1) / threadCount;
+        for (int i = begin; i < end; ++i) {
+            const APKEntry& localEntry = localApkMetadata.entries(i);
+            sizes[thread] += localEntry.datasize();
+
+            md5Digest md5;
+            memcpy(&md5, localEntry.md5().data(), localEntry.md5().size());
+
+            auto deviceEntriesIt = deviceEntries.find(md5);
+            if (deviceEntriesIt == deviceEntries.end()) {
+                continue;
+            }
 
-        auto deviceEntriesIt = deviceEntries.find(md5);
-        if (deviceEntriesIt == deviceEntries.end()) {
-            continue;
+            for (const auto* deviceEntry : deviceEntriesIt->second) {
+                if (deviceEntry->md5() == localEntry.md5()) {
+                    matches[thread].push_back({&localEntry, deviceEntry});
+                    break;
+                }
+            }
         }
+    };
+    std::vector<std::thread> threads;
+    for (int thread = 1; thread < threadCount; ++thread) {
+        threads.emplace_back(match, thread);
+    }
+    match(0);
+    for (auto& thread : threads) {
+        thread.join();
+    }
 
-        for (const auto* deviceEntry : deviceEntriesIt->second) {
-            if (deviceEntry->md5() == localEntry.md5()) {
-                SimpleEntry simpleEntry;
-                simpleEntry.localEntry = &localEntry;
-                simpleEntry.deviceEntry = deviceEntry;
-                APKEntryToLog(localEntry);
-                outIdenticalEntries.push_back(simpleEntry);
-                break;
-            }
+    uint64_t totalSize = 0;
+    for (int thread = 0; thread < threadCount; ++thread) {
+        totalSize += sizes[thread];
+        for (const auto& entry : matches[thread]) {
+            APKEntryToLog(*entry.localEntry);
+            outIdenticalEntries.push_back(entry);
         }
     }
     std::sort(outIdenticalEntries.begin(), outIdenticalEntries.end(),
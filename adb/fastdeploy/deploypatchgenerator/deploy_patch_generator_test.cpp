@@ -49,6 +49,37 @@ TEST(DeployPatchGeneratorTest, IdenticalFileEntries) {
     EXPECT_EQ(identicalCount, entriesCount);
 }
 
+// Enough entries for the matching to be split across threads.
+TEST(DeployPatchGeneratorTest, ManyEntries) {
+    APKMetaData local;
+    APKMetaData device;
+    for (int i = 0; i < 10000; ++i) {
+        std::string md5(16, '\0');
+        memcpy(md5.data(), &i, sizeof(i));
+
+        auto localEntry = local.add_entries();
+        localEntry->set_md5(md5);
+        localEntry->set_dataoffset(i * 100);
+        localEntry->set_datasize(100);
+        // The device has every other entry, in the opposite order.
+        if (i % 2 == 0) {
+            auto deviceEntry = device.add_entries();
+            deviceEntry->set_md5(md5);
+            deviceEntry->set_dataoffset((10000 - i) * 100);
+            deviceEntry->set_datasize(100);
+        }
+    }
+
+    TestPatchGenerator generator(false);
+    std::vector<DeployPatchGenerator::SimpleEntry> entries;
+    EXPECT_EQ(1000000U, generator.BuildIdenticalEntries(entries, local, device));
+    ASSERT_EQ(5000U, entries.size());
+    for (size_t i = 0; i < entries.size(); ++i) {
+        EXPECT_EQ(int64_t(i) * 200, entries[i].localEntry->dataoffset());
+        EXPECT_EQ(entries[i].localEntry->md5(), entries[i].deviceEntry->md5());
+    }
+}
+
 TEST(DeployPatchGeneratorTest, NoDeviceMetadata) {
     std::string apkPath = GetTestFile("rotating_cube-release.apk");
     // Get size of our test apk.
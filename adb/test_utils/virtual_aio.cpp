@@ -0,0 +1,229 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// A replacement for libasyncio that services iocbs with VirtualUsbPipes instead of the kernel, so
+// that UsbFfsConnection's AIO state machine can run without a USB gadget. Binaries that link this
+// file get these definitions instead of the ones in libasyncio.
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <unordered_map>
+
+#include <asyncio/AsyncIO.h>
+
+#include <android-base/logging.h>
+#include <android-base/thread_annotations.h>
+
+#include "test_utils/virtual_usb.h"
+
+namespace {
+
+struct VirtualAioContext {
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<io_event> events GUARDED_BY(mutex);
+
+    // Submitted iocbs that haven't completed yet, and the transfers servicing them.
+    std::unordered_map<iocb*, std::pair<test_utils::VirtualUsbPipe*, uint64_t>> pending
+            GUARDED_BY(mutex);
+
+    // Completions that have been queued but haven't signalled their eventfd yet.
+    size_t signalling GUARDED_BY(mutex) = 0;
+};
+
+std::mutex bindings_mutex;
+std::unordered_map<int, test_utils::VirtualUsbPipe*>& bindings() {
+    static auto& bindings = *new std::unordered_map<int, test_utils::VirtualUsbPipe*>();
+    return bindings;
+}
+
+VirtualAioContext* FromContext(aio_context_t ctx) {
+    return reinterpret_cast<VirtualAioContext*>(ctx);
+}
+
+void Complete(VirtualAioContext* context, iocb* control, test_utils::VirtualUsbStatus status,
+              size_t length) {
+    io_event event = {};
+    event.data = control->aio_data;
+    event.obj = reinterpret_cast<uintptr_t>(control);
+    switch (status) {
+        case test_utils::VirtualUsbStatus::kCompleted:
+            event.res = length;
+            break;
+        case test_utils::VirtualUsbStatus::kOverflow:
+            event.res = -EOVERFLOW;
+            break;
+        case test_utils::VirtualUsbStatus::kCancelled:
+            event.res = -ECANCELED;
+            break;
+    }
+
+    // Read the iocb before it's handed back: the owner is free to reuse it after that.
+    bool signal = control->aio_flags & IOCB_FLAG_RESFD;
+    int resfd = control->aio_resfd;
+    {
+        std::lock_guard<std::mutex> lock(context->mutex);
+        context->pending.erase(control);
+        context->events.push_back(event);
+        ++context->signalling;
+    }
+    context->cv.notify_all();
+
+    if (signal) {
+        uint64_t value = 1;
+        if (TEMP_FAILURE_RETRY(write(resfd, &value, sizeof(value))) == -1) {
+            PLOG(FATAL) << "failed to signal aio completion eventfd";
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(context->mutex);
+        --context->signalling;
+    }
+    context->cv.notify_all();
+}
+
+}  // namespace
+
+namespace test_utils {
+
+void VirtualAioBind(int fd, VirtualUsbPipe* pipe) {
+    std::lock_guard<std::mutex> lock(bindings_mutex);
+    bindings()[fd] = pipe;
+}
+
+void VirtualAioUnbind(int fd) {
+    std::lock_guard<std::mutex> lock(bindings_mutex);
+    bindings().erase(fd);
+}
+
+}  // namespace test_utils
+
+int io_setup(unsigned, aio_context_t* ctxp) {
+    *ctxp = reinterpret_cast<aio_context_t>(new VirtualAioContext());
+    return 0;
+}
+
+int io_destroy(aio_context_t ctx) {
+    VirtualAioContext* context = FromContext(ctx);
+    {
+        // Like the kernel, cancel everything that's still in flight and wait for it.
+        std::unique_lock<std::mutex> lock(context->mutex);
+        android::base::ScopedLockAssertion assume_locked(context->mutex);
+        for (auto& [control, transfer] : context->pending) {
+            transfer.first->Cancel(transfer.second);
+        }
+        context->cv.wait(lock, [context]() {
+            android::base::ScopedLockAssertion assume_locked(context->mutex);
+            return context->pending.empty() && context->signalling == 0;
+        });
+    }
+    delete context;
+    return 0;
+}
+
+int io_submit(aio_context_t ctx, long nr, iocb** iocbpp) {
+    VirtualAioContext* context = FromContext(ctx);
+    std::lock_guard<std::mutex> lock(context->mutex);
+    for (long i = 0; i < nr; ++i) {
+        iocb* control = iocbpp[i];
+        test_utils::VirtualUsbPipe* pipe;
+        {
+            std::lock_guard<std::mutex> bindings_lock(bindings_mutex);
+            auto it = bindings().find(control->aio_fildes);
+            if (it == bindings().end()) {
+                if (i == 0) {
+                    errno = EBADF;
+                    return -1;
+                }
+                return i;
+            }
+            pipe = it->second;
+        }
+
+        auto callback = [context, control](test_utils::VirtualUsbStatus status, size_t length) {
+            Complete(context, control, status, length);
+        };
+        void* buf = reinterpret_cast<void*>(control->aio_buf);
+        uint64_t id;
+        if (control->aio_lio_opcode == IOCB_CMD_PREAD) {
+            id = pipe->SubmitRead(buf, control->aio_nbytes, std::move(callback));
+        } else if (control->aio_lio_opcode == IOCB_CMD_PWRITE) {
+            id = pipe->SubmitWrite(buf, control->aio_nbytes, std::move(callback));
+        } else {
+            LOG(FATAL) << "unsupported aio opcode " << control->aio_lio_opcode;
+        }
+
+        // The completion can't run until we drop the lock, so this is always in time.
+        context->pending[control] = {pipe, id};
+    }
+    return nr;
+}
+
+int io_getevents(aio_context_t ctx, long min_nr, long max_nr, io_event* events,
+                 timespec* timeout) {
+    VirtualAioContext* context = FromContext(ctx);
+    std::unique_lock<std::mutex> lock(context->mutex);
+    android::base::ScopedLockAssertion assume_locked(context->mutex);
+    auto ready = [context, min_nr]() {
+        android::base::ScopedLockAssertion assume_locked(context->mutex);
+        return context->events.size() >= static_cast<size_t>(min_nr);
+    };
+    if (timeout) {
+        auto duration = std::chrono::seconds(timeout->tv_sec) +
+                        std::chrono::nanoseconds(timeout->tv_nsec);
+        context->cv.wait_for(lock, duration, ready);
+    } else {
+        context->cv.wait(lock, ready);
+    }
+
+    long count = 0;
+    while (count < max_nr && !context->events.empty()) {
+        events[count++] = context->events.front();
+        context->events.pop_front();
+    }
+    return count;
+}
+
+int io_cancel(aio_context_t ctx, iocb* control, io_event*) {
+    VirtualAioContext* context = FromContext(ctx);
+    std::lock_guard<std::mutex> lock(context->mutex);
+    auto it = context->pending.find(control);
+    if (it == context->pending.end() || !it->second.first->Cancel(it->second.second)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // As on current kernels, the cancellation is reported through io_getevents.
+    errno = EINPROGRESS;
+    return -1;
+}
+
+void io_prep(iocb* control, int fd, const void* buf, uint64_t count, int64_t offset, bool read) {
+    memset(control, 0, sizeof(*control));
+    control->aio_fildes = fd;
+    control->aio_lio_opcode = read ? IOCB_CMD_PREAD : IOCB_CMD_PWRITE;
+    control->aio_reqprio = 0;
+    control->aio_buf = reinterpret_cast<uintptr_t>(buf);
+    control->aio_nbytes = count;
+    control->aio_offset = offset;
+}
@@ -0,0 +1,241 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "test_utils/virtual_usb.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#include <android-base/logging.h>
+
+namespace test_utils {
+
+using Clock = std::chrono::steady_clock;
+
+VirtualUsbPipe::VirtualUsbPipe(VirtualUsbConfig config) : config_(config), rng_(config.seed) {
+    CHECK_NE(0U, config_.max_packet_size);
+    thread_ = std::thread([this]() { Run(); });
+}
+
+VirtualUsbPipe::~VirtualUsbPipe() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    cv_.notify_all();
+    thread_.join();
+}
+
+uint64_t VirtualUsbPipe::SubmitWrite(const void* data, size_t length, Callback callback) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    uint64_t id = next_id_++;
+
+    // Writes go out one after another, each taking the configured latency plus its length
+    // divided by the bandwidth before it shows up on the other end.
+    auto start = std::max(Clock::now(), wire_free_at_);
+    auto duration = std::chrono::duration_cast<Clock::duration>(config_.latency);
+    if (config_.bandwidth != 0) {
+        duration += std::chrono::duration_cast<Clock::duration>(
+                std::chrono::duration<double>(static_cast<double>(length) / config_.bandwidth));
+    }
+    wire_free_at_ = start + duration;
+
+    const char* p = static_cast<const char*>(data);
+    size_t offset = 0;
+    do {
+        size_t packet_size = std::min(config_.max_packet_size, length - offset);
+        packets_.push_back(Packet{
+                .write_id = id,
+                .data = packet_size == 0 ? std::string() : std::string(p + offset, packet_size),
+                .last = false,
+                .ready_at = wire_free_at_,
+        });
+        offset += packet_size;
+    } while (offset < length);
+
+    if (length != 0 && length % config_.max_packet_size == 0 && config_.auto_zlp) {
+        packets_.push_back(Packet{.write_id = id, .data = {}, .last = false,
+                                  .ready_at = wire_free_at_});
+    }
+    packets_.back().last = true;
+
+    writes_.push_back(Transfer{
+            .id = id,
+            .data = const_cast<char*>(p),
+            .length = length,
+            .transferred = 0,
+            .callback = std::move(callback),
+    });
+    ++stats_.writes;
+    cv_.notify_all();
+    return id;
+}
+
+uint64_t VirtualUsbPipe::SubmitRead(void* data, size_t length, Callback callback) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    uint64_t id = next_id_++;
+    reads_.push_back(Transfer{
+            .id = id,
+            .data = static_cast<char*>(data),
+            .length = length,
+            .transferred = 0,
+            .callback = std::move(callback),
+    });
+    ++stats_.reads;
+    cv_.notify_all();
+    return id;
+}
+
+bool VirtualUsbPipe::Cancel(uint64_t id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto match = [id](const Transfer& transfer) { return transfer.id == id; };
+
+    if (auto it = std::find_if(reads_.begin(), reads_.end(), match); it != reads_.end()) {
+        Transfer read = std::move(*it);
+        reads_.erase(it);
+        completions_.push_back([read = std::move(read)]() {
+            read.callback(VirtualUsbStatus::kCancelled, read.transferred);
+        });
+        cv_.notify_all();
+        return true;
+    }
+
+    if (auto it = std::find_if(writes_.begin(), writes_.end(), match); it != writes_.end()) {
+        Transfer write = std::move(*it);
+        writes_.erase(it);
+        packets_.erase(std::remove_if(packets_.begin(), packets_.end(),
+                                      [id](const Packet& packet) { return packet.write_id == id; }),
+                       packets_.end());
+        completions_.push_back([write = std::move(write)]() {
+            write.callback(VirtualUsbStatus::kCancelled, write.transferred);
+        });
+        cv_.notify_all();
+        return true;
+    }
+
+    return false;
+}
+
+VirtualUsbStats VirtualUsbPipe::stats() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stats_;
+}
+
+void VirtualUsbPipe::ConsumePacket(std::vector<Completion>* completions) {
+    Packet& packet = packets_.front();
+    CHECK(!writes_.empty());
+    Transfer& write = writes_.front();
+    CHECK_EQ(write.id, packet.write_id);
+
+    write.transferred += packet.data.size();
+    ++stats_.packets;
+    stats_.bytes += packet.data.size();
+    if (packet.data.empty()) {
+        ++stats_.zero_length_packets;
+    }
+
+    if (packet.last) {
+        completions->push_back([write = std::move(write)]() {
+            write.callback(VirtualUsbStatus::kCompleted, write.transferred);
+        });
+        writes_.pop_front();
+    }
+    packets_.pop_front();
+}
+
+std::optional<Clock::time_point> VirtualUsbPipe::MatchReads(
+        std::vector<Completion>* completions) {
+    auto now = Clock::now();
+    while (!reads_.empty() && !packets_.empty()) {
+        Packet& packet = packets_.front();
+        if (packet.ready_at > now) {
+            return packet.ready_at;
+        }
+
+        Transfer& read = reads_.front();
+        size_t packet_size = packet.data.size();
+        bool overflow = packet_size > read.length - read.transferred;
+        if (!overflow) {
+            memcpy(read.data + read.transferred, packet.data.data(), packet_size);
+            read.transferred += packet_size;
+        }
+        ConsumePacket(completions);
+
+        if (overflow || packet_size < config_.max_packet_size || read.transferred == read.length) {
+            auto status = overflow ? VirtualUsbStatus::kOverflow : VirtualUsbStatus::kCompleted;
+            completions->push_back([read = std::move(read), status]() {
+                read.callback(status, read.transferred);
+            });
+            reads_.pop_front();
+        }
+    }
+    return std::nullopt;
+}
+
+void VirtualUsbPipe::Run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        std::vector<Completion> completions = std::move(completions_);
+        completions_.clear();
+
+        if (stopping_) {
+            for (Transfer& transfer : reads_) {
+                completions.push_back([transfer = std::move(transfer)]() {
+                    transfer.callback(VirtualUsbStatus::kCancelled, transfer.transferred);
+                });
+            }
+            for (Transfer& transfer : writes_) {
+                completions.push_back([transfer = std::move(transfer)]() {
+                    transfer.callback(VirtualUsbStatus::kCancelled, transfer.transferred);
+                });
+            }
+            reads_.clear();
+            writes_.clear();
+            packets_.clear();
+            lock.unlock();
+            for (auto& completion : completions) {
+                completion();
+            }
+            return;
+        }
+
+        auto next_ready = MatchReads(&completions);
+        if (config_.reorder_completions) {
+            std::shuffle(completions.begin(), completions.end(), rng_);
+        }
+
+        if (!completions.empty()) {
+            lock.unlock();
+            for (auto& completion : completions) {
+                completion();
+            }
+            lock.lock();
+            continue;
+        }
+
+        if (next_ready) {
+            cv_.wait_until(lock, *next_ready);
+        } else {
+            cv_.wait(lock, [this]() {
+                android::base::ScopedLockAssertion assume_locked(mutex_);
+                return stopping_ || !completions_.empty() || (!reads_.empty() && !packets_.empty());
+            });
+        }
+    }
+}
+
+}  // namespace test_utils
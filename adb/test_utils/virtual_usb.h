@@ -0,0 +1,163 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <android-base/thread_annotations.h>
+
+namespace test_utils {
+
+// An in-process stand-in for one direction of a USB bulk endpoint pair, so that the USB
+// connection code can be exercised and benchmarked without hardware.
+//
+// Writes are split into packets of max_packet_size bytes. A read completes when it has been
+// filled, or when a short packet (including a zero-length packet) arrives. A packet that doesn't
+// fit in the remainder of a read fails the read with kOverflow, like a babble error on real
+// hardware. This means that transfer boundaries are only visible to the reader if the writer
+// ends them with a short packet, which is what the zero-length packet logic on both ends of the
+// adb USB protocol exists for.
+struct VirtualUsbConfig {
+    size_t max_packet_size = 512;
+
+    // Terminate writes that are a non-zero multiple of max_packet_size with a zero-length packet,
+    // like a gadget request with |zero| set.
+    bool auto_zlp = false;
+
+    // Time it takes before a write starts to arrive on the other end.
+    std::chrono::microseconds latency = std::chrono::microseconds(0);
+
+    // Bytes per second, or 0 for no limit.
+    uint64_t bandwidth = 0;
+
+    // Deliver the completions of reads that finish together in a random order, to exercise
+    // handling of out-of-order completions.
+    bool reorder_completions = false;
+    uint32_t seed = 0;
+};
+
+enum class VirtualUsbStatus {
+    kCompleted,
+    kOverflow,
+    kCancelled,
+};
+
+struct VirtualUsbStats {
+    uint64_t bytes = 0;
+    uint64_t packets = 0;
+    uint64_t zero_length_packets = 0;
+    uint64_t writes = 0;
+    uint64_t reads = 0;
+};
+
+class VirtualUsbPipe {
+  public:
+    // Called on the pipe's thread with the outcome of a transfer and the number of bytes moved.
+    using Callback = std::function<void(VirtualUsbStatus status, size_t length)>;
+
+    explicit VirtualUsbPipe(VirtualUsbConfig config = {});
+
+    // Cancels all outstanding transfers.
+    ~VirtualUsbPipe();
+
+    VirtualUsbPipe(const VirtualUsbPipe& copy) = delete;
+    VirtualUsbPipe& operator=(const VirtualUsbPipe& copy) = delete;
+
+    // Submit a transfer, returning an id that can be passed to Cancel. |data| must stay valid
+    // until the callback has been called.
+    uint64_t SubmitWrite(const void* data, size_t length, Callback callback);
+    uint64_t SubmitRead(void* data, size_t length, Callback callback);
+
+    // Cancel a transfer that hasn't completed yet. Returns false if it already completed.
+    bool Cancel(uint64_t id);
+
+    VirtualUsbStats stats();
+    const VirtualUsbConfig& config() const { return config_; }
+
+  private:
+    struct Transfer {
+        uint64_t id;
+        char* data;
+        size_t length;
+        size_t transferred;
+        Callback callback;
+    };
+
+    struct Packet {
+        uint64_t write_id;
+        std::string data;
+
+        // Whether this is the final packet of its write.
+        bool last;
+
+        std::chrono::steady_clock::time_point ready_at;
+    };
+
+    using Completion = std::function<void()>;
+
+    void Run();
+    void ConsumePacket(std::vector<Completion>* completions) REQUIRES(mutex_);
+
+    // Hand packets that have arrived to pending reads. Returns when the next packet will arrive,
+    // if there's a read waiting for it.
+    std::optional<std::chrono::steady_clock::time_point> MatchReads(
+            std::vector<Completion>* completions) REQUIRES(mutex_);
+
+    const VirtualUsbConfig config_;
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool stopping_ GUARDED_BY(mutex_) = false;
+    uint64_t next_id_ GUARDED_BY(mutex_) = 1;
+    std::deque<Transfer> writes_ GUARDED_BY(mutex_);
+    std::deque<Transfer> reads_ GUARDED_BY(mutex_);
+    std::deque<Packet> packets_ GUARDED_BY(mutex_);
+    std::vector<Completion> completions_ GUARDED_BY(mutex_);
+    std::chrono::steady_clock::time_point wire_free_at_ GUARDED_BY(mutex_);
+    std::mt19937 rng_ GUARDED_BY(mutex_);
+    VirtualUsbStats stats_ GUARDED_BY(mutex_);
+
+    std::thread thread_;
+};
+
+// A host-to-device and a device-to-host pipe.
+struct VirtualUsbLink {
+    explicit VirtualUsbLink(VirtualUsbConfig config = {})
+        : host_to_device(config), device_to_host(config) {}
+
+    VirtualUsbPipe host_to_device;
+    VirtualUsbPipe device_to_host;
+};
+
+// Route IOCB_CMD_PREAD/IOCB_CMD_PWRITE iocbs submitted against |fd| with io_submit to |pipe|.
+// Only available in binaries that link virtual_aio.cpp in place of libasyncio.
+void VirtualAioBind(int fd, VirtualUsbPipe* pipe);
+void VirtualAioUnbind(int fd);
+
+}  // namespace test_utils
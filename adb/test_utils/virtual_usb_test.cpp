@@ -0,0 +1,188 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "test_utils/virtual_usb.h"
+
+#include <chrono>
+#include <future>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "client/usb.h"
+
+using namespace std::chrono_literals;
+
+namespace test_utils {
+
+namespace {
+
+struct Result {
+    VirtualUsbStatus status;
+    size_t length;
+};
+
+std::future<Result> Submit(VirtualUsbPipe* pipe, bool read, void* data, size_t length,
+                           uint64_t* id = nullptr) {
+    auto promise = std::make_shared<std::promise<Result>>();
+    auto future = promise->get_future();
+    auto callback = [promise](VirtualUsbStatus status, size_t length) {
+        promise->set_value({status, length});
+    };
+    uint64_t transfer_id = read ? pipe->SubmitRead(data, length, std::move(callback))
+                                : pipe->SubmitWrite(data, length, std::move(callback));
+    if (id) {
+        *id = transfer_id;
+    }
+    return future;
+}
+
+std::future<Result> Write(VirtualUsbPipe* pipe, const std::string& data) {
+    return Submit(pipe, false, const_cast<char*>(data.data()), data.size());
+}
+
+std::future<Result> Read(VirtualUsbPipe* pipe, std::string* buf) {
+    return Submit(pipe, true, buf->data(), buf->size());
+}
+
+}  // namespace
+
+TEST(VirtualUsbPipe, short_packet_ends_read) {
+    VirtualUsbPipe pipe({.max_packet_size = 512});
+    std::string data(700, 'a');
+    std::string buf(4096, '\0');
+
+    auto read = Read(&pipe, &buf);
+    auto write = Write(&pipe, data);
+
+    Result result = read.get();
+    ASSERT_EQ(VirtualUsbStatus::kCompleted, result.status);
+    ASSERT_EQ(700U, result.length);
+    ASSERT_EQ(data, buf.substr(0, 700));
+    ASSERT_EQ(VirtualUsbStatus::kCompleted, write.get().status);
+
+    VirtualUsbStats stats = pipe.stats();
+    ASSERT_EQ(2U, stats.packets);
+    ASSERT_EQ(700U, stats.bytes);
+}
+
+TEST(VirtualUsbPipe, full_packets_run_together) {
+    VirtualUsbPipe pipe({.max_packet_size = 512});
+    std::string first(1024, 'a');
+    std::string second(10, 'b');
+    std::string buf(4096, '\0');
+
+    auto read = Read(&pipe, &buf);
+    auto first_write = Write(&pipe, first);
+    auto second_write = Write(&pipe, second);
+
+    // Without a zero-length packet, nothing tells the reader that the first write ended.
+    Result result = read.get();
+    ASSERT_EQ(VirtualUsbStatus::kCompleted, result.status);
+    ASSERT_EQ(1034U, result.length);
+    ASSERT_EQ(first + second, buf.substr(0, 1034));
+    ASSERT_EQ(VirtualUsbStatus::kCompleted, first_write.get().status);
+    ASSERT_EQ(VirtualUsbStatus::kCompleted, second_write.get().status);
+}
+
+TEST(VirtualUsbPipe, zero_length_packet) {
+    VirtualUsbPipe pipe({.max_packet_size = 512});
+    std::string data(1024, 'a');
+    std::string buf(4096, '\0');
+
+    auto read = Read(&pipe, &buf);
+    auto write = Write(&pipe, data);
+    ASSERT_TRUE(should_perform_zero_transfer(data.size(), pipe.config().max_packet_size - 1));
+    auto zlp = Write(&pipe, "");
+
+    Result result = read.get();
+    ASSERT_EQ(VirtualUsbStatus::kCompleted, result.status);
+    ASSERT_EQ(1024U, result.length);
+    ASSERT_EQ(VirtualUsbStatus::kCompleted, write.get().status);
+    ASSERT_EQ(VirtualUsbStatus::kCompleted, zlp.get().status);
+    ASSERT_EQ(1U, pipe.stats().zero_length_packets);
+}
+
+TEST(VirtualUsbPipe, auto_zlp) {
+    VirtualUsbPipe pipe({.max_packet_size = 512, .auto_zlp = true});
+    std::string data(512, 'a');
+    std::string buf(4096, '\0');
+
+    auto read = Read(&pipe, &buf);
+    auto write = Write(&pipe, data);
+    ASSERT_EQ(512U, read.get().length);
+    ASSERT_EQ(512U, write.get().length);
+    ASSERT_EQ(1U, pipe.stats().zero_length_packets);
+}
+
+TEST(VirtualUsbPipe, overflow) {
+    VirtualUsbPipe pipe({.max_packet_size = 512});
+    std::string data(100, 'a');
+    std::string buf(24, '\0');
+
+    auto read = Read(&pipe, &buf);
+    auto write = Write(&pipe, data);
+    ASSERT_EQ(VirtualUsbStatus::kOverflow, read.get().status);
+    ASSERT_EQ(VirtualUsbStatus::kCompleted, write.get().status);
+}
+
+TEST(VirtualUsbPipe, cancel) {
+    VirtualUsbPipe pipe;
+    std::string buf(4096, '\0');
+    uint64_t id;
+    auto read = Submit(&pipe, true, buf.data(), buf.size(), &id);
+    ASSERT_TRUE(pipe.Cancel(id));
+    ASSERT_EQ(VirtualUsbStatus::kCancelled, read.get().status);
+    ASSERT_FALSE(pipe.Cancel(id));
+
+    // Writes don't complete until they've been read, so they can be cancelled too.
+    std::string data(100, 'a');
+    auto write = Submit(&pipe, false, data.data(), data.size(), &id);
+    ASSERT_TRUE(pipe.Cancel(id));
+    ASSERT_EQ(VirtualUsbStatus::kCancelled, write.get().status);
+
+    auto pending = Read(&pipe, &buf);
+    ASSERT_EQ(std::future_status::timeout, pending.wait_for(10ms));
+}
+
+TEST(VirtualUsbPipe, cancelled_on_destruction) {
+    std::string buf(4096, '\0');
+    std::future<Result> read;
+    {
+        VirtualUsbPipe pipe;
+        read = Read(&pipe, &buf);
+    }
+    ASSERT_EQ(VirtualUsbStatus::kCancelled, read.get().status);
+}
+
+TEST(VirtualUsbPipe, latency_and_bandwidth) {
+    VirtualUsbPipe pipe({.latency = 20ms, .bandwidth = 1024 * 1024});
+    std::string data(64 * 1024, 'a');
+    std::string buf(data.size(), '\0');
+
+    auto start = std::chrono::steady_clock::now();
+    auto read = Read(&pipe, &buf);
+    auto write = Write(&pipe, data);
+    ASSERT_EQ(data.size(), read.get().length);
+    ASSERT_EQ(data.size(), write.get().length);
+
+    // 20ms of latency plus 62.5ms on the wire.
+    ASSERT_GE(std::chrono::steady_clock::now() - start, 80ms);
+}
+
+}  // namespace test_utils
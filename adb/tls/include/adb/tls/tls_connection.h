@@ -20,6 +20,8 @@
 #include <stdint.h>
 
 #include <functional>
+#include <initializer_list>
+#include <string>
 #include <string_view>
 #include <vector>
 
@@ -109,6 +111,19 @@ class TlsConnection {
     // Returns false otherwise.
     virtual bool WriteFully(std::string_view data) = 0;
 
+    // Writes |buffers| back to back, as if they were a single buffer. Returns
+    // true if everything was written, false otherwise. This is cheaper than a
+    // WriteFully per buffer, since the data is packed into as few TLS records
+    // as possible.
+    virtual bool WritevFully(std::initializer_list<std::string_view> buffers) = 0;
+
+    // Hands record encryption and decryption over to the kernel (kTLS), so
+    // that subsequent reads and writes go straight to the socket. This is only
+    // valid after |DoHandshake| succeeds. Returns false if the kernel, the
+    // socket type or the negotiated cipher suite doesn't support it, in which
+    // case the connection keeps working in userspace.
+    virtual bool EnableKernelTls() = 0;
+
     // Create a new TlsConnection instance. |cert| and |priv_key| cannot be
     // empty.
     static std::unique_ptr<TlsConnection> Create(Role role, std::string_view cert,
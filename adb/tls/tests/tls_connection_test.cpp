@@ -16,6 +16,10 @@
 
 #define LOG_TAG "AdbWifiTlsConnectionTest"
 
+#include <linux/tls.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
 #include <thread>
 
 #include <gtest/gtest.h>
@@ -251,6 +255,57 @@ class AdbWifiTlsConnectionTest : public testing::Test {
         }
     }
 
+    // Replace the socketpair with a loopback TCP connection, which is what kernel TLS needs.
+    void UseTcpConnection() {
+        unique_fd listener(socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0));
+        ASSERT_NE(-1, listener.get());
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t addr_len = sizeof(addr);
+        ASSERT_EQ(0, bind(listener.get(), reinterpret_cast<sockaddr*>(&addr), sizeof(addr)));
+        ASSERT_EQ(0, listen(listener.get(), 1));
+        ASSERT_EQ(0, getsockname(listener.get(), reinterpret_cast<sockaddr*>(&addr), &addr_len));
+
+        client_fd_.reset(socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0));
+        ASSERT_NE(-1, client_fd_.get());
+        ASSERT_EQ(0, connect(client_fd_.get(), reinterpret_cast<sockaddr*>(&addr), sizeof(addr)));
+        server_fd_.reset(accept4(listener.get(), nullptr, nullptr, SOCK_CLOEXEC));
+        ASSERT_NE(-1, server_fd_.get());
+
+        server_ = TlsConnection::Create(TlsConnection::Role::Server, kTestRsa2048ServerCert,
+                                        kTestRsa2048ServerPrivKey, server_fd_);
+        client_ = TlsConnection::Create(TlsConnection::Role::Client, kTestRsa2048ClientCert,
+                                        kTestRsa2048ClientPrivKey, client_fd_);
+    }
+
+    // Send adb-sized packets both ways, as a header and a payload each.
+    void ExchangePackets() {
+        std::string header(24, 'h');
+        std::vector<std::string> payloads = {"", "x", std::string(16384, 'y'),
+                                             std::string(1024 * 1024, 'z')};
+        client_thread_ = std::thread([&]() {
+            for (const std::string& payload : payloads) {
+                EXPECT_TRUE(client_->WritevFully({header, payload}));
+            }
+            for (const std::string& payload : payloads) {
+                std::string buf(header.size() + payload.size(), '\0');
+                ASSERT_TRUE(client_->ReadFully(buf.data(), buf.size()));
+                EXPECT_EQ(header + payload, buf);
+            }
+        });
+
+        for (const std::string& payload : payloads) {
+            std::string buf(header.size() + payload.size(), '\0');
+            ASSERT_TRUE(server_->ReadFully(buf.data(), buf.size()));
+            EXPECT_EQ(header + payload, buf);
+        }
+        for (const std::string& payload : payloads) {
+            EXPECT_TRUE(server_->WritevFully({header, payload}));
+        }
+        WaitForClientConnection();
+    }
+
     unique_fd server_fd_;
     unique_fd client_fd_;
     const std::vector<uint8_t> msg_{0xff, 0xab, 0x32, 0xf6, 0x12, 0x56};
@@ -604,5 +659,63 @@ TEST_F(AdbWifiTlsConnectionTest, SetClientCAList_AdbCAList) {
     ASSERT_EQ(server_->DoHandshake(), TlsError::Success);
     client_thread_.join();
 }
+
+TEST_F(AdbWifiTlsConnectionTest, WritevFully) {
+    server_->SetCertVerifyCallback([](X509_STORE_CTX*) { return 1; });
+    client_->SetCertVerifyCallback([](X509_STORE_CTX*) { return 1; });
+    StartClientHandshakeAsync(TlsError::Success);
+    ASSERT_EQ(server_->DoHandshake(), TlsError::Success);
+    WaitForClientConnection();
+
+    ExchangePackets();
+}
+
+TEST_F(AdbWifiTlsConnectionTest, EnableKernelTls_Unsupported) {
+    server_->SetCertVerifyCallback([](X509_STORE_CTX*) { return 1; });
+    client_->SetCertVerifyCallback([](X509_STORE_CTX*) { return 1; });
+    StartClientHandshakeAsync(TlsError::Success);
+    ASSERT_EQ(server_->DoHandshake(), TlsError::Success);
+    WaitForClientConnection();
+
+    // Kernel TLS only works on TCP sockets, so this has to fall back to userspace.
+    EXPECT_FALSE(server_->EnableKernelTls());
+    EXPECT_FALSE(client_->EnableKernelTls());
+    ExchangePackets();
+}
+
+// Whether the kernel has the keys to send on |fd|, i.e. whether EnableKernelTls() didn't fall back.
+static bool HasKernelTlsKeys(const unique_fd& fd) {
+    tls_crypto_info info;
+    socklen_t size = sizeof(info);
+    return getsockopt(fd.get(), SOL_TLS, TLS_TX, &info, &size) == 0;
+}
+
+TEST_F(AdbWifiTlsConnectionTest, EnableKernelTls) {
+    ASSERT_NO_FATAL_FAILURE(UseTcpConnection());
+    server_->SetCertVerifyCallback([](X509_STORE_CTX*) { return 1; });
+    client_->SetCertVerifyCallback([](X509_STORE_CTX*) { return 1; });
+    client_->EnableClientPostHandshakeCheck(true);
+
+    // The post-handshake check needs the server to speak first, and leaves that data buffered
+    // in BoringSSL on the client, so the client's receive side can only move to the kernel after
+    // it's been read.
+    std::string hello = "hello";
+    client_thread_ = std::thread([&]() {
+        ASSERT_EQ(client_->DoHandshake(), TlsError::Success);
+        bool offloaded = client_->EnableKernelTls();
+        EXPECT_EQ(offloaded, HasKernelTlsKeys(client_fd_));
+        std::string buf(hello.size(), '\0');
+        ASSERT_TRUE(client_->ReadFully(buf.data(), buf.size()));
+        EXPECT_EQ(hello, buf);
+    });
+    ASSERT_EQ(server_->DoHandshake(), TlsError::Success);
+    ASSERT_TRUE(server_->WriteFully(hello));
+    bool offloaded = server_->EnableKernelTls();
+    EXPECT_EQ(offloaded, HasKernelTlsKeys(server_fd_));
+    WaitForClientConnection();
+
+    // Whether or not the kernel supports it, the connection has to keep working.
+    ExchangePackets();
+}
 }  // namespace tls
 }  // namespace adb
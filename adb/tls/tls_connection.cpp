@@ -17,15 +17,37 @@
 #include "adb/tls/tls_connection.h"
 
 #include <limits.h>
+#include <string.h>
+
+#if defined(__linux__)
+#include <linux/tls.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#endif
 
 #include <algorithm>
 #include <vector>
 
 #include <android-base/logging.h>
+#include <android-base/macros.h>
 #include <android-base/strings.h>
+#include <openssl/digest.h>
 #include <openssl/err.h>
+#include <openssl/hkdf.h>
+#include <openssl/mem.h>
 #include <openssl/ssl.h>
 
+#if defined(__linux__)
+#if !defined(SOL_TLS)
+#define SOL_TLS 282
+#endif
+#if !defined(TCP_ULP)
+#define TCP_ULP 31
+#endif
+#endif
+
 using android::base::borrowed_fd;
 
 namespace adb {
@@ -35,6 +57,119 @@ namespace {
 
 static constexpr char kExportedKeyLabel[] = "adb-label";
 
+#if defined(__linux__)
+// TLS 1.3 cipher suites (RFC 8446, B.4) that the kernel can take over.
+static constexpr uint16_t kTlsAes128GcmSha256 = 0x1301;
+static constexpr uint16_t kTlsAes256GcmSha384 = 0x1302;
+static constexpr uint16_t kTlsChacha20Poly1305Sha256 = 0x1303;
+
+// TLS record content types (RFC 8446, 5.1).
+static constexpr unsigned char kRecordTypeAlert = 21;
+static constexpr unsigned char kRecordTypeHandshake = 22;
+static constexpr unsigned char kRecordTypeApplicationData = 23;
+
+// The crypto_info structures for the TLS_TX and TLS_RX socket options.
+union KernelCryptoInfo {
+    tls_crypto_info info;
+    tls12_crypto_info_aes_gcm_128 aes_gcm_128;
+    tls12_crypto_info_aes_gcm_256 aes_gcm_256;
+#if defined(TLS_CIPHER_CHACHA20_POLY1305)
+    tls12_crypto_info_chacha20_poly1305 chacha20_poly1305;
+#endif
+};
+
+// Derives a traffic key or IV from a TLS 1.3 traffic secret with HKDF-Expand-Label (RFC 8446,
+// 7.1 and 7.3).
+static bool HkdfExpandLabel(uint8_t* out, size_t out_len, const EVP_MD* digest,
+                            bssl::Span<const uint8_t> secret, std::string_view label) {
+    std::string full_label = "tls13 " + std::string(label);
+    std::vector<uint8_t> info;
+    info.push_back(out_len >> 8);
+    info.push_back(out_len & 0xff);
+    info.push_back(full_label.size());
+    info.insert(info.end(), full_label.begin(), full_label.end());
+    info.push_back(0);  // empty context
+    return HKDF_expand(out, out_len, digest, secret.data(), secret.size(), info.data(),
+                       info.size());
+}
+
+// Fills in |crypto| for the negotiated |cipher|, using a traffic secret and the sequence number
+// of the next record. Returns the size of the structure to pass to the kernel, or 0 if the
+// cipher isn't supported.
+static size_t MakeKernelCryptoInfo(KernelCryptoInfo* crypto, uint16_t cipher,
+                                   bssl::Span<const uint8_t> secret, uint64_t sequence) {
+    const EVP_MD* digest;
+    size_t key_len;
+    switch (cipher) {
+        case kTlsAes128GcmSha256:
+            digest = EVP_sha256();
+            key_len = TLS_CIPHER_AES_GCM_128_KEY_SIZE;
+            break;
+        case kTlsAes256GcmSha384:
+            digest = EVP_sha384();
+            key_len = TLS_CIPHER_AES_GCM_256_KEY_SIZE;
+            break;
+#if defined(TLS_CIPHER_CHACHA20_POLY1305)
+        case kTlsChacha20Poly1305Sha256:
+            digest = EVP_sha256();
+            key_len = TLS_CIPHER_CHACHA20_POLY1305_KEY_SIZE;
+            break;
+#endif
+        default:
+            return 0;
+    }
+
+    // All of these ciphers use a 12 byte nonce: the kernel's AES-GCM structures split it into a
+    // 4 byte salt and an 8 byte IV.
+    uint8_t key[32];
+    uint8_t iv[12];
+    uint8_t rec_seq[8];
+    if (!HkdfExpandLabel(key, key_len, digest, secret, "key") ||
+        !HkdfExpandLabel(iv, sizeof(iv), digest, secret, "iv")) {
+        return 0;
+    }
+    for (size_t i = 0; i < sizeof(rec_seq); ++i) {
+        rec_seq[i] = sequence >> (8 * (sizeof(rec_seq) - 1 - i));
+    }
+
+    size_t size = 0;
+    memset(crypto, 0, sizeof(*crypto));
+    crypto->info.version = TLS_1_3_VERSION;
+    switch (cipher) {
+        case kTlsAes128GcmSha256:
+            crypto->info.cipher_type = TLS_CIPHER_AES_GCM_128;
+            memcpy(crypto->aes_gcm_128.key, key, key_len);
+            memcpy(crypto->aes_gcm_128.salt, iv, TLS_CIPHER_AES_GCM_128_SALT_SIZE);
+            memcpy(crypto->aes_gcm_128.iv, iv + TLS_CIPHER_AES_GCM_128_SALT_SIZE,
+                   TLS_CIPHER_AES_GCM_128_IV_SIZE);
+            memcpy(crypto->aes_gcm_128.rec_seq, rec_seq, sizeof(rec_seq));
+            size = sizeof(crypto->aes_gcm_128);
+            break;
+        case kTlsAes256GcmSha384:
+            crypto->info.cipher_type = TLS_CIPHER_AES_GCM_256;
+            memcpy(crypto->aes_gcm_256.key, key, key_len);
+            memcpy(crypto->aes_gcm_256.salt, iv, TLS_CIPHER_AES_GCM_256_SALT_SIZE);
+            memcpy(crypto->aes_gcm_256.iv, iv + TLS_CIPHER_AES_GCM_256_SALT_SIZE,
+                   TLS_CIPHER_AES_GCM_256_IV_SIZE);
+            memcpy(crypto->aes_gcm_256.rec_seq, rec_seq, sizeof(rec_seq));
+            size = sizeof(crypto->aes_gcm_256);
+            break;
+#if defined(TLS_CIPHER_CHACHA20_POLY1305)
+        case kTlsChacha20Poly1305Sha256:
+            crypto->info.cipher_type = TLS_CIPHER_CHACHA20_POLY1305;
+            memcpy(crypto->chacha20_poly1305.key, key, key_len);
+            memcpy(crypto->chacha20_poly1305.iv, iv, TLS_CIPHER_CHACHA20_POLY1305_IV_SIZE);
+            memcpy(crypto->chacha20_poly1305.rec_seq, rec_seq, sizeof(rec_seq));
+            size = sizeof(crypto->chacha20_poly1305);
+            break;
+#endif
+    }
+    OPENSSL_cleanse(key, sizeof(key));
+    OPENSSL_cleanse(iv, sizeof(iv));
+    return size;
+}
+#endif
+
 class TlsConnectionImpl : public TlsConnection {
   public:
     explicit TlsConnectionImpl(Role role, std::string_view cert, std::string_view priv_key,
@@ -51,6 +186,8 @@ class TlsConnectionImpl : public TlsConnection {
     std::vector<uint8_t> ReadFully(size_t size) override;
     bool ReadFully(void* buf, size_t size) override;
     bool WriteFully(std::string_view data) override;
+    bool WritevFully(std::initializer_list<std::string_view> buffers) override;
+    bool EnableKernelTls() override;
 
     static bssl::UniquePtr<EVP_PKEY> EvpPkeyFromPEM(std::string_view pem);
     static bssl::UniquePtr<CRYPTO_BUFFER> BufferFromPEM(std::string_view pem);
@@ -65,6 +202,17 @@ class TlsConnectionImpl : public TlsConnection {
     TlsError GetFailureReason(int err);
     const char* RoleToString() { return role_ == Role::Server ? kServerRoleStr : kClientRoleStr; }
 
+#if defined(__linux__)
+    bool InstallKernelKeys(int direction);
+    void MaybeEnableKernelRx();
+    bool KernelReadFully(void* buf, size_t size);
+    // Checks post-handshake messages the kernel passed up, returning false for any that can't be
+    // ignored.
+    bool KernelSkipPostHandshake(const uint8_t* data, size_t size);
+    bool KernelWritevFully(std::initializer_list<std::string_view> buffers);
+    void KernelSendCloseNotify();
+#endif
+
     Role role_;
     bssl::UniquePtr<EVP_PKEY> priv_key_;
     bssl::UniquePtr<CRYPTO_BUFFER> cert_;
@@ -78,6 +226,18 @@ class TlsConnectionImpl : public TlsConnection {
     CertVerifyCb cert_verify_cb_;
     SetCertCb set_cert_cb_;
     borrowed_fd fd_;
+
+    // Whether the kernel has taken over each direction of the record layer. The receive side is
+    // only handed over once BoringSSL has no more buffered records to return.
+    bool kernel_tx_ = false;
+    bool kernel_rx_ = false;
+    bool kernel_rx_pending_ = false;
+    // The post-handshake message being skipped: its header, then how much of it is left.
+    std::string kernel_handshake_header_;
+    size_t kernel_handshake_left_ = 0;
+
+    // Scratch space for coalescing the start of WritevFully's buffers in userspace.
+    std::string write_buffer_;
     static constexpr char kClientRoleStr[] = "[client]: ";
     static constexpr char kServerRoleStr[] = "[server]: ";
 };  // TlsConnectionImpl
@@ -96,6 +256,13 @@ TlsConnectionImpl::TlsConnectionImpl(Role role, std::string_view cert, std::stri
 TlsConnectionImpl::~TlsConnectionImpl() {
     // shutdown the SSL connection
     if (ssl_ != nullptr) {
+#if defined(__linux__)
+        // BoringSSL's write state is stale once the kernel owns it.
+        if (kernel_tx_) {
+            KernelSendCloseNotify();
+            return;
+        }
+#endif
         SSL_shutdown(ssl_.get());
     }
 }
@@ -324,6 +491,13 @@ bool TlsConnectionImpl::ReadFully(void* buf, size_t size) {
         return false;
     }
 
+#if defined(__linux__)
+    MaybeEnableKernelRx();
+    if (kernel_rx_) {
+        return KernelReadFully(buf, size);
+    }
+#endif
+
     size_t offset = 0;
     uint8_t* p8 = reinterpret_cast<uint8_t*>(buf);
     while (size > 0) {
@@ -346,6 +520,12 @@ bool TlsConnectionImpl::WriteFully(std::string_view data) {
         return false;
     }
 
+#if defined(__linux__)
+    if (kernel_tx_) {
+        return KernelWritevFully({data});
+    }
+#endif
+
     while (!data.empty()) {
         int bytes_out = SSL_write(ssl_.get(), data.data(),
                                   std::min(static_cast<size_t>(INT_MAX), data.size()));
@@ -357,6 +537,242 @@ bool TlsConnectionImpl::WriteFully(std::string_view data) {
     }
     return true;
 }
+
+bool TlsConnectionImpl::WritevFully(std::initializer_list<std::string_view> buffers) {
+    if (!ssl_) {
+        LOG(ERROR) << RoleToString() << "Tried to write on a null SSL connection";
+        return false;
+    }
+
+#if defined(__linux__)
+    if (kernel_tx_) {
+        return KernelWritevFully(buffers);
+    }
+#endif
+
+    // Each SSL_write starts a new record, so small buffers, like a packet's header, are coalesced
+    // with the start of the next one up to a full record. The rest is written in place, so no
+    // more than a record is ever copied.
+    write_buffer_.clear();
+    for (std::string_view buffer : buffers) {
+        if (!write_buffer_.empty() || buffer.size() < SSL3_RT_MAX_PLAIN_LENGTH) {
+            const size_t size =
+                    std::min(buffer.size(), SSL3_RT_MAX_PLAIN_LENGTH - write_buffer_.size());
+            write_buffer_.append(buffer.substr(0, size));
+            buffer.remove_prefix(size);
+            if (write_buffer_.size() < SSL3_RT_MAX_PLAIN_LENGTH) {
+                continue;
+            }
+            if (!WriteFully(write_buffer_)) {
+                return false;
+            }
+            write_buffer_.clear();
+        }
+        if (!buffer.empty() && !WriteFully(buffer)) {
+            return false;
+        }
+    }
+    return write_buffer_.empty() || WriteFully(write_buffer_);
+}
+
+bool TlsConnectionImpl::EnableKernelTls() {
+#if defined(__linux__)
+    if (!ssl_) {
+        return false;
+    }
+    if (kernel_tx_) {
+        return true;
+    }
+
+    const SSL_CIPHER* cipher = SSL_get_current_cipher(ssl_.get());
+    KernelCryptoInfo probe;
+    bssl::Span<const uint8_t> read_secret, write_secret;
+    if (SSL_version(ssl_.get()) != TLS1_3_VERSION || cipher == nullptr ||
+        !bssl::SSL_get_traffic_secrets(ssl_.get(), &read_secret, &write_secret) ||
+        MakeKernelCryptoInfo(&probe, SSL_CIPHER_get_protocol_id(cipher), write_secret, 0) == 0) {
+        LOG(INFO) << RoleToString() << "kernel TLS doesn't support the negotiated cipher suite";
+        return false;
+    }
+    OPENSSL_cleanse(&probe, sizeof(probe));
+
+    // Attaching the TLS ULP doesn't change the socket's behavior until keys are installed.
+    if (setsockopt(fd_.get(), SOL_TCP, TCP_ULP, "tls", sizeof("tls")) != 0) {
+        PLOG(INFO) << RoleToString() << "kernel TLS unavailable";
+        return false;
+    }
+    if (!InstallKernelKeys(TLS_TX)) {
+        PLOG(WARNING) << RoleToString() << "failed to install kernel TLS transmit keys";
+        return false;
+    }
+
+    kernel_tx_ = true;
+    kernel_rx_pending_ = true;
+    MaybeEnableKernelRx();
+    LOG(INFO) << RoleToString() << "using kernel TLS";
+    return true;
+#else
+    return false;
+#endif
+}
+
+#if defined(__linux__)
+bool TlsConnectionImpl::InstallKernelKeys(int direction) {
+    bssl::Span<const uint8_t> read_secret, write_secret;
+    if (!bssl::SSL_get_traffic_secrets(ssl_.get(), &read_secret, &write_secret)) {
+        return false;
+    }
+
+    bool tx = direction == TLS_TX;
+    KernelCryptoInfo crypto;
+    uint16_t cipher = SSL_CIPHER_get_protocol_id(SSL_get_current_cipher(ssl_.get()));
+    size_t size = MakeKernelCryptoInfo(
+            &crypto, cipher, tx ? write_secret : read_secret,
+            tx ? SSL_get_write_sequence(ssl_.get()) : SSL_get_read_sequence(ssl_.get()));
+    int rc = size == 0 ? -1 : setsockopt(fd_.get(), SOL_TLS, direction, &crypto, size);
+    OPENSSL_cleanse(&crypto, sizeof(crypto));
+    return rc == 0;
+}
+
+void TlsConnectionImpl::MaybeEnableKernelRx() {
+    if (!kernel_rx_pending_ || SSL_has_pending(ssl_.get())) {
+        return;
+    }
+
+    kernel_rx_pending_ = false;
+    kernel_rx_ = InstallKernelKeys(TLS_RX);
+    if (!kernel_rx_) {
+        PLOG(WARNING) << RoleToString() << "failed to install kernel TLS receive keys";
+    }
+}
+
+bool TlsConnectionImpl::KernelReadFully(void* buf, size_t size) {
+    uint8_t* p = static_cast<uint8_t*>(buf);
+    while (size > 0) {
+        char control[CMSG_SPACE(sizeof(unsigned char))];
+        iovec iov = {.iov_base = p, .iov_len = size};
+        msghdr msg = {};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        ssize_t rc = TEMP_FAILURE_RETRY(recvmsg(fd_.get(), &msg, 0));
+        if (rc <= 0) {
+            PLOG(ERROR) << RoleToString() << "kernel TLS read failed";
+            return false;
+        }
+
+        // Records other than application data come with their type attached. Post-handshake
+        // messages are checked and dropped; alerts end the connection.
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg && cmsg->cmsg_level == SOL_TLS && cmsg->cmsg_type == TLS_GET_RECORD_TYPE) {
+            unsigned char record_type = *CMSG_DATA(cmsg);
+            if (record_type == kRecordTypeHandshake) {
+                if (!KernelSkipPostHandshake(p, rc)) {
+                    return false;
+                }
+                continue;
+            } else if (record_type != kRecordTypeApplicationData) {
+                LOG(ERROR) << RoleToString() << "received TLS record of type "
+                           << static_cast<int>(record_type)
+                           << (record_type == kRecordTypeAlert ? " (alert)" : "");
+                return false;
+            }
+        }
+
+        p += rc;
+        size -= rc;
+    }
+    return true;
+}
+
+bool TlsConnectionImpl::KernelSkipPostHandshake(const uint8_t* data, size_t size) {
+    while (size > 0) {
+        if (kernel_handshake_left_ > 0) {
+            const size_t skipped = std::min(kernel_handshake_left_, size);
+            kernel_handshake_left_ -= skipped;
+            data += skipped;
+            size -= skipped;
+            continue;
+        }
+
+        // A handshake message starts with a 1-byte type and a 3-byte length, which may be split
+        // across reads.
+        const size_t header_size = std::min(4 - kernel_handshake_header_.size(), size);
+        kernel_handshake_header_.append(reinterpret_cast<const char*>(data), header_size);
+        data += header_size;
+        size -= header_size;
+        if (kernel_handshake_header_.size() < 4) {
+            break;
+        }
+
+        // adb never resumes sessions, so session tickets can be ignored. Anything else, such as a
+        // KeyUpdate, needs a response from BoringSSL, which no longer has the keys.
+        const auto header = reinterpret_cast<const uint8_t*>(kernel_handshake_header_.data());
+        if (header[0] != SSL3_MT_NEW_SESSION_TICKET) {
+            LOG(ERROR) << RoleToString() << "received post-handshake message of type "
+                       << static_cast<int>(header[0]) << " with kernel TLS";
+            return false;
+        }
+        kernel_handshake_left_ = (header[1] << 16) | (header[2] << 8) | header[3];
+        kernel_handshake_header_.clear();
+    }
+    return true;
+}
+
+bool TlsConnectionImpl::KernelWritevFully(std::initializer_list<std::string_view> buffers) {
+    std::vector<iovec> iov;
+    iov.reserve(buffers.size());
+    for (std::string_view buffer : buffers) {
+        if (!buffer.empty()) {
+            iov.push_back({.iov_base = const_cast<char*>(buffer.data()),
+                           .iov_len = buffer.size()});
+        }
+    }
+
+    size_t index = 0;
+    while (index < iov.size()) {
+        ssize_t rc = TEMP_FAILURE_RETRY(writev(fd_.get(), &iov[index], iov.size() - index));
+        if (rc <= 0) {
+            PLOG(ERROR) << RoleToString() << "kernel TLS write failed";
+            return false;
+        }
+
+        size_t written = rc;
+        while (written > 0 && written >= iov[index].iov_len) {
+            written -= iov[index].iov_len;
+            ++index;
+        }
+        if (written > 0) {
+            iov[index].iov_base = static_cast<char*>(iov[index].iov_base) + written;
+            iov[index].iov_len -= written;
+        }
+    }
+    return true;
+}
+
+void TlsConnectionImpl::KernelSendCloseNotify() {
+    // A warning-level close_notify alert (RFC 8446, 6.1).
+    unsigned char alert[2] = {1, 0};
+    iovec iov = {.iov_base = alert, .iov_len = sizeof(alert)};
+
+    char control[CMSG_SPACE(sizeof(unsigned char))] = {};
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_TLS;
+    cmsg->cmsg_type = TLS_SET_RECORD_TYPE;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(unsigned char));
+    *CMSG_DATA(cmsg) = kRecordTypeAlert;
+
+    // Best effort: the peer may already be gone.
+    (void)TEMP_FAILURE_RETRY(sendmsg(fd_.get(), &msg, MSG_NOSIGNAL));
+}
+#endif
 }  // namespace
 
 // static
@@ -99,6 +99,8 @@ const char* const kFeatureDelayedAck = "delayed_ack";
 const char* const kFeatureOpenscreenMdns = "openscreen_mdns";
 const char* const kFeatureDeviceTrackerProtoFormat = "devicetracker_proto_format";
 const char* const kFeatureDevRaw = "devraw";
+const char* const kFeatureIncrementalZstd = "incremental_zstd";
+const char* const kFeatureFastDeployDump = "fastdeploy_dump";
 const char* const kFeatureAppInfo = "app_info";  // Add information to track-app (package name, ...)
 const char* const kFeatureServerStatus = "server_status";  // Ability to output server status
 
@@ -492,6 +494,17 @@ bool FdConnection::Read(apacket* packet) {
 }
 
 bool FdConnection::Write(apacket* packet) {
+    if (tls_ != nullptr) {
+        // Send the header and payload together, so that they share TLS records.
+        std::string_view header(reinterpret_cast<const char*>(&packet->msg), sizeof(packet->msg));
+        std::string_view payload(packet->payload.data(), packet->msg.data_length);
+        if (!tls_->WritevFully({header, payload})) {
+            D("remote local: write terminated");
+            return false;
+        }
+        return true;
+    }
+
     if (!DispatchWrite(&packet->msg, sizeof(packet->msg))) {
         D("remote local: write terminated");
         return false;
@@ -546,6 +559,8 @@ bool FdConnection::DoTlsHandshake(RSA* key, std::string* auth_key) {
 
     auto err = tls_->DoHandshake();
     if (err == TlsError::Success) {
+        // Move record encryption into the kernel where possible; otherwise, it stays in BoringSSL.
+        tls_->EnableKernelTls();
         return true;
     }
 
@@ -1212,6 +1227,7 @@ const FeatureSet& supported_features() {
             kFeatureDevRaw,
             kFeatureAppInfo,
             kFeatureServerStatus,
+            kFeatureFastDeployDump,
         };
         // clang-format on
 
@@ -1219,8 +1235,14 @@ const FeatureSet& supported_features() {
         if (delayed_ack_enabled()) {
             result.push_back(kFeatureDelayedAck);
         }
+        result.push_back(kFeatureIncrementalZstd);
 #else
         result.push_back(kFeatureDelayedAck);
+        // Incremental data blocks are handed to incfs still compressed, so zstd can only be used
+        // if the kernel can decompress it.
+        if (access("/sys/fs/incremental-fs/features/zstd", F_OK) == 0) {
+            result.push_back(kFeatureIncrementalZstd);
+        }
 #endif
         return result;
     }());
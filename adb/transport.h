@@ -103,6 +103,10 @@ extern const char* const kFeatureSendRecv2DryRunSend;
 extern const char* const kFeatureDelayedAck;
 // adbd supports `dev-raw` service
 extern const char* const kFeatureDevRaw;
+// The device accepts zstd-compressed blocks in incremental installs.
+extern const char* const kFeatureIncrementalZstd;
+// adbd supports the native `fastdeploy-dump` service.
+extern const char* const kFeatureFastDeployDump;
 
 TransportId NextTransportId();
 
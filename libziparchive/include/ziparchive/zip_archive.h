@@ -26,24 +26,32 @@
 #include <sys/types.h>
 
 #include <functional>
+#include <memory>
 #include <string>
 #include <string_view>
 #include <utility>
+#include <vector>
 
 #include "android-base/macros.h"
 #include "android-base/off64_t.h"
+#include "android-base/unique_fd.h"
+
+namespace android::base {
+class MappedFile;
+}
 
 /* Zip compression methods we support */
 enum {
   kCompressStored = 0,    // no compression
   kCompressDeflated = 8,  // standard deflate
+  kCompressZstd = 93,     // zstd, written only in builds with ZIPARCHIVE_WITH_ZSTD_WRITER
 };
 
 // This struct holds the common information of a zip entry other than the
 // the entry size. The compressed and uncompressed length will be handled
 // separately in the derived class.
 struct ZipEntryCommon {
-  // Compression method. One of kCompressStored or kCompressDeflated.
+  // Compression method. One of kCompressStored, kCompressDeflated or kCompressZstd.
   // See also `gpbf` for deflate subtypes.
   uint16_t method;
 
@@ -193,6 +201,10 @@ struct ZipArchiveInfo {
   off64_t archive_size;
   /** The number of entries in the archive. */
   uint64_t entry_count;
+  /** Where the central directory starts, relative to the start of the archive. */
+  off64_t central_directory_offset;
+  /** The size in bytes of the central directory, not including the EOCD record. */
+  uint64_t central_directory_size;
 };
 
 /**
@@ -270,6 +282,31 @@ void EndIteration(void* cookie);
  */
 int32_t ExtractEntryToFile(ZipArchiveHandle archive, const ZipEntry64* entry, int fd);
 
+/*
+ * Uncompress |entries| to files on up to |threads| threads, the biggest entries first.
+ *
+ * |open_output| is called with the index of each entry in |entries|, from any of the threads,
+ * and returns the file descriptor to write it to, or -1 to fail the batch. Each entry is written
+ * as by ExtractEntryToFile, at the current offset of its file descriptor, except that the file
+ * is preallocated and written with pwrite(2): the descriptor's offset isn't changed. The
+ * descriptor is closed once the entry has been written.
+ *
+ * Extraction stops at the first failure. Returns 0 on success and the first error otherwise.
+ */
+int32_t ExtractEntriesParallel(
+    ZipArchiveHandle archive, const std::vector<ZipEntry64>& entries,
+    const std::function<android::base::unique_fd(size_t index)>& open_output, size_t threads);
+
+/*
+ * Checks the CRC32 of every entry in |archive| on up to |threads| threads, by uncompressing them
+ * without writing them anywhere. Useful to reject a corrupt archive up front, before any of it
+ * has been used.
+ *
+ * Returns 0 if every entry is intact, kInconsistentInformation if one's CRC doesn't match, or
+ * another negative error code if one can't be read.
+ */
+int32_t VerifyArchiveCrcs(ZipArchiveHandle archive, size_t threads);
+
 /**
  * Uncompress a given zip entry to the memory region at |begin| and of
  * size |size|. This size is expected to be the same as the *declared*
@@ -389,8 +426,113 @@ class Reader : public LowLevelReader {
 int32_t ExtractToWriter(ZipArchiveHandle handle, const ZipEntry64* entry,
                         zip_archive::Writer* writer);
 
+/*
+ * The data of a stored entry, used in place rather than copied. See MapEntry().
+ */
+class EntryMapping {
+ public:
+  EntryMapping();
+  EntryMapping(EntryMapping&& other);
+  EntryMapping& operator=(EntryMapping&& other);
+  ~EntryMapping();
+
+  const uint8_t* data() const { return data_; }
+  size_t size() const { return size_; }
+
+ private:
+  friend int32_t MapEntry(ZipArchiveHandle archive, const ZipEntry64* entry,
+                          EntryMapping* mapping);
+
+  // The entry's pages, unless the whole archive is already in memory.
+  std::unique_ptr<android::base::MappedFile> map_;
+  const uint8_t* data_ = nullptr;
+  size_t size_ = 0;
+};
+
+/*
+ * Points |mapping| at the data of the stored entry |entry|, without copying it: into the archive
+ * itself if it's in memory, and otherwise into a new read-only mapping of the entry's pages,
+ * which stays valid after the archive is closed. The data of an entry aligned to the page size
+ * (see ZipWriter::StartAlignedEntry) starts a page, so nothing else of the archive is mapped.
+ * An empty entry's mapping is empty, with null data().
+ *
+ * Unlike the data that's extracted, the data isn't checked against its crc32 (see
+ * VerifyArchiveCrcs), and reading it from a file that's truncated meanwhile raises SIGBUS.
+ *
+ * Returns 0 on success, kMmapFailed if the entry is compressed or can't be mapped, and another
+ * negative value if it's outside the archive.
+ */
+int32_t MapEntry(ZipArchiveHandle archive, const ZipEntry64* entry, EntryMapping* mapping);
+
 #endif  // !ZIPARCHIVE_DISABLE_CALLBACK_API
 
+/*
+ * Matches entry names that start with a prefix and end with a suffix, either of which may be
+ * empty. Names are tested a word at a time, after the prefix and suffix are prepared once.
+ */
+class NameMatcher {
+ public:
+  explicit NameMatcher(std::string_view prefix = {}, std::string_view suffix = {});
+
+  bool Match(std::string_view name) const;
+
+ private:
+  std::string prefix_;
+  std::string suffix_;
+  // The first 8 bytes of |prefix_| and the last 8 of |suffix_|, as names of at least 8 bytes are
+  // loaded, with masks of the bytes that are compared.
+  uint64_t prefix_word_;
+  uint64_t prefix_mask_;
+  uint64_t suffix_word_;
+  uint64_t suffix_mask_;
+};
+
+/*
+ * What the central directory says about an entry. Nothing is read from the local file header,
+ * so FindEntry() is still needed to find the entry's data.
+ */
+struct CdEntry {
+  // Points into the archive's central directory, and is valid until the archive is closed.
+  std::string_view name;
+  uint64_t compressed_length;
+  uint64_t uncompressed_length;
+  uint64_t local_header_offset;
+  // As in ZipEntryCommon.
+  int32_t mod_time;
+  uint32_t crc32;
+  uint16_t method;
+};
+
+/*
+ * The position of NextEntries() in the central directory. Starts at the first entry.
+ */
+struct IterationCursor {
+  uint64_t entry = 0;
+  uint64_t offset = 0;
+};
+
+/*
+ * Fills in up to |max_entries| of |entries| with the entries of |archive| that |matcher| matches,
+ * in central directory order, starting from |cursor|, and sets |num_entries| to their number.
+ * Unlike Next(), this neither allocates nor reads any local file headers, and any number of
+ * cursors can iterate over the same archive at once.
+ *
+ * Returns 0 if any entries were filled in, kIterationEnd once no entries are left, and another
+ * negative value on failure.
+ */
+int32_t NextEntries(ZipArchiveHandle archive, IterationCursor* cursor, const NameMatcher& matcher,
+                    CdEntry* entries, size_t max_entries, size_t* num_entries);
+
+/*
+ * Asks the kernel to start reading the data of |entries| into memory, with as few requests as
+ * it takes, so that extracting or mapping them later doesn't wait for each in turn. Entries
+ * close together are read with one request, which may include what lies between them. This is
+ * only a hint: it doesn't wait for anything to be read, and it does nothing except on Linux.
+ *
+ * Returns 0 on success, or kInvalidOffset if an entry's data is outside the archive.
+ */
+int32_t PrefetchEntries(ZipArchiveHandle archive, const std::vector<ZipEntry64>& entries);
+
 /*
  * Inflates the first |compressed_length| bytes of |reader| to a given |writer|.
  * |crc_out| is set to the CRC32 checksum of the uncompressed data.
@@ -409,4 +551,38 @@ int32_t ExtractToWriter(ZipArchiveHandle handle, const ZipEntry64* entry,
 int32_t Inflate(const Reader& reader, const uint64_t compressed_length,
                 const uint64_t uncompressed_length, Writer* writer, uint64_t* crc_out);
 
+/*
+ * The decompressors used for deflated entries.
+ */
+enum class InflateBackend {
+  // zlib's streaming inflate(), through 32KiB buffers unless the reader and writer have their own.
+  kZlib,
+  // As kZlib, but entries whose output fits the writer's own buffer (see Writer::GetBuffer) are
+  // inflated with a single call, if the archive is in memory or their compressed data is at most
+  // 1MiB. The default.
+  kZlibOneShot,
+  // As kZlibOneShot, but with libdeflate's faster whole-buffer decoder. This is the default in
+  // builds with ZIPARCHIVE_WITH_LIBDEFLATE, and unavailable otherwise.
+  kLibdeflate,
+};
+
+/*
+ * Selects the decompressor for the whole process, e.g. to compare them.
+ *
+ * Returns false, leaving the current one in place, if |backend| isn't built in.
+ */
+bool SetInflateBackend(InflateBackend backend);
+InflateBackend GetInflateBackend();
+
+/*
+ * Saves an index of the central directory of each archive with 4096 or more entries in |dir|,
+ * which must already exist, and maps it instead of parsing the central directory again the next
+ * time the archive is opened, by any process. Indexes are keyed by the archive's size,
+ * modification time and central directory checksum, so a changed archive gets a new one, and
+ * nothing is ever removed from |dir|.
+ *
+ * An empty |dir| turns indexing off, the default. Archives opened from memory aren't indexed.
+ */
+void SetCentralDirectoryIndexDir(const std::string& dir);
+
 }  // namespace zip_archive
@@ -0,0 +1,116 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Forward-only access to Zip archives read from a pipe or socket.
+#pragma once
+
+#include <ziparchive/zip_archive.h>
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "android-base/macros.h"
+
+/**
+ * Reads a Zip archive's entries from their local file headers, in the order
+ * they're stored, as the archive is received. Nothing needs to be seekable,
+ * and nothing waits for the central directory at the end, so an archive coming
+ * from a pipe or socket can be inspected or extracted while it's received.
+ *
+ * Example:
+ *
+ *   ZipStreamReader reader(fd);
+ *   ZipEntry64 entry;
+ *   std::string name;
+ *   int32_t result;
+ *   while ((result = reader.Next(&entry, &name)) == 0) {
+ *     if (name == "AndroidManifest.xml") {
+ *       result = reader.ReadData(&entry, &writer);
+ *       ...
+ *     }
+ *   }
+ *   if (result != kIterationEnd) ...
+ *
+ * With only the local file headers to go on:
+ *  - Entries the central directory doesn't list (e.g. left over from an
+ *    update) are returned too.
+ *  - Stored entries whose sizes are in a data descriptor (as ZipWriter writes
+ *    them to a pipe) end at the first data descriptor whose crc32 and sizes
+ *    match the data before it, so that data descriptor needs its optional
+ *    signature.
+ *  - Iteration ends at the first record that isn't a local file header, which
+ *    is the central directory, or an APK's signing block.
+ */
+class ZipStreamReader {
+ public:
+  // Reads the archive from |fd|, which isn't closed.
+  explicit ZipStreamReader(int fd);
+
+  /**
+   * Reads the next entry's local file header, skipping the data of the entry
+   * before if ReadData() wasn't called. If the entry has a data descriptor,
+   * its sizes and crc32 are 0 until its data has been read.
+   *
+   * Returns 0 on success, kIterationEnd after the last entry, and another
+   * negative value on failure, including when the input ends first.
+   */
+  int32_t Next(ZipEntry64* entry, std::string* name);
+
+  /**
+   * Writes the data of the entry that Next() returned to |writer|, checking
+   * its crc32, or skips it if |writer| is nullptr. Fills in |entry|'s sizes and
+   * crc32 from its data descriptor, if it has one.
+   *
+   * Returns 0 on success and negative values on failure.
+   */
+  int32_t ReadData(ZipEntry64* entry, zip_archive::Writer* writer);
+
+  // The number of bytes of the archive consumed so far.
+  uint64_t position() const { return position_; }
+
+ private:
+  DISALLOW_COPY_AND_ASSIGN(ZipStreamReader);
+
+  // Makes sure |len| bytes are buffered. Returns false if the input ends first.
+  bool Fill(size_t len);
+  bool Read(void* buf, size_t len);
+  bool Skip(uint64_t len);
+  void Consume(size_t len);
+  size_t buffered() const { return end_ - begin_; }
+
+  // Writes |len| buffered bytes to |writer|, if any, and consumes them.
+  bool Append(zip_archive::Writer* writer, size_t len);
+
+  int32_t CopyStored(ZipEntry64* entry, zip_archive::Writer* writer, uint32_t* crc);
+  int32_t FindDataDescriptor(ZipEntry64* entry, zip_archive::Writer* writer, uint32_t* crc);
+  int32_t Inflate(ZipEntry64* entry, zip_archive::Writer* writer, uint32_t* crc);
+  int32_t ReadDataDescriptor(ZipEntry64* entry);
+
+  const int fd_;
+  std::vector<uint8_t> buffer_;
+  size_t begin_ = 0;
+  size_t end_ = 0;
+  uint64_t position_ = 0;
+
+  // Whether the data of the entry Next() last returned hasn't been read, and
+  // that entry.
+  bool data_pending_ = false;
+  ZipEntry64 current_;
+  // Whether |current_|'s data descriptor has 64-bit sizes.
+  bool current_zip64_ = false;
+};
@@ -30,6 +30,8 @@
 
 struct z_stream_s;
 typedef struct z_stream_s z_stream;
+struct ZSTD_CCtx_s;
+typedef struct ZSTD_CCtx_s ZSTD_CCtx;
 
 /**
  * Writes a Zip file via a stateful interface.
@@ -71,6 +73,15 @@ class ZipWriter {
      * be used.
      */
     kDefaultCompression = 0x04,
+
+    /**
+     * With kCompress, flag to compress the zip entry using zstd (method 93)
+     * rather than deflate, at zstd's default level (3) with kDefaultCompression
+     * and at 9 otherwise. Readers need zstd support to extract such entries, and
+     * StartEntry() fails unless libziparchive is built with
+     * ZIPARCHIVE_WITH_ZSTD_WRITER.
+     */
+    kZstd = 0x08,
   };
 
   /**
@@ -103,6 +114,24 @@ class ZipWriter {
   // Move assignment.
   ZipWriter& operator=(ZipWriter&& zipWriter) noexcept;
 
+  ~ZipWriter();
+
+  /**
+   * Compresses entries on |threads| threads instead of the caller's, for archives with many or
+   * large compressed entries. Entries are still written in the order they were added, but
+   * WriteBytes() copies their data, and FinishEntry() returns before they are written, so the
+   * file only has every entry after Finish(). Entries of 256KiB or more are split into blocks
+   * that are compressed in parallel too, as pigz does, unless |deterministic| is set: then the
+   * archive is byte-identical to the one written on a single thread. Entries over 8MiB aren't
+   * held in memory whole: once the entries before them are written, their blocks are compressed
+   * and written as their data arrives, with at most 8MiB queued, or without splitting, they're
+   * written on the caller's thread.
+   *
+   * Must be called before the first entry is started. |threads| of 1 or less turns this off.
+   * Returns 0 on success, and an error value < 0 on failure.
+   */
+  int32_t SetParallelCompression(size_t threads, bool deterministic);
+
   /**
    * Starts a new zip entry with the given path and flags.
    * Flags can be a bitwise OR of ZipWriter::kCompress and ZipWriter::kAlign.
@@ -167,11 +196,32 @@ class ZipWriter {
  private:
   DISALLOW_COPY_AND_ASSIGN(ZipWriter);
 
+  class ParallelCompressor;
+
   int32_t HandleError(int32_t error_code);
+  int32_t WriteLocalFileHeader(FileEntry* file, uint32_t alignment, bool use_data_descriptor);
+  int32_t WriteDataDescriptor(const FileEntry& file);
+  // Writes the entries ParallelCompressor has finished, in order. Waits for all
+  // of them if |wait|, and otherwise only while too much data is queued.
+  int32_t WritePendingEntries(bool wait);
+  // Stops buffering the current entry for ParallelCompressor, and writes it and
+  // the rest of its data on the caller's thread.
+  int32_t WriteCurrentEntrySerially();
+  // Stops buffering the current entry for ParallelCompressor, and writes its
+  // header so that its blocks can be compressed and written as they arrive.
+  int32_t StreamCurrentEntry();
+  // Queues the current streamed entry's whole blocks, or all of its data if
+  // |finish|, and writes the compressed blocks in order. Waits for all of them
+  // if |finish|, and otherwise only while too many are queued.
+  int32_t QueueStreamedBlocks(bool finish);
+  int32_t WriteEntryBytes(const void* data, uint32_t len);
   int32_t PrepareDeflate(int compression_level);
   int32_t StoreBytes(FileEntry* file, const void* data, uint32_t len);
   int32_t CompressBytes(FileEntry* file, const void* data, uint32_t len);
   int32_t FlushCompressedBytes(FileEntry* file);
+  int32_t PrepareZstd(int compression_level);
+  int32_t ZstdCompressBytes(FileEntry* file, const void* data, uint32_t len);
+  int32_t FlushZstdBytes(FileEntry* file);
   bool ShouldUseDataDescriptor() const;
 
   enum class State {
@@ -189,7 +239,11 @@ class ZipWriter {
   FileEntry current_file_entry_;
 
   std::unique_ptr<z_stream, void (*)(z_stream*)> z_stream_;
+  // Kept from one zstd entry to the next, since it's costly to set up.
+  std::unique_ptr<ZSTD_CCtx, void (*)(ZSTD_CCtx*)> zstd_cctx_;
   std::vector<uint8_t> buffer_;
 
+  std::unique_ptr<ParallelCompressor> parallel_;
+
   FRIEND_TEST(zipwriter, WriteToUnseekableFile);
 };
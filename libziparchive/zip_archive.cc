@@ -28,6 +28,7 @@
 #include <limits.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -37,9 +38,14 @@
 #include <sys/mman.h>
 #endif
 
+#include <algorithm>
+#include <atomic>
 #include <memory>
+#include <mutex>
+#include <numeric>
 #include <optional>
 #include <span>
+#include <thread>
 #include <vector>
 
 #if defined(__APPLE__)
@@ -51,24 +57,36 @@
 #endif
 
 #include <android-base/file.h>
+#include <android-base/hex.h>
 #include <android-base/logging.h>
 #include <android-base/macros.h>  // TEMP_FAILURE_RETRY may or may not be in unistd
 #include <android-base/mapped_file.h>
 #include <android-base/memory.h>
+#include <android-base/stringprintf.h>
 #include <android-base/strings.h>
+#include <android-base/unique_fd.h>
 #include <android-base/utf8.h>
 #include <log/log.h>
+#include <openssl/sha.h>
 
 #include "entry_name_utils-inl.h"
 #include "incfs_support/signal_handling.h"
 #include "incfs_support/util.h"
 #include "zip_archive_common.h"
 #include "zip_archive_private.h"
+#include "zip_crc32.h"
 #include "zlib.h"
 
+#if defined(ZIPARCHIVE_WITH_LIBDEFLATE)
+#include <libdeflate.h>
+#endif
+
+#include <zstd.h>
+
 // Used to turn on crc checks - verify that the content CRC matches the values
-// specified in the local file header and the central directory.
-static constexpr bool kCrcChecksEnabled = false;
+// specified in the local file header and the central directory. ZipCrc32 keeps
+// up with inflate, so this is cheap enough to leave on.
+static constexpr bool kCrcChecksEnabled = true;
 
 // The maximum number of bytes to scan backwards for the EOCD start.
 static const uint32_t kMaxEOCDSearch = kMaxCommentLen + sizeof(EocdRecord);
@@ -540,11 +558,12 @@ static ZipError ParseZip64ExtendedInfoInExtraField(
 
 /*
  * Parses the Zip archive's Central Directory.  Allocates and populates the
- * hash table.
+ * hash table in |entry_map|.
  *
  * Returns 0 on success.
  */
-static ZipError ParseZipArchive(ZipArchive* archive) {
+static ZipError ParseZipArchive(const ZipArchive* archive,
+                                std::unique_ptr<CdEntryMapInterface>* entry_map) {
   SCOPED_SIGBUS_HANDLER(return kIoError);
 
   maybePrefetch(archive->central_directory.GetBasePtr(), archive->central_directory.GetMapLength());
@@ -627,8 +646,8 @@ static ZipError ParseZipArchive(ZipArchive* archive) {
   }
 
   /* Create memory efficient entry map */
-  archive->cd_entry_map = CdEntryMapInterface::Create(num_entries, cd_length, max_file_name_length);
-  if (archive->cd_entry_map == nullptr) {
+  *entry_map = CdEntryMapInterface::Create(num_entries, cd_length, max_file_name_length);
+  if (*entry_map == nullptr) {
     return kAllocationFailed;
   }
 
@@ -638,7 +657,7 @@ static ZipError ParseZipArchive(ZipArchive* archive) {
     auto cdr = reinterpret_cast<const CentralDirectoryRecord*>(ptr);
     std::string_view entry_name{reinterpret_cast<const char*>(ptr + sizeof(*cdr)),
                                 cdr->file_name_length};
-    auto add_result = archive->cd_entry_map->AddToMap(entry_name, cd_ptr);
+    auto add_result = (*entry_map)->AddToMap(entry_name, cd_ptr);
     if (add_result != 0) {
       ALOGW("Zip: Error adding entry to hash table %d", add_result);
       return add_result;
@@ -646,6 +665,12 @@ static ZipError ParseZipArchive(ZipArchive* archive) {
     ptr += sizeof(*cdr) + cdr->file_name_length + cdr->extra_field_length + cdr->comment_length;
   }
 
+  ALOGV("+++ zip good scan %" PRIu64 " entries", num_entries);
+
+  return kSuccess;
+}
+
+static ZipError CheckFirstLocalFileHeader(ZipArchive* archive) {
   uint32_t lfh_start_bytes_buf;
   auto lfh_start_bytes = reinterpret_cast<const uint32_t*>(archive->mapped_zip.ReadAtOffset(
       reinterpret_cast<uint8_t*>(&lfh_start_bytes_buf), sizeof(lfh_start_bytes_buf), 0));
@@ -662,14 +687,167 @@ static ZipError ParseZipArchive(ZipArchive* archive) {
     return kInvalidFile;
   }
 
-  ALOGV("+++ zip good scan %" PRIu64 " entries", num_entries);
-
   return kSuccess;
 }
 
+// Archives with fewer entries are parsed quickly enough without an index.
+static constexpr uint64_t kMinIndexedEntries = 4096;
+
+static constexpr uint32_t kCdIndexMagic = 0x78646463;  // "cddx"
+static constexpr uint32_t kCdIndexVersion = 2;
+
+// The start of a central directory index file, followed by a serialized
+// CdEntryMapIndex. The index is used if the whole header matches. Loading it
+// skips validating the central directory, so the header has a cryptographic
+// hash of it: anything weaker could be matched by a crafted one.
+struct CdIndexHeader {
+  uint32_t magic;
+  uint32_t version;
+  int64_t archive_offset;
+  int64_t archive_length;
+  int64_t archive_mtime;
+  int64_t cd_offset;
+  uint64_t cd_length;
+  uint64_t num_entries;
+  uint8_t cd_sha256[SHA256_DIGEST_LENGTH];
+};
+
+// The serialized table is mapped in place, so it has to stay aligned.
+static_assert(sizeof(CdIndexHeader) % 8 == 0);
+
+static std::mutex g_cd_index_dir_lock;
+static std::string g_cd_index_dir;
+
+static std::string GetCdIndexDir() {
+  std::lock_guard<std::mutex> lock(g_cd_index_dir_lock);
+  return g_cd_index_dir;
+}
+
+/*
+ * Returns the path of the index of |archive|'s central directory in |dir| and
+ * fills in the |header| it should have, or returns an empty string if the
+ * archive shouldn't be indexed.
+ */
+static std::string GetCdIndexPath(const std::string& dir, ZipArchive* archive,
+                                  CdIndexHeader* header) {
+  const int fd = archive->mapped_zip.GetFileDescriptor();
+  const size_t cd_length = archive->central_directory.GetMapLength();
+  if (fd < 0 || archive->num_entries < kMinIndexedEntries || cd_length > UINT32_MAX) {
+    return {};
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    return {};
+  }
+
+  SCOPED_SIGBUS_HANDLER(return {});
+  // The hash reads the whole central directory, much as parsing it would.
+  maybePrefetch(archive->central_directory.GetBasePtr(), cd_length);
+  *header = {
+      .magic = kCdIndexMagic,
+      .version = kCdIndexVersion,
+      .archive_offset = archive->mapped_zip.GetFileOffset(),
+      .archive_length = archive->mapped_zip.GetFileLength(),
+      .archive_mtime = static_cast<int64_t>(st.st_mtime),
+      .cd_offset = archive->directory_offset,
+      .cd_length = cd_length,
+      .num_entries = archive->num_entries,
+  };
+  SHA256(archive->central_directory.GetBasePtr(), cd_length, header->cd_sha256);
+  return android::base::StringPrintf("%s/%" PRIx64 "-%" PRIx64 "-%" PRIx64 "-%s.cdidx", dir.c_str(),
+                                     static_cast<uint64_t>(header->archive_length),
+                                     static_cast<uint64_t>(header->archive_offset),
+                                     static_cast<uint64_t>(header->archive_mtime),
+                                     android::base::HexString(header->cd_sha256, 8).c_str());
+}
+
+static bool LoadCdIndex(const std::string& path, const CdIndexHeader& header,
+                        ZipArchive* archive) {
+  android::base::unique_fd fd(
+      ::android::base::utf8::open(path.c_str(), O_RDONLY | O_BINARY | O_CLOEXEC, 0));
+  if (fd == -1) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd.get(), &st) != 0 || st.st_size < static_cast<off64_t>(sizeof(header))) {
+    return false;
+  }
+  auto map = android::base::MappedFile::FromFd(fd, 0, static_cast<size_t>(st.st_size), PROT_READ);
+  if (map == nullptr) {
+    return false;
+  }
+  const auto data = reinterpret_cast<const uint8_t*>(map->data());
+  const size_t size = map->size();
+  if (memcmp(data, &header, sizeof(header)) != 0) {
+    ALOGW("Zip: Ignoring stale central directory index %s", path.c_str());
+    return false;
+  }
+  // A damaged index is dropped for the map it should have held. The archive
+  // outlives its map, and parsing doesn't change it.
+  auto rebuild = [archive]() -> std::unique_ptr<CdEntryMapInterface> {
+    std::unique_ptr<CdEntryMapInterface> entry_map;
+    if (ParseZipArchive(archive, &entry_map) != kSuccess) {
+      return nullptr;
+    }
+    return entry_map;
+  };
+  auto index = CdEntryMapIndex::Create(std::move(map), data + sizeof(header),
+                                       size - sizeof(header), header.cd_length, rebuild);
+  if (index == nullptr) {
+    return false;
+  }
+  ALOGV("+++ zip loaded central directory index %s", path.c_str());
+  archive->cd_entry_map = std::move(index);
+  return true;
+}
+
+static void SaveCdIndex(const std::string& path, const CdIndexHeader& header,
+                        ZipArchive* archive) {
+  std::string contents(reinterpret_cast<const char*>(&header), sizeof(header));
+  contents += CdEntryMapIndex::Serialize(archive->cd_entry_map.get(), archive->num_entries,
+                                         archive->central_directory.GetBasePtr());
+
+  // Other threads and processes may be saving the same index. They all write
+  // the same thing, so it doesn't matter which rename wins.
+  static std::atomic<uint32_t> temp_counter;
+  const std::string temp_path = android::base::StringPrintf(
+      "%s.%d.%" PRIu32 ".tmp", path.c_str(), getpid(), temp_counter++);
+  if (!android::base::WriteStringToFile(contents, temp_path)) {
+    ALOGW("Zip: Unable to write %s: %s", temp_path.c_str(), strerror(errno));
+    ::android::base::utf8::unlink(temp_path.c_str());
+    return;
+  }
+  if (rename(temp_path.c_str(), path.c_str()) != 0) {
+    ALOGW("Zip: Unable to save %s: %s", path.c_str(), strerror(errno));
+    ::android::base::utf8::unlink(temp_path.c_str());
+  }
+}
+
 static int32_t OpenArchiveInternal(ZipArchive* archive, const char* debug_file_name) {
   int32_t result = MapCentralDirectory(debug_file_name, archive);
-  return result != kSuccess ? result : ParseZipArchive(archive);
+  if (result != kSuccess) {
+    return result;
+  }
+
+  std::string index_path;
+  CdIndexHeader index_header = {};
+  if (const std::string index_dir = GetCdIndexDir(); !index_dir.empty()) {
+    index_path = GetCdIndexPath(index_dir, archive, &index_header);
+  }
+  if (!index_path.empty() && LoadCdIndex(index_path, index_header, archive)) {
+    // The index was saved after the central directory it matches was
+    // verified, so all that's left is the check that doesn't depend on it.
+    return CheckFirstLocalFileHeader(archive);
+  }
+
+  result = ParseZipArchive(archive, &archive->cd_entry_map);
+  if (result == kSuccess) {
+    result = CheckFirstLocalFileHeader(archive);
+  }
+  if (result == kSuccess && !index_path.empty()) {
+    SaveCdIndex(index_path, index_header, archive);
+  }
+  return result;
 }
 
 int32_t OpenArchiveFd(int fd, const char* debug_file_name, ZipArchiveHandle* handle,
@@ -721,6 +899,8 @@ ZipArchiveInfo GetArchiveInfo(ZipArchiveHandle archive) {
   ZipArchiveInfo result;
   result.archive_size = archive->mapped_zip.GetFileLength();
   result.entry_count = archive->num_entries;
+  result.central_directory_offset = archive->directory_offset;
+  result.central_directory_size = archive->central_directory.GetMapLength();
   return result;
 }
 
@@ -1062,10 +1242,8 @@ int32_t StartIteration(ZipArchiveHandle archive, void** cookie_ptr,
   if (optional_prefix.empty() && optional_suffix.empty()) {
     return StartIteration(archive, cookie_ptr, std::function<bool(std::string_view)>{});
   }
-  auto matcher = [prefix = std::string(optional_prefix),
-                  suffix = std::string(optional_suffix)](std::string_view name) mutable {
-    return android::base::StartsWith(name, prefix) && android::base::EndsWith(name, suffix);
-  };
+  auto matcher = [name_matcher = zip_archive::NameMatcher(optional_prefix, optional_suffix)](
+                     std::string_view name) { return name_matcher.Match(name); };
   return StartIteration(archive, cookie_ptr, std::move(matcher));
 }
 
@@ -1248,8 +1426,12 @@ class FileWriter final : public zip_archive::Writer {
   // is truncated to the correct length (no truncation if |fd| references a
   // block device).
   //
+  // If |positional| is set, the data is written with pwrite(2) and the file descriptor's offset
+  // is left where it is, so that other threads can write other entries to it.
+  //
   // Returns a valid FileWriter on success, |nullopt| if an error occurred.
-  static std::optional<FileWriter> Create(int fd, const ZipEntry64* entry) {
+  static std::optional<FileWriter> Create(int fd, const ZipEntry64* entry,
+                                          bool positional = false) {
     const uint64_t declared_length = entry->uncompressed_length;
     const off64_t current_offset = lseek64(fd, 0, SEEK_CUR);
     if (current_offset == -1) {
@@ -1298,7 +1480,8 @@ class FileWriter final : public zip_archive::Writer {
       }
     }
 
-    return std::make_optional<FileWriter>(fd, declared_length);
+    return std::make_optional<FileWriter>(fd, declared_length,
+                                          positional ? current_offset : off64_t(-1));
   }
 
   virtual bool Append(uint8_t* buf, size_t buf_size) override {
@@ -1308,7 +1491,11 @@ class FileWriter final : public zip_archive::Writer {
       return false;
     }
 
-    const bool result = android::base::WriteFully(fd_, buf, buf_size);
+    const bool result =
+        write_offset_ == -1
+            ? android::base::WriteFully(fd_, buf, buf_size)
+            : android::base::WriteFullyAtOffset(fd_, buf, buf_size,
+                                                write_offset_ + off64_t(total_bytes_written_));
     if (result) {
       total_bytes_written_ += buf_size;
     } else {
@@ -1318,10 +1505,12 @@ class FileWriter final : public zip_archive::Writer {
     return result;
   }
 
-  explicit FileWriter(const int fd = -1, const uint64_t declared_length = 0)
+  explicit FileWriter(const int fd = -1, const uint64_t declared_length = 0,
+                      const off64_t write_offset = -1)
       : Writer(),
         fd_(fd),
         declared_length_(static_cast<size_t>(declared_length)),
+        write_offset_(write_offset),
         total_bytes_written_(0) {
     CHECK_LE(declared_length, SIZE_MAX);
   }
@@ -1329,6 +1518,8 @@ class FileWriter final : public zip_archive::Writer {
  private:
   int fd_;
   const size_t declared_length_;
+  // Where pwrite(2) starts writing, or -1 to write(2) at the file descriptor's offset.
+  const off64_t write_offset_;
   size_t total_bytes_written_;
 };
 
@@ -1380,12 +1571,132 @@ bool Reader::IsZeroCopy() const {
   return false;
 }
 
+#if defined(ZIPARCHIVE_WITH_LIBDEFLATE)
+static std::atomic<InflateBackend> g_inflate_backend = InflateBackend::kLibdeflate;
+#else
+static std::atomic<InflateBackend> g_inflate_backend = InflateBackend::kZlibOneShot;
+#endif
+
+bool SetInflateBackend(InflateBackend backend) {
+#if !defined(ZIPARCHIVE_WITH_LIBDEFLATE)
+  if (backend == InflateBackend::kLibdeflate) return false;
+#endif
+  g_inflate_backend = backend;
+  return true;
+}
+
+InflateBackend GetInflateBackend() {
+  return g_inflate_backend;
+}
+
+void SetCentralDirectoryIndexDir(const std::string& dir) {
+  std::lock_guard<std::mutex> lock(g_cd_index_dir_lock);
+  g_cd_index_dir = dir;
+}
+
 }  // namespace zip_archive
 
 static std::span<uint8_t> bufferToSpan(zip_archive::Writer::Buffer buf) {
   return std::span<uint8_t>(buf.first, buf.second);
 }
 
+#if defined(ZIPARCHIVE_WITH_LIBDEFLATE)
+static int32_t libdeflateInflate(std::span<const uint8_t> in, std::span<uint8_t> out,
+                                 uint64_t* total_out) {
+  // A decompressor is ~10KiB, so keep one per thread rather than allocating one per entry.
+  static thread_local std::unique_ptr<libdeflate_decompressor,
+                                      decltype(&libdeflate_free_decompressor)>
+      decompressor(libdeflate_alloc_decompressor(), libdeflate_free_decompressor);
+  if (!decompressor) {
+    ALOGW("Zip: failed to allocate a libdeflate decompressor");
+    return kAllocationFailed;
+  }
+
+  size_t actual_out = 0;
+  const auto result = libdeflate_deflate_decompress(decompressor.get(), in.data(), in.size(),
+                                                    out.data(), out.size(), &actual_out);
+  if (result != LIBDEFLATE_SUCCESS) {
+    ALOGW("Zip: libdeflate result=%d (in=%zu out=%zu)", result, in.size(), out.size());
+    return kZlibError;
+  }
+  *total_out = actual_out;
+  return 0;
+}
+#endif
+
+/*
+ * Inflates a whole entry with a single call into |out|, the writer's own buffer. This is the
+ * common case for ExtractToMemory, and saves the 32KiB bounce buffers and the per-chunk calls of
+ * the streaming path; it also lets libdeflate, which can only decode whole buffers, be used.
+ */
+template <bool OnIncfs>
+static int32_t inflateWhole(const zip_archive::Reader& reader, const uint64_t compressed_length,
+                            const uint64_t uncompressed_length, std::span<uint8_t> out,
+                            zip_archive::InflateBackend backend, uint64_t* crc_out) {
+  std::vector<uint8_t> read_buf;
+  if (!reader.IsZeroCopy()) {
+    read_buf.resize(static_cast<size_t>(compressed_length));
+  }
+
+  z_stream zstream = {};
+  auto zstream_deleter = [](z_stream* stream) {
+    inflateEnd(stream); /* free up any allocated structures */
+  };
+  std::unique_ptr<z_stream, decltype(zstream_deleter)> zstream_guard(nullptr, zstream_deleter);
+
+  SCOPED_SIGBUS_HANDLER_CONDITIONAL(OnIncfs, {
+    zstream_guard.reset();
+    incfs::util::clearAndFree(read_buf);
+    return kIoError;
+  });
+
+  auto in = reader.AccessAtOffset(read_buf.data(), static_cast<size_t>(compressed_length), 0);
+  if (!in) {
+    ALOGW("Zip: inflate read failed, getSize = %" PRIu64 ": %s", compressed_length,
+          strerror(errno));
+    return kIoError;
+  }
+
+  uint64_t total_output = 0;
+#if defined(ZIPARCHIVE_WITH_LIBDEFLATE)
+  if (backend == zip_archive::InflateBackend::kLibdeflate) {
+    const int32_t result = libdeflateInflate({in, size_t(compressed_length)}, out, &total_output);
+    if (result != 0) return result;
+    if (crc_out != nullptr) *crc_out = libdeflate_crc32(0, out.data(), size_t(total_output));
+  }
+#endif
+  if (backend != zip_archive::InflateBackend::kLibdeflate) {
+    int zerr = zlib_inflateInit2(&zstream, -MAX_WBITS);
+    if (zerr != Z_OK) {
+      ALOGW("Call to inflateInit2 failed (zerr=%d)", zerr);
+      return kZlibError;
+    }
+    zstream_guard.reset(&zstream);
+    zstream.next_in = const_cast<uint8_t*>(in);
+    zstream.avail_in = static_cast<uint32_t>(compressed_length);
+    zstream.next_out = out.data();
+    zstream.avail_out = static_cast<uint32_t>(out.size());
+    zerr = inflate(&zstream, Z_FINISH);
+    if (zerr != Z_STREAM_END) {
+      ALOGW("Zip: inflate zerr=%d (aIn=%u aOut=%u)", zerr, zstream.avail_in, zstream.avail_out);
+      return kZlibError;
+    }
+    total_output = zstream.total_out;
+    if (crc_out != nullptr) *crc_out = ZipCrc32(0, out.data(), size_t(total_output));
+  }
+
+  if (total_output != uncompressed_length) {
+    ALOGW("Zip: size mismatch on inflated file (%" PRIu64 " vs %" PRIu64 ")", total_output,
+          uncompressed_length);
+    return kInconsistentInformation;
+  }
+  return 0;
+}
+
+// Entries of a file archive (rather than one in memory) are only inflated whole if their
+// compressed data is at most this big, since it has to be read into a buffer of its own first.
+static constexpr uint64_t kMaxOneShotReadSize = 1024 * 1024;
+
 template <bool OnIncfs>
 static int32_t inflateImpl(const zip_archive::Reader& reader,
                            const uint64_t compressed_length,
@@ -1393,15 +1704,6 @@ static int32_t inflateImpl(const zip_archive::Reader& reader,
                            zip_archive::Writer* writer, uint64_t* crc_out) {
   constexpr uint64_t kBufSize = 32768;
 
-  std::vector<uint8_t> read_buf;
-  uint64_t max_read_size;
-  if (reader.IsZeroCopy()) {
-    max_read_size = std::min<uint64_t>(std::numeric_limits<uint32_t>::max(), compressed_length);
-  } else {
-    max_read_size = std::min(compressed_length, kBufSize);
-    read_buf.resize(static_cast<size_t>(max_read_size));
-  }
-
   std::vector<uint8_t> write_buf;
   // For some files zlib needs more space than the uncompressed buffer size, e.g. when inflating
   // an empty file.
@@ -1416,6 +1718,23 @@ static int32_t inflateImpl(const zip_archive::Reader& reader,
     write_span = write_buf;
   }
 
+  const auto backend = zip_archive::GetInflateBackend();
+  if (direct_writer && backend != zip_archive::InflateBackend::kZlib &&
+      min_write_buffer_size <= std::numeric_limits<uint32_t>::max() &&
+      (reader.IsZeroCopy() || compressed_length <= kMaxOneShotReadSize)) {
+    return inflateWhole<OnIncfs>(reader, compressed_length, uncompressed_length, write_span,
+                                 backend, crc_out);
+  }
+
+  std::vector<uint8_t> read_buf;
+  uint64_t max_read_size;
+  if (reader.IsZeroCopy()) {
+    max_read_size = std::min<uint64_t>(std::numeric_limits<uint32_t>::max(), compressed_length);
+  } else {
+    max_read_size = std::min(compressed_length, kBufSize);
+    read_buf.resize(static_cast<size_t>(max_read_size));
+  }
+
   /*
    * Initialize the zlib stream struct.
    */
@@ -1493,7 +1812,7 @@ static int32_t inflateImpl(const zip_archive::Reader& reader,
       const size_t write_size = zstream.next_out - write_span.data();
       if (compute_crc) {
         DCHECK_LE(write_size, write_span.size());
-        crc = crc32(crc, write_span.data(), static_cast<uint32_t>(write_size));
+        crc = ZipCrc32(static_cast<uint32_t>(crc), write_span.data(), write_size);
       }
       total_output += write_span.size() - zstream.avail_out;
 
@@ -1537,6 +1856,117 @@ static int32_t InflateEntryToWriter(MappedZipFile& mapped_zip, const ZipEntry64*
                            entry->uncompressed_length, writer, crc_out);
 }
 
+/*
+ * Decompresses a zstd (method 93) entry, which holds a single zstd frame. Like inflateImpl, it
+ * decompresses straight into the writer's buffer when it has one, and through a 32KiB bounce
+ * buffer otherwise.
+ */
+template <bool OnIncfs>
+static int32_t zstdImpl(const zip_archive::Reader& reader, const uint64_t compressed_length,
+                        const uint64_t uncompressed_length, zip_archive::Writer* writer,
+                        uint64_t* crc_out) {
+  constexpr uint64_t kBufSize = 32768;
+
+  // A decompression context is ~100KiB, so keep one per thread rather than allocating one per
+  // entry.
+  static thread_local std::unique_ptr<ZSTD_DCtx, decltype(&ZSTD_freeDCtx)> dctx(ZSTD_createDCtx(),
+                                                                                 ZSTD_freeDCtx);
+  if (!dctx) {
+    ALOGW("Zip: failed to allocate a zstd decompression context");
+    return kAllocationFailed;
+  }
+  ZSTD_DCtx_reset(dctx.get(), ZSTD_reset_session_only);
+
+  std::vector<uint8_t> write_buf;
+  auto write_span = bufferToSpan(writer->GetBuffer(size_t(uncompressed_length)));
+  const bool direct_writer = write_span.size() >= uncompressed_length;
+  if (!direct_writer) {
+    write_buf.resize(kBufSize);
+    write_span = write_buf;
+  }
+
+  std::vector<uint8_t> read_buf;
+  uint64_t max_read_size;
+  if (reader.IsZeroCopy()) {
+    max_read_size = compressed_length;
+  } else {
+    max_read_size = std::min(compressed_length, kBufSize);
+    read_buf.resize(static_cast<size_t>(max_read_size));
+  }
+
+  SCOPED_SIGBUS_HANDLER_CONDITIONAL(OnIncfs, {
+    incfs::util::clearAndFree(read_buf);
+    incfs::util::clearAndFree(write_buf);
+    return kIoError;
+  });
+
+  uint32_t crc = 0;
+  uint64_t remaining_bytes = compressed_length;
+  uint64_t total_output = 0;
+  ZSTD_inBuffer in = {nullptr, 0, 0};
+  while (true) {
+    if (in.pos == in.size && remaining_bytes != 0) {
+      const auto read_size = static_cast<size_t>(std::min(remaining_bytes, max_read_size));
+      const off64_t offset = (compressed_length - remaining_bytes);
+      auto buf = reader.AccessAtOffset(read_buf.data(), read_size, offset);
+      if (!buf) {
+        ALOGW("Zip: zstd read failed, getSize = %zu: %s", read_size, strerror(errno));
+        return kIoError;
+      }
+      remaining_bytes -= read_size;
+      in = {buf, read_size, 0};
+    }
+
+    ZSTD_outBuffer out = {write_span.data(), write_span.size(), 0};
+    const size_t in_pos = in.pos;
+    const size_t result = ZSTD_decompressStream(dctx.get(), &out, &in);
+    if (ZSTD_isError(result)) {
+      ALOGW("Zip: zstd error: %s", ZSTD_getErrorName(result));
+      return kZlibError;
+    }
+
+    if (out.pos != 0) {
+      if (crc_out != nullptr) {
+        crc = ZipCrc32(crc, write_span.data(), out.pos);
+      }
+      total_output += out.pos;
+      if (direct_writer) {
+        write_span = write_span.subspan(out.pos);
+      } else if (!writer->Append(write_span.data(), out.pos)) {
+        return kIoError;
+      }
+    }
+
+    // 0 means the frame is complete and flushed.
+    if (result == 0) break;
+    // Otherwise it has to make progress: if it can't, the frame is either truncated or
+    // decompresses to more than the direct buffer can hold.
+    if (out.pos == 0 && in.pos == in_pos) {
+      ALOGW("Zip: zstd frame is truncated or too long (%" PRIu64 " bytes out, %" PRIu64
+            " expected)",
+            total_output, uncompressed_length);
+      return kInconsistentInformation;
+    }
+  }
+
+  if (crc_out != nullptr) {
+    *crc_out = crc;
+  }
+  if (total_output != uncompressed_length || remaining_bytes != 0 || in.pos != in.size) {
+    ALOGW("Zip: size mismatch on zstd entry (%" PRIu64 " vs %" PRIu64 ")", total_output,
+          uncompressed_length);
+    return kInconsistentInformation;
+  }
+  return 0;
+}
+
+static int32_t ZstdEntryToWriter(MappedZipFile& mapped_zip, const ZipEntry64* entry,
+                                 zip_archive::Writer* writer, uint64_t* crc_out) {
+  const EntryReader reader(mapped_zip, entry);
+  return zstdImpl<true>(reader, entry->compressed_length, entry->uncompressed_length, writer,
+                        crc_out);
+}
+
 static int32_t CopyEntryToWriter(MappedZipFile& mapped_zip, const ZipEntry64* entry,
                                  zip_archive::Writer* writer, uint64_t* crc_out) {
   constexpr uint64_t kBufSize = 32768;
@@ -1588,7 +2018,7 @@ static int32_t CopyEntryToWriter(MappedZipFile& mapped_zip, const ZipEntry64* en
       write_span = write_span.subspan(block_size);
     }
     if (crc_out) {
-      crc = crc32(crc, read_buf, block_size);
+      crc = ZipCrc32(static_cast<uint32_t>(crc), read_buf, block_size);
     }
     count += block_size;
   }
@@ -1613,6 +2043,9 @@ static int32_t extractToWriter(ZipArchiveHandle handle, const ZipEntry64* entry,
   } else if (method == kCompressDeflated) {
     return_value =
         InflateEntryToWriter(handle->mapped_zip, entry, writer, kCrcChecksEnabled ? &crc : nullptr);
+  } else if (method == kCompressZstd) {
+    return_value =
+        ZstdEntryToWriter(handle->mapped_zip, entry, writer, kCrcChecksEnabled ? &crc : nullptr);
   }
 
   if (!return_value && entry->has_data_descriptor) {
@@ -1622,8 +2055,8 @@ static int32_t extractToWriter(ZipArchiveHandle handle, const ZipEntry64* entry,
     }
   }
 
-  // Validate that the CRC matches the calculated value.
-  if (kCrcChecksEnabled && (entry->crc32 != static_cast<uint32_t>(crc))) {
+  // Validate that the CRC matches the calculated value, which is only complete if nothing failed.
+  if (return_value == 0 && kCrcChecksEnabled && (entry->crc32 != static_cast<uint32_t>(crc))) {
     ALOGW("Zip: crc mismatch: expected %" PRIu32 ", was %" PRIu64, entry->crc32, crc);
     return kInconsistentInformation;
   }
@@ -1659,6 +2092,90 @@ int32_t ExtractEntryToFile(ZipArchiveHandle archive, const ZipEntry64* entry, in
   return extractToWriter(archive, entry, &writer.value());
 }
 
+// Runs |task| for each of |entries| on up to |threads| threads, the biggest entries first so a
+// big one doesn't start last, on its own. Stops at the first failure and returns it.
+static int32_t ForEachEntryParallel(const std::vector<ZipEntry64>& entries, size_t threads,
+                                    const std::function<int32_t(size_t index)>& task) {
+  std::vector<size_t> order(entries.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [&entries](size_t lhs, size_t rhs) {
+    return entries[lhs].uncompressed_length > entries[rhs].uncompressed_length;
+  });
+
+  std::atomic<size_t> next = 0;
+  std::atomic<int32_t> result = 0;
+  auto run = [&]() {
+    while (result == 0) {
+      const size_t i = next++;
+      if (i >= order.size()) break;
+      const int32_t error = task(order[i]);
+      if (error != 0) {
+        int32_t expected = 0;
+        result.compare_exchange_strong(expected, error);
+      }
+    }
+  };
+
+#if defined(_WIN32)
+  // Reads move the file pointer on Windows, so the archive can't be read from several threads.
+  threads = 1;
+#endif
+  threads = std::clamp<size_t>(threads, 1, std::max<size_t>(entries.size(), 1));
+  std::vector<std::thread> workers;
+  for (size_t i = 1; i < threads; ++i) {
+    workers.emplace_back(run);
+  }
+  run();
+  for (auto& worker : workers) {
+    worker.join();
+  }
+  return result;
+}
+
+int32_t ExtractEntriesParallel(
+    ZipArchiveHandle archive, const std::vector<ZipEntry64>& entries,
+    const std::function<android::base::unique_fd(size_t index)>& open_output, size_t threads) {
+  return ForEachEntryParallel(entries, threads, [&](size_t i) {
+    const ZipEntry64* entry = &entries[i];
+    android::base::unique_fd fd = open_output(i);
+    auto writer = fd == -1 ? std::nullopt : FileWriter::Create(fd.get(), entry, true);
+    return writer ? extractToWriter(archive, entry, &writer.value()) : kIoError;
+  });
+}
+
+namespace {
+
+// Throws the data away: extractToWriter checks the CRC as it goes.
+class DiscardWriter final : public zip_archive::Writer {
+ public:
+  bool Append(uint8_t*, size_t) override { return true; }
+};
+
+}  // namespace
+
+int32_t VerifyArchiveCrcs(ZipArchiveHandle archive, size_t threads) {
+  void* cookie;
+  int32_t result = StartIteration(archive, &cookie);
+  if (result != 0) {
+    return result;
+  }
+  std::vector<ZipEntry64> entries;
+  ZipEntry64 entry;
+  std::string_view name;
+  while ((result = Next(cookie, &entry, &name)) == 0) {
+    entries.push_back(entry);
+  }
+  EndIteration(cookie);
+  if (result != kIterationEnd) {
+    return result;
+  }
+
+  return ForEachEntryParallel(entries, threads, [&](size_t i) {
+    DiscardWriter writer;
+    return extractToWriter(archive, &entries[i], &writer);
+  });
+}
+
 int GetFileDescriptor(const ZipArchiveHandle archive) {
   return archive->mapped_zip.GetFileDescriptor();
 }
@@ -1893,6 +2410,222 @@ int32_t ExtractToWriter(ZipArchiveHandle handle, const ZipEntry64* entry,
   return extractToWriter(handle, entry, writer);
 }
 
+EntryMapping::EntryMapping() = default;
+EntryMapping::EntryMapping(EntryMapping&& other) = default;
+EntryMapping& EntryMapping::operator=(EntryMapping&& other) = default;
+EntryMapping::~EntryMapping() = default;
+
+int32_t MapEntry(ZipArchiveHandle archive, const ZipEntry64* entry, EntryMapping* mapping) {
+  if (entry->method != kCompressStored) {
+    ALOGW("Zip: can't map compressed entry (method %" PRIu16 ")", entry->method);
+    return kMmapFailed;
+  }
+  const off64_t file_length = archive->mapped_zip.GetFileLength();
+  if (entry->offset < 0 || entry->compressed_length > static_cast<uint64_t>(file_length) ||
+      static_cast<uint64_t>(entry->offset) > file_length - entry->compressed_length) {
+    ALOGW("Zip: entry data %" PRId64 "+%" PRIu64 " is outside the archive (%" PRId64 ")",
+          static_cast<int64_t>(entry->offset), entry->compressed_length,
+          static_cast<int64_t>(file_length));
+    return kInvalidOffset;
+  }
+  if (entry->compressed_length > std::numeric_limits<size_t>::max()) {
+    return kMmapFailed;
+  }
+  const auto size = static_cast<size_t>(entry->compressed_length);
+
+  // There's nothing to map, and mmap() rejects empty mappings.
+  if (size == 0) {
+    mapping->map_.reset();
+    mapping->data_ = nullptr;
+    mapping->size_ = 0;
+    return kSuccess;
+  }
+
+  if (const void* base = archive->mapped_zip.GetBasePtr(); base != nullptr) {
+    mapping->map_.reset();
+    mapping->data_ = static_cast<const uint8_t*>(base) + entry->offset;
+    mapping->size_ = size;
+    return kSuccess;
+  }
+
+  // MappedFile maps whole pages, and points data() at the entry in them.
+  auto map = android::base::MappedFile::FromFd(
+      archive->mapped_zip.GetFileDescriptor(),
+      archive->mapped_zip.GetFileOffset() + entry->offset, size, PROT_READ);
+  if (map == nullptr) {
+    ALOGW("Zip: failed to map entry data %" PRId64 "+%zu: %s",
+          static_cast<int64_t>(entry->offset), size, strerror(errno));
+    return kMmapFailed;
+  }
+  mapping->data_ = reinterpret_cast<const uint8_t*>(map->data());
+  mapping->size_ = size;
+  mapping->map_ = std::move(map);
+  return kSuccess;
+}
+
 #endif  // !ZIPARCHIVE_DISABLE_CALLBACK_API
 
+// Entries whose data is at most this far apart are prefetched together, since a request for the
+// gap costs less than another request, and readahead would fetch much of it anyway.
+static constexpr uint64_t kPrefetchMaxGap = 64 * 1024;
+
+int32_t PrefetchEntries(ZipArchiveHandle archive, const std::vector<ZipEntry64>& entries) {
+  const off64_t file_length = archive->mapped_zip.GetFileLength();
+  // The [start, end) offsets of the data to read.
+  std::vector<std::pair<uint64_t, uint64_t>> ranges;
+  ranges.reserve(entries.size());
+  for (const ZipEntry64& entry : entries) {
+    if (entry.offset < 0 || entry.compressed_length > static_cast<uint64_t>(file_length) ||
+        static_cast<uint64_t>(entry.offset) > file_length - entry.compressed_length) {
+      return kInvalidOffset;
+    }
+    if (entry.compressed_length != 0) {
+      ranges.emplace_back(entry.offset, entry.offset + entry.compressed_length);
+    }
+  }
+  std::sort(ranges.begin(), ranges.end());
+
+  auto prefetch = [archive]([[maybe_unused]] uint64_t start, [[maybe_unused]] uint64_t end) {
+#ifdef __linux__
+    if (const void* base = archive->mapped_zip.GetBasePtr(); base != nullptr) {
+      auto [aligned_ptr, aligned_size] = expandToPageBounds(
+          const_cast<uint8_t*>(static_cast<const uint8_t*>(base) + start), end - start);
+      if (::madvise(aligned_ptr, aligned_size, MADV_WILLNEED)) {
+        ALOGW("Zip: madvise(file, WILLNEED) failed: %s (%d)", strerror(errno), errno);
+      }
+    } else if (int error = posix_fadvise(archive->mapped_zip.GetFileDescriptor(),
+                                         archive->mapped_zip.GetFileOffset() + start, end - start,
+                                         POSIX_FADV_WILLNEED)) {
+      ALOGW("Zip: posix_fadvise(WILLNEED) failed: %s (%d)", strerror(error), error);
+    }
+#endif
+  };
+  for (size_t i = 0; i < ranges.size();) {
+    auto [start, end] = ranges[i];
+    for (i++; i < ranges.size() && ranges[i].first <= end + kPrefetchMaxGap; i++) {
+      end = std::max(end, ranges[i].second);
+    }
+    prefetch(start, end);
+  }
+  return kSuccess;
+}
+
+static inline uint64_t LoadWord(const void* p) {
+  uint64_t word;
+  memcpy(&word, p, sizeof(word));
+  return word;
+}
+
+NameMatcher::NameMatcher(std::string_view prefix, std::string_view suffix)
+    : prefix_(prefix), suffix_(suffix) {
+  // Build the words the way names are loaded, so that byte order doesn't matter.
+  uint8_t bytes[8] = {};
+  uint8_t mask[8] = {};
+  const size_t prefix_bytes = std::min(prefix.size(), sizeof(bytes));
+  // An empty string_view's data() may be null, which memcpy doesn't allow even for no bytes.
+  if (prefix_bytes != 0) {
+    memcpy(bytes, prefix.data(), prefix_bytes);
+  }
+  memset(mask, 0xff, prefix_bytes);
+  prefix_word_ = LoadWord(bytes);
+  prefix_mask_ = LoadWord(mask);
+
+  memset(bytes, 0, sizeof(bytes));
+  memset(mask, 0, sizeof(mask));
+  const size_t suffix_bytes = std::min(suffix.size(), sizeof(bytes));
+  if (suffix_bytes != 0) {
+    memcpy(bytes + sizeof(bytes) - suffix_bytes, suffix.data() + suffix.size() - suffix_bytes,
+           suffix_bytes);
+  }
+  memset(mask + sizeof(mask) - suffix_bytes, 0xff, suffix_bytes);
+  suffix_word_ = LoadWord(bytes);
+  suffix_mask_ = LoadWord(mask);
+}
+
+bool NameMatcher::Match(std::string_view name) const {
+  if (name.size() < prefix_.size() || name.size() < suffix_.size()) {
+    return false;
+  }
+  if (name.size() < sizeof(uint64_t)) {
+    return memcmp(name.data(), prefix_.data(), prefix_.size()) == 0 &&
+           memcmp(name.data() + name.size() - suffix_.size(), suffix_.data(), suffix_.size()) == 0;
+  }
+  // Most prefixes and suffixes ("lib/", ".so") fit in a word, and are compared with one load.
+  if ((LoadWord(name.data()) & prefix_mask_) != prefix_word_ ||
+      (LoadWord(name.data() + name.size() - sizeof(uint64_t)) & suffix_mask_) != suffix_word_) {
+    return false;
+  }
+  return (prefix_.size() <= sizeof(uint64_t) ||
+          memcmp(name.data() + sizeof(uint64_t), prefix_.data() + sizeof(uint64_t),
+                 prefix_.size() - sizeof(uint64_t)) == 0) &&
+         (suffix_.size() <= sizeof(uint64_t) ||
+          memcmp(name.data() + name.size() - suffix_.size(), suffix_.data(),
+                 suffix_.size() - sizeof(uint64_t)) == 0);
+}
+
+int32_t NextEntries(ZipArchiveHandle archive, IterationCursor* cursor, const NameMatcher& matcher,
+                    CdEntry* entries, size_t max_entries, size_t* num_entries) {
+  *num_entries = 0;
+  if (archive == nullptr || archive->cd_entry_map == nullptr) {
+    ALOGW("Zip: Invalid ZipArchiveHandle");
+    return kInvalidHandle;
+  }
+
+  SCOPED_SIGBUS_HANDLER(return kIoError);
+
+  // The central directory was checked when the archive was opened, but the cursor wasn't.
+  const uint8_t* const cd_ptr = archive->central_directory.GetBasePtr();
+  const size_t cd_length = archive->central_directory.GetMapLength();
+  size_t count = 0;
+  while (count < max_entries && cursor->entry < archive->num_entries) {
+    if (cursor->offset > cd_length - sizeof(CentralDirectoryRecord)) {
+      ALOGW("Zip: iteration cursor %" PRIu64 " is outside the central directory", cursor->offset);
+      return kInvalidOffset;
+    }
+    const uint8_t* const ptr = cd_ptr + cursor->offset;
+    auto cdr = reinterpret_cast<const CentralDirectoryRecord*>(ptr);
+    const uint64_t record_length = sizeof(CentralDirectoryRecord) + cdr->file_name_length +
+                                   cdr->extra_field_length + cdr->comment_length;
+    if (cdr->record_signature != CentralDirectoryRecord::kSignature ||
+        record_length > cd_length - cursor->offset) {
+      ALOGW("Zip: bad central directory record at %" PRIu64, cursor->offset);
+      return kInvalidOffset;
+    }
+    const std::string_view name(reinterpret_cast<const char*>(ptr + sizeof(*cdr)),
+                                cdr->file_name_length);
+    if (matcher.Match(name)) {
+      CdEntry* entry = &entries[count];
+      entry->name = name;
+      entry->compressed_length = cdr->compressed_size;
+      entry->uncompressed_length = cdr->uncompressed_size;
+      entry->local_header_offset = cdr->local_file_header_offset;
+      entry->mod_time = cdr->last_mod_date << 16 | cdr->last_mod_time;
+      entry->crc32 = cdr->crc32;
+      entry->method = cdr->compression_method;
+      if (cdr->uncompressed_size == UINT32_MAX || cdr->compressed_size == UINT32_MAX ||
+          cdr->local_file_header_offset == UINT32_MAX) {
+        Zip64ExtendedInfo zip64_info{};
+        if (auto status = ParseZip64ExtendedInfoInExtraField(
+                ptr + sizeof(*cdr) + cdr->file_name_length, cdr->extra_field_length,
+                cdr->uncompressed_size, cdr->compressed_size, cdr->local_file_header_offset,
+                &zip64_info);
+            status != kSuccess) {
+          *num_entries = count;
+          return status;
+        }
+        entry->uncompressed_length =
+            zip64_info.uncompressed_file_size.value_or(cdr->uncompressed_size);
+        entry->compressed_length = zip64_info.compressed_file_size.value_or(cdr->compressed_size);
+        entry->local_header_offset =
+            zip64_info.local_header_offset.value_or(cdr->local_file_header_offset);
+      }
+      count++;
+    }
+    cursor->entry++;
+    cursor->offset += record_length;
+  }
+  *num_entries = count;
+  return count == 0 ? kIterationEnd : kSuccess;
+}
+
 }  // namespace zip_archive
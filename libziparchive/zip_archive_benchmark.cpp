@@ -14,20 +14,44 @@
  * limitations under the License.
  */
 
+#include <dirent.h>
+#include <fcntl.h>
+
+#include <atomic>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <memory>
 #include <string>
 #include <string_view>
+#include <thread>
 #include <vector>
 
+#include <android-base/file.h>
 #include <android-base/test_utils.h>
+#include <android-base/unique_fd.h>
 #include <benchmark/benchmark.h>
 #include <ziparchive/zip_archive.h>
 #include <ziparchive/zip_archive_stream_entry.h>
+#include <ziparchive/zip_stream_reader.h>
 #include <ziparchive/zip_writer.h>
 
+// Counts heap allocations, so that benchmarks can report them.
+static std::atomic<uint64_t> allocations;
+
+void* operator new(size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  void* result = malloc(size);
+  if (result == nullptr) {
+    abort();
+  }
+  return result;
+}
+
+void operator delete(void* ptr) noexcept {
+  free(ptr);
+}
+
 static std::unique_ptr<TemporaryFile> CreateZip(int size = 4, int count = 1000,
                                                 bool compress = true) {
   auto result = std::make_unique<TemporaryFile>();
@@ -64,6 +88,39 @@ static void OpenClose(benchmark::State& state) {
 }
 BENCHMARK(OpenClose)->Arg(1)->Arg(10)->Arg(1000)->Arg(10000);
 
+static void RemoveFiles(const char* dir) {
+  std::unique_ptr<DIR, decltype(&closedir)> d(opendir(dir), closedir);
+  while (dirent* de = readdir(d.get())) {
+    if (de->d_type == DT_REG) {
+      unlink((std::string(dir) + "/" + de->d_name).c_str());
+    }
+  }
+}
+
+// Arg 1 is 0 without a central directory index, 1 to open the archive and save
+// its index each time (cold), and 2 to open it using the saved index (warm).
+static void OpenClose_index(benchmark::State& state) {
+  std::unique_ptr<TemporaryFile> temp_file(CreateZip(4, int(state.range(0))));
+  TemporaryDir dir;
+  const auto mode = state.range(1);
+  if (mode != 0) {
+    zip_archive::SetCentralDirectoryIndexDir(dir.path);
+  }
+  ZipArchiveHandle handle;
+  for (auto _ : state) {
+    if (mode == 1) {
+      state.PauseTiming();
+      RemoveFiles(dir.path);
+      state.ResumeTiming();
+    }
+    OpenArchive(temp_file->path, &handle);
+    CloseArchive(handle);
+  }
+  zip_archive::SetCentralDirectoryIndexDir("");
+  RemoveFiles(dir.path);
+}
+BENCHMARK(OpenClose_index)->ArgsProduct({{10000, 60000}, {0, 1, 2}});
+
 static void FindEntry_no_match(benchmark::State& state) {
   // Create a temporary zip archive.
   std::unique_ptr<TemporaryFile> temp_file(CreateZip(4, int(state.range(0))));
@@ -91,16 +148,41 @@ static void Iterate_all_files(benchmark::State& state) {
   std::string_view name;
 
   OpenArchive(temp_file->path, &handle);
+  const uint64_t allocations_before = allocations;
   for (auto _ : state) {
     StartIteration(handle, &iteration_cookie);
     while (Next(iteration_cookie, &data, &name) == 0) {
     }
     EndIteration(iteration_cookie);
   }
+  state.counters["allocs"] = benchmark::Counter(double(allocations - allocations_before),
+                                                benchmark::Counter::kAvgIterations);
   CloseArchive(handle);
 }
 BENCHMARK(Iterate_all_files)->Arg(1)->Arg(10)->Arg(1000)->Arg(10000);
 
+// As Iterate_all_files, but with NextEntries() and 64 entries at a time.
+static void Iterate_all_files_batch(benchmark::State& state) {
+  std::unique_ptr<TemporaryFile> temp_file(CreateZip(4, int(state.range(0))));
+  ZipArchiveHandle handle;
+  zip_archive::CdEntry entries[64];
+  size_t count;
+  const zip_archive::NameMatcher matcher;
+
+  OpenArchive(temp_file->path, &handle);
+  const uint64_t allocations_before = allocations;
+  for (auto _ : state) {
+    zip_archive::IterationCursor cursor;
+    while (zip_archive::NextEntries(handle, &cursor, matcher, entries, std::size(entries),
+                                    &count) == 0) {
+    }
+  }
+  state.counters["allocs"] = benchmark::Counter(double(allocations - allocations_before),
+                                                benchmark::Counter::kAvgIterations);
+  CloseArchive(handle);
+}
+BENCHMARK(Iterate_all_files_batch)->Arg(1)->Arg(10)->Arg(1000)->Arg(10000);
+
 static void StartAlignedEntry(benchmark::State& state) {
   TemporaryFile file;
   FILE* fp = fdopen(file.fd, "w");
@@ -125,6 +207,11 @@ BENCHMARK(StartAlignedEntry)->Arg(2)->Arg(16)->Arg(1024)->Arg(4096);
 static void ExtractEntry(benchmark::State& state) {
   const auto size = int(state.range(0));
   std::unique_ptr<TemporaryFile> temp_file(CreateZip(size * 1024, 1));
+  const auto default_backend = zip_archive::GetInflateBackend();
+  if (!zip_archive::SetInflateBackend(zip_archive::InflateBackend(state.range(1)))) {
+    state.SkipWithError("Inflate backend not built in");
+    return;
+  }
 
   ZipArchiveHandle handle;
   ZipEntry data;
@@ -143,9 +230,11 @@ static void ExtractEntry(benchmark::State& state) {
     }
   }
   CloseArchive(handle);
+  zip_archive::SetInflateBackend(default_backend);
 }
 
-BENCHMARK(ExtractEntry)->Arg(2)->Arg(16)->Arg(64)->Arg(1024)->Arg(4096);
+// The second argument is the zip_archive::InflateBackend.
+BENCHMARK(ExtractEntry)->ArgsProduct({{2, 16, 64, 1024, 4096}, {0, 1, 2}});
 
 static void ExtractStored(benchmark::State& state) {
   const auto size = int(state.range(0));
@@ -172,4 +261,316 @@ static void ExtractStored(benchmark::State& state) {
 
 BENCHMARK(ExtractStored)->Arg(2)->Arg(16)->Arg(64)->Arg(1024)->Arg(4096);
 
+// As ExtractStored, but reading the entry in place: the cost is mapping it and
+// faulting its pages in, rather than copying it.
+static void MapStored(benchmark::State& state) {
+  const auto size = int(state.range(0));
+  std::unique_ptr<TemporaryFile> temp_file(CreateZip(size * 1024, 1, false));
+
+  ZipArchiveHandle handle;
+  ZipEntry64 data;
+  if (OpenArchive(temp_file->path, &handle)) {
+    state.SkipWithError("Failed to open archive");
+  }
+  if (FindEntry(handle, "file0", &data)) {
+    state.SkipWithError("Failed to find archive entry");
+  }
+
+  for (auto _ : state) {
+    zip_archive::EntryMapping mapping;
+    if (zip_archive::MapEntry(handle, &data, &mapping)) {
+      state.SkipWithError("Failed to map archive entry");
+      break;
+    }
+    uint64_t sum = 0;
+    for (size_t i = 0; i < mapping.size(); i += 4096) {
+      sum += mapping.data()[i];
+    }
+    benchmark::DoNotOptimize(sum);
+  }
+  CloseArchive(handle);
+}
+
+BENCHMARK(MapStored)->Arg(2)->Arg(16)->Arg(64)->Arg(1024)->Arg(4096);
+
+static void ExtractAll(benchmark::State& state) {
+  // 10k compressed entries of 16KiB, roughly the shape of a big APK.
+  constexpr int kCount = 10000;
+  TemporaryFile temp_file;
+  FILE* fp = fdopen(dup(temp_file.fd), "w");
+  ZipWriter writer(fp);
+  std::string data;
+  for (int i = 0; data.size() < 16 * 1024; i++) {
+    data += "line " + std::to_string(i * 7919 % 1000) + "\n";
+  }
+  for (int i = 0; i < kCount; i++) {
+    writer.StartEntry("file" + std::to_string(i), ZipWriter::kCompress);
+    writer.WriteBytes(data.data(), data.size());
+    writer.FinishEntry();
+  }
+  writer.Finish();
+  fclose(fp);
+
+  ZipArchiveHandle handle;
+  if (OpenArchive(temp_file.path, &handle)) {
+    state.SkipWithError("Failed to open archive");
+    return;
+  }
+  std::vector<ZipEntry64> entries(kCount);
+  for (int i = 0; i < kCount; i++) {
+    FindEntry(handle, "file" + std::to_string(i), &entries[i]);
+  }
+
+  TemporaryDir dir;
+  auto open_output = [&dir](size_t i) {
+    return android::base::unique_fd(open((std::string(dir.path) + "/" + std::to_string(i)).c_str(),
+                                         O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600));
+  };
+  const auto threads = size_t(state.range(0));
+  for (auto _ : state) {
+    int32_t error = 0;
+    if (threads == 0) {
+      // The ExtractEntryToFile loop ExtractEntriesParallel replaces.
+      for (size_t i = 0; i < entries.size() && error == 0; i++) {
+        android::base::unique_fd fd = open_output(i);
+        error = ExtractEntryToFile(handle, &entries[i], fd.get());
+      }
+    } else {
+      error = ExtractEntriesParallel(handle, entries, open_output, threads);
+    }
+    if (error) {
+      state.SkipWithError("Failed to extract archive entries");
+      break;
+    }
+  }
+  state.SetBytesProcessed(int64_t(state.iterations()) * kCount * data.size());
+  CloseArchive(handle);
+}
+BENCHMARK(ExtractAll)->Arg(0)->Arg(1)->Arg(2)->Arg(4)->Arg(8)->UseRealTime();
+
+// Arg 0 is the number of threads (1 is the caller's, as without
+// SetParallelCompression), and arg 1 is whether the output must be
+// deterministic, which stops big entries being split into blocks.
+static void WriteCompressed(benchmark::State& state) {
+  // 200 entries of 16KiB and one of 16MiB.
+  std::string data;
+  for (int i = 0; data.size() < 16 * 1024; i++) {
+    data += "line " + std::to_string(i * 7919 % 1000) + "\n";
+  }
+  std::string big;
+  while (big.size() < 16 * 1024 * 1024) {
+    big += data;
+  }
+  const auto threads = size_t(state.range(0));
+  const bool deterministic = state.range(1) != 0;
+  TemporaryFile temp_file;
+  for (auto _ : state) {
+    FILE* fp = fopen(temp_file.path, "w");
+    ZipWriter writer(fp);
+    writer.SetParallelCompression(threads, deterministic);
+    for (int i = 0; i < 200; i++) {
+      writer.StartEntry("file" + std::to_string(i), ZipWriter::kCompress);
+      writer.WriteBytes(data.data(), data.size());
+      writer.FinishEntry();
+    }
+    writer.StartEntry("big", ZipWriter::kCompress);
+    writer.WriteBytes(big.data(), big.size());
+    writer.FinishEntry();
+    if (writer.Finish() != 0) {
+      state.SkipWithError("Failed to write archive");
+    }
+    fclose(fp);
+  }
+  state.SetBytesProcessed(int64_t(state.iterations()) * (200 * data.size() + big.size()));
+}
+BENCHMARK(WriteCompressed)
+    ->ArgsProduct({{1, 2, 4, 8}, {0, 1}})
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+
+// Text that compresses about as well as source code or manifests.
+static std::string CompressibleData(size_t size) {
+  std::string data;
+  for (int i = 0; data.size() < size; i++) {
+    data += "line " + std::to_string(i * 7919 % 1000) + " of " + std::to_string(i % 97) + "\n";
+  }
+  data.resize(size);
+  return data;
+}
+
+// The flags of the entries the *Method benchmarks write: arg 1 is 0 for
+// deflate and 1 for zstd, and arg 2 is whether to use the default level rather
+// than the best.
+static size_t MethodFlags(const benchmark::State& state) {
+  return ZipWriter::kCompress | (state.range(1) ? ZipWriter::kZstd : 0) |
+         (state.range(2) ? ZipWriter::kDefaultCompression : 0);
+}
+
+// Extracts an entry of arg 0 KiB compressed with deflate or zstd, straight into
+// memory or, if arg 3 is set, in chunks through ProcessZipEntryContents. The
+// "ratio" counter is the compressed size over the uncompressed size.
+static void ExtractMethod(benchmark::State& state) {
+  const std::string data = CompressibleData(size_t(state.range(0)) * 1024);
+  TemporaryFile temp_file;
+  FILE* fp = fdopen(dup(temp_file.fd), "w");
+  ZipWriter writer(fp);
+  if (writer.StartEntry("file", MethodFlags(state)) != 0) {
+    fclose(fp);
+    state.SkipWithError("Compression method not built in");
+    return;
+  }
+  writer.WriteBytes(data.data(), data.size());
+  writer.FinishEntry();
+  writer.Finish();
+  fclose(fp);
+
+  ZipArchiveHandle handle;
+  ZipEntry64 entry;
+  if (OpenArchive(temp_file.path, &handle)) {
+    state.SkipWithError("Failed to open archive");
+    return;
+  }
+  if (FindEntry(handle, "file", &entry)) {
+    state.SkipWithError("Failed to find archive entry");
+  }
+
+  std::vector<uint8_t> buffer(data.size());
+  const bool chunked = state.range(3) != 0;
+  for (auto _ : state) {
+    const int32_t result =
+        chunked ? ProcessZipEntryContents(
+                      handle, &entry,
+                      [](const uint8_t* buf, size_t, void*) {
+                        benchmark::DoNotOptimize(buf);
+                        return true;
+                      },
+                      nullptr)
+                : ExtractToMemory(handle, &entry, buffer.data(), buffer.size());
+    if (result != 0) {
+      state.SkipWithError("Failed to extract archive entry");
+      break;
+    }
+  }
+  state.SetBytesProcessed(int64_t(state.iterations()) * data.size());
+  state.counters["ratio"] = double(entry.compressed_length) / double(data.size());
+  CloseArchive(handle);
+}
+BENCHMARK(ExtractMethod)->ArgsProduct({{16, 1024, 16384}, {0, 1}, {0, 1}, {0, 1}});
+
+// Writes an entry of 16MiB compressed with deflate or zstd, with the same
+// arguments as ExtractMethod.
+static void WriteMethod(benchmark::State& state) {
+  const std::string data = CompressibleData(16 * 1024 * 1024);
+  TemporaryFile temp_file;
+  for (auto _ : state) {
+    FILE* fp = fopen(temp_file.path, "w");
+    ZipWriter writer(fp);
+    if (writer.StartEntry("file", MethodFlags(state)) != 0) {
+      fclose(fp);
+      state.SkipWithError("Compression method not built in");
+      return;
+    }
+    writer.WriteBytes(data.data(), data.size());
+    writer.FinishEntry();
+    if (writer.Finish() != 0) {
+      state.SkipWithError("Failed to write archive");
+    }
+    fclose(fp);
+  }
+  state.SetBytesProcessed(int64_t(state.iterations()) * data.size());
+}
+BENCHMARK(WriteMethod)
+    ->ArgsProduct({{16384}, {0, 1}, {0, 1}})
+    ->Unit(benchmark::kMillisecond);
+
+class DiscardWriter final : public zip_archive::Writer {
+ public:
+  bool Append(uint8_t*, size_t) override { return true; }
+};
+
+// Extracts every entry of an archive written to a pipe, as when it's
+// downloaded or received from adb. Arg 0 is whether the entries are
+// compressed, and arg 1 whether the archive is copied to a file and opened
+// when it's complete rather than read with ZipStreamReader as it arrives.
+static void ExtractFromPipe(benchmark::State& state) {
+  const bool compress = state.range(0) != 0;
+  const bool copy = state.range(1) != 0;
+  // 200 entries of 64KiB.
+  std::string data;
+  for (int i = 0; data.size() < 64 * 1024; i++) {
+    data += "line " + std::to_string(i * 7919 % 1000) + "\n";
+  }
+  TemporaryFile temp_file;
+  FILE* fp = fdopen(dup(temp_file.fd), "w");
+  ZipWriter zip_writer(fp);
+  for (int i = 0; i < 200; i++) {
+    zip_writer.StartEntry("file" + std::to_string(i), compress ? ZipWriter::kCompress : 0);
+    zip_writer.WriteBytes(data.data(), data.size());
+    zip_writer.FinishEntry();
+  }
+  zip_writer.Finish();
+  fclose(fp);
+  std::string zip;
+  android::base::ReadFileToString(temp_file.path, &zip);
+
+  DiscardWriter writer;
+  for (auto _ : state) {
+    android::base::unique_fd read_fd, write_fd;
+    if (!android::base::Pipe(&read_fd, &write_fd)) {
+      state.SkipWithError("Failed to create pipe");
+      break;
+    }
+    std::thread sender([&zip, fd = std::move(write_fd)] {
+      android::base::WriteFully(fd.get(), zip.data(), zip.size());
+    });
+
+    int32_t error = 0;
+    if (copy) {
+      TemporaryFile copy_file;
+      char buf[64 * 1024];
+      ssize_t n;
+      while ((n = TEMP_FAILURE_RETRY(read(read_fd.get(), buf, sizeof(buf)))) > 0) {
+        android::base::WriteFully(copy_file.fd, buf, n);
+      }
+      ZipArchiveHandle handle;
+      void* cookie;
+      ZipEntry64 entry;
+      std::string name;
+      error = OpenArchiveFd(copy_file.fd, "copy", &handle, false);
+      if (error == 0 && (error = StartIteration(handle, &cookie)) == 0) {
+        while ((error = Next(cookie, &entry, &name)) == 0) {
+          if ((error = ExtractToWriter(handle, &entry, &writer)) != 0) {
+            break;
+          }
+        }
+        EndIteration(cookie);
+        CloseArchive(handle);
+      }
+    } else {
+      ZipStreamReader reader(read_fd.get());
+      ZipEntry64 entry;
+      std::string name;
+      while ((error = reader.Next(&entry, &name)) == 0) {
+        if ((error = reader.ReadData(&entry, &writer)) != 0) {
+          break;
+        }
+      }
+      // Let the sender finish writing the central directory.
+      char buf[4096];
+      while (TEMP_FAILURE_RETRY(read(read_fd.get(), buf, sizeof(buf))) > 0) {
+      }
+    }
+    sender.join();
+    if (error != -1) {
+      state.SkipWithError("Failed to extract archive entries");
+      break;
+    }
+  }
+  state.SetBytesProcessed(int64_t(state.iterations()) * zip.size());
+}
+BENCHMARK(ExtractFromPipe)
+    ->ArgsProduct({{0, 1}, {0, 1}})
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+
 BENCHMARK_MAIN();
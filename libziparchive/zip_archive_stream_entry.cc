@@ -36,6 +36,7 @@
 #include <zlib.h>
 
 #include "zip_archive_private.h"
+#include "zip_crc32.h"
 
 static constexpr size_t kBufSize = 65535;
 
@@ -108,8 +109,7 @@ const std::vector<uint8_t>* ZipArchiveStreamEntryUncompressed::Read() {
   } else if (bytes < data_.size()) {
     data_.resize(bytes);
   }
-  computed_crc32_ = static_cast<uint32_t>(
-      crc32(computed_crc32_, data_.data(), static_cast<uint32_t>(data_.size())));
+  computed_crc32_ = ZipCrc32(computed_crc32_, data_.data(), data_.size());
   length_ -= bytes;
   offset_ += bytes;
   return &data_;
@@ -249,16 +249,14 @@ const std::vector<uint8_t>* ZipArchiveStreamEntryCompressed::Read() {
 
     if (z_stream_.avail_out == 0) {
       uncompressed_length_ -= out_.size();
-      computed_crc32_ = static_cast<uint32_t>(
-          crc32(computed_crc32_, out_.data(), static_cast<uint32_t>(out_.size())));
+      computed_crc32_ = ZipCrc32(computed_crc32_, out_.data(), out_.size());
       return &out_;
     }
     if (zerr == Z_STREAM_END) {
       if (z_stream_.avail_out != 0) {
         // Resize the vector down to the actual size of the data.
         out_.resize(out_.size() - z_stream_.avail_out);
-        computed_crc32_ = static_cast<uint32_t>(
-            crc32(computed_crc32_, out_.data(), static_cast<uint32_t>(out_.size())));
+        computed_crc32_ = ZipCrc32(computed_crc32_, out_.data(), out_.size());
         uncompressed_length_ -= out_.size();
         return &out_;
       }
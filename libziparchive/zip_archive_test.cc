@@ -14,6 +14,7 @@
  * limitations under the License.
  */
 
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
@@ -23,8 +24,11 @@
 
 #include <map>
 #include <memory>
+#include <random>
 #include <set>
+#include <span>
 #include <string_view>
+#include <thread>
 #include <vector>
 
 #include <android-base/file.h>
@@ -36,9 +40,13 @@
 #include <gtest/gtest.h>
 #include <ziparchive/zip_archive.h>
 #include <ziparchive/zip_archive_stream_entry.h>
+#include <ziparchive/zip_stream_reader.h>
+#include <ziparchive/zip_writer.h>
+#include <zlib.h>
 
 #include "zip_archive_common.h"
 #include "zip_archive_private.h"
+#include "zip_crc32.h"
 
 static std::string test_data_dir = android::base::GetExecutableDirectory() + "/testdata";
 
@@ -131,6 +139,46 @@ TEST_F(CdEntryMapTest, Iteration) {
   }
 }
 
+TEST(CdEntryMap, ManyEntries) {
+  // Enough names to fill many groups, with long shared prefixes like an APK's.
+  std::string cd = "header";
+  std::vector<std::pair<size_t, size_t>> names;
+  for (size_t i = 0; i < 5000; i++) {
+    const std::string name = "res/drawable-xxhdpi/icon_" + std::to_string(i) + ".png";
+    names.emplace_back(cd.size(), name.size());
+    cd += name + "separator";
+  }
+  const auto base_ptr = reinterpret_cast<const uint8_t*>(cd.data());
+  auto name_at = [&cd](const std::pair<size_t, size_t>& name) {
+    return std::string_view(cd).substr(name.first, name.second);
+  };
+
+  std::vector<std::unique_ptr<CdEntryMapInterface>> entry_maps;
+  entry_maps.emplace_back(new CdEntryMapZip32<ZipStringOffset32>(names.size()));
+  // Starts small and grows.
+  entry_maps.emplace_back(new CdEntryMapZip64());
+  for (auto& cd_map : entry_maps) {
+    for (const auto& name : names) {
+      ASSERT_EQ(kSuccess, cd_map->AddToMap(name_at(name), base_ptr));
+    }
+    for (const auto& name : names) {
+      auto [status, offset] = cd_map->GetCdEntryOffset(std::string(name_at(name)), base_ptr);
+      ASSERT_EQ(kSuccess, status);
+      ASSERT_EQ(name.first, offset);
+    }
+    ASSERT_EQ(kEntryNotFound, cd_map->GetCdEntryOffset("res/drawable-xxhdpi/icon_5000.png",
+                                                       base_ptr).first);
+    ASSERT_EQ(kDuplicateEntry, cd_map->AddToMap(name_at(names[1234]), base_ptr));
+
+    size_t count = 0;
+    cd_map->ResetIteration();
+    while (cd_map->Next(base_ptr) != std::pair<std::string_view, uint64_t>{}) {
+      count++;
+    }
+    ASSERT_EQ(names.size(), count);
+  }
+}
+
 TEST(ziparchive, Open) {
   ZipArchiveHandle handle;
   ASSERT_EQ(0, OpenArchiveWrapper(kValidZip, &handle));
@@ -344,6 +392,88 @@ TEST(ziparchive, IterationWithBadPrefixAndSuffix) {
   CloseArchive(handle);
 }
 
+TEST(ziparchive, NameMatcher) {
+  const std::vector<std::string> names = {"", "a", "lib/", "lib/x.so", "lib/arm64-v8a/libfoo.so",
+                                          "res/lib.so", "classes.dex", "classes2.dex.so"};
+  const std::vector<std::pair<std::string, std::string>> filters = {
+      {"", ""},
+      {"lib/", ""},
+      {"", ".so"},
+      {"lib/", ".so"},
+      {"lib/arm64-v8a/", ""},
+      {"", "libfoo.so"},
+      {"classes", ".dex"},
+      {"a", "a"},
+  };
+  for (const auto& [prefix, suffix] : filters) {
+    zip_archive::NameMatcher matcher(prefix, suffix);
+    for (const auto& name : names) {
+      ASSERT_EQ(android::base::StartsWith(name, prefix) && android::base::EndsWith(name, suffix),
+                matcher.Match(name))
+          << "\"" << name << "\" \"" << prefix << "\" \"" << suffix << "\"";
+    }
+  }
+}
+
+TEST(ziparchive, NextEntries) {
+  TemporaryFile zip_file;
+  FILE* fp = fdopen(dup(zip_file.fd), "w");
+  ASSERT_NE(nullptr, fp);
+  ZipWriter writer(fp);
+  std::vector<std::string> expected;
+  for (size_t i = 0; i < 100; i++) {
+    const std::string name =
+        "dir" + std::to_string(i % 3) + "/file" + std::to_string(i) + (i % 2 ? ".so" : ".txt");
+    ASSERT_EQ(0, writer.StartEntry(name, i % 5 ? ZipWriter::kCompress : 0));
+    ASSERT_EQ(0, writer.WriteBytes(name.data(), name.size()));
+    ASSERT_EQ(0, writer.FinishEntry());
+    if (i % 3 == 1 && i % 2) {
+      expected.push_back(name);
+    }
+  }
+  ASSERT_EQ(0, writer.Finish());
+  ASSERT_EQ(0, fclose(fp));
+
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchiveFd(zip_file.fd, "NextEntries", &handle, false));
+  const zip_archive::NameMatcher matcher("dir1/", ".so");
+  zip_archive::IterationCursor cursor;
+  zip_archive::IterationCursor all_cursor;
+  zip_archive::CdEntry entries[7];
+  size_t count;
+  std::vector<std::string> names;
+  int32_t result;
+  while ((result = zip_archive::NextEntries(handle, &cursor, matcher, entries, std::size(entries),
+                                            &count)) == 0) {
+    ASSERT_NE(0u, count);
+    for (size_t i = 0; i < count; i++) {
+      names.emplace_back(entries[i].name);
+      ZipEntry64 entry;
+      ASSERT_EQ(0, FindEntry(handle, entries[i].name, &entry));
+      ASSERT_EQ(entry.method, entries[i].method);
+      ASSERT_EQ(entry.crc32, entries[i].crc32);
+      ASSERT_EQ(entry.mod_time, entries[i].mod_time);
+      ASSERT_EQ(entry.compressed_length, entries[i].compressed_length);
+      ASSERT_EQ(entry.uncompressed_length, entries[i].uncompressed_length);
+      ASSERT_LT(entries[i].local_header_offset, static_cast<uint64_t>(entry.offset));
+    }
+    // Another cursor isn't affected.
+    ASSERT_EQ(0, zip_archive::NextEntries(handle, &all_cursor, zip_archive::NameMatcher(),
+                                          entries, 1, &count));
+    ASSERT_EQ(1u, count);
+  }
+  ASSERT_EQ(kIterationEnd, result);
+  ASSERT_EQ(0u, count);
+  ASSERT_EQ(expected, names);
+  ASSERT_EQ(kIterationEnd,
+            zip_archive::NextEntries(handle, &cursor, matcher, entries, std::size(entries), &count));
+
+  zip_archive::IterationCursor bad_cursor{.entry = 0, .offset = 1};
+  ASSERT_EQ(kInvalidOffset,
+            zip_archive::NextEntries(handle, &bad_cursor, matcher, entries, 1, &count));
+  CloseArchive(handle);
+}
+
 TEST(ziparchive, FindEntry) {
   ZipArchiveHandle handle;
   ASSERT_EQ(0, OpenArchiveWrapper(kValidZip, &handle));
@@ -576,6 +706,21 @@ TEST(ziparchive, EntryLargerThan32K) {
   }
 }
 
+TEST(ziparchive, GetArchiveInfo) {
+  TemporaryFile tmp_file;
+  ASSERT_NE(-1, tmp_file.fd);
+  ASSERT_TRUE(android::base::WriteFully(tmp_file.fd, kEmptyEntriesZip, sizeof(kEmptyEntriesZip)));
+
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchiveFd(tmp_file.fd, "GetArchiveInfo", &handle, false));
+  ZipArchiveInfo info = GetArchiveInfo(handle);
+  ASSERT_EQ(static_cast<off64_t>(sizeof(kEmptyEntriesZip)), info.archive_size);
+  ASSERT_EQ(1u, info.entry_count);
+  ASSERT_EQ(0x43, info.central_directory_offset);
+  ASSERT_EQ(0x4fu, info.central_directory_size);
+  CloseArchive(handle);
+}
+
 TEST(ziparchive, TrailerAfterEOCD) {
   TemporaryFile tmp_file;
   ASSERT_NE(-1, tmp_file.fd);
@@ -621,6 +766,284 @@ TEST(ziparchive, ExtractToFile) {
             lseek(tmp_file.fd, 0, SEEK_END));
 }
 
+TEST(ziparchive, ExtractEntriesParallel) {
+  TemporaryFile zip_file;
+  FILE* fp = fdopen(dup(zip_file.fd), "w");
+  ASSERT_NE(nullptr, fp);
+  ZipWriter writer(fp);
+  std::vector<std::string> contents;
+  for (size_t i = 0; i < 20; i++) {
+    contents.push_back(std::string(i * 1000, 'a' + i));
+    const std::string name = "file" + std::to_string(i);
+    ASSERT_EQ(0, writer.StartEntry(name, i % 2 ? ZipWriter::kCompress : 0));
+    ASSERT_EQ(0, writer.WriteBytes(contents.back().data(), contents.back().size()));
+    ASSERT_EQ(0, writer.FinishEntry());
+  }
+  ASSERT_EQ(0, writer.Finish());
+  ASSERT_EQ(0, fclose(fp));
+
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchiveFd(zip_file.fd, "ExtractEntriesParallel", &handle, false));
+  std::vector<ZipEntry64> entries(contents.size());
+  for (size_t i = 0; i < contents.size(); i++) {
+    ASSERT_EQ(0, FindEntry(handle, "file" + std::to_string(i), &entries[i]));
+  }
+
+  TemporaryDir dir;
+  auto path = [&dir](size_t i) { return std::string(dir.path) + "/" + std::to_string(i); };
+  ASSERT_EQ(0, ExtractEntriesParallel(
+                   handle, entries,
+                   [&path](size_t i) {
+                     return android::base::unique_fd(
+                         open(path(i).c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0600));
+                   },
+                   4));
+  for (size_t i = 0; i < contents.size(); i++) {
+    std::string extracted;
+    ASSERT_TRUE(android::base::ReadFileToString(path(i), &extracted));
+    ASSERT_EQ(contents[i], extracted) << i;
+  }
+
+  // A file that can't be opened fails the batch.
+  ASSERT_EQ(kIoError, ExtractEntriesParallel(
+                          handle, entries,
+                          [](size_t i) {
+                            return android::base::unique_fd(
+                                i == 3 ? -1 : open("/dev/null", O_WRONLY | O_CLOEXEC));
+                          },
+                          4));
+  CloseArchive(handle);
+}
+
+TEST(ziparchive, ZipCrc32) {
+  std::vector<uint8_t> data(70000);
+  for (size_t i = 0; i < data.size(); i++) {
+    data[i] = static_cast<uint8_t>(i * 131 + 7);
+  }
+  // Every alignment, and lengths either side of the SIMD block sizes.
+  for (size_t offset = 0; offset < 16; offset++) {
+    for (size_t length : {0, 1, 15, 16, 17, 63, 64, 65, 127, 128, 4095, 65537}) {
+      ASSERT_EQ(crc32(0x12345678, &data[offset], static_cast<uint32_t>(length)),
+                ZipCrc32(0x12345678, &data[offset], length))
+          << offset << " " << length;
+    }
+  }
+}
+
+TEST(ziparchive, VerifyArchiveCrcs) {
+  TemporaryFile zip_file;
+  FILE* fp = fdopen(dup(zip_file.fd), "w");
+  ASSERT_NE(nullptr, fp);
+  ZipWriter writer(fp);
+  for (size_t i = 0; i < 10; i++) {
+    const std::string contents(i * 1000 + 1, 'a' + i);
+    ASSERT_EQ(0, writer.StartEntry("file" + std::to_string(i), i % 2 ? ZipWriter::kCompress : 0));
+    ASSERT_EQ(0, writer.WriteBytes(contents.data(), contents.size()));
+    ASSERT_EQ(0, writer.FinishEntry());
+  }
+  ASSERT_EQ(0, writer.Finish());
+  ASSERT_EQ(0, fclose(fp));
+
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchiveFd(zip_file.fd, "VerifyArchiveCrcs", &handle, false));
+  ASSERT_EQ(0, VerifyArchiveCrcs(handle, 4));
+  ZipEntry64 entry;
+  ASSERT_EQ(0, FindEntry(handle, "file4", &entry));
+  ASSERT_EQ(kCompressStored, entry.method);
+  CloseArchive(handle);
+
+  // Flip a byte of a stored entry: only the CRC can tell.
+  ASSERT_TRUE(android::base::WriteFullyAtOffset(zip_file.fd, "b", 1, entry.offset + 100));
+  ASSERT_EQ(0, OpenArchiveFd(zip_file.fd, "VerifyArchiveCrcs", &handle, false));
+  ASSERT_EQ(kInconsistentInformation, VerifyArchiveCrcs(handle, 4));
+  ASSERT_EQ(kInconsistentInformation, VerifyArchiveCrcs(handle, 1));
+  std::vector<uint8_t> buffer(entry.uncompressed_length);
+  ASSERT_EQ(kInconsistentInformation, ExtractToMemory(handle, &entry, buffer.data(), buffer.size()));
+  CloseArchive(handle);
+}
+
+TEST(ziparchive, MapEntry) {
+  TemporaryFile zip_file;
+  FILE* fp = fdopen(dup(zip_file.fd), "w");
+  ASSERT_NE(nullptr, fp);
+  ZipWriter writer(fp);
+  const std::string contents(10000, 'x');
+  ASSERT_EQ(0, writer.StartEntry("stored", 0));
+  ASSERT_EQ(0, writer.WriteBytes(contents.data(), contents.size()));
+  ASSERT_EQ(0, writer.FinishEntry());
+  ASSERT_EQ(0, writer.StartAlignedEntry("aligned", 0, 4096));
+  ASSERT_EQ(0, writer.WriteBytes(contents.data(), contents.size()));
+  ASSERT_EQ(0, writer.FinishEntry());
+  ASSERT_EQ(0, writer.StartEntry("compressed", ZipWriter::kCompress));
+  ASSERT_EQ(0, writer.WriteBytes(contents.data(), contents.size()));
+  ASSERT_EQ(0, writer.FinishEntry());
+  ASSERT_EQ(0, writer.StartEntry("empty", 0));
+  ASSERT_EQ(0, writer.FinishEntry());
+  ASSERT_EQ(0, writer.Finish());
+  ASSERT_EQ(0, fclose(fp));
+  std::string zip;
+  ASSERT_TRUE(android::base::ReadFileToString(zip_file.path, &zip));
+
+  for (bool in_memory : {false, true}) {
+    SCOPED_TRACE(in_memory);
+    ZipArchiveHandle handle;
+    if (in_memory) {
+      ASSERT_EQ(0, OpenArchiveFromMemory(zip.data(), zip.size(), "MapEntry", &handle));
+    } else {
+      ASSERT_EQ(0, OpenArchiveFd(zip_file.fd, "MapEntry", &handle, false));
+    }
+    std::vector<ZipEntry64> entries(4);
+    ASSERT_EQ(0, FindEntry(handle, "stored", &entries[0]));
+    ASSERT_EQ(0, FindEntry(handle, "aligned", &entries[1]));
+    ASSERT_EQ(0, FindEntry(handle, "compressed", &entries[2]));
+    ASSERT_EQ(0, FindEntry(handle, "empty", &entries[3]));
+    ASSERT_EQ(0, zip_archive::PrefetchEntries(handle, entries));
+
+    zip_archive::EntryMapping stored;
+    zip_archive::EntryMapping aligned;
+    zip_archive::EntryMapping compressed;
+    ASSERT_EQ(0, zip_archive::MapEntry(handle, &entries[0], &stored));
+    ASSERT_EQ(0, zip_archive::MapEntry(handle, &entries[1], &aligned));
+    ASSERT_EQ(kMmapFailed, zip_archive::MapEntry(handle, &entries[2], &compressed));
+    zip_archive::EntryMapping empty;
+    ASSERT_EQ(0, zip_archive::MapEntry(handle, &entries[3], &empty));
+    ASSERT_EQ(0u, empty.size());
+    if (in_memory) {
+      ASSERT_EQ(reinterpret_cast<const uint8_t*>(zip.data()) + entries[0].offset, stored.data());
+    } else {
+      ASSERT_EQ(0u, reinterpret_cast<uintptr_t>(aligned.data()) % 4096);
+    }
+
+    ZipEntry64 outside = entries[0];
+    outside.offset = zip.size() - 100;
+    ASSERT_EQ(kInvalidOffset, zip_archive::MapEntry(handle, &outside, &compressed));
+    ASSERT_EQ(kInvalidOffset, zip_archive::PrefetchEntries(handle, {entries[0], outside}));
+    CloseArchive(handle);
+
+    // Mappings of files outlive the archive.
+    ASSERT_EQ(contents,
+              std::string_view(reinterpret_cast<const char*>(stored.data()), stored.size()));
+    ASSERT_EQ(contents,
+              std::string_view(reinterpret_cast<const char*>(aligned.data()), aligned.size()));
+  }
+}
+
+static std::vector<std::string> ListIndexes(const char* dir) {
+  std::vector<std::string> result;
+  std::unique_ptr<DIR, decltype(&closedir)> d(opendir(dir), closedir);
+  while (dirent* de = readdir(d.get())) {
+    if (android::base::EndsWith(de->d_name, ".cdidx")) {
+      result.push_back(std::string(dir) + "/" + de->d_name);
+    }
+  }
+  return result;
+}
+
+static void WriteManyEntries(int fd, const std::string& prefix, size_t count) {
+  FILE* fp = fdopen(dup(fd), "w");
+  ASSERT_NE(nullptr, fp);
+  ZipWriter writer(fp);
+  for (size_t i = 0; i < count; i++) {
+    ASSERT_EQ(0, writer.StartEntry(prefix + std::to_string(i), 0));
+    ASSERT_EQ(0, writer.WriteBytes("x", 1));
+    ASSERT_EQ(0, writer.FinishEntry());
+  }
+  ASSERT_EQ(0, writer.Finish());
+  ASSERT_EQ(0, fclose(fp));
+}
+
+TEST(ziparchive, CentralDirectoryIndex) {
+  TemporaryDir dir;
+  zip_archive::SetCentralDirectoryIndexDir(dir.path);
+  TemporaryFile zip_file;
+  ASSERT_NO_FATAL_FAILURE(WriteManyEntries(zip_file.fd, "res/raw/file", 5000));
+
+  auto check = [&zip_file](const std::string& prefix) {
+    ZipArchiveHandle handle;
+    ASSERT_EQ(0, OpenArchive(zip_file.path, &handle));
+    ZipEntry64 entry;
+    ASSERT_EQ(0, FindEntry(handle, prefix + "0", &entry));
+    ASSERT_EQ(0, FindEntry(handle, prefix + "4999", &entry));
+    ASSERT_EQ(kEntryNotFound, FindEntry(handle, prefix + "5000", &entry));
+    void* cookie;
+    ASSERT_EQ(0, StartIteration(handle, &cookie, prefix, ""));
+    std::string_view name;
+    size_t count = 0;
+    while (Next(cookie, &entry, &name) == 0) {
+      count++;
+    }
+    EndIteration(cookie);
+    ASSERT_EQ(5000u, count);
+    CloseArchive(handle);
+  };
+
+  // The first open saves the index and the second uses it.
+  ASSERT_NO_FATAL_FAILURE(check("res/raw/file"));
+  auto indexes = ListIndexes(dir.path);
+  ASSERT_EQ(1u, indexes.size());
+  ASSERT_NO_FATAL_FAILURE(check("res/raw/file"));
+
+  // A damaged index is ignored.
+  std::string index;
+  ASSERT_TRUE(android::base::ReadFileToString(indexes[0], &index));
+  ASSERT_TRUE(android::base::WriteStringToFile(index.substr(0, index.size() - 1), indexes[0]));
+  ASSERT_NO_FATAL_FAILURE(check("res/raw/file"));
+
+  // So is one whose slots don't point at central directory records. The slots
+  // are the last part of the file, and only the last 1000 are damaged, so some
+  // entries are only found after the map is rebuilt.
+  ASSERT_TRUE(android::base::ReadFileToString(indexes[0], &index));
+  for (size_t i = 1; i <= 1000; i++) {
+    ZipStringOffset32 slot;
+    char* ptr = index.data() + index.size() - i * sizeof(slot);
+    memcpy(&slot, ptr, sizeof(slot));
+    if (slot.name_length != 0) {
+      slot.name_offset++;
+      memcpy(ptr, &slot, sizeof(slot));
+    }
+  }
+  ASSERT_TRUE(android::base::WriteStringToFile(index, indexes[0]));
+  for (bool iterate_first : {false, true}) {
+    ZipArchiveHandle handle;
+    ASSERT_EQ(0, OpenArchive(zip_file.path, &handle));
+    if (iterate_first) {
+      void* cookie;
+      ASSERT_EQ(0, StartIteration(handle, &cookie));
+      std::set<std::string_view> names;
+      ZipEntry64 entry;
+      std::string_view name;
+      while (Next(cookie, &entry, &name) == 0) {
+        names.insert(name);
+      }
+      EndIteration(cookie);
+      ASSERT_EQ(5000u, names.size());
+    }
+    for (size_t i = 0; i < 5000; i++) {
+      ZipEntry64 entry;
+      ASSERT_EQ(0, FindEntry(handle, "res/raw/file" + std::to_string(i), &entry)) << i;
+    }
+    CloseArchive(handle);
+  }
+
+  // A changed archive gets a new index.
+  ASSERT_EQ(0, ftruncate(zip_file.fd, 0));
+  ASSERT_EQ(0, lseek(zip_file.fd, 0, SEEK_SET));
+  ASSERT_NO_FATAL_FAILURE(WriteManyEntries(zip_file.fd, "assets/file", 5000));
+  ASSERT_NO_FATAL_FAILURE(check("assets/file"));
+  ASSERT_EQ(2u, ListIndexes(dir.path).size());
+  ASSERT_NO_FATAL_FAILURE(check("assets/file"));
+
+  // Small archives aren't indexed.
+  TemporaryFile small_file;
+  ASSERT_NO_FATAL_FAILURE(WriteManyEntries(small_file.fd, "file", 10));
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchive(small_file.path, &handle));
+  CloseArchive(handle);
+  ASSERT_EQ(2u, ListIndexes(dir.path).size());
+
+  zip_archive::SetCentralDirectoryIndexDir("");
+}
+
 #if !defined(_WIN32)
 TEST(ziparchive, OpenFromMemory) {
   const std::string zip_path = test_data_dir + "/dummy-update.zip";
@@ -987,6 +1410,242 @@ TEST(ziparchive, Inflate) {
   }
 }
 
+// A writer's error is reported as such, not as the crc mismatch that its missing data causes.
+TEST(ziparchive, ExtractToWriterError) {
+  TemporaryFile zip_file;
+  FILE* fp = fdopen(dup(zip_file.fd), "w");
+  ASSERT_NE(nullptr, fp);
+  ZipWriter zip_writer(fp);
+  const std::string contents(100000, 'x');
+  ASSERT_EQ(0, zip_writer.StartEntry("stored", 0));
+  ASSERT_EQ(0, zip_writer.WriteBytes(contents.data(), contents.size()));
+  ASSERT_EQ(0, zip_writer.FinishEntry());
+  ASSERT_EQ(0, zip_writer.StartEntry("deflated", ZipWriter::kCompress));
+  ASSERT_EQ(0, zip_writer.WriteBytes(contents.data(), contents.size()));
+  ASSERT_EQ(0, zip_writer.FinishEntry());
+  ASSERT_EQ(0, zip_writer.Finish());
+  ASSERT_EQ(0, fclose(fp));
+
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchiveFd(zip_file.fd, "ExtractToWriterError", &handle, false));
+  for (const char* name : {"stored", "deflated"}) {
+    SCOPED_TRACE(name);
+    ZipEntry64 entry;
+    ASSERT_EQ(0, FindEntry(handle, name, &entry));
+    BadWriter writer;
+    ASSERT_EQ(kIoError, ExtractToWriter(handle, &entry, &writer));
+  }
+  CloseArchive(handle);
+}
+
+// "zstd " 20000 times, compressed into a single frame at zstd's default level.
+static const std::vector<uint8_t> kZstdFrame{0x28, 0xb5, 0x2f, 0xfd, 0xa0, 0xa0, 0x86, 0x01, 0x00,
+                                             0x6d, 0x00, 0x00, 0x28, 0x7a, 0x73, 0x74, 0x64, 0x20,
+                                             0x01, 0x00, 0x98, 0x86, 0xc8, 0x8b, 0x16};
+
+// Builds an archive with |frame| as the zstd entry "file", so that reading zstd entries is tested
+// whether or not ZipWriter can write them.
+static std::vector<uint8_t> MakeZstdArchive(uint32_t uncompressed_size, uint32_t crc) {
+  const std::string name = "file";
+  std::vector<uint8_t> zip;
+  auto append = [&zip](const void* data, size_t size) {
+    auto bytes = reinterpret_cast<const uint8_t*>(data);
+    zip.insert(zip.end(), bytes, bytes + size);
+  };
+
+  LocalFileHeader lfh = {};
+  lfh.lfh_signature = LocalFileHeader::kSignature;
+  lfh.compression_method = kCompressZstd;
+  lfh.crc32 = crc;
+  lfh.compressed_size = static_cast<uint32_t>(kZstdFrame.size());
+  lfh.uncompressed_size = uncompressed_size;
+  lfh.file_name_length = static_cast<uint16_t>(name.size());
+  append(&lfh, sizeof(lfh));
+  append(name.data(), name.size());
+  append(kZstdFrame.data(), kZstdFrame.size());
+
+  const auto cd_start = static_cast<uint32_t>(zip.size());
+  CentralDirectoryRecord cdr = {};
+  cdr.record_signature = CentralDirectoryRecord::kSignature;
+  cdr.compression_method = kCompressZstd;
+  cdr.crc32 = crc;
+  cdr.compressed_size = static_cast<uint32_t>(kZstdFrame.size());
+  cdr.uncompressed_size = uncompressed_size;
+  cdr.file_name_length = static_cast<uint16_t>(name.size());
+  append(&cdr, sizeof(cdr));
+  append(name.data(), name.size());
+
+  EocdRecord eocd = {};
+  eocd.eocd_signature = EocdRecord::kSignature;
+  eocd.num_records_on_disk = 1;
+  eocd.num_records = 1;
+  eocd.cd_size = static_cast<uint32_t>(zip.size()) - cd_start;
+  eocd.cd_start_offset = cd_start;
+  append(&eocd, sizeof(eocd));
+  return zip;
+}
+
+TEST(ziparchive, ExtractZstd) {
+  std::string contents;
+  for (size_t i = 0; i < 20000; i++) {
+    contents += "zstd ";
+  }
+  const auto size = static_cast<uint32_t>(contents.size());
+  const auto crc = static_cast<uint32_t>(
+      crc32(0, reinterpret_cast<const Bytef*>(contents.data()), size));
+
+  const std::vector<uint8_t> zip = MakeZstdArchive(size, crc);
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchiveFromMemory(zip.data(), zip.size(), "ExtractZstd", &handle));
+  ZipEntry64 entry;
+  ASSERT_EQ(0, FindEntry(handle, "file", &entry));
+  ASSERT_EQ(kCompressZstd, entry.method);
+
+  // Straight into the output.
+  std::string extracted(contents.size(), '\0');
+  ASSERT_EQ(0, ExtractToMemory(handle, &entry, reinterpret_cast<uint8_t*>(extracted.data()),
+                               extracted.size()));
+  ASSERT_TRUE(contents == extracted);
+
+  // Or through the 32KiB bounce buffer, a few times over.
+  VectorWriter writer;
+  ASSERT_EQ(0, ExtractToWriter(handle, &entry, &writer));
+  ASSERT_TRUE(std::equal(contents.begin(), contents.end(), writer.GetOutput().begin(),
+                         writer.GetOutput().end()));
+  CloseArchive(handle);
+
+  // The data is checked against the crc32.
+  const std::vector<uint8_t> bad_crc_zip = MakeZstdArchive(size, crc ^ 1);
+  ASSERT_EQ(0, OpenArchiveFromMemory(bad_crc_zip.data(), bad_crc_zip.size(), "ExtractZstd",
+                                     &handle));
+  ASSERT_EQ(0, FindEntry(handle, "file", &entry));
+  ASSERT_EQ(kInconsistentInformation, ExtractToMemory(handle, &entry,
+                                                      reinterpret_cast<uint8_t*>(extracted.data()),
+                                                      extracted.size()));
+  CloseArchive(handle);
+}
+
+class BufferWriter final : public zip_archive::Writer {
+ public:
+  explicit BufferWriter(size_t size) : Writer(), buffer_(size) {}
+
+  bool Append(uint8_t*, size_t) { return false; }
+
+  Buffer GetBuffer(size_t length) {
+    return length <= buffer_.size() ? Buffer{buffer_.data(), length} : Buffer{};
+  }
+
+  std::vector<uint8_t>& GetOutput() { return buffer_; }
+
+ private:
+  std::vector<uint8_t> buffer_;
+};
+
+TEST(ziparchive, InflateBackends) {
+  const uint32_t compressed_length = static_cast<uint32_t>(kATxtContentsCompressed.size());
+  const uint32_t uncompressed_length = static_cast<uint32_t>(kATxtContents.size());
+  const VectorReader reader(kATxtContentsCompressed);
+  const auto default_backend = zip_archive::GetInflateBackend();
+
+  for (auto backend : {zip_archive::InflateBackend::kZlib, zip_archive::InflateBackend::kZlibOneShot,
+                       zip_archive::InflateBackend::kLibdeflate}) {
+    if (!zip_archive::SetInflateBackend(backend)) {
+      ASSERT_EQ(zip_archive::InflateBackend::kLibdeflate, backend);
+      continue;
+    }
+    SCOPED_TRACE(static_cast<int>(backend));
+
+    // Written directly into the writer's buffer.
+    BufferWriter writer(uncompressed_length);
+    uint64_t crc_out = 0;
+    ASSERT_EQ(0, zip_archive::Inflate(reader, compressed_length, uncompressed_length, &writer,
+                                      &crc_out));
+    ASSERT_EQ(kATxtContents, writer.GetOutput());
+    ASSERT_EQ(0x950821C5u, crc_out);
+
+    // Or appended, 32KiB at a time.
+    VectorWriter vector_writer;
+    ASSERT_EQ(0, zip_archive::Inflate(reader, compressed_length, uncompressed_length,
+                                      &vector_writer, &crc_out));
+    ASSERT_EQ(kATxtContents, vector_writer.GetOutput());
+
+    // More data than the entry claims doesn't fit.
+    BufferWriter short_writer(uncompressed_length - 1);
+    ASSERT_GT(0, zip_archive::Inflate(reader, compressed_length, uncompressed_length - 1,
+                                      &short_writer, nullptr));
+  }
+  ASSERT_TRUE(zip_archive::SetInflateBackend(default_backend));
+}
+
+// Reads from a buffer, remembering the biggest read.
+class MaxReadReader final : public zip_archive::Reader {
+ public:
+  explicit MaxReadReader(std::span<const uint8_t> input) : Reader(), input_(input) {}
+
+  bool ReadAtOffset(uint8_t* buf, size_t len, off64_t offset) const {
+    max_read_ = std::max(max_read_, len);
+    memcpy(buf, input_.data() + offset, len);
+    return true;
+  }
+
+  size_t max_read() const { return max_read_; }
+
+ private:
+  std::span<const uint8_t> input_;
+  mutable size_t max_read_ = 0;
+};
+
+TEST(ziparchive, InflateBackendsLargeEntry) {
+  // Incompressible, so that the compressed data is as big as the entry.
+  std::vector<uint8_t> contents(8 * 1024 * 1024);
+  std::mt19937 random;
+  std::generate(contents.begin(), contents.end(), [&random]() { return random(); });
+
+  TemporaryFile zip_file;
+  FILE* fp = fdopen(dup(zip_file.fd), "w");
+  ASSERT_NE(nullptr, fp);
+  ZipWriter zip_writer(fp);
+  ASSERT_EQ(0, zip_writer.StartEntry("large", ZipWriter::kCompress));
+  ASSERT_EQ(0, zip_writer.WriteBytes(contents.data(), contents.size()));
+  ASSERT_EQ(0, zip_writer.FinishEntry());
+  ASSERT_EQ(0, zip_writer.Finish());
+  ASSERT_EQ(0, fclose(fp));
+  std::string zip;
+  ASSERT_TRUE(android::base::ReadFileToString(zip_file.path, &zip));
+
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchiveFd(zip_file.fd, "InflateBackendsLargeEntry", &handle, false));
+  ZipEntry64 entry;
+  ASSERT_EQ(0, FindEntry(handle, "large", &entry));
+  ASSERT_EQ(kCompressDeflated, entry.method);
+  const auto compressed = std::span(reinterpret_cast<const uint8_t*>(zip.data()), zip.size())
+                                  .subspan(entry.offset, entry.compressed_length);
+
+  const auto default_backend = zip_archive::GetInflateBackend();
+  for (auto backend : {zip_archive::InflateBackend::kZlib, zip_archive::InflateBackend::kZlibOneShot,
+                       zip_archive::InflateBackend::kLibdeflate}) {
+    if (!zip_archive::SetInflateBackend(backend)) {
+      continue;
+    }
+    SCOPED_TRACE(static_cast<int>(backend));
+
+    std::vector<uint8_t> extracted(contents.size());
+    ASSERT_EQ(0, ExtractToMemory(handle, &entry, extracted.data(), extracted.size()));
+    ASSERT_TRUE(contents == extracted);
+
+    // A file's data is streamed through 32KiB reads, rather than read whole, even into a writer
+    // with room for all of it.
+    MaxReadReader reader(compressed);
+    BufferWriter writer(std::max(entry.compressed_length, entry.uncompressed_length));
+    ASSERT_EQ(0, zip_archive::Inflate(reader, entry.compressed_length, entry.uncompressed_length,
+                                      &writer, nullptr));
+    ASSERT_TRUE(std::equal(contents.begin(), contents.end(), writer.GetOutput().begin()));
+    ASSERT_LE(reader.max_read(), 32768u);
+  }
+  ASSERT_TRUE(zip_archive::SetInflateBackend(default_backend));
+  CloseArchive(handle);
+}
+
 // The class constructs a zipfile with zip64 format, and test the parsing logic.
 class Zip64ParseTest : public ::testing::Test {
  protected:
@@ -1030,9 +1689,11 @@ class Zip64ParseTest : public ::testing::Test {
   };
 
   static void ConstructLocalFileHeader(const std::string& name, std::vector<uint8_t>* output,
-                                       uint32_t uncompressed_size, uint32_t compressed_size) {
+                                       uint32_t uncompressed_size, uint32_t compressed_size,
+                                       uint32_t crc) {
     LocalFileHeader lfh = {};
     lfh.lfh_signature = LocalFileHeader::kSignature;
+    lfh.crc32 = crc;
     lfh.compressed_size = compressed_size;
     lfh.uncompressed_size = uncompressed_size;
     lfh.file_name_length = static_cast<uint16_t>(name.size());
@@ -1060,9 +1721,10 @@ class Zip64ParseTest : public ::testing::Test {
 
   static void ConstructCentralDirectoryRecord(const std::string& name, uint32_t uncompressed_size,
                                               uint32_t compressed_size, uint32_t local_offset,
-                                              std::vector<uint8_t>* output) {
+                                              uint32_t crc, std::vector<uint8_t>* output) {
     CentralDirectoryRecord cdr = {};
     cdr.record_signature = CentralDirectoryRecord::kSignature;
+    cdr.crc32 = crc;
     cdr.compressed_size = uncompressed_size;
     cdr.uncompressed_size = compressed_size;
     cdr.file_name_length = static_cast<uint16_t>(name.size());
@@ -1079,6 +1741,8 @@ class Zip64ParseTest : public ::testing::Test {
                 bool local_offset_in_extended, bool include_data_descriptor = false) {
     auto uncompressed_size = static_cast<uint32_t>(content.size());
     auto compressed_size = static_cast<uint32_t>(content.size());
+    const auto crc = static_cast<uint32_t>(
+        crc32(0, content.data(), static_cast<uint32_t>(content.size())));
     uint32_t local_file_header_offset = 0;
     std::for_each(file_entries_.begin(), file_entries_.end(),
                   [&local_file_header_offset](const LocalFileEntry& file_entry) {
@@ -1101,14 +1765,14 @@ class Zip64ParseTest : public ::testing::Test {
         .compressed_bytes = content,
     };
     ConstructLocalFileHeader(name, &local_entry.local_file_header, uncompressed_size,
-                             compressed_size);
+                             compressed_size, crc);
     ConstructExtendedField(zip64_fields, &local_entry.extended_field);
     if (include_data_descriptor) {
       size_t descriptor_size = compressed_size_in_extended ? 24 : 16;
       local_entry.data_descriptor.resize(descriptor_size);
       uint8_t* write_ptr = local_entry.data_descriptor.data();
       EmitUnaligned<uint32_t>(&write_ptr, DataDescriptor::kOptSignature);
-      EmitUnaligned<uint32_t>(&write_ptr, 0 /* crc */);
+      EmitUnaligned<uint32_t>(&write_ptr, crc);
       if (compressed_size_in_extended) {
         EmitUnaligned<uint64_t>(&write_ptr, compressed_size_in_extended);
         EmitUnaligned<uint64_t>(&write_ptr, uncompressed_size_in_extended);
@@ -1130,7 +1794,8 @@ class Zip64ParseTest : public ::testing::Test {
         .extended_field = {},
     };
     ConstructCentralDirectoryRecord(name, uncompressed_size, compressed_size,
-                                    local_file_header_offset, &cd_entry.central_directory_record);
+                                    local_file_header_offset, crc,
+                                    &cd_entry.central_directory_record);
     ConstructExtendedField(zip64_fields, &cd_entry.extended_field);
     cd_entries_.push_back(std::move(cd_entry));
   }
@@ -1389,6 +2054,7 @@ TEST_F(Zip64ParseTest, extraLFHOffset) {
   ConstructCentralDirectoryRecord(
       "b.txt", static_cast<uint32_t>(content.size()),
       static_cast<uint32_t>(content.size()), local_file_header_offset,
+      static_cast<uint32_t>(crc32(0, content.data(), static_cast<uint32_t>(content.size()))),
       &cd_entry.central_directory_record);
   ConstructEocd();
   ConstructZipFile();
@@ -1429,3 +2095,121 @@ TEST(ziparchive, Bug174945959) {
   }
   EndIteration(cookie);
 }
+
+// Entries that ZipWriter writes with data descriptors when its output is a
+// pipe, including stored data that contains a data descriptor signature.
+static const std::vector<std::pair<std::string, std::string>> kStreamedEntries{
+    {"empty", ""},
+    {"stored", std::string(100000, 's')},
+    {"compressed", std::string(200000, 'c')},
+    // A data descriptor for "ab", but with the wrong crc32.
+    {"signature", std::string("abPK\x07\x08\0\0\0\0\x02\0\0\0\x02\0\0\0", 18)},
+    {"aligned", "aligned"},
+};
+
+static void WriteStreamedArchive(FILE* fp) {
+  ZipWriter writer(fp);
+  for (const auto& [name, contents] : kStreamedEntries) {
+    const size_t flags = name == "compressed" ? ZipWriter::kCompress : 0;
+    EXPECT_EQ(0, writer.StartAlignedEntry(name, flags, name == "aligned" ? 4096 : 0));
+    EXPECT_EQ(0, writer.WriteBytes(contents.data(), contents.size()));
+    EXPECT_EQ(0, writer.FinishEntry());
+  }
+  EXPECT_EQ(0, writer.Finish());
+  EXPECT_EQ(0, fclose(fp));
+}
+
+#if !defined(_WIN32)
+TEST(ziparchive, StreamReader) {
+  for (bool seekable : {false, true}) {
+    SCOPED_TRACE(seekable);
+    TemporaryFile zip_file;
+    android::base::unique_fd read_fd;
+    std::thread writer_thread;
+    if (seekable) {
+      FILE* fp = fdopen(dup(zip_file.fd), "w");
+      ASSERT_NE(nullptr, fp);
+      WriteStreamedArchive(fp);
+      ASSERT_EQ(0, lseek(zip_file.fd, 0, SEEK_SET));
+      read_fd.reset(dup(zip_file.fd));
+    } else {
+      android::base::unique_fd write_fd;
+      ASSERT_TRUE(android::base::Pipe(&read_fd, &write_fd));
+      FILE* fp = fdopen(write_fd.release(), "w");
+      ASSERT_NE(nullptr, fp);
+      writer_thread = std::thread(WriteStreamedArchive, fp);
+    }
+
+    ZipStreamReader reader(read_fd.get());
+    ZipEntry64 entry;
+    std::string name;
+    for (size_t i = 0; i < kStreamedEntries.size(); i++) {
+      ASSERT_EQ(0, reader.Next(&entry, &name));
+      const auto& [expected_name, contents] = kStreamedEntries[i];
+      ASSERT_EQ(expected_name, name);
+      ASSERT_EQ(!seekable, entry.has_data_descriptor);
+      if (name == "aligned") {
+        ASSERT_EQ(0, entry.offset % 4096);
+      }
+      // Skip every other entry, to check that the reader finds the next one.
+      if (i % 2 == 0) {
+        continue;
+      }
+      VectorWriter writer;
+      ASSERT_EQ(0, reader.ReadData(&entry, &writer));
+      ASSERT_EQ(contents, std::string(writer.GetOutput().begin(), writer.GetOutput().end()));
+      ASSERT_EQ(contents.size(), entry.uncompressed_length);
+      ASSERT_EQ(ZipCrc32(0, reinterpret_cast<const uint8_t*>(contents.data()), contents.size()),
+                entry.crc32);
+      ASSERT_EQ(kInvalidHandle, reader.ReadData(&entry, &writer));
+    }
+    ASSERT_EQ(kIterationEnd, reader.Next(&entry, &name));
+
+    // Drain the central directory, so that the writer can finish.
+    char buf[4096];
+    while (TEMP_FAILURE_RETRY(read(read_fd.get(), buf, sizeof(buf))) > 0) {
+    }
+    if (writer_thread.joinable()) {
+      writer_thread.join();
+    }
+  }
+}
+#endif
+
+TEST(ziparchive, StreamReaderErrors) {
+  TemporaryFile zip_file;
+  FILE* fp = fdopen(dup(zip_file.fd), "w");
+  ASSERT_NE(nullptr, fp);
+  WriteStreamedArchive(fp);
+  std::string zip;
+  ASSERT_TRUE(android::base::ReadFileToString(zip_file.path, &zip));
+
+  // Finds entry |name| in |data| and reads it, returning the first error.
+  auto read_entry = [](const std::string& data, const std::string& entry_name) {
+    TemporaryFile file;
+    EXPECT_TRUE(android::base::WriteStringToFd(data, file.fd));
+    EXPECT_EQ(0, lseek(file.fd, 0, SEEK_SET));
+    ZipStreamReader reader(file.fd);
+    ZipEntry64 entry;
+    std::string name;
+    int32_t result;
+    while ((result = reader.Next(&entry, &name)) == 0 && name != entry_name) {
+    }
+    if (result != 0) {
+      return result;
+    }
+    VectorWriter writer;
+    return reader.ReadData(&entry, &writer);
+  };
+  ASSERT_EQ(0, read_entry(zip, "aligned"));
+
+  const size_t stored = zip.find(std::string(100, 's'));
+  ASSERT_NE(std::string::npos, stored);
+  std::string corrupt = zip;
+  corrupt[stored] = 't';
+  ASSERT_EQ(kInconsistentInformation, read_entry(corrupt, "stored"));
+
+  // The input ends in entry data, then in a local file header.
+  ASSERT_EQ(kIoError, read_entry(zip.substr(0, stored + 1000), "stored"));
+  ASSERT_EQ(kIoError, read_entry(zip.substr(0, stored + 100000 + 10), "compressed"));
+}
@@ -18,8 +18,37 @@
 
 #include "zip_cd_entry_map.h"
 
-static uint32_t ComputeHash(std::string_view name) {
-  return static_cast<uint32_t>(std::hash<std::string_view>{}(name));
+#include <string.h>
+
+#include <algorithm>
+#include <bit>
+
+#include "zip_archive_common.h"
+
+static inline uint64_t Load64(const void* p) {
+  uint64_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+// The low 7 bits of the hash are the fingerprint and the rest pick the group.
+static uint64_t ComputeHash(std::string_view name) {
+  return std::hash<std::string_view>{}(name);
+}
+
+static constexpr uint64_t kLsbs = 0x0101010101010101;
+static constexpr uint64_t kMsbs = 0x8080808080808080;
+
+// Returns a mask with the top bit of each byte of |ctrl| equal to |value| set.
+// There may be false positives, but only just after a true one, and the names
+// are compared anyway.
+static inline uint64_t MatchByte(uint64_t ctrl, uint8_t value) {
+  const uint64_t x = ctrl ^ (kLsbs * value);
+  return (x - kLsbs) & ~x & kMsbs;
+}
+
+static inline uint8_t Fingerprint(uint64_t hash) {
+  return static_cast<uint8_t>(hash & 0x7f);
 }
 
 template <typename ZipStringOffset>
@@ -28,19 +57,68 @@ const std::string_view ToStringView(ZipStringOffset& entry, const uint8_t *start
   return std::string_view{name, entry.name_length};
 }
 
-// Convert a ZipEntry to a hash table index, verifying that it's in a valid range.
 template <typename ZipStringOffset>
-std::pair<ZipError, uint64_t> CdEntryMapZip32<ZipStringOffset>::GetCdEntryOffset(
-        std::string_view name, const uint8_t* start) const {
-  const uint32_t hash = ComputeHash(name);
+CdEntryMapTable<ZipStringOffset>::CdEntryMapTable(uint64_t num_entries) {
+  /*
+   * Keep the load factor below 7/8, so there's always an empty slot to end a
+   * probe, and round up to a power of 2.
+   */
+  capacity_ = std::bit_ceil(std::max<size_t>(kGroupSize, num_entries + num_entries / 7 + 1));
+  ctrl_.reset(new uint8_t[capacity_]);
+  memset(ctrl_.get(), kEmpty, capacity_);
+  slots_.reset(new ZipStringOffset[capacity_]());
+}
 
-  // NOTE: (hash_table_size - 1) is guaranteed to be non-negative.
-  uint32_t ent = hash & (hash_table_size_ - 1);
-  while (hash_table_[ent].name_offset != 0) {
-    if (ToStringView(hash_table_[ent], start) == name) {
-      return {kSuccess, static_cast<uint64_t>(hash_table_[ent].name_offset)};
+template <typename ZipStringOffset>
+std::pair<size_t, bool> CdEntryMapTable<ZipStringOffset>::FindSlot(std::string_view name,
+                                                                   uint64_t hash,
+                                                                   const uint8_t* start) const {
+  const uint8_t fingerprint = Fingerprint(hash);
+  const size_t mask = capacity_ - 1;
+  // Groups are aligned and probed one after the other. Nothing is ever
+  // removed, so a name can't be past a group with an empty slot.
+  for (size_t group = (hash >> 7) & mask & ~(kGroupSize - 1);;
+       group = (group + kGroupSize) & mask) {
+    const uint64_t ctrl = Load64(&ctrl_[group]);
+    for (uint64_t match = MatchByte(ctrl, fingerprint); match != 0; match &= match - 1) {
+      const size_t slot = group + std::countr_zero(match) / 8;
+      if (ToStringView(slots_[slot], start) == name) {
+        return {slot, true};
+      }
+    }
+    if (const uint64_t empty = ctrl & kMsbs; empty != 0) {
+      return {group + std::countr_zero(empty) / 8, false};
     }
-    ent = (ent + 1) & (hash_table_size_ - 1);
+  }
+}
+
+template <typename ZipStringOffset>
+void CdEntryMapTable<ZipStringOffset>::Resize(size_t capacity, const uint8_t* start) {
+  auto old_ctrl = std::move(ctrl_);
+  auto old_slots = std::move(slots_);
+  const size_t old_capacity = capacity_;
+
+  capacity_ = capacity;
+  ctrl_.reset(new uint8_t[capacity_]);
+  memset(ctrl_.get(), kEmpty, capacity_);
+  slots_.reset(new ZipStringOffset[capacity_]());
+  for (size_t i = 0; i < old_capacity; i++) {
+    if (old_ctrl[i] == kEmpty) continue;
+    const std::string_view name = ToStringView(old_slots[i], start);
+    const uint64_t hash = ComputeHash(name);
+    const size_t slot = FindSlot(name, hash, start).first;
+    ctrl_[slot] = Fingerprint(hash);
+    slots_[slot] = old_slots[i];
+  }
+}
+
+// Convert a ZipEntry to a hash table index, verifying that it's in a valid range.
+template <typename ZipStringOffset>
+std::pair<ZipError, uint64_t> CdEntryMapTable<ZipStringOffset>::GetCdEntryOffset(
+        std::string_view name, const uint8_t* start) const {
+  const auto [slot, found] = FindSlot(name, ComputeHash(name), start);
+  if (found) {
+    return {kSuccess, static_cast<uint64_t>(slots_[slot].name_offset)};
   }
 
   ALOGV("Zip: Unable to find entry %.*s", static_cast<int>(name.size()), name.data());
@@ -48,43 +126,43 @@ std::pair<ZipError, uint64_t> CdEntryMapZip32<ZipStringOffset>::GetCdEntryOffset
 }
 
 template <typename ZipStringOffset>
-ZipError CdEntryMapZip32<ZipStringOffset>::AddToMap(std::string_view name, const uint8_t* start) {
-  const uint64_t hash = ComputeHash(name);
-  uint32_t ent = hash & (hash_table_size_ - 1);
+ZipError CdEntryMapTable<ZipStringOffset>::AddToMap(std::string_view name, const uint8_t* start) {
+  // The table is sized up front for the archive's entries, so this only
+  // happens if it was created without a count.
+  if ((size_ + 1) * 8 > capacity_ * 7) {
+    Resize(capacity_ * 2, start);
+  }
 
-  /*
-   * We over-allocated the table, so we're guaranteed to find an empty slot.
-   * Further, we guarantee that the hashtable size is not 0.
-   */
-  while (hash_table_[ent].name_offset != 0) {
-    if (ToStringView(hash_table_[ent], start) == name) {
-      // We've found a duplicate entry. We don't accept duplicates.
-      ALOGW("Zip: Found duplicate entry %.*s", static_cast<int>(name.size()), name.data());
-      return kDuplicateEntry;
-    }
-    ent = (ent + 1) & (hash_table_size_ - 1);
+  const uint64_t hash = ComputeHash(name);
+  const auto [slot, found] = FindSlot(name, hash, start);
+  if (found) {
+    // We've found a duplicate entry. We don't accept duplicates.
+    ALOGW("Zip: Found duplicate entry %.*s", static_cast<int>(name.size()), name.data());
+    return kDuplicateEntry;
   }
 
   // `name` has already been validated before entry.
   const char* start_char = reinterpret_cast<const char*>(start);
-  hash_table_[ent].name_offset = static_cast<uint32_t>(name.data() - start_char);
-  hash_table_[ent].name_length = static_cast<uint16_t>(name.size());
+  auto& entry = slots_[slot];
+  ctrl_[slot] = Fingerprint(hash);
+  entry.name_offset = static_cast<decltype(entry.name_offset)>(name.data() - start_char);
+  entry.name_length = static_cast<uint16_t>(name.size());
+  size_++;
   return kSuccess;
 }
 
 template <typename ZipStringOffset>
-void CdEntryMapZip32<ZipStringOffset>::ResetIteration() {
+void CdEntryMapTable<ZipStringOffset>::ResetIteration() {
   current_position_ = 0;
 }
 
 template <typename ZipStringOffset>
-std::pair<std::string_view, uint64_t> CdEntryMapZip32<ZipStringOffset>::Next(
+std::pair<std::string_view, uint64_t> CdEntryMapTable<ZipStringOffset>::Next(
         const uint8_t* cd_start) {
-  while (current_position_ < hash_table_size_) {
-    const auto& entry = hash_table_[current_position_];
-    current_position_ += 1;
-
-    if (entry.name_offset != 0) {
+  while (current_position_ < capacity_) {
+    const size_t position = current_position_++;
+    if (ctrl_[position] != kEmpty) {
+      const auto& entry = slots_[position];
       return {ToStringView(entry, cd_start), static_cast<uint64_t>(entry.name_offset)};
     }
   }
@@ -92,49 +170,206 @@ std::pair<std::string_view, uint64_t> CdEntryMapZip32<ZipStringOffset>::Next(
   return {};
 }
 
-ZipError CdEntryMapZip64::AddToMap(std::string_view name, const uint8_t* start) {
-  const auto [it, added] =
-      entry_table_.insert({name, name.data() - reinterpret_cast<const char*>(start)});
-  if (!added) {
-    ALOGW("Zip: Found duplicate entry %.*s", static_cast<int>(name.size()), name.data());
-    return kDuplicateEntry;
+template class CdEntryMapTable<ZipStringOffset20>;
+template class CdEntryMapTable<ZipStringOffset32>;
+template class CdEntryMapTable<ZipStringOffset64>;
+
+std::unique_ptr<CdEntryMapInterface> CdEntryMapInterface::Create(uint64_t num_entries,
+        size_t cd_length, uint16_t max_file_name_length) {
+  using T = std::unique_ptr<CdEntryMapInterface>;
+  if (num_entries > UINT16_MAX)
+    return T(new CdEntryMapZip64(num_entries));
+
+  uint16_t num_entries_ = static_cast<uint16_t>(num_entries);
+  if (cd_length > ZipStringOffset20::offset_max ||
+      max_file_name_length > ZipStringOffset20::length_max) {
+    return T(new CdEntryMapZip32<ZipStringOffset32>(num_entries_));
   }
-  return kSuccess;
+  return T(new CdEntryMapZip32<ZipStringOffset20>(num_entries_));
+}
+
+namespace {
+
+using IndexTable = CdEntryMapTable<ZipStringOffset32>;
+
+// Followed by |capacity| control bytes and then |capacity| slots.
+struct IndexTableHeader {
+  // The hash of kHashCheckName, so that a table can't be used by a build
+  // whose std::hash differs from the one that saved it.
+  uint64_t hash_check;
+  uint64_t capacity;
+};
+
+static_assert(sizeof(ZipStringOffset32) == 8);
+
+constexpr std::string_view kHashCheckName = "META-INF/MANIFEST.MF";
+
+}  // namespace
+
+std::string CdEntryMapIndex::Serialize(CdEntryMapInterface* map, uint64_t num_entries,
+                                       const uint8_t* cd_start) {
+  IndexTable table(num_entries);
+  map->ResetIteration();
+  for (auto entry = map->Next(cd_start); entry != std::pair<std::string_view, uint64_t>();
+       entry = map->Next(cd_start)) {
+    table.AddToMap(entry.first, cd_start);
+  }
+  map->ResetIteration();
+
+  const size_t capacity = table.capacity_;
+  const IndexTableHeader header = {ComputeHash(kHashCheckName), capacity};
+  std::string result(sizeof(header) + capacity * (1 + sizeof(ZipStringOffset32)), '\0');
+  char* ptr = result.data();
+  memcpy(ptr, &header, sizeof(header));
+  memcpy(ptr + sizeof(header), table.ctrl_.get(), capacity);
+  memcpy(ptr + sizeof(header) + capacity, table.slots_.get(),
+         capacity * sizeof(ZipStringOffset32));
+  return result;
 }
 
-std::pair<ZipError, uint64_t> CdEntryMapZip64::GetCdEntryOffset(std::string_view name,
-                                                                const uint8_t* /*cd_start*/) const {
-  const auto it = entry_table_.find(name);
-  if (it == entry_table_.end()) {
-    ALOGV("Zip: Could not find entry %.*s", static_cast<int>(name.size()), name.data());
-    return {kEntryNotFound, 0};
+std::unique_ptr<CdEntryMapIndex> CdEntryMapIndex::Create(
+    std::unique_ptr<android::base::MappedFile> storage, const uint8_t* data, size_t size,
+    size_t cd_length, std::function<std::unique_ptr<CdEntryMapInterface>()> rebuild) {
+  IndexTableHeader header;
+  if (size < sizeof(header)) {
+    return nullptr;
+  }
+  memcpy(&header, data, sizeof(header));
+  const size_t max_capacity = (size - sizeof(header)) / (1 + sizeof(ZipStringOffset32));
+  if (header.hash_check != ComputeHash(kHashCheckName) || header.capacity > max_capacity ||
+      header.capacity < IndexTable::kGroupSize || !std::has_single_bit(header.capacity) ||
+      size != sizeof(header) + header.capacity * (1 + sizeof(ZipStringOffset32))) {
+    ALOGW("Zip: Ignoring central directory index with the wrong layout");
+    return nullptr;
   }
 
-  return {kSuccess, it->second};
+  const uint8_t* ctrl = data + sizeof(header);
+  const uint8_t* slots = ctrl + header.capacity;
+  if (reinterpret_cast<uintptr_t>(slots) % alignof(ZipStringOffset32) != 0) {
+    return nullptr;
+  }
+  return std::unique_ptr<CdEntryMapIndex>(
+      new CdEntryMapIndex(std::move(storage), ctrl,
+                          reinterpret_cast<const ZipStringOffset32*>(slots),
+                          static_cast<size_t>(header.capacity), cd_length,
+                          std::move(rebuild)));
 }
 
-void CdEntryMapZip64::ResetIteration() {
-  iterator_ = entry_table_.begin();
+CdEntryMapIndex::CdEntryMapIndex(std::unique_ptr<android::base::MappedFile> storage,
+                                 const uint8_t* ctrl, const ZipStringOffset32* slots,
+                                 size_t capacity, size_t cd_length,
+                                 std::function<std::unique_ptr<CdEntryMapInterface>()> rebuild)
+    : storage_(std::move(storage)),
+      ctrl_(ctrl),
+      slots_(slots),
+      capacity_(capacity),
+      cd_length_(cd_length),
+      rebuild_(std::move(rebuild)) {}
+
+ZipError CdEntryMapIndex::AddToMap(std::string_view, const uint8_t*) {
+  ALOGW("Zip: Can't add entries to a saved central directory index");
+  return kInvalidFile;
 }
 
-std::pair<std::string_view, uint64_t> CdEntryMapZip64::Next(const uint8_t* /*cd_start*/) {
-  if (iterator_ == entry_table_.end()) {
+std::string_view CdEntryMapIndex::SlotName(size_t slot, const uint8_t* cd_start) const {
+  const auto& entry = slots_[slot];
+  const size_t name_offset = entry.name_offset;
+  CentralDirectoryRecord cdr;
+  if (name_offset < sizeof(cdr) || name_offset > cd_length_) {
+    ALOGW("Zip: Central directory index slot %zu is out of range", slot);
+    return {};
+  }
+  // The record may not be aligned.
+  memcpy(&cdr, cd_start + name_offset - sizeof(cdr), sizeof(cdr));
+  const size_t record_length =
+      static_cast<size_t>(cdr.file_name_length) + cdr.extra_field_length + cdr.comment_length;
+  if (cdr.record_signature != CentralDirectoryRecord::kSignature ||
+      cdr.file_name_length != entry.name_length || record_length > cd_length_ - name_offset) {
+    ALOGW("Zip: Central directory index slot %zu doesn't point at a record", slot);
     return {};
   }
+  return ToStringView(entry, cd_start);
+}
 
-  return *iterator_++;
+CdEntryMapInterface* CdEntryMapIndex::Rebuilt() const {
+  std::call_once(rebuild_once_, [this] {
+    ALOGW("Zip: Ignoring damaged central directory index");
+    rebuilt_ = rebuild_();
+    damaged_.store(true, std::memory_order_release);
+  });
+  return rebuilt_.get();
 }
 
-std::unique_ptr<CdEntryMapInterface> CdEntryMapInterface::Create(uint64_t num_entries,
-        size_t cd_length, uint16_t max_file_name_length) {
-  using T = std::unique_ptr<CdEntryMapInterface>;
-  if (num_entries > UINT16_MAX)
-    return T(new CdEntryMapZip64());
+std::pair<ZipError, uint64_t> CdEntryMapIndex::GetCdEntryOffset(std::string_view name,
+                                                                const uint8_t* cd_start) const {
+  if (damaged_.load(std::memory_order_acquire)) {
+    const CdEntryMapInterface* rebuilt = Rebuilt();
+    return rebuilt ? rebuilt->GetCdEntryOffset(name, cd_start)
+                   : std::pair<ZipError, uint64_t>(kInvalidFile, 0);
+  }
 
-  uint16_t num_entries_ = static_cast<uint16_t>(num_entries);
-  if (cd_length > ZipStringOffset20::offset_max ||
-      max_file_name_length > ZipStringOffset20::length_max) {
-    return T(new CdEntryMapZip32<ZipStringOffset32>(num_entries_));
+  const uint64_t hash = ComputeHash(name);
+  const uint8_t fingerprint = Fingerprint(hash);
+  const size_t mask = capacity_ - 1;
+  size_t group = (hash >> 7) & mask & ~(IndexTable::kGroupSize - 1);
+  for (size_t probed = 0; probed < capacity_; probed += IndexTable::kGroupSize) {
+    const uint64_t ctrl = Load64(&ctrl_[group]);
+    for (uint64_t match = MatchByte(ctrl, fingerprint); match != 0; match &= match - 1) {
+      const size_t slot = group + std::countr_zero(match) / 8;
+      const std::string_view slot_name = SlotName(slot, cd_start);
+      if (slot_name.data() == nullptr) {
+        Rebuilt();
+        return GetCdEntryOffset(name, cd_start);
+      }
+      if (slot_name == name) {
+        return {kSuccess, static_cast<uint64_t>(slots_[slot].name_offset)};
+      }
+    }
+    if ((ctrl & kMsbs) != 0) {
+      break;
+    }
+    group = (group + IndexTable::kGroupSize) & mask;
   }
-  return T(new CdEntryMapZip32<ZipStringOffset20>(num_entries_));
+
+  ALOGV("Zip: Unable to find entry %.*s", static_cast<int>(name.size()), name.data());
+  return {kEntryNotFound, 0};
+}
+
+void CdEntryMapIndex::ResetIteration() {
+  current_position_ = 0;
+  if (damaged_.load(std::memory_order_acquire) && Rebuilt() != nullptr) {
+    Rebuilt()->ResetIteration();
+  }
+}
+
+std::pair<std::string_view, uint64_t> CdEntryMapIndex::Next(const uint8_t* cd_start) {
+  if (!damaged_.load(std::memory_order_acquire) && !all_slots_checked_) {
+    for (size_t slot = 0; slot < capacity_; slot++) {
+      if (ctrl_[slot] != IndexTable::kEmpty && SlotName(slot, cd_start).data() == nullptr) {
+        if (Rebuilt() != nullptr) {
+          Rebuilt()->ResetIteration();
+        }
+        break;
+      }
+    }
+    all_slots_checked_ = true;
+  }
+  if (damaged_.load(std::memory_order_acquire)) {
+    CdEntryMapInterface* rebuilt = Rebuilt();
+    return rebuilt ? rebuilt->Next(cd_start) : std::pair<std::string_view, uint64_t>();
+  }
+
+  while (current_position_ < capacity_) {
+    const size_t position = current_position_++;
+    if (ctrl_[position] != IndexTable::kEmpty) {
+      const std::string_view name = SlotName(position, cd_start);
+      if (name.data() == nullptr) {
+        // Stop rather than skip entries without saying so.
+        current_position_ = capacity_;
+        return {};
+      }
+      return {name, static_cast<uint64_t>(slots_[position].name_offset)};
+    }
+  }
+  return {};
 }
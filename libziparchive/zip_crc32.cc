@@ -0,0 +1,156 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "zip_crc32.h"
+
+#include <string.h>
+
+#include "zlib.h"
+
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define ZIP_CRC32_ARM 1
+#define ZIP_CRC32_ARM_TARGET
+#elif defined(__aarch64__) && defined(__linux__)
+// The default arm64 targets don't assume the CRC32 instructions, so check for them at runtime.
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#define ZIP_CRC32_ARM 1
+#define ZIP_CRC32_ARM_TARGET __attribute__((target("crc")))
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#elif defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ZIP_CRC32_PCLMUL 1
+#endif
+
+#if defined(ZIP_CRC32_ARM)
+ZIP_CRC32_ARM_TARGET static uint32_t Crc32Arm(uint32_t crc, const uint8_t* buf, size_t len) {
+  crc = ~crc;
+  for (; len > 0 && (reinterpret_cast<uintptr_t>(buf) & 7) != 0; --len) {
+    crc = __crc32b(crc, *buf++);
+  }
+  for (; len >= 8; len -= 8, buf += 8) {
+    uint64_t word;
+    memcpy(&word, buf, sizeof(word));
+    crc = __crc32d(crc, word);
+  }
+  for (; len > 0; --len) {
+    crc = __crc32b(crc, *buf++);
+  }
+  return ~crc;
+}
+
+static bool HaveArmCrc32() {
+#if defined(__ARM_FEATURE_CRC32)
+  return true;
+#else
+  static const bool have_crc32 = (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+  return have_crc32;
+#endif
+}
+#endif
+
+#if defined(ZIP_CRC32_PCLMUL)
+#define ZIP_CRC32_TARGET __attribute__((target("pclmul,sse4.1")))
+
+ZIP_CRC32_TARGET static inline __m128i Load(const uint8_t* p) {
+  return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+}
+
+// Multiplies |x| forward by the distance |k| encodes and adds |next|.
+ZIP_CRC32_TARGET static inline __m128i Fold(__m128i x, __m128i k, __m128i next) {
+  return _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x11), next),
+                       _mm_clmulepi64_si128(x, k, 0x00));
+}
+
+/*
+ * Folds 64 bytes at a time with carry-less multiplication, as in Intel's "Fast CRC Computation
+ * for Generic Polynomials Using PCLMULQDQ Instruction". The constants are for the bit-reflected
+ * CRC32 polynomial 0x04C11DB7.
+ *
+ * |len| must be at least 64 and a multiple of 16. |crc| isn't pre- or post-conditioned.
+ */
+ZIP_CRC32_TARGET static uint32_t Crc32Pclmul(uint32_t crc, const uint8_t* buf, size_t len) {
+  alignas(16) static const uint64_t k1k2[] = {0x0154442bd4, 0x01c6e41596};
+  alignas(16) static const uint64_t k3k4[] = {0x01751997d0, 0x00ccaa009e};
+  alignas(16) static const uint64_t k5k0[] = {0x0163cd6124, 0x0000000000};
+  alignas(16) static const uint64_t poly[] = {0x01db710641, 0x01f7011641};
+
+  __m128i x1 = _mm_xor_si128(Load(buf), _mm_cvtsi32_si128(static_cast<int>(crc)));
+  __m128i x2 = Load(buf + 16);
+  __m128i x3 = Load(buf + 32);
+  __m128i x4 = Load(buf + 48);
+  buf += 64;
+  len -= 64;
+
+  // Four lanes of 16 bytes in parallel.
+  __m128i k = _mm_load_si128(reinterpret_cast<const __m128i*>(k1k2));
+  for (; len >= 64; buf += 64, len -= 64) {
+    x1 = Fold(x1, k, Load(buf));
+    x2 = Fold(x2, k, Load(buf + 16));
+    x3 = Fold(x3, k, Load(buf + 32));
+    x4 = Fold(x4, k, Load(buf + 48));
+  }
+
+  // Then down to one lane, and through whatever's left 16 bytes at a time.
+  k = _mm_load_si128(reinterpret_cast<const __m128i*>(k3k4));
+  x1 = Fold(x1, k, x2);
+  x1 = Fold(x1, k, x3);
+  x1 = Fold(x1, k, x4);
+  for (; len >= 16; buf += 16, len -= 16) {
+    x1 = Fold(x1, k, Load(buf));
+  }
+
+  // 128 bits to 64.
+  const __m128i mask = _mm_setr_epi32(~0, 0, ~0, 0);
+  x2 = _mm_clmulepi64_si128(x1, k, 0x10);
+  x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+  k = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(k5k0));
+  x2 = _mm_srli_si128(x1, 4);
+  x1 = _mm_xor_si128(_mm_clmulepi64_si128(_mm_and_si128(x1, mask), k, 0x00), x2);
+
+  // Barrett reduction to 32 bits.
+  k = _mm_load_si128(reinterpret_cast<const __m128i*>(poly));
+  x2 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask), k, 0x10);
+  x2 = _mm_clmulepi64_si128(_mm_and_si128(x2, mask), k, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+  return static_cast<uint32_t>(_mm_extract_epi32(x1, 1));
+}
+
+static bool HavePclmul() {
+  static const bool have_pclmul =
+      __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+  return have_pclmul;
+}
+#endif
+
+uint32_t ZipCrc32(uint32_t crc, const uint8_t* buf, size_t len) {
+#if defined(ZIP_CRC32_ARM)
+  if (HaveArmCrc32()) {
+    return Crc32Arm(crc, buf, len);
+  }
+#elif defined(ZIP_CRC32_PCLMUL)
+  if (len >= 64 && HavePclmul()) {
+    const size_t folded = len & ~size_t(15);
+    crc = ~Crc32Pclmul(~crc, buf, folded);
+    buf += folded;
+    len -= folded;
+  }
+#endif
+  return static_cast<uint32_t>(crc32_z(crc, buf, len));
+}
@@ -0,0 +1,29 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Updates the running CRC32 |crc| with |len| bytes of |buf|, as zlib's crc32() does.
+ *
+ * Uses the ARMv8 CRC32 instructions on arm64 CPUs that have them, and carry-less multiplication
+ * (PCLMULQDQ) on x86 CPUs that support it; that's fast enough to check every entry we extract.
+ * Falls back to zlib otherwise.
+ */
+uint32_t ZipCrc32(uint32_t crc, const uint8_t* buf, size_t len);
@@ -0,0 +1,388 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "ziparchive"
+
+#include "ziparchive/zip_stream_reader.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <memory>
+
+#include <android-base/logging.h>
+#include <android-base/macros.h>  // TEMP_FAILURE_RETRY may or may not be in unistd
+#include <android-base/memory.h>
+#include <log/log.h>
+#include <zlib.h>
+
+#include "entry_name_utils-inl.h"
+#include "zip_archive_common.h"
+#include "zip_crc32.h"
+#include "zip_error.h"
+
+// Big enough for any local file header, with its name and extra field.
+static constexpr size_t kBufferSize = 192 * 1024;
+static constexpr size_t kOutputSize = 32 * 1024;
+
+ZipStreamReader::ZipStreamReader(int fd) : fd_(fd), buffer_(kBufferSize) {}
+
+bool ZipStreamReader::Fill(size_t len) {
+  CHECK_LE(len, buffer_.size());
+  if (buffered() >= len) {
+    return true;
+  }
+  if (begin_ + len > buffer_.size()) {
+    memmove(buffer_.data(), buffer_.data() + begin_, buffered());
+    end_ -= begin_;
+    begin_ = 0;
+  }
+  while (buffered() < len) {
+    const ssize_t n = TEMP_FAILURE_RETRY(read(fd_, buffer_.data() + end_, buffer_.size() - end_));
+    if (n <= 0) {
+      if (n < 0) {
+        ALOGW("Zip: stream read failed: %s", strerror(errno));
+      }
+      return false;
+    }
+    end_ += n;
+  }
+  return true;
+}
+
+void ZipStreamReader::Consume(size_t len) {
+  begin_ += len;
+  position_ += len;
+  if (begin_ == end_) {
+    begin_ = end_ = 0;
+  }
+}
+
+bool ZipStreamReader::Read(void* buf, size_t len) {
+  // Nothing to copy, and |buf| and the buffer may both be null.
+  if (len == 0) {
+    return true;
+  }
+  if (!Fill(len)) {
+    return false;
+  }
+  memcpy(buf, buffer_.data() + begin_, len);
+  Consume(len);
+  return true;
+}
+
+bool ZipStreamReader::Skip(uint64_t len) {
+  while (len > 0) {
+    if (buffered() == 0 && !Fill(1)) {
+      return false;
+    }
+    const size_t n = static_cast<size_t>(std::min<uint64_t>(len, buffered()));
+    Consume(n);
+    len -= n;
+  }
+  return true;
+}
+
+int32_t ZipStreamReader::Next(ZipEntry64* entry, std::string* name) {
+  if (data_pending_) {
+    if (int32_t result = ReadData(&current_, nullptr); result != kSuccess) {
+      return result;
+    }
+  }
+
+  if (!Fill(sizeof(uint32_t))) {
+    ALOGW("Zip: stream ended before the central directory");
+    return kIoError;
+  }
+  if (android::base::get_unaligned<uint32_t>(buffer_.data() + begin_) !=
+      LocalFileHeader::kSignature) {
+    return kIterationEnd;
+  }
+
+  LocalFileHeader lfh;
+  std::string entry_name;
+  std::vector<uint8_t> extra;
+  if (!Read(&lfh, sizeof(lfh))) {
+    ALOGW("Zip: stream ended in a local file header");
+    return kIoError;
+  }
+  entry_name.resize(lfh.file_name_length);
+  extra.resize(lfh.extra_field_length);
+  if (!Read(entry_name.data(), entry_name.size()) || !Read(extra.data(), extra.size())) {
+    ALOGW("Zip: stream ended in a local file header");
+    return kIoError;
+  }
+  if (!IsValidEntryName(reinterpret_cast<const uint8_t*>(entry_name.data()),
+                        entry_name.size())) {
+    ALOGW("Zip: invalid file name at offset %" PRIu64, position_);
+    return kInvalidEntryName;
+  }
+
+  ZipEntry64 data;
+  data.method = lfh.compression_method;
+  data.mod_time = lfh.last_mod_date << 16 | lfh.last_mod_time;
+  data.unix_mode = 0777;
+  data.has_data_descriptor = (lfh.gpb_flags & kGPBDDFlagMask) != 0;
+  data.crc32 = lfh.crc32;
+  data.compressed_length = lfh.compressed_size;
+  data.uncompressed_length = lfh.uncompressed_size;
+  data.offset = static_cast<off64_t>(position_);
+  data.gpbf = lfh.gpb_flags;
+
+  // The sizes, if they don't fit, and the size of those in the data
+  // descriptor, depend on the zip64 extended info.
+  current_zip64_ = false;
+  for (size_t offset = 0; offset + 4 <= extra.size();) {
+    const uint16_t header_id = android::base::get_unaligned<uint16_t>(&extra[offset]);
+    const uint16_t data_size = android::base::get_unaligned<uint16_t>(&extra[offset + 2]);
+    offset += 4;
+    if (data_size > extra.size() - offset) {
+      break;
+    }
+    if (header_id == Zip64ExtendedInfo::kHeaderId && data_size >= 16) {
+      current_zip64_ = true;
+      data.zip64_format_size = true;
+      data.uncompressed_length = android::base::get_unaligned<uint64_t>(&extra[offset]);
+      data.compressed_length = android::base::get_unaligned<uint64_t>(&extra[offset + 8]);
+    }
+    offset += data_size;
+  }
+  if (!current_zip64_ &&
+      (lfh.compressed_size == UINT32_MAX || lfh.uncompressed_size == UINT32_MAX)) {
+    ALOGW("Zip: zip64 extended info isn't found in the extra field.");
+    return kInvalidFile;
+  }
+
+  if (data.has_data_descriptor) {
+    data.crc32 = 0;
+    data.compressed_length = 0;
+    data.uncompressed_length = 0;
+  }
+
+  current_ = data;
+  data_pending_ = true;
+  *entry = data;
+  if (name != nullptr) {
+    *name = std::move(entry_name);
+  }
+  return kSuccess;
+}
+
+bool ZipStreamReader::Append(zip_archive::Writer* writer, size_t len) {
+  if (writer != nullptr && !writer->Append(buffer_.data() + begin_, len)) {
+    return false;
+  }
+  Consume(len);
+  return true;
+}
+
+int32_t ZipStreamReader::CopyStored(ZipEntry64* entry, zip_archive::Writer* writer,
+                                    uint32_t* crc) {
+  if (entry->has_data_descriptor) {
+    return FindDataDescriptor(entry, writer, crc);
+  }
+  if (entry->compressed_length != entry->uncompressed_length) {
+    ALOGW("Zip: stored entry sizes differ: %" PRIu64 " vs %" PRIu64, entry->compressed_length,
+          entry->uncompressed_length);
+    return kInconsistentInformation;
+  }
+  for (uint64_t left = entry->compressed_length; left > 0;) {
+    if (buffered() == 0 && !Fill(1)) {
+      ALOGW("Zip: stream ended in entry data");
+      return kIoError;
+    }
+    const size_t n = static_cast<size_t>(std::min<uint64_t>(left, buffered()));
+    *crc = ZipCrc32(*crc, buffer_.data() + begin_, n);
+    if (!Append(writer, n)) {
+      return kIoError;
+    }
+    left -= n;
+  }
+  return kSuccess;
+}
+
+int32_t ZipStreamReader::FindDataDescriptor(ZipEntry64* entry, zip_archive::Writer* writer,
+                                            uint32_t* crc) {
+  // Nothing says where the data ends, so look for a data descriptor signature
+  // followed by the crc32 and the size of the data before it. The data can
+  // contain the signature too, but not also its own crc32 after it.
+  const size_t descriptor_size = 2 * sizeof(uint32_t) + (current_zip64_ ? 16 : 8);
+  uint64_t length = 0;
+  while (true) {
+    if (!Fill(descriptor_size)) {
+      ALOGW("Zip: stream ended in entry data");
+      return kIoError;
+    }
+    const uint8_t* data = buffer_.data() + begin_;
+    const size_t candidates = buffered() - descriptor_size + 1;
+    size_t n = 0;
+    for (const uint8_t* p = data;
+         (p = static_cast<const uint8_t*>(memchr(p, 'P', data + candidates - p))) != nullptr;
+         p++) {
+      if (android::base::get_unaligned<uint32_t>(p) != DataDescriptor::kOptSignature) {
+        continue;
+      }
+      *crc = ZipCrc32(*crc, data + n, p - data - n);
+      n = p - data;
+      uint64_t compressed_length;
+      uint64_t uncompressed_length;
+      if (current_zip64_) {
+        compressed_length = android::base::get_unaligned<uint64_t>(p + 8);
+        uncompressed_length = android::base::get_unaligned<uint64_t>(p + 16);
+      } else {
+        compressed_length = android::base::get_unaligned<uint32_t>(p + 8);
+        uncompressed_length = android::base::get_unaligned<uint32_t>(p + 12);
+      }
+      if (android::base::get_unaligned<uint32_t>(p + 4) == *crc &&
+          compressed_length == length + n && uncompressed_length == length + n) {
+        if (!Append(writer, n)) {
+          return kIoError;
+        }
+        entry->compressed_length = entry->uncompressed_length = length + n;
+        return kSuccess;
+      }
+    }
+    *crc = ZipCrc32(*crc, data + n, candidates - n);
+    if (!Append(writer, candidates)) {
+      return kIoError;
+    }
+    length += candidates;
+  }
+}
+
+int32_t ZipStreamReader::Inflate(ZipEntry64* entry, zip_archive::Writer* writer, uint32_t* crc) {
+  z_stream stream = {};
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wold-style-cast"
+  if (inflateInit2(&stream, -MAX_WBITS) != Z_OK) {
+    return kZlibError;
+  }
+#pragma GCC diagnostic pop
+  std::unique_ptr<z_stream, int (*)(z_stream*)> stream_cleanup(&stream, inflateEnd);
+
+  // Without a writer, the data is inflated just to find where it ends.
+  std::vector<uint8_t> out(kOutputSize);
+  int zerr;
+  do {
+    if (buffered() == 0 && !Fill(1)) {
+      ALOGW("Zip: stream ended in entry data");
+      return kIoError;
+    }
+    stream.next_in = buffer_.data() + begin_;
+    stream.avail_in = static_cast<uInt>(buffered());
+    stream.next_out = out.data();
+    stream.avail_out = static_cast<uInt>(out.size());
+    zerr = inflate(&stream, Z_NO_FLUSH);
+    if (zerr != Z_OK && zerr != Z_STREAM_END) {
+      ALOGW("Zip: inflate zerr=%d (nIn=%p aIn=%u nOut=%p aOut=%u)", zerr, stream.next_in,
+            stream.avail_in, stream.next_out, stream.avail_out);
+      return kZlibError;
+    }
+    Consume(buffered() - stream.avail_in);
+
+    const size_t produced = out.size() - stream.avail_out;
+    if (writer != nullptr && produced > 0) {
+      *crc = ZipCrc32(*crc, out.data(), produced);
+      if (!writer->Append(out.data(), produced)) {
+        return kIoError;
+      }
+    }
+  } while (zerr != Z_STREAM_END);
+
+  if (entry->has_data_descriptor) {
+    entry->compressed_length = stream.total_in;
+    entry->uncompressed_length = stream.total_out;
+  } else if (stream.total_in != entry->compressed_length ||
+             stream.total_out != entry->uncompressed_length) {
+    ALOGW("Zip: size mismatch on inflated file (%lu vs %" PRIu64 ", %lu vs %" PRIu64 ")",
+          stream.total_in, entry->compressed_length, stream.total_out, entry->uncompressed_length);
+    return kInconsistentInformation;
+  }
+  return kSuccess;
+}
+
+int32_t ZipStreamReader::ReadDataDescriptor(ZipEntry64* entry) {
+  uint32_t crc32;
+  if (!Read(&crc32, sizeof(crc32))) {
+    return kIoError;
+  }
+  // The signature is optional.
+  if (crc32 == DataDescriptor::kOptSignature && !Read(&crc32, sizeof(crc32))) {
+    return kIoError;
+  }
+  uint64_t compressed_length;
+  uint64_t uncompressed_length;
+  if (current_zip64_) {
+    if (!Read(&compressed_length, sizeof(uint64_t)) ||
+        !Read(&uncompressed_length, sizeof(uint64_t))) {
+      return kIoError;
+    }
+  } else {
+    uint32_t sizes[2];
+    if (!Read(sizes, sizeof(sizes))) {
+      return kIoError;
+    }
+    compressed_length = sizes[0];
+    uncompressed_length = sizes[1];
+  }
+  if (compressed_length != entry->compressed_length ||
+      uncompressed_length != entry->uncompressed_length) {
+    ALOGW("Zip: data descriptor sizes {%" PRIu64 ", %" PRIu64 "} don't match the data {%" PRIu64
+          ", %" PRIu64 "}",
+          compressed_length, uncompressed_length, entry->compressed_length,
+          entry->uncompressed_length);
+    return kInconsistentInformation;
+  }
+  entry->crc32 = crc32;
+  return kSuccess;
+}
+
+int32_t ZipStreamReader::ReadData(ZipEntry64* entry, zip_archive::Writer* writer) {
+  if (!data_pending_) {
+    ALOGW("Zip: entry data already read");
+    return kInvalidHandle;
+  }
+  data_pending_ = false;
+
+  int32_t result;
+  uint32_t crc = 0;
+  if (writer == nullptr && !entry->has_data_descriptor) {
+    result = Skip(entry->compressed_length) ? kSuccess : kIoError;
+  } else if (entry->method == kCompressStored) {
+    result = CopyStored(entry, writer, &crc);
+  } else if (entry->method == kCompressDeflated) {
+    result = Inflate(entry, writer, &crc);
+  } else {
+    ALOGW("Zip: unsupported compression method %" PRIu16, entry->method);
+    result = kInvalidFile;
+  }
+  if (result == kSuccess && entry->has_data_descriptor) {
+    result = ReadDataDescriptor(entry);
+  }
+  if (result != kSuccess) {
+    return result;
+  }
+
+  if (writer != nullptr && entry->crc32 != crc) {
+    ALOGW("Zip: crc mismatch: expected %" PRIu32 ", was %" PRIu32, entry->crc32, crc);
+    return kInconsistentInformation;
+  }
+  current_ = *entry;
+  return kSuccess;
+}
@@ -24,11 +24,20 @@
 #include <cstdio>
 #define DEF_MEM_LEVEL 8  // normally in zutil.h?
 
+#include <condition_variable>
+#include <deque>
 #include <memory>
+#include <mutex>
+#include <span>
+#include <thread>
 #include <vector>
 
 #include "android-base/logging.h"
 
+#if defined(ZIPARCHIVE_WITH_ZSTD_WRITER)
+#include <zstd.h>
+#endif
+
 #include "entry_name_utils-inl.h"
 #include "zip_archive_common.h"
 
@@ -44,6 +53,7 @@
 enum {
   kCompressStored = 0,    // no compression
   kCompressDeflated = 8,  // standard deflate
+  kCompressZstd = 93,     // zstd
 };
 
 // Size of the output buffer used for compression.
@@ -70,6 +80,9 @@ static const int32_t kInvalidAlign32Flag = -5;
 // The alignment parameter is not a power of 2.
 static const int32_t kInvalidAlignment = -6;
 
+// The compression method isn't supported by this build.
+static const int32_t kUnsupportedMethod = -7;
+
 static const char* sErrorCodes[] = {
     "Invalid state", "IO error", "Invalid entry name", "Zlib error",
 };
@@ -86,12 +99,350 @@ static void DeleteZStream(z_stream* stream) {
   delete stream;
 }
 
+static void DeleteZstdCCtx([[maybe_unused]] ZSTD_CCtx* cctx) {
+#if defined(ZIPARCHIVE_WITH_ZSTD_WRITER)
+  ZSTD_freeCCtx(cctx);
+#endif
+}
+
+// Entries at least twice this size are split into blocks that are compressed
+// in parallel, the same size as pigz's.
+static const size_t kParallelBlockSize = 128 * 1024;
+
+// Each block after the first is compressed with the previous 32KiB of data as
+// its dictionary, so that splitting costs next to nothing in compression.
+static const size_t kParallelDictionarySize = 32 * 1024;
+
+// How much data may be queued before FinishEntry() waits for entries to be
+// written.
+static const size_t kMaxParallelPendingBytes = 64 * 1024 * 1024;
+
+// Entries that grow past this aren't held in memory whole. Their blocks are
+// compressed and written as their data arrives instead, or if they can't be
+// split, they're written on the caller's thread.
+static const size_t kMaxParallelEntrySize = 8 * 1024 * 1024;
+
+// How many blocks of an entry too big to hold whole may be queued before
+// WriteBytes() waits for the oldest to be written: as much data as the biggest
+// entry that is held whole.
+static const size_t kMaxQueuedBlocks = kMaxParallelEntrySize / kParallelBlockSize;
+
+/*
+ * Deflates |len| bytes of |data| to |out| as CompressBytes() and
+ * FlushCompressedBytes() would, so that the output is the same. If the data is
+ * a block of a bigger entry, |dictionary| holds the data before it, and unless
+ * it's the |last| block it ends with a sync flush, so that the compressed
+ * blocks can be concatenated.
+ */
+static bool DeflateBlock(int compression_level, const uint8_t* data, size_t len,
+                         std::span<const uint8_t> dictionary, bool last,
+                         std::vector<uint8_t>* out) {
+  z_stream stream = {};
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wold-style-cast"
+  if (deflateInit2(&stream, compression_level, Z_DEFLATED, -MAX_WBITS, DEF_MEM_LEVEL,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    return false;
+  }
+#pragma GCC diagnostic pop
+  std::unique_ptr<z_stream, int (*)(z_stream*)> stream_cleanup(&stream, deflateEnd);
+  if (!dictionary.empty() &&
+      deflateSetDictionary(&stream, dictionary.data(), static_cast<uInt>(dictionary.size())) !=
+          Z_OK) {
+    return false;
+  }
+
+  stream.next_in = const_cast<uint8_t*>(data);
+  stream.avail_in = static_cast<uInt>(len);
+  for (const int flush : {Z_NO_FLUSH, last ? Z_FINISH : Z_SYNC_FLUSH}) {
+    while (flush != Z_NO_FLUSH || stream.avail_in != 0) {
+      if (stream.avail_out == 0) {
+        const size_t used = out->size();
+        out->resize(used + kBufSize);
+        stream.next_out = out->data() + used;
+        stream.avail_out = static_cast<uInt>(kBufSize);
+      }
+      const int zerr = deflate(&stream, flush);
+      if (zerr == Z_STREAM_END) break;
+      if (zerr != Z_OK) return false;
+      if (flush == Z_NO_FLUSH ? stream.avail_in == 0 : stream.avail_out != 0) break;
+    }
+  }
+  out->resize(out->size() - stream.avail_out);
+  return true;
+}
+
+#if defined(ZIPARCHIVE_WITH_ZSTD_WRITER)
+/*
+ * Compresses |len| bytes of |data| to |out| as a single zstd frame, streamed
+ * the way ZstdCompressBytes() and FlushZstdBytes() stream it, so that the
+ * output is the same.
+ */
+static bool ZstdBlock(int compression_level, const uint8_t* data, size_t len,
+                      std::vector<uint8_t>* out) {
+  static thread_local std::unique_ptr<ZSTD_CCtx, decltype(&DeleteZstdCCtx)> cctx(
+      ZSTD_createCCtx(), DeleteZstdCCtx);
+  if (!cctx) {
+    return false;
+  }
+  ZSTD_CCtx_reset(cctx.get(), ZSTD_reset_session_only);
+  if (ZSTD_isError(
+          ZSTD_CCtx_setParameter(cctx.get(), ZSTD_c_compressionLevel, compression_level))) {
+    return false;
+  }
+
+  out->resize(ZSTD_compressBound(len));
+  ZSTD_inBuffer in = {data, len, 0};
+  ZSTD_outBuffer output = {out->data(), out->size(), 0};
+  // Like ZstdCompressBytes(), only ZSTD_e_end is used for an empty entry, so
+  // its frame header records the size of 0.
+  while (in.pos < in.size) {
+    if (output.pos == output.size) {
+      out->resize(out->size() + kBufSize);
+      output = {out->data(), out->size(), output.pos};
+    }
+    if (ZSTD_isError(ZSTD_compressStream2(cctx.get(), &output, &in, ZSTD_e_continue))) {
+      return false;
+    }
+  }
+  size_t remaining;
+  do {
+    if (output.pos == output.size) {
+      out->resize(out->size() + kBufSize);
+      output = {out->data(), out->size(), output.pos};
+    }
+    remaining = ZSTD_compressStream2(cctx.get(), &output, &in, ZSTD_e_end);
+    if (ZSTD_isError(remaining)) {
+      return false;
+    }
+  } while (remaining != 0);
+  out->resize(output.pos);
+  return true;
+}
+#endif
+
+// Compresses ZipWriter's entries on a pool of threads. The writer queues each
+// entry when it's finished and writes the queued entries out, in order, once
+// they've been compressed.
+class ZipWriter::ParallelCompressor {
+ public:
+  struct Entry {
+    FileEntry file;
+    uint32_t alignment = 0;
+    int compression_level = 0;
+    std::vector<uint8_t> data;
+    // The compressed data of each block, if the entry is compressed. zstd
+    // entries are compressed as a single block.
+    std::vector<std::vector<uint8_t>> blocks;
+    size_t blocks_left = 0;
+    bool failed = false;
+    // Whether the entry grew too big to hold whole, so that its header has
+    // been written and its blocks are queued as its data arrives. |data| then
+    // only holds the data that hasn't been queued yet, after up to
+    // kParallelDictionarySize bytes of the data before it.
+    bool streamed = false;
+    size_t dictionary_size = 0;
+  };
+
+  // A block of a streamed entry.
+  struct Block {
+    int compression_level = 0;
+    // The block's dictionary and then the block itself.
+    std::vector<uint8_t> data;
+    size_t dictionary_size = 0;
+    bool last = false;
+    std::vector<uint8_t> compressed;
+    bool done = false;
+    bool failed = false;
+  };
+
+  ParallelCompressor(size_t threads, bool deterministic) : deterministic_(deterministic) {
+    for (size_t i = 0; i < threads; i++) {
+      threads_.emplace_back([this]() { Run(); });
+    }
+  }
+
+  ~ParallelCompressor() {
+    {
+      std::lock_guard<std::mutex> lock(lock_);
+      stopping_ = true;
+    }
+    work_cv_.notify_all();
+    for (auto& thread : threads_) {
+      thread.join();
+    }
+  }
+
+  // The entry being written, from StartEntry() until FinishEntry().
+  std::unique_ptr<Entry> current;
+
+  // Whether entries compressed with |compression_method| may be split into
+  // blocks, which changes their compressed data.
+  bool CanSplit(uint16_t compression_method) const {
+    return compression_method == kCompressDeflated && !deterministic_;
+  }
+
+  // Queues |current| to be compressed and written.
+  void QueueCurrent() {
+    Entry* entry = current.get();
+    size_t block_count = 0;
+    if (entry->file.compression_method != kCompressStored) {
+      block_count = 1;
+      if (CanSplit(entry->file.compression_method) &&
+          entry->data.size() >= 2 * kParallelBlockSize) {
+        block_count = (entry->data.size() + kParallelBlockSize - 1) / kParallelBlockSize;
+      }
+    }
+    entry->blocks.resize(block_count);
+    entry->blocks_left = block_count;
+
+    std::lock_guard<std::mutex> lock(lock_);
+    pending_bytes_ += entry->data.size();
+    entries_.push_back(std::move(current));
+    for (size_t i = 0; i < block_count; i++) {
+      tasks_.emplace_back(entry, i);
+    }
+    work_cv_.notify_all();
+  }
+
+  // Returns the oldest queued entry if it's been compressed, waiting for it if
+  // |wait|, or nullptr.
+  std::unique_ptr<Entry> PopFinished(bool wait) {
+    std::unique_lock<std::mutex> lock(lock_);
+    if (entries_.empty()) {
+      return nullptr;
+    }
+    if (wait) {
+      done_cv_.wait(lock, [this]() { return entries_.front()->blocks_left == 0; });
+    } else if (entries_.front()->blocks_left != 0) {
+      return nullptr;
+    }
+    auto entry = std::move(entries_.front());
+    entries_.pop_front();
+    pending_bytes_ -= entry->data.size();
+    return entry;
+  }
+
+  // Queues a |block| of the streamed entry |current| to be compressed.
+  void QueueBlock(std::unique_ptr<Block> block) {
+    std::lock_guard<std::mutex> lock(lock_);
+    block_tasks_.push_back(block.get());
+    blocks_.push_back(std::move(block));
+    work_cv_.notify_one();
+  }
+
+  // Returns the oldest queued block if it's been compressed, waiting for it if
+  // |wait|, or nullptr.
+  std::unique_ptr<Block> PopFinishedBlock(bool wait) {
+    std::unique_lock<std::mutex> lock(lock_);
+    if (blocks_.empty()) {
+      return nullptr;
+    }
+    if (wait) {
+      done_cv_.wait(lock, [this]() { return blocks_.front()->done; });
+    } else if (!blocks_.front()->done) {
+      return nullptr;
+    }
+    auto block = std::move(blocks_.front());
+    blocks_.pop_front();
+    return block;
+  }
+
+  size_t queued_entries() {
+    std::lock_guard<std::mutex> lock(lock_);
+    return entries_.size();
+  }
+
+  size_t queued_blocks() {
+    std::lock_guard<std::mutex> lock(lock_);
+    return blocks_.size();
+  }
+
+  size_t pending_bytes() {
+    std::lock_guard<std::mutex> lock(lock_);
+    return pending_bytes_;
+  }
+
+ private:
+  void Run() {
+    std::unique_lock<std::mutex> lock(lock_);
+    while (true) {
+      work_cv_.wait(lock,
+                    [this]() { return stopping_ || !tasks_.empty() || !block_tasks_.empty(); });
+      if (stopping_) {
+        return;
+      }
+      if (!block_tasks_.empty()) {
+        Block* streamed = block_tasks_.front();
+        block_tasks_.pop_front();
+        lock.unlock();
+        const bool ok = DeflateBlock(
+            streamed->compression_level, streamed->data.data() + streamed->dictionary_size,
+            streamed->data.size() - streamed->dictionary_size,
+            std::span(streamed->data).first(streamed->dictionary_size), streamed->last,
+            &streamed->compressed);
+        lock.lock();
+        streamed->failed = !ok;
+        streamed->done = true;
+        done_cv_.notify_all();
+        continue;
+      }
+      auto [entry, block] = tasks_.front();
+      tasks_.pop_front();
+      lock.unlock();
+
+      const size_t block_count = entry->blocks.size();
+      const size_t begin = block * kParallelBlockSize;
+      const size_t end = block + 1 == block_count ? entry->data.size() : begin + kParallelBlockSize;
+      std::span<const uint8_t> dictionary;
+      if (block > 0) {
+        dictionary = std::span(entry->data).subspan(begin - kParallelDictionarySize,
+                                                     kParallelDictionarySize);
+      }
+      bool ok;
+#if defined(ZIPARCHIVE_WITH_ZSTD_WRITER)
+      if (entry->file.compression_method == kCompressZstd) {
+        ok = ZstdBlock(entry->compression_level, entry->data.data(), entry->data.size(),
+                       &entry->blocks[block]);
+      } else
+#endif
+      {
+        ok = DeflateBlock(entry->compression_level, entry->data.data() + begin, end - begin,
+                          dictionary, block + 1 == block_count, &entry->blocks[block]);
+      }
+
+      lock.lock();
+      entry->failed |= !ok;
+      if (--entry->blocks_left == 0) {
+        done_cv_.notify_all();
+      }
+    }
+  }
+
+  const bool deterministic_;
+  std::mutex lock_;
+  std::condition_variable work_cv_;
+  std::condition_variable done_cv_;
+  bool stopping_ = false;
+  // Queued entries, in the order they're to be written.
+  std::deque<std::unique_ptr<Entry>> entries_;
+  size_t pending_bytes_ = 0;
+  // Blocks of queued entries waiting for a thread.
+  std::deque<std::pair<Entry*, size_t>> tasks_;
+  // Queued blocks of the streamed entry, in the order they're to be written,
+  // and those of them waiting for a thread.
+  std::deque<std::unique_ptr<Block>> blocks_;
+  std::deque<Block*> block_tasks_;
+  std::vector<std::thread> threads_;
+};
+
 ZipWriter::ZipWriter(FILE* f)
     : file_(f),
       seekable_(false),
       current_offset_(0),
       state_(State::kWritingZip),
       z_stream_(nullptr, DeleteZStream),
+      zstd_cctx_(nullptr, DeleteZstdCCtx),
       buffer_(kBufSize) {
   // Check if the file is seekable (regular file). If fstat fails, that's fine, subsequent calls
   // will fail as well.
@@ -108,7 +459,9 @@ ZipWriter::ZipWriter(ZipWriter&& writer) noexcept
       state_(writer.state_),
       files_(std::move(writer.files_)),
       z_stream_(std::move(writer.z_stream_)),
-      buffer_(std::move(writer.buffer_)) {
+      zstd_cctx_(std::move(writer.zstd_cctx_)),
+      buffer_(std::move(writer.buffer_)),
+      parallel_(std::move(writer.parallel_)) {
   writer.file_ = nullptr;
   writer.state_ = State::kError;
 }
@@ -120,12 +473,27 @@ ZipWriter& ZipWriter::operator=(ZipWriter&& writer) noexcept {
   state_ = writer.state_;
   files_ = std::move(writer.files_);
   z_stream_ = std::move(writer.z_stream_);
+  zstd_cctx_ = std::move(writer.zstd_cctx_);
   buffer_ = std::move(writer.buffer_);
+  parallel_ = std::move(writer.parallel_);
   writer.file_ = nullptr;
   writer.state_ = State::kError;
   return *this;
 }
 
+ZipWriter::~ZipWriter() = default;
+
+int32_t ZipWriter::SetParallelCompression(size_t threads, bool deterministic) {
+  if (state_ != State::kWritingZip || !files_.empty()) {
+    return kInvalidState;
+  }
+  parallel_.reset();
+  if (threads > 1) {
+    parallel_ = std::make_unique<ParallelCompressor>(threads, deterministic);
+  }
+  return kNoError;
+}
+
 int32_t ZipWriter::HandleError(int32_t error_code) {
   state_ = State::kError;
   z_stream_.reset();
@@ -210,7 +578,8 @@ int32_t ZipWriter::StartAlignedEntryWithTime(std::string_view path, size_t flags
   }
 
   // Can only have 16535 entries because of zip records.
-  if (files_.size() == std::numeric_limits<uint16_t>::max()) {
+  const size_t queued_entries = parallel_ ? parallel_->queued_entries() : 0;
+  if (files_.size() + queued_entries == std::numeric_limits<uint16_t>::max()) {
     return HandleError(kIoError);
   }
 
@@ -226,25 +595,37 @@ int32_t ZipWriter::StartAlignedEntryWithTime(std::string_view path, size_t flags
   }
 
   FileEntry file_entry = {};
-  file_entry.local_file_header_offset = current_offset_;
   file_entry.path = path;
-  // No support for larger than 4GB files.
-  if (file_entry.local_file_header_offset > std::numeric_limits<uint32_t>::max()) {
-    return HandleError(kIoError);
-  }
 
   if (!IsValidEntryName(reinterpret_cast<const uint8_t*>(file_entry.path.data()),
                         file_entry.path.size())) {
     return kInvalidEntryName;
   }
 
-  if (flags & ZipWriter::kCompress) {
+  int compression_level = 0;
+  if ((flags & ZipWriter::kCompress) && (flags & ZipWriter::kZstd)) {
+#if defined(ZIPARCHIVE_WITH_ZSTD_WRITER)
+    file_entry.compression_method = kCompressZstd;
+
+    compression_level = (flags & ZipWriter::kDefaultCompression) ? ZSTD_CLEVEL_DEFAULT : 9;
+    if (!parallel_) {
+      int32_t result = PrepareZstd(compression_level);
+      if (result != kNoError) {
+        return result;
+      }
+    }
+#else
+    return kUnsupportedMethod;
+#endif
+  } else if (flags & ZipWriter::kCompress) {
     file_entry.compression_method = kCompressDeflated;
 
-    int compression_level = (flags & ZipWriter::kDefaultCompression) ? 6 : 9;
-    int32_t result = PrepareDeflate(compression_level);
-    if (result != kNoError) {
-      return result;
+    compression_level = (flags & ZipWriter::kDefaultCompression) ? 6 : 9;
+    if (!parallel_) {
+      int32_t result = PrepareDeflate(compression_level);
+      if (result != kNoError) {
+        return result;
+      }
     }
   } else {
     file_entry.compression_method = kCompressStored;
@@ -252,7 +633,34 @@ int32_t ZipWriter::StartAlignedEntryWithTime(std::string_view path, size_t flags
 
   ExtractTimeAndDate(time, &file_entry.last_mod_time, &file_entry.last_mod_date);
 
-  off_t offset = current_offset_ + sizeof(LocalFileHeader) + file_entry.path.size();
+  if (parallel_) {
+    // The header is written with the data, once the entries before it are.
+    parallel_->current = std::make_unique<ParallelCompressor::Entry>();
+    parallel_->current->alignment = alignment;
+    parallel_->current->compression_level = compression_level;
+  } else {
+    // Always start expecting a data descriptor. When the data has finished being written,
+    // if it is possible to seek back, the GPB flag will reset and the sizes written.
+    int32_t result = WriteLocalFileHeader(&file_entry, alignment, true /*use_data_descriptor*/);
+    if (result != kNoError) {
+      return result;
+    }
+  }
+
+  current_file_entry_ = std::move(file_entry);
+  state_ = State::kWritingEntry;
+  return kNoError;
+}
+
+int32_t ZipWriter::WriteLocalFileHeader(FileEntry* file, uint32_t alignment,
+                                        bool use_data_descriptor) {
+  file->local_file_header_offset = current_offset_;
+  // No support for larger than 4GB files.
+  if (file->local_file_header_offset > std::numeric_limits<uint32_t>::max()) {
+    return HandleError(kIoError);
+  }
+
+  off_t offset = current_offset_ + sizeof(LocalFileHeader) + file->path.size();
   // prepare a pre-zeroed 4K memory block in case when we need to pad some aligned data.
   static constexpr char kSmallZeroPadding[4096] = {};
   // use this buffer if our preallocated one is too small
@@ -262,7 +670,7 @@ int32_t ZipWriter::StartAlignedEntryWithTime(std::string_view path, size_t flags
   if (alignment != 0 && (offset & (alignment - 1))) {
     // Pad the extra field so the data will be aligned.
     uint16_t padding = static_cast<uint16_t>(alignment - (offset % alignment));
-    file_entry.padding_length = padding;
+    file->padding_length = padding;
     offset += padding;
     if (padding <= std::size(kSmallZeroPadding)) {
         zero_padding = kSmallZeroPadding;
@@ -273,31 +681,36 @@ int32_t ZipWriter::StartAlignedEntryWithTime(std::string_view path, size_t flags
   }
 
   LocalFileHeader header = {};
-  // Always start expecting a data descriptor. When the data has finished being written,
-  // if it is possible to seek back, the GPB flag will reset and the sizes written.
-  CopyFromFileEntry(file_entry, true /*use_data_descriptor*/, &header);
+  CopyFromFileEntry(*file, use_data_descriptor, &header);
 
   if (fwrite(&header, sizeof(header), 1, file_) != 1) {
     return HandleError(kIoError);
   }
 
-  if (fwrite(path.data(), 1, path.size(), file_) != path.size()) {
+  if (fwrite(file->path.data(), 1, file->path.size(), file_) != file->path.size()) {
     return HandleError(kIoError);
   }
 
-  if (file_entry.padding_length != 0 && fwrite(zero_padding, 1, file_entry.padding_length,
-                                               file_) != file_entry.padding_length) {
+  if (file->padding_length != 0 && fwrite(zero_padding, 1, file->padding_length,
+                                          file_) != file->padding_length) {
     return HandleError(kIoError);
   }
 
-  current_file_entry_ = std::move(file_entry);
   current_offset_ = offset;
-  state_ = State::kWritingEntry;
   return kNoError;
 }
 
 int32_t ZipWriter::DiscardLastEntry() {
-  if (state_ != State::kWritingZip || files_.empty()) {
+  if (state_ != State::kWritingZip) {
+    return kInvalidState;
+  }
+  if (parallel_) {
+    int32_t result = WritePendingEntries(true);
+    if (result != kNoError) {
+      return result;
+    }
+  }
+  if (files_.empty()) {
     return kInvalidState;
   }
 
@@ -313,6 +726,12 @@ int32_t ZipWriter::DiscardLastEntry() {
 int32_t ZipWriter::GetLastEntry(FileEntry* out_entry) {
   CHECK(out_entry != nullptr);
 
+  if (parallel_ && state_ == State::kWritingZip) {
+    int32_t result = WritePendingEntries(true);
+    if (result != kNoError) {
+      return result;
+    }
+  }
   if (files_.empty()) {
     return kInvalidState;
   }
@@ -359,11 +778,25 @@ int32_t ZipWriter::WriteBytes(const void* data, size_t len) {
   }
   uint32_t len32 = static_cast<uint32_t>(len);
 
+  if (parallel_ && parallel_->current && !parallel_->current->streamed &&
+      parallel_->current->data.size() + len > kMaxParallelEntrySize) {
+    int32_t result = parallel_->CanSplit(current_file_entry_.compression_method)
+                         ? StreamCurrentEntry()
+                         : WriteCurrentEntrySerially();
+    if (result != kNoError) {
+      return result;
+    }
+  }
+
   int32_t result = kNoError;
-  if (current_file_entry_.compression_method & kCompressDeflated) {
-    result = CompressBytes(&current_file_entry_, data, len32);
+  if (parallel_ && parallel_->current) {
+    auto bytes = reinterpret_cast<const uint8_t*>(data);
+    parallel_->current->data.insert(parallel_->current->data.end(), bytes, bytes + len32);
+    if (parallel_->current->streamed) {
+      result = QueueStreamedBlocks(false);
+    }
   } else {
-    result = StoreBytes(&current_file_entry_, data, len32);
+    result = WriteEntryBytes(data, len32);
   }
 
   if (result != kNoError) {
@@ -376,6 +809,107 @@ int32_t ZipWriter::WriteBytes(const void* data, size_t len) {
   return kNoError;
 }
 
+int32_t ZipWriter::WriteEntryBytes(const void* data, uint32_t len) {
+  if (current_file_entry_.compression_method == kCompressZstd) {
+    return ZstdCompressBytes(&current_file_entry_, data, len);
+  } else if (current_file_entry_.compression_method == kCompressDeflated) {
+    return CompressBytes(&current_file_entry_, data, len);
+  }
+  return StoreBytes(&current_file_entry_, data, len);
+}
+
+int32_t ZipWriter::WriteCurrentEntrySerially() {
+  // The entries queued before it go first, and then it's written just as
+  // without parallel compression.
+  state_ = State::kWritingZip;
+  int32_t result = WritePendingEntries(true);
+  if (result != kNoError) {
+    return result;
+  }
+  std::unique_ptr<ParallelCompressor::Entry> entry = std::move(parallel_->current);
+  if (current_file_entry_.compression_method == kCompressZstd) {
+    result = PrepareZstd(entry->compression_level);
+  } else if (current_file_entry_.compression_method == kCompressDeflated) {
+    result = PrepareDeflate(entry->compression_level);
+  }
+  if (result != kNoError) {
+    return result;
+  }
+  result = WriteLocalFileHeader(&current_file_entry_, entry->alignment,
+                                true /*use_data_descriptor*/);
+  if (result != kNoError) {
+    return result;
+  }
+  state_ = State::kWritingEntry;
+  return WriteEntryBytes(entry->data.data(), static_cast<uint32_t>(entry->data.size()));
+}
+
+int32_t ZipWriter::StreamCurrentEntry() {
+  // As when it's written serially, the entries queued before it go first.
+  state_ = State::kWritingZip;
+  int32_t result = WritePendingEntries(true);
+  if (result != kNoError) {
+    return result;
+  }
+  result = WriteLocalFileHeader(&current_file_entry_, parallel_->current->alignment,
+                                true /*use_data_descriptor*/);
+  if (result != kNoError) {
+    return result;
+  }
+  parallel_->current->streamed = true;
+  state_ = State::kWritingEntry;
+  return kNoError;
+}
+
+int32_t ZipWriter::QueueStreamedBlocks(bool finish) {
+  ParallelCompressor::Entry* entry = parallel_->current.get();
+  std::vector<uint8_t>& data = entry->data;
+  size_t begin = entry->dictionary_size;
+  while (true) {
+    // The last block is only queued once the entry is finished, so it's never
+    // empty unless the entry is.
+    const size_t left = data.size() - begin;
+    const bool last = finish && left <= kParallelBlockSize;
+    if (!last && left <= kParallelBlockSize) {
+      break;
+    }
+    const size_t len = last ? left : kParallelBlockSize;
+    const size_t dictionary_begin = begin - std::min(begin, kParallelDictionarySize);
+    auto block = std::make_unique<ParallelCompressor::Block>();
+    block->compression_level = entry->compression_level;
+    block->data.assign(data.begin() + dictionary_begin, data.begin() + begin + len);
+    block->dictionary_size = begin - dictionary_begin;
+    block->last = last;
+    parallel_->QueueBlock(std::move(block));
+    begin += len;
+    if (last) {
+      break;
+    }
+  }
+  // Keep the data the next block needs as its dictionary.
+  const size_t dictionary_begin = begin - std::min(begin, kParallelDictionarySize);
+  data.erase(data.begin(), data.begin() + dictionary_begin);
+  entry->dictionary_size = begin - dictionary_begin;
+
+  while (auto block = parallel_->PopFinishedBlock(
+             finish || parallel_->queued_blocks() > kMaxQueuedBlocks)) {
+    if (block->failed) {
+      return HandleError(kZlibError);
+    }
+    const size_t size = block->compressed.size();
+    if (current_file_entry_.compressed_size + static_cast<uint64_t>(size) >
+        std::numeric_limits<uint32_t>::max()) {
+      return HandleError(kIoError);
+    }
+    if (fwrite(block->compressed.data(), 1, size, file_) != size) {
+      return HandleError(kIoError);
+    }
+    current_file_entry_.compressed_size += static_cast<uint32_t>(size);
+    current_offset_ += size;
+  }
+  return kNoError;
+}
+
 int32_t ZipWriter::StoreBytes(FileEntry* file, const void* data, uint32_t len) {
   CHECK(state_ == State::kWritingEntry);
 
@@ -460,36 +994,144 @@ int32_t ZipWriter::FlushCompressedBytes(FileEntry* file) {
   return kNoError;
 }
 
+int32_t ZipWriter::PrepareZstd([[maybe_unused]] int compression_level) {
+  CHECK(state_ == State::kWritingZip);
+
+#if defined(ZIPARCHIVE_WITH_ZSTD_WRITER)
+  if (!zstd_cctx_) {
+    zstd_cctx_.reset(ZSTD_createCCtx());
+    if (!zstd_cctx_) {
+      LOG(ERROR) << "ZSTD_createCCtx failed";
+      return HandleError(kZlibError);
+    }
+  }
+  ZSTD_CCtx_reset(zstd_cctx_.get(), ZSTD_reset_session_only);
+  size_t result = ZSTD_CCtx_setParameter(zstd_cctx_.get(), ZSTD_c_compressionLevel,
+                                         compression_level);
+  if (ZSTD_isError(result)) {
+    LOG(ERROR) << "ZSTD_CCtx_setParameter failed: " << ZSTD_getErrorName(result);
+    return HandleError(kZlibError);
+  }
+  return kNoError;
+#else
+  return HandleError(kUnsupportedMethod);
+#endif
+}
+
+int32_t ZipWriter::ZstdCompressBytes([[maybe_unused]] FileEntry* file,
+                                     [[maybe_unused]] const void* data,
+                                     [[maybe_unused]] uint32_t len) {
+  CHECK(state_ == State::kWritingEntry);
+
+#if defined(ZIPARCHIVE_WITH_ZSTD_WRITER)
+  CHECK(zstd_cctx_);
+  ZSTD_inBuffer in = {data, len, 0};
+  while (in.pos < in.size) {
+    ZSTD_outBuffer out = {buffer_.data(), buffer_.size(), 0};
+    size_t result = ZSTD_compressStream2(zstd_cctx_.get(), &out, &in, ZSTD_e_continue);
+    if (ZSTD_isError(result)) {
+      LOG(ERROR) << "ZSTD_compressStream2 failed: " << ZSTD_getErrorName(result);
+      return HandleError(kZlibError);
+    }
+    if (out.pos != 0) {
+      if (fwrite(buffer_.data(), 1, out.pos, file_) != out.pos) {
+        return HandleError(kIoError);
+      }
+      file->compressed_size += out.pos;
+      current_offset_ += out.pos;
+    }
+  }
+  return kNoError;
+#else
+  return HandleError(kUnsupportedMethod);
+#endif
+}
+
+int32_t ZipWriter::FlushZstdBytes([[maybe_unused]] FileEntry* file) {
+  CHECK(state_ == State::kWritingEntry);
+
+#if defined(ZIPARCHIVE_WITH_ZSTD_WRITER)
+  CHECK(zstd_cctx_);
+  ZSTD_inBuffer in = {nullptr, 0, 0};
+  size_t remaining;
+  do {
+    ZSTD_outBuffer out = {buffer_.data(), buffer_.size(), 0};
+    remaining = ZSTD_compressStream2(zstd_cctx_.get(), &out, &in, ZSTD_e_end);
+    if (ZSTD_isError(remaining)) {
+      LOG(ERROR) << "ZSTD_compressStream2 failed: " << ZSTD_getErrorName(remaining);
+      return HandleError(kZlibError);
+    }
+    if (out.pos != 0) {
+      if (fwrite(buffer_.data(), 1, out.pos, file_) != out.pos) {
+        return HandleError(kIoError);
+      }
+      file->compressed_size += out.pos;
+      current_offset_ += out.pos;
+    }
+  } while (remaining != 0);
+  return kNoError;
+#else
+  return HandleError(kUnsupportedMethod);
+#endif
+}
+
 bool ZipWriter::ShouldUseDataDescriptor() const {
   // Only use a trailing "data descriptor" if the output isn't seekable.
   return !seekable_;
 }
 
+int32_t ZipWriter::WriteDataDescriptor(const FileEntry& file) {
+  // Some versions of ZIP don't allow STORED data to have a trailing DataDescriptor.
+  // If this file is not seekable, or if the data is compressed, write a DataDescriptor.
+  // We haven't supported zip64 format yet. Write both uncompressed size and compressed
+  // size as uint32_t.
+  std::vector<uint32_t> dataDescriptor = {
+      DataDescriptor::kOptSignature, file.crc32,
+      file.compressed_size, file.uncompressed_size};
+  if (fwrite(dataDescriptor.data(), dataDescriptor.size() * sizeof(uint32_t), 1, file_) != 1) {
+    return HandleError(kIoError);
+  }
+
+  current_offset_ += sizeof(uint32_t) * dataDescriptor.size();
+  return kNoError;
+}
+
 int32_t ZipWriter::FinishEntry() {
   if (state_ != State::kWritingEntry) {
     return kInvalidState;
   }
 
-  if (current_file_entry_.compression_method & kCompressDeflated) {
+  if (parallel_ && parallel_->current && !parallel_->current->streamed) {
+    parallel_->current->file = std::move(current_file_entry_);
+    parallel_->QueueCurrent();
+    state_ = State::kWritingZip;
+    return WritePendingEntries(false);
+  }
+
+  if (parallel_ && parallel_->current) {
+    // The last block ends the compressed data itself.
+    int32_t result = QueueStreamedBlocks(true);
+    if (result != kNoError) {
+      return result;
+    }
+    parallel_->current.reset();
+  } else if (current_file_entry_.compression_method == kCompressDeflated) {
     int32_t result = FlushCompressedBytes(&current_file_entry_);
     if (result != kNoError) {
       return result;
     }
+  } else if (current_file_entry_.compression_method == kCompressZstd) {
+    int32_t result = FlushZstdBytes(&current_file_entry_);
+    if (result != kNoError) {
+      return result;
+    }
   }
 
   if (ShouldUseDataDescriptor()) {
-    // Some versions of ZIP don't allow STORED data to have a trailing DataDescriptor.
-    // If this file is not seekable, or if the data is compressed, write a DataDescriptor.
-    // We haven't supported zip64 format yet. Write both uncompressed size and compressed
-    // size as uint32_t.
-    std::vector<uint32_t> dataDescriptor = {
-        DataDescriptor::kOptSignature, current_file_entry_.crc32,
-        current_file_entry_.compressed_size, current_file_entry_.uncompressed_size};
-    if (fwrite(dataDescriptor.data(), dataDescriptor.size() * sizeof(uint32_t), 1, file_) != 1) {
-      return HandleError(kIoError);
+    int32_t result = WriteDataDescriptor(current_file_entry_);
+    if (result != kNoError) {
+      return result;
     }
-
-    current_offset_ += sizeof(uint32_t) * dataDescriptor.size();
   } else {
     // Seek back to the header and rewrite to include the size.
     if (fseeko(file_, current_file_entry_.local_file_header_offset, SEEK_SET) != 0) {
@@ -513,11 +1155,65 @@ int32_t ZipWriter::FinishEntry() {
   return kNoError;
 }
 
+int32_t ZipWriter::WritePendingEntries(bool wait) {
+  CHECK(parallel_);
+  while (auto entry = parallel_->PopFinished(
+             wait || parallel_->pending_bytes() > kMaxParallelPendingBytes)) {
+    if (entry->failed) {
+      return HandleError(kZlibError);
+    }
+    FileEntry& file = entry->file;
+    uint64_t compressed_size = entry->data.size();
+    if (file.compression_method != kCompressStored) {
+      compressed_size = 0;
+      for (const auto& block : entry->blocks) {
+        compressed_size += block.size();
+      }
+    }
+    if (compressed_size > std::numeric_limits<uint32_t>::max()) {
+      return HandleError(kIoError);
+    }
+    file.compressed_size = static_cast<uint32_t>(compressed_size);
+
+    // The sizes are known, so the header doesn't need rewriting.
+    int32_t result = WriteLocalFileHeader(&file, entry->alignment, ShouldUseDataDescriptor());
+    if (result != kNoError) {
+      return result;
+    }
+    if (file.compression_method != kCompressStored) {
+      for (const auto& block : entry->blocks) {
+        if (fwrite(block.data(), 1, block.size(), file_) != block.size()) {
+          return HandleError(kIoError);
+        }
+      }
+    } else if (!entry->data.empty() &&
+               fwrite(entry->data.data(), 1, entry->data.size(), file_) != entry->data.size()) {
+      return HandleError(kIoError);
+    }
+    current_offset_ += file.compressed_size;
+    if (ShouldUseDataDescriptor()) {
+      result = WriteDataDescriptor(file);
+      if (result != kNoError) {
+        return result;
+      }
+    }
+    files_.emplace_back(std::move(file));
+  }
+  return kNoError;
+}
+
 int32_t ZipWriter::Finish() {
   if (state_ != State::kWritingZip) {
     return kInvalidState;
   }
 
+  if (parallel_) {
+    int32_t result = WritePendingEntries(true);
+    if (result != kNoError) {
+      return result;
+    }
+  }
+
   off_t startOfCdr = current_offset_;
   for (FileEntry& file : files_) {
     CentralDirectoryRecord cdr = {};
@@ -569,9 +1265,10 @@ int32_t ZipWriter::Finish() {
   current_offset_ += sizeof(er);
 
   // Since we can BackUp() and potentially finish writing at an offset less than one we had
-  // already written at, we must truncate the file.
+  // already written at, we must truncate the file. That can't happen, and
+  // ftruncate() fails, when writing to a pipe.
 
-  if (ftruncate(fileno(file_), current_offset_) != 0) {
+  if (seekable_ && ftruncate(fileno(file_), current_offset_) != 0) {
     return HandleError(kIoError);
   }
 
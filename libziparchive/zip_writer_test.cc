@@ -17,6 +17,7 @@
 #include "ziparchive/zip_writer.h"
 #include "ziparchive/zip_archive.h"
 
+#include <android-base/file.h>
 #include <android-base/test_utils.h>
 #include <gtest/gtest.h>
 #include <time.h>
@@ -487,6 +488,198 @@ TEST_F(zipwriter, TruncateFileAfterBackup) {
   ASSERT_GT(before_len, after_len);
 }
 
+// Writes a mix of entries, some of them big enough to be split into blocks, and
+// the last too big for the parallel compressor to buffer.
+static void WriteMixedEntries(ZipWriter* writer, std::vector<std::string>* contents) {
+  for (size_t i = 0; i < 14; i++) {
+    std::string data;
+    const size_t size = i == 13 ? 9 * 1024 * 1024 : i % 4 == 3 ? 1000000 + i : i * 1000;
+    for (size_t j = 0; j < size; j++) {
+      data += static_cast<char>("zip"[j % 3] + (j * j >> 12) % 7);
+    }
+    const size_t flags = (i % 2 ? ZipWriter::kCompress : 0) | (i % 3 ? 0 : ZipWriter::kAlign32) |
+                         (i % 5 ? 0 : ZipWriter::kDefaultCompression);
+    ASSERT_EQ(0, writer->StartEntry("file" + std::to_string(i), flags));
+    // In pieces, like a stream.
+    for (size_t offset = 0; offset < data.size(); offset += 60000) {
+      ASSERT_EQ(0, writer->WriteBytes(data.data() + offset,
+                                      std::min<size_t>(60000, data.size() - offset)));
+    }
+    ASSERT_EQ(0, writer->FinishEntry());
+    contents->push_back(std::move(data));
+  }
+  ASSERT_EQ(0, writer->Finish());
+}
+
+TEST_F(zipwriter, ParallelCompressionDeterministic) {
+  std::vector<std::string> contents;
+  ZipWriter sequential(file_);
+  ASSERT_NO_FATAL_FAILURE(WriteMixedEntries(&sequential, &contents));
+  ASSERT_EQ(0, fflush(file_));
+
+  TemporaryFile parallel_file;
+  FILE* fp = fdopen(dup(parallel_file.fd), "w");
+  ASSERT_NE(nullptr, fp);
+  ZipWriter parallel(fp);
+  ASSERT_EQ(0, parallel.SetParallelCompression(4, true));
+  ASSERT_NO_FATAL_FAILURE(WriteMixedEntries(&parallel, &contents));
+  ASSERT_EQ(0, fclose(fp));
+
+  std::string expected;
+  std::string actual;
+  ASSERT_TRUE(android::base::ReadFileToString(temp_file_->path, &expected));
+  ASSERT_TRUE(android::base::ReadFileToString(parallel_file.path, &actual));
+  ASSERT_TRUE(expected == actual);
+}
+
+TEST_F(zipwriter, ParallelCompressionBlocks) {
+  ZipWriter writer(file_);
+  ASSERT_EQ(0, writer.SetParallelCompression(4, false));
+  std::vector<std::string> contents;
+  ASSERT_NO_FATAL_FAILURE(WriteMixedEntries(&writer, &contents));
+  ASSERT_NE(0, writer.SetParallelCompression(4, false));
+
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchiveFd(fd_, "temp", &handle, false));
+  off64_t previous_offset = -1;
+  for (size_t i = 0; i < contents.size(); i++) {
+    ZipEntry data;
+    ASSERT_EQ(0, FindEntry(handle, "file" + std::to_string(i), &data));
+    ASSERT_EQ(i % 2 ? kCompressDeflated : kCompressStored, data.method);
+    EXPECT_EQ(0u, data.has_data_descriptor);
+    // In the order they were added.
+    ASSERT_GT(data.offset, previous_offset);
+    previous_offset = data.offset;
+    if (i % 3 == 0) {
+      ASSERT_EQ(0, data.offset & 0x03);
+    }
+    ASSERT_TRUE(AssertFileEntryContentsEq(contents[i], handle, &data)) << i;
+  }
+  CloseArchive(handle);
+}
+
+// Writes a 9MiB entry, too big for the parallel compressor to buffer, between
+// two small ones.
+static void WriteLargeEntry(ZipWriter* writer, std::vector<std::string>* contents) {
+  for (size_t i = 0; i < 3; i++) {
+    std::string data;
+    const size_t size = i == 1 ? 9 * 1024 * 1024 : 1000;
+    for (size_t j = 0; j < size; j++) {
+      data += static_cast<char>("zip"[j % 3] + (j * j >> 12) % 7);
+    }
+    ASSERT_EQ(0, writer->StartEntry("file" + std::to_string(i),
+                                    ZipWriter::kCompress | ZipWriter::kDefaultCompression));
+    for (size_t offset = 0; offset < data.size(); offset += 1000000) {
+      ASSERT_EQ(0, writer->WriteBytes(data.data() + offset,
+                                      std::min<size_t>(1000000, data.size() - offset)));
+    }
+    ASSERT_EQ(0, writer->FinishEntry());
+    contents->push_back(std::move(data));
+  }
+  ASSERT_EQ(0, writer->Finish());
+}
+
+TEST_F(zipwriter, ParallelCompressionLargeEntry) {
+  std::vector<std::string> contents;
+  ZipWriter sequential(file_);
+  ASSERT_NO_FATAL_FAILURE(WriteLargeEntry(&sequential, &contents));
+  ASSERT_EQ(0, fflush(file_));
+
+  TemporaryFile parallel_file;
+  FILE* fp = fdopen(dup(parallel_file.fd), "w");
+  ASSERT_NE(nullptr, fp);
+  ZipWriter parallel(fp);
+  ASSERT_EQ(0, parallel.SetParallelCompression(4, true));
+  ASSERT_NO_FATAL_FAILURE(WriteLargeEntry(&parallel, &contents));
+  ASSERT_EQ(0, fclose(fp));
+
+  std::string expected;
+  std::string actual;
+  ASSERT_TRUE(android::base::ReadFileToString(temp_file_->path, &expected));
+  ASSERT_TRUE(android::base::ReadFileToString(parallel_file.path, &actual));
+  ASSERT_TRUE(expected == actual);
+}
+
+// Writes zstd entries of a few sizes, some of them at the default level.
+// Returns false if zstd isn't supported.
+static bool WriteZstdEntries(ZipWriter* writer, std::vector<std::string>* contents) {
+  for (size_t i = 0; i < 6; i++) {
+    std::string data;
+    const size_t size = i % 3 == 2 ? 1000000 + i : i * 1000;
+    for (size_t j = 0; j < size; j++) {
+      data += static_cast<char>("zip"[j % 3] + (j * j >> 12) % 7);
+    }
+    const size_t flags = ZipWriter::kCompress | ZipWriter::kZstd |
+                         (i % 2 ? 0 : ZipWriter::kDefaultCompression);
+    const int32_t result = writer->StartEntry("file" + std::to_string(i), flags);
+    if (result == -7) {
+      return false;
+    }
+    EXPECT_EQ(0, result);
+    for (size_t offset = 0; offset < data.size(); offset += 60000) {
+      EXPECT_EQ(0, writer->WriteBytes(data.data() + offset,
+                                      std::min<size_t>(60000, data.size() - offset)));
+    }
+    EXPECT_EQ(0, writer->FinishEntry());
+    contents->push_back(std::move(data));
+  }
+  EXPECT_EQ(0, writer->Finish());
+  return true;
+}
+
+TEST_F(zipwriter, WriteZstdZip) {
+  ZipWriter writer(file_);
+  std::vector<std::string> contents;
+  if (!WriteZstdEntries(&writer, &contents)) {
+    GTEST_SKIP() << "built without zstd";
+  }
+  ASSERT_FALSE(::testing::Test::HasFailure());
+
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchiveFd(fd_, "temp", &handle, false));
+  for (size_t i = 0; i < contents.size(); i++) {
+    ZipEntry64 data;
+    ASSERT_EQ(0, FindEntry(handle, "file" + std::to_string(i), &data));
+    EXPECT_EQ(kCompressZstd, data.method);
+    EXPECT_EQ(0u, data.has_data_descriptor);
+    ZipEntry entry;
+    ASSERT_EQ(0, FindEntry(handle, "file" + std::to_string(i), &entry));
+    ASSERT_TRUE(AssertFileEntryContentsEq(contents[i], handle, &entry)) << i;
+
+    // Through a bounce buffer rather than straight into the output.
+    TemporaryFile extracted;
+    ASSERT_EQ(0, ExtractEntryToFile(handle, &data, extracted.fd));
+    std::string actual;
+    ASSERT_TRUE(android::base::ReadFileToString(extracted.path, &actual));
+    ASSERT_TRUE(contents[i] == actual) << i;
+  }
+  CloseArchive(handle);
+}
+
+TEST_F(zipwriter, ParallelCompressionZstd) {
+  std::vector<std::string> contents;
+  ZipWriter sequential(file_);
+  if (!WriteZstdEntries(&sequential, &contents)) {
+    GTEST_SKIP() << "built without zstd";
+  }
+  ASSERT_FALSE(::testing::Test::HasFailure());
+  ASSERT_EQ(0, fflush(file_));
+
+  TemporaryFile parallel_file;
+  FILE* fp = fdopen(dup(parallel_file.fd), "w");
+  ASSERT_NE(nullptr, fp);
+  ZipWriter parallel(fp);
+  ASSERT_EQ(0, parallel.SetParallelCompression(4, true));
+  ASSERT_TRUE(WriteZstdEntries(&parallel, &contents));
+  ASSERT_EQ(0, fclose(fp));
+
+  std::string expected;
+  std::string actual;
+  ASSERT_TRUE(android::base::ReadFileToString(temp_file_->path, &expected));
+  ASSERT_TRUE(android::base::ReadFileToString(parallel_file.path, &actual));
+  ASSERT_TRUE(expected == actual);
+}
+
 static ::testing::AssertionResult AssertFileEntryContentsEq(const std::string& expected,
                                                             ZipArchiveHandle handle,
                                                             ZipEntry* zip_entry) {
@@ -30,12 +30,16 @@
 
 #include <set>
 #include <string>
+#include <vector>
 
 #include <android-base/file.h>
+#include <android-base/parseint.h>
 #include <android-base/strings.h>
 #include <ziparchive/zip_archive.h>
 #include <zlib.h>
 
+#include "zip_error.h"
+
 using android::base::EndsWith;
 using android::base::StartsWith;
 
@@ -61,6 +65,7 @@ static bool flag_q = false;
 static bool flag_t = false;
 static bool flag_v = false;
 static bool flag_x = false;
+static size_t flag_J = 1;
 static const char* archive_name = nullptr;
 static std::set<std::string> includes;
 static std::set<std::string> excludes;
@@ -215,19 +220,23 @@ class TestWriter final : public zip_archive::Writer {
   bool Append(uint8_t* buf, size_t size) {
     crc = static_cast<uint32_t>(crc32(crc, reinterpret_cast<const Bytef*>(buf),
                                       static_cast<uInt>(size)));
+    length += size;
     return true;
   }
   uint32_t crc = 0;
+  uint64_t length = 0;
 };
 
 static void TestOne(ZipArchiveHandle zah, const ZipEntry64& entry, const std::string& name) {
   if (!flag_q) printf("    testing: %-24s ", name.c_str());
   TestWriter writer;
   int err = ExtractToWriter(zah, &entry, &writer);
-  if (err < 0) {
+  // A bad CRC is an error too, but one we report here rather than die for.
+  const bool bad_crc = err == kInconsistentInformation && writer.crc != entry.crc32;
+  if (err < 0 && !bad_crc) {
     die(0, "failed to extract %s: %s", name.c_str(), ErrorCodeString(err));
   }
-  if (writer.crc == entry.crc32) {
+  if (!bad_crc) {
     if (!flag_q) printf("OK\n");
   } else {
     if (flag_q) printf("%-23s ", name.c_str());
@@ -255,37 +264,81 @@ static void ExtractToPipe(ZipArchiveHandle zah, const ZipEntry64& entry, const s
   delete[] buffer;
 }
 
-static void ExtractOne(ZipArchiveHandle zah, const ZipEntry64& entry, std::string name) {
+// Entries waiting to be extracted in parallel with -J, and where to.
+static std::vector<ZipEntry64> queued_entries;
+static std::vector<std::string> queued_names;
+
+// Checks |*name|, creates the directories it goes in, and sets |*dst| to where it's extracted to.
+// Returns false if there's nothing left to do: |*name| was a directory.
+static bool PrepareOne(const ZipEntry64& entry, std::string* name, std::string* dst) {
   // Bad filename?
-  if (StartsWith(name, "/") || StartsWith(name, "../") || name.find("/../") != std::string::npos) {
-    die(0, "bad filename %s", name.c_str());
+  if (StartsWith(*name, "/") || StartsWith(*name, "../") ||
+      name->find("/../") != std::string::npos) {
+    die(0, "bad filename %s", name->c_str());
   }
 
   // Junk the path if we were asked to.
-  if (flag_j) name = android::base::Basename(name);
+  if (flag_j) *name = android::base::Basename(*name);
 
   // Where are we actually extracting to (for human-readable output)?
   // flag_d is the empty string if -d wasn't used, or has a trailing '/'
   // otherwise.
-  std::string dst = flag_d + name;
+  *dst = flag_d + *name;
 
   // Ensure the directory hierarchy exists.
-  if (!MakeDirectoryHierarchy(android::base::Dirname(name))) {
-    die(errno, "couldn't create directory hierarchy for %s", dst.c_str());
+  if (!MakeDirectoryHierarchy(android::base::Dirname(*name))) {
+    die(errno, "couldn't create directory hierarchy for %s", dst->c_str());
   }
 
   // An entry in a zip file can just be a directory itself.
-  if (EndsWith(name, "/")) {
-    if (mkdir(name.c_str(), entry.unix_mode) == -1) {
+  if (EndsWith(*name, "/")) {
+    if (mkdir(name->c_str(), entry.unix_mode) == -1) {
       // If the directory already exists, that's fine.
       if (errno == EEXIST) {
         struct stat sb;
-        if (stat(name.c_str(), &sb) != -1 && S_ISDIR(sb.st_mode)) return;
+        if (stat(name->c_str(), &sb) != -1 && S_ISDIR(sb.st_mode)) return false;
       }
-      die(errno, "couldn't extract directory %s", dst.c_str());
+      die(errno, "couldn't extract directory %s", dst->c_str());
     }
-    return;
+    return false;
   }
+  return true;
+}
+
+// Like ExtractOne, but leaves the extraction itself to ExtractQueued.
+static void QueueOne(const ZipEntry64& entry, std::string name) {
+  std::string dst;
+  if (!PrepareOne(entry, &name, &dst)) return;
+
+  struct stat sb;
+  if (lstat(name.c_str(), &sb) == 0) {
+    if (overwrite_mode == kNever) return;
+    if (overwrite_mode == kPrompt && !PromptOverwrite(dst)) return;
+  }
+
+  if (!flag_q) printf("  inflating: %s\n", dst.c_str());
+  queued_entries.push_back(entry);
+  queued_names.push_back(std::move(name));
+}
+
+static void ExtractQueued(ZipArchiveHandle zah) {
+  int err = ExtractEntriesParallel(
+      zah, queued_entries,
+      [](size_t i) {
+        android::base::unique_fd fd(open(queued_names[i].c_str(),
+                                         O_WRONLY | O_CREAT | O_CLOEXEC | O_TRUNC,
+                                         queued_entries[i].unix_mode));
+        if (fd == -1) fprintf(stderr, "%s: couldn't create file %s: %s\n", g_progname,
+                              (flag_d + queued_names[i]).c_str(), strerror(errno));
+        return fd;
+      },
+      flag_J);
+  if (err < 0) die(0, "failed to extract %s: %s", archive_name, ErrorCodeString(err));
+}
+
+static void ExtractOne(ZipArchiveHandle zah, const ZipEntry64& entry, std::string name) {
+  std::string dst;
+  if (!PrepareOne(entry, &name, &dst)) return;
 
   // Create the file.
   int fd = open(name.c_str(), O_CREAT | O_WRONLY | O_CLOEXEC | O_EXCL, entry.unix_mode);
@@ -311,7 +364,10 @@ static void ListOne(const ZipEntry64& entry, const std::string& name) {
            t.tm_mday, t.tm_hour, t.tm_min);
   if (flag_v) {
     printf("%8" PRIu64 "  %s %8" PRIu64 " %3.0f%% %s %08x  %s\n", entry.uncompressed_length,
-           (entry.method == kCompressStored) ? "Stored" : "Defl:N", entry.compressed_length,
+           (entry.method == kCompressStored)  ? "Stored"
+           : (entry.method == kCompressZstd) ? "  Zstd"
+                                              : "Defl:N",
+           entry.compressed_length,
            CompressionRatio(entry.uncompressed_length, entry.compressed_length), time, entry.crc32,
            name.c_str());
   } else {
@@ -364,6 +420,8 @@ static void InfoOne(const ZipEntry64& entry, const std::string& name) {
   char method[5] = "stor";
   if (entry.method == kCompressDeflated) {
     snprintf(method, sizeof(method), "def%c", "NXFS"[(entry.gpbf >> 1) & 0x3]);
+  } else if (entry.method == kCompressZstd) {
+    snprintf(method, sizeof(method), "zstd");
   }
 
   // TODO: zipinfo (unlike unzip) sometimes uses time zone?
@@ -391,6 +449,8 @@ static void ProcessOne(ZipArchiveHandle zah, const ZipEntry64& entry, const std:
       // Actually extract.
       if (flag_p) {
         ExtractToPipe(zah, entry, name);
+      } else if (flag_J > 1) {
+        QueueOne(entry, name);
       } else {
         ExtractOne(zah, entry, name);
       }
@@ -424,12 +484,15 @@ static void ProcessAll(ZipArchiveHandle zah) {
   if (err < -1) die(0, "failed iterating %s: %s", archive_name, ErrorCodeString(err));
   EndIteration(cookie);
 
+  if (!queued_entries.empty()) ExtractQueued(zah);
+
   MaybeShowFooter();
 }
 
 static void ShowHelp(bool full) {
   if (role == kUnzip) {
-    fprintf(full ? stdout : stderr, "usage: unzip [-d DIR] [-lnopqv] ZIP [FILE...] [-x FILE...]\n");
+    fprintf(full ? stdout : stderr,
+            "usage: unzip [-d DIR] [-J N] [-lnopqv] ZIP [FILE...] [-x FILE...]\n");
     if (!full) exit(EXIT_FAILURE);
 
     printf(
@@ -439,6 +502,7 @@ static void ShowHelp(bool full) {
         "\n"
         "-d DIR	Extract into DIR\n"
         "-j	Junk (ignore) file paths\n"
+        "-J N	Extract N files at a time\n"
         "-l	List contents (-lq excludes archive name, -lv is verbose)\n"
         "-n	Never overwrite files (default: prompt)\n"
         "-o	Always overwrite files\n"
@@ -512,7 +576,7 @@ int main(int argc, char* argv[]) {
     }
 
     int opt;
-    while ((opt = getopt_long(argc, argv, "-Dd:hjlnopqtvx", opts, nullptr)) != -1) {
+    while ((opt = getopt_long(argc, argv, "-Dd:hjJ:lnopqtvx", opts, nullptr)) != -1) {
       switch (opt) {
         case 'D':
           // Undocumented and ignored, since we never use the times from the zip
@@ -528,6 +592,11 @@ int main(int argc, char* argv[]) {
         case 'j':
           flag_j = true;
           break;
+        case 'J':
+          if (!android::base::ParseUint(optarg, &flag_J) || flag_J == 0) {
+            die(0, "bad job count %s", optarg);
+          }
+          break;
         case 'l':
           flag_l = true;
           break;